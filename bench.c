@@ -0,0 +1,774 @@
+/*
+C_UPDI bench.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Benchmark of updi_process() against the simulated target in sim/, to measure how a change to updi.c affects programming time without any hardware.
+Every operation goes through updi_init() / updi_process() exactly like the examples in main.c, on a link modelled by baud rate, fixed per transfer
+latency on both sides of the USB-UART adapter and target NVM busy times. By default everything runs on the virtual clock so a full run takes well
+under a second, --realtime makes the host actually wait out the modelled time.
+
+One JSON object per line is written for the config and for each operation, with the modelled link time, the host wall time, the number of blocking
+round trips and bytes each way, so results can be diffed or tracked between commits. An op is ok when updi_process() returned true and the
+target's memories check out. Most ops are one updi_process() call named after its args, the rest:
+
+recover: the target starts with UPDI out of step, so the time is a failed handshake, the double break and the retry.
+
+write_flash_glitch: one byte is lost on the link part way through the image, so the time is a resync and resume from the failed page.
+
+watch: attaches to the running target without a reset and samples its RTC counter and some SRAM with updi_watch(), adds samples and rate_hz.
+
+snapshot: reads signature, serial number, fuses and USERROW with updi_snapshot(), adds the round trips it took.
+
+stream_write_flash: writes the image with updi.stream_write, without verify to compare with write_flash, adds checkpoints and the final page_us.
+
+patch_flash: patches a serial number, a MAC address across a page boundary and a calibration word with updi_patch_flash(), adds patch_pages.
+
+boot_write_flash: writes the image with updi.keep_boot over a boot section set up in the fuses, which has to be left alone, and the rest of the
+application section erased. The same write on the part locked has to fail. Adds app_pages.
+
+daemon: sends daemon.c on the bench port four jobs as a board stays in, is taken out and the next goes in, only the first and last may run.
+Adds the first job's time from submit to reply, the last one's with everything warm, and how often the daemon opened the port.
+
+discover: probes the bench port, a second target and one that never answers at once with updi_discover(), adds how many it found.
+
+Build with gcc:
+    gcc bench.c -DUPDI_SIM sim/file.c sim/serial.c sim/loopback.c sim/estimate.c sim/bridge.c sim/target.c sim/time.c sim/thread.c \
+        log.c trace.c image.c transport.c tcp.c daemon.c updi.c -o bench
+Add -DUPDI_SMALL -Wstack-usage=1024 -Werror to run the same ops through the page at a time build, flash reads are then collected through
+updi.read_page for the checks. The stack flags fail the build if any function's frame passes the 1 KiB updi.h counts on.
+
+Options:
+    --device <n>            device id from updi.h (ATMEGA4809)
+    --baud <n>              baud rate (115200)
+    --write-latency-us <n>  host write until first byte on the wire (1000)
+    --read-latency-us <n>   last byte received until host read returns (1000)
+    --open-us <n>           cost of opening / reconfiguring the port (10000)
+    --guard-bits <n>        target guard time before responding (128)
+    --page-write-us <n>     NVM page write time (2000)
+    --page-erase-us <n>     NVM page erase time (2000)
+    --chip-erase-us <n>     NVM chip erase time (4000)
+    --fuse-write-us <n>     NVM fuse write time (2000)
+    --image-size <n>        bytes of flash image to write (full flash)
+    --runs <n>              repeat each operation, the best wall time is reported (1)
+    --realtime              wait out modelled time on the host clock
+    --duplex                run every operation with updi.full_duplex set
+    --loopback              go through sim/loopback.c instead of the modelled link, so wall_us is the protocol code alone and
+                            model_us only the target's NVM busy times
+    --tcp                   go through tcp.c to sim/bridge.c, an RFC 2217 serial server for the target on a local port served from its own thread,
+                            so every transfer is a real TCP round trip and busy times are waited out on the host clock, as are updi.c's own sleeps
+                            (--realtime is implied), model_us means nothing here
+    --detect                pass UPDI_DEVICE_AUTO to updi_init() instead of --device (except for the locked op, a locked part cant be detected),
+                            the sim target is still set up from --device
+    --estimate              dry run each updi_process() op first through sim/estimate.c with the same link and NVM model and add its estimated
+                            time and round trips to the op's line (not the ops that start from a stuck, locked or glitched target)
+    --verbose               turn on log_str output (LOG_VERBOSE)
+    --hex <file>            temporary hex file to generate (bench_image.hex)
+    --output <file>         write results here instead of stdout, progress output from log.c still goes to stdout
+    --trace <file>          record a timeline of every op, each one a span holding its phases down to the serial transfers, and write it
+                            as Chrome trace JSON (open in ui.perfetto.dev or chrome://tracing). Timestamps are model time
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "updi.h"
+#include "sim/loopback.h"
+#include "sim/bridge.h"
+#include "tcp.h"
+#include "daemon.h"
+#include "sim/estimate.h"
+
+#define BENCH_COM_PORT          1
+#define BENCH_PROBE_PORT        2       //a second target for the discover op
+#define BENCH_DEAD_PORT         3       //and one that never answers
+#define BENCH_WATCH_SAMPLES     200
+#define BENCH_RTC_ADDRESS       0x0140
+#define BENCH_TRACE_SPANS       (1UL << 17)
+#define BENCH_DAEMON_SOCKET     "bench_daemon.sock"
+#define BENCH_DAEMON_JOBS       4       //one fixture cycle, see run_daemon()
+#define BENCH_BOOT_SIZE         1024    //boot section the boot_write_flash op sets up, a whole number of boot blocks on every family
+
+typedef struct {
+    const char *name;
+    uint8_t args;
+    bool stuck;         //target starts with UPDI out of step, so the handshake fails and the double break has to recover it
+    bool locked;        //target is locked for the op, flash has to be left as it was
+    bool glitch;        //one byte 90% of the way through the image is lost on the link, the write has to resync and resume
+    bool (*run)(void);  //runs the op instead of updi_process(), may add fields to its line in bench_extra
+} BenchOp;
+
+static bool run_watch(void);
+static bool run_snapshot(void);
+static bool run_stream(void);
+static bool run_patch(void);
+static bool run_boot(void);
+static bool run_daemon(void);
+static bool run_discover(void);
+
+static const BenchOp bench_ops[] = {
+    {"get_info",            UPDI_PROCESS_GET_INFO,                                      false,  false,  false,  NULL},
+    {"read_fuses",          UPDI_PROCESS_READ_FUSES,                                    false,  false,  false,  NULL},
+    {"write_fuses",         UPDI_PROCESS_WRITE_FUSES,                                   false,  false,  false,  NULL},
+    {"erase",               UPDI_PROCESS_ERASE,                                         false,  false,  false,  NULL},
+    {"write_flash",         UPDI_PROCESS_WRITE_FLASH,                                   false,  false,  false,  NULL},
+    {"write_verify_flash",  UPDI_PROCESS_WRITE_FLASH | UPDI_PROCESS_VERIFY_FLASH,       false,  false,  false,  NULL},
+    {"read_flash",          UPDI_PROCESS_READ_FLASH,                                    false,  false,  false,  NULL},
+    {"session",             UPDI_PROCESS_GET_INFO | UPDI_PROCESS_READ_FUSES | UPDI_PROCESS_WRITE_FUSES | UPDI_PROCESS_READ_FLASH, false, false, false, NULL},   //one handshake and progmode for all of them
+    {"write_flash_glitch",  UPDI_PROCESS_WRITE_FLASH,                                   false,  false,  true,   NULL},
+    {"recover",             UPDI_PROCESS_GET_INFO,                                      true,   false,  false,  NULL},
+    {"write_userrow",       UPDI_PROCESS_WRITE_USERROW,                                 false,  false,  false,  NULL},
+    {"write_userrow_locked",UPDI_PROCESS_WRITE_USERROW,                                 false,  true,   false,  NULL},
+    {"watch",               0,                                                          false,  false,  false,  run_watch},
+    {"snapshot",            0,                                                          false,  false,  false,  run_snapshot},
+    {"stream_write_flash",  UPDI_PROCESS_WRITE_FLASH,                                   false,  false,  false,  run_stream},
+    {"stream_write_flash_glitch", UPDI_PROCESS_WRITE_FLASH,                             false,  false,  true,   run_stream},
+    {"patch_flash",         0,                                                          false,  false,  false,  run_patch},
+    {"boot_write_flash",    0,                                                          false,  false,  false,  run_boot},
+    {"daemon",              UPDI_PROCESS_WRITE_FLASH,                                   false,  false,  false,  run_daemon},
+    {"discover",            0,                                                          false,  false,  false,  run_discover},
+};
+
+static UPDI updi;
+static UPDI estimate_updi;
+static SimTarget target;
+static SimTarget probe_target;
+static SimTarget dead_target;
+static SimBridge bridge;
+static uint8_t image[UPDI_MAX_FLASH_SIZE];
+static uint32_t image_length;                   //bytes of image in the hex file
+static uint8_t patched[UPDI_MAX_FLASH_SIZE];     //what run_patch() and run_boot() expect flash to hold after them
+
+#if defined UPDI_SMALL
+static UPDIArena arena;
+static uint8_t flash_read[UPDI_MAX_FLASH_SIZE];
+
+static bool read_page(void *ctx, uint32_t offset, uint8_t *data, uint16_t len);
+#endif
+
+static bool write_hex(char *filename, uint8_t *data, uint32_t length);
+static bool check_op(const BenchOp *op, uint32_t image_size);
+static bool watch_sample(void *ctx, const UPDIWatchSample *sample);
+
+static char bench_extra[160];
+
+static UPDIWatch watch;
+static UPDIWatchSample watch_ring[16];
+static uint32_t watch_resets;
+static bool watch_ok;
+
+static TraceSpan trace_spans[BENCH_TRACE_SPANS];
+
+
+int main(int argc, char *argv[]){
+    uint8_t dev = ATMEGA4809;
+    uint32_t baudrate = 115200;
+    uint32_t image_size = 0;
+    uint16_t runs = 1;
+    bool realtime = false;
+    bool duplex = false;
+    bool loopback = false;
+    bool tcp = false;
+    bool detect = false;
+    bool estimate = false;
+    bool verbose = false;
+    char *hex_filename = "bench_image.hex";
+    char *output = NULL;
+    char *trace_file = NULL;
+
+    SimLinkModel model = {
+        .write_latency_us = 1000,
+        .read_latency_us = 1000,
+        .open_us = 10000,
+        .guard_bits = 128,
+    };
+
+    SimTargetConfig cfg = {
+        .revision = 0,
+        .page_write_us = 2000,
+        .page_erase_us = 2000,
+        .chip_erase_us = 4000,
+        .fuse_write_us = 2000,
+    };
+
+    for(int i = 1; i < argc; i++){
+        char *arg = argv[i];
+        char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if(strcmp(arg, "--realtime") == 0){
+            realtime = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--detect") == 0){
+            detect = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--duplex") == 0){
+            duplex = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--loopback") == 0){
+            loopback = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--tcp") == 0){
+            tcp = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--estimate") == 0){
+            estimate = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--verbose") == 0){
+            verbose = true;
+            continue;
+        }
+
+        if(val == NULL){
+            fprintf(stderr, "missing value for %s\n", arg);
+            return 2;
+        }
+        i++;
+
+        if(strcmp(arg, "--device") == 0)                 dev = atoi(val);
+        else if(strcmp(arg, "--baud") == 0)             baudrate = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--write-latency-us") == 0) model.write_latency_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--read-latency-us") == 0)  model.read_latency_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--open-us") == 0)          model.open_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--guard-bits") == 0)       model.guard_bits = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--page-write-us") == 0)    cfg.page_write_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--page-erase-us") == 0)    cfg.page_erase_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--chip-erase-us") == 0)    cfg.chip_erase_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--fuse-write-us") == 0)    cfg.fuse_write_us = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--image-size") == 0)       image_size = strtoul(val, NULL, 0);
+        else if(strcmp(arg, "--runs") == 0)             runs = atoi(val);
+        else if(strcmp(arg, "--hex") == 0)              hex_filename = val;
+        else if(strcmp(arg, "--output") == 0)           output = val;
+        else if(strcmp(arg, "--trace") == 0)            trace_file = val;
+        else{
+            fprintf(stderr, "unknown option %s\n", arg);
+            return 2;
+        }
+    }
+
+    if(runs == 0){
+        fprintf(stderr, "--runs must be at least 1\n");
+        return 2;
+    }
+
+    FILE *out = stdout;
+    if(output != NULL){
+        out = fopen(output, "w");
+        if(out == NULL){
+            fprintf(stderr, "couldnt open %s\n", output);
+            return 2;
+        }
+    }
+
+    LOG_VERBOSE = verbose;
+
+    //target geometry comes from the same table updi.c uses
+    updi_init(&updi, BENCH_COM_PORT, baudrate, dev, 0, NULL, 0);
+    bool known = estimate_target_config(&updi, &cfg);
+    cfg.rtc_address = BENCH_RTC_ADDRESS;
+
+    if(!known){
+        fprintf(stderr, "unknown device %d\n", dev);
+        return 2;
+    }
+
+    if(image_size == 0 || image_size > cfg.flash_size) image_size = cfg.flash_size;
+    image_length = image_size;
+
+    sim_target_init(&target, &cfg);
+    for(uint8_t i = 0; i < cfg.num_fuses; i++) target.fuses[i] = 0xA0 + i;
+    for(uint16_t i = 0; i < cfg.sram_size; i++) target.sram[i] = (uint8_t)(i * 7 + 3);
+    sim_attach(BENCH_COM_PORT, &target, &model);
+    loopback_attach(BENCH_COM_PORT, &target);
+
+    //the discover op's other ports, a target of the other family and one with UPDI out of step that no probe gets an answer from
+    SimTargetConfig probe_cfg = cfg;
+    strcpy(probe_cfg.sib, (dev <= ATMEGA3209) ? "tinyAVR P:0D:1-3" : "megaAVR P:0D:1-3");
+    sim_target_init(&probe_target, &probe_cfg);
+    sim_target_init(&dead_target, &cfg);
+    dead_target.stuck = true;
+    sim_attach(BENCH_PROBE_PORT, &probe_target, &model);
+    sim_attach(BENCH_DEAD_PORT, &dead_target, &model);
+    loopback_attach(BENCH_PROBE_PORT, &probe_target);
+    loopback_attach(BENCH_DEAD_PORT, &dead_target);
+
+    if(tcp && (!bridge_start(&bridge, &target, 0, true) || !tcp_attach(BENCH_COM_PORT, "127.0.0.1", bridge.port, true))){
+        fprintf(stderr, "couldnt start the tcp bridge\n");
+        return 2;
+    }
+    sim_time_set_realtime(realtime || tcp);
+
+    //deterministic pseudo random image so that every run writes the same data
+    uint32_t seed = 0x12345678;
+    for(uint32_t i = 0; i < image_size; i++){
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+
+    if(!write_hex(hex_filename, image, image_size)){
+        fprintf(stderr, "couldnt write %s\n", hex_filename);
+        return 2;
+    }
+
+    fprintf(out, "{\"bench\":\"c_updi\",\"device\":%d,\"baud\":%lu,\"write_latency_us\":%lu,\"read_latency_us\":%lu,\"open_us\":%lu,\"guard_bits\":%u,"
+                 "\"page_write_us\":%lu,\"page_erase_us\":%lu,\"chip_erase_us\":%lu,\"fuse_write_us\":%lu,\"image_size\":%lu,\"runs\":%u,\"realtime\":%s,\"duplex\":%s,\"detect\":%s,\"loopback\":%s,\"tcp\":%s}\n",
+            dev, (unsigned long)baudrate, (unsigned long)model.write_latency_us, (unsigned long)model.read_latency_us, (unsigned long)model.open_us,
+            model.guard_bits, (unsigned long)cfg.page_write_us, (unsigned long)cfg.page_erase_us, (unsigned long)cfg.chip_erase_us,
+            (unsigned long)cfg.fuse_write_us, (unsigned long)image_size, runs, realtime ? "true" : "false", duplex ? "true" : "false", detect ? "true" : "false", loopback ? "true" : "false", tcp ? "true" : "false");
+
+    bool all_ok = true;
+    uint8_t fuses[UPDI_MAX_FUSES];
+    memset(fuses, 0, sizeof(fuses));
+
+    //the dry run is given the same link and target as the sim
+    EstimateModel estimate_model = {model.write_latency_us, model.read_latency_us, model.open_us, model.guard_bits,
+                                    cfg.page_write_us, cfg.page_erase_us, cfg.chip_erase_us, cfg.fuse_write_us};
+
+    if(trace_file != NULL) trace_start(trace_spans, BENCH_TRACE_SPANS);
+
+    for(uint8_t op = 0; op < sizeof(bench_ops) / sizeof(bench_ops[0]); op++){
+        uint64_t best_wall_ns = UINT64_MAX;
+        uint64_t model_ns = 0;
+        SimStats stats = {0};
+        bool ok = true;
+        char estimate_extra[64] = "";
+
+        //estimate before anything else, updi_process() ops on a target left as a fresh one would be
+        if(estimate && bench_ops[op].run == NULL && !bench_ops[op].stuck && !bench_ops[op].locked && !bench_ops[op].glitch){
+            Estimate cost;
+
+            updi_init(&estimate_updi, BENCH_COM_PORT, baudrate, dev, bench_ops[op].args, hex_filename, strlen(hex_filename));
+            memcpy(estimate_updi.fuse_values_write, fuses, UPDI_MAX_FUSES);
+            estimate_updi.full_duplex = duplex;
+#if defined UPDI_SMALL
+            estimate_updi.arena = &arena;
+            estimate_updi.read_page = read_page;
+#endif
+            if(estimate_process(&estimate_updi, &estimate_model, &cost)){
+                snprintf(estimate_extra, sizeof(estimate_extra), ",\"estimate_us\":%lu,\"estimate_round_trips\":%lu",
+                         (unsigned long)cost.total_us, (unsigned long)cost.round_trips);
+            }
+        }
+
+        for(uint16_t run = 0; run < runs; run++){
+            updi_init(&updi, BENCH_COM_PORT, baudrate, (detect && !bench_ops[op].locked) ? UPDI_DEVICE_AUTO : dev, bench_ops[op].args, hex_filename, strlen(hex_filename));
+            memcpy(updi.fuse_values_write, fuses, UPDI_MAX_FUSES);
+            updi.full_duplex = duplex;
+            if(loopback) updi.transport = &loopback_transport;
+            if(tcp) updi.transport = &tcp_transport;
+#if defined UPDI_SMALL
+            updi.arena = &arena;
+            updi.read_page = read_page;
+#endif
+            target.stuck = bench_ops[op].stuck;
+            target.locked = bench_ops[op].locked;
+            for(uint8_t i = 0; i < UPDI_MAX_USERROW_SIZE; i++) updi.userrow_write[i] = (uint8_t)(op * 16 + run + i);
+
+            SimStats *port_stats = sim_stats(BENCH_COM_PORT);
+            LoopbackStats *lb_stats = loopback_stats(BENCH_COM_PORT);
+            TcpStats *tcp_port_stats = tcp_stats(BENCH_COM_PORT);
+            memset(port_stats, 0, sizeof(SimStats));
+            memset(lb_stats, 0, sizeof(LoopbackStats));
+            memset(tcp_port_stats, 0, sizeof(TcpStats));
+            sim_drop_byte(BENCH_COM_PORT, (!loopback && bench_ops[op].glitch) ? image_size * 9 / 10 : 0);
+            loopback_drop_byte(BENCH_COM_PORT, (loopback && bench_ops[op].glitch) ? image_size * 9 / 10 : 0);
+            if(tcp) bridge_drop_byte(&bridge, bench_ops[op].glitch ? image_size * 9 / 10 : 0);
+
+            uint64_t model_start = sim_time_ns();
+            uint64_t wall_start = sim_host_time_ns();
+
+            bench_extra[0] = '\0';
+
+            trace_begin(bench_ops[op].name);
+
+            //every op has to report success, memories that check out after a failed one dont make it pass
+            if(bench_ops[op].run != NULL){
+                ok = bench_ops[op].run() && ok;
+            }else{
+                ok = updi_process(&updi) && ok;
+            }
+
+            trace_end();
+
+            uint64_t wall_ns = sim_host_time_ns() - wall_start;
+            if(wall_ns < best_wall_ns) best_wall_ns = wall_ns;
+            model_ns = sim_time_ns() - model_start;
+            stats = *port_stats;
+
+            if(loopback){
+                stats.round_trips = lb_stats->round_trips;
+                stats.opens = lb_stats->opens;
+                stats.breaks = lb_stats->breaks;
+                stats.timeouts = lb_stats->timeouts;
+                stats.tx_bytes = lb_stats->tx_bytes;
+                stats.rx_bytes = lb_stats->rx_bytes;
+            }
+
+            if(tcp){
+                stats.round_trips = tcp_port_stats->round_trips;
+                stats.opens = tcp_port_stats->opens;
+                stats.breaks = tcp_port_stats->breaks;
+                stats.timeouts = tcp_port_stats->timeouts;
+                stats.tx_bytes = tcp_port_stats->tx_bytes;
+                stats.rx_bytes = tcp_port_stats->rx_bytes;
+            }
+
+            ok = ok && check_op(&(bench_ops[op]), image_size);
+        }
+
+        strcat(bench_extra, estimate_extra);
+
+        //write the values just read back in the write_fuses op
+        if(bench_ops[op].args & UPDI_PROCESS_READ_FUSES) memcpy(fuses, updi.fuse_values_read, UPDI_MAX_FUSES);
+
+        all_ok = all_ok && ok;
+
+        fprintf(out, "{\"op\":\"%s\",\"model_us\":%llu,\"wall_us\":%llu,\"round_trips\":%lu,\"opens\":%lu,\"breaks\":%lu,\"timeouts\":%lu,\"recoveries\":%u,\"tx_bytes\":%lu,\"rx_bytes\":%lu%s,\"ok\":%s}\n",
+                bench_ops[op].name, (unsigned long long)(model_ns / 1000), (unsigned long long)(best_wall_ns / 1000),
+                (unsigned long)stats.round_trips, (unsigned long)stats.opens, (unsigned long)stats.breaks, (unsigned long)stats.timeouts, updi.stats.recoveries,
+                (unsigned long)stats.tx_bytes, (unsigned long)stats.rx_bytes, bench_extra, ok ? "true" : "false");
+        fflush(out);
+    }
+
+    if(tcp) bridge_stop(&bridge);
+
+    if(trace_file != NULL){
+        trace_stop();
+        if(!trace_export(trace_file)) all_ok = false;
+        if(trace_dropped() > 0) fprintf(stderr, "trace full, %lu spans dropped\n", (unsigned long)trace_dropped());
+    }
+
+    remove(hex_filename);
+    if(out != stdout) fclose(out);
+
+    return all_ok ? 0 : 1;
+}
+
+/*
+Write data as an intel hex file with 16 byte records starting at address 0, with an extended linear address record at each 64K boundary
+*/
+static bool write_hex(char *filename, uint8_t *data, uint32_t length){
+    FILE *fp = fopen(filename, "w");
+    if(fp == NULL) return false;
+
+    for(uint32_t address = 0; address < length; address += 16){
+        if(address > 0 && (address & 0xFFFF) == 0){
+            uint8_t upper = address >> 16;
+            fprintf(fp, ":02000004%04X%02X\n", upper, (uint8_t)(0x100 - (2 + 4 + upper)));
+        }
+
+        uint8_t count = (length - address < 16) ? length - address : 16;
+        uint8_t crc = count + ((address >> 8) & 0xFF) + (address & 0xFF);
+
+        fprintf(fp, ":%02X%04X00", count, (unsigned int)(address & 0xFFFF));
+        for(uint8_t i = 0; i < count; i++){
+            fprintf(fp, "%02X", data[address + i]);
+            crc += data[address + i];
+        }
+        fprintf(fp, "%02X\n", (uint8_t)(0x100 - crc));
+    }
+    fprintf(fp, ":00000001FF\n");
+
+    fclose(fp);
+    return true;
+}
+
+/*
+Compare what updi_process() did against the simulated target's memories
+*/
+static bool check_op(const BenchOp *op, uint32_t image_size){
+    uint8_t args = op->args;
+
+    if(args & UPDI_PROCESS_GET_INFO){
+        if(memcmp(updi.info.dev_id, target.cfg.signature, 3) != 0) return false;
+    }
+
+    if(args & UPDI_PROCESS_READ_FUSES){
+        if(memcmp(updi.fuse_values_read, target.fuses, updi.device.num_fuses) != 0) return false;
+    }
+
+    if(args & UPDI_PROCESS_WRITE_FUSES){
+        if(memcmp(updi.fuse_values_write, target.fuses, updi.device.num_fuses) != 0) return false;
+    }
+
+    if(args & UPDI_PROCESS_ERASE){
+        for(uint32_t i = 0; i < updi.device.flash_size; i++){
+            if(target.flash[i] != 0xFF) return false;
+        }
+    }
+
+    if(args & UPDI_PROCESS_WRITE_FLASH){
+        if(memcmp(target.flash, image, image_size) != 0) return false;
+    }
+
+    if(args & UPDI_PROCESS_READ_FLASH){
+#if defined UPDI_SMALL
+        if(memcmp(flash_read, target.flash, updi.device.flash_size) != 0) return false;
+#else
+        if(memcmp(updi.flash_data_read, target.flash, updi.device.flash_size) != 0) return false;
+#endif
+    }
+
+    if(args & UPDI_PROCESS_WRITE_USERROW){
+        if(memcmp(updi.userrow_write, target.userrow, updi.device.userrow_size) != 0) return false;
+    }
+
+    if(op->glitch){
+        if(updi.stats.recoveries == 0) return false;
+    }
+
+    //the earlier write ops left the image in flash
+    if(op->locked){
+        if(!target.locked || memcmp(target.flash, image, image_size) != 0) return false;
+    }
+
+    return true;
+}
+
+/*
+Attach to the running target and watch its RTC counter, a run of SRAM, a pair further up and one address twice. Every sample has to show the SRAM
+as it is and the counter never going backwards, and the target must not have been reset or put in progmode
+*/
+static bool run_watch(void){
+    SimTargetConfig *cfg = &(target.cfg);
+    uint32_t addresses[] = {
+        cfg->sram_address + 0x41, BENCH_RTC_ADDRESS + SIM_RTC_CNT, BENCH_RTC_ADDRESS + SIM_RTC_CNT + 1, cfg->sram_address + 0x40,
+        cfg->sram_address + 3,
+    };
+
+    memset(&watch, 0, sizeof(watch));
+    memcpy(watch.addresses, addresses, sizeof(addresses));
+    watch.count = sizeof(addresses) / sizeof(addresses[0]);
+    for(uint8_t i = 0; i < 16; i++) watch.addresses[watch.count++] = cfg->sram_address + i;
+
+    watch.max_samples = BENCH_WATCH_SAMPLES;
+    watch.func = watch_sample;
+    watch.ring = watch_ring;
+    watch.ring_size = sizeof(watch_ring) / sizeof(watch_ring[0]);
+
+    watch_resets = target.resets;
+    watch_ok = true;
+
+    if(!updi_attach(&updi)) return false;
+
+    bool ok = updi_watch(&updi, &watch);
+
+    ok = ok && !target.progmode && target.resets == watch_resets;
+
+    updi_close(&updi);
+
+    UPDIWatchSample *last = &(watch_ring[(watch.samples - 1) % watch.ring_size]);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"samples\":%lu,\"rate_hz\":%lu", (unsigned long)watch.samples, (unsigned long)watch.rate_hz);
+
+    return ok && watch_ok && watch.samples == BENCH_WATCH_SAMPLES && watch.bursts == 3 && last->index == watch.samples - 1;
+}
+
+static bool watch_sample(void *ctx, const UPDIWatchSample *sample){
+    static uint16_t last_count;
+
+    for(uint8_t i = 0; i < watch.count; i++){
+        uint32_t offset = watch.addresses[i] - target.cfg.sram_address;
+        if(offset < target.cfg.sram_size && sample->values[i] != target.sram[offset]) watch_ok = false;
+    }
+
+    uint16_t count = sample->values[1] | (sample->values[2] << 8);
+    if(sample->index > 0 && (uint16_t)(count - last_count) > 0x8000) watch_ok = false;
+    last_count = count;
+
+    return true;
+}
+
+/*
+Read the traceability snapshot in a session of its own and compare it against the target, it has to take no more than two round trips
+*/
+static bool run_snapshot(void){
+    UPDISnapshot snapshot;
+    uint8_t serial_offset = (target.cfg.nvm_version == UPDI_NVM_V2) ? UPDI_SIGROW_SERNUM_V2 : UPDI_SIGROW_SERNUM_V0;
+
+    if(!updi_open(&updi)) return false;
+
+    bool ok = updi_snapshot(&updi, &snapshot);
+
+    updi_close(&updi);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"snapshot_round_trips\":%u", snapshot.round_trips);
+
+    return ok && snapshot.round_trips <= 2
+        && memcmp(snapshot.signature, target.cfg.signature, 3) == 0
+        && memcmp(snapshot.serial, target.sigrow + serial_offset, snapshot.serial_size) == 0
+        && memcmp(snapshot.fuses, target.fuses, snapshot.num_fuses) == 0
+        && memcmp(snapshot.userrow, target.userrow, snapshot.userrow_size) == 0;
+}
+
+//updi_process() with the flash write streamed
+static bool run_stream(void){
+    updi.stream_write = true;
+    bool ok = updi_process(&updi);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"checkpoints\":%u,\"page_us\":%lu", updi.stats.stream_checkpoints, (unsigned long)updi.stats.stream_page_us);
+
+    return ok;
+}
+
+/*
+Patch per-unit data into flash in a session of its own, checked against the target byte for byte. The pages written have to be exactly those
+the patches change, one more edit repeats what the flash already holds
+*/
+static bool run_patch(void){
+    uint16_t pagesize = target.cfg.flash_pagesize;
+    uint8_t serial_number[8] = {'S', 'N', '0', '0', '4', '2', 0x13, 0x37};
+    uint8_t mac[6] = {0x02, 0x00, 0x5E, 0x10, 0x20, 0x30};
+    uint8_t calibration[2] = {0xA5, 0x5A};
+    uint16_t expected_pages = 0;
+
+    UPDIPatch patches[4] = {
+        {pagesize * 10 + 16, sizeof(serial_number), serial_number},
+        {pagesize * 3 - 3, sizeof(mac), mac},
+        {pagesize * 10 + 32, sizeof(calibration), calibration},
+        {pagesize * 5, 16, target.flash + pagesize * 5},
+    };
+
+    memcpy(patched, target.flash, target.cfg.flash_size);
+    for(uint8_t i = 0; i < 4; i++) memcpy(patched + patches[i].offset, patches[i].data, patches[i].size);
+
+    for(uint32_t page = 0; page < target.cfg.flash_size; page += pagesize){
+        if(memcmp(patched + page, target.flash + page, pagesize) != 0) expected_pages++;
+    }
+
+    if(!updi_open(&updi)) return false;
+
+    bool ok = updi_patch_flash(&updi, patches, 4, true);
+
+    updi_close(&updi);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"patch_pages\":%u", updi.stats.patch_pages);
+
+    return ok && updi.stats.patch_pages == expected_pages && memcmp(patched, target.flash, target.cfg.flash_size) == 0;
+}
+
+/*
+Write the image with updi.keep_boot over a BENCH_BOOT_SIZE boot section holding a stand-in bootloader, the application section scrambled first.
+The boot section has to come out as it was with the image's data for it left out, exactly the application pages of the image written and the
+rest of the application section erased. Then the same write on the part locked has to fail without touching flash
+*/
+static bool run_boot(void){
+    uint16_t pagesize = target.cfg.flash_pagesize;
+    uint16_t block = (target.cfg.nvm_version == UPDI_NVM_V2) ? UPDI_BOOT_BLOCK_V2_SIZE : UPDI_BOOT_BLOCK_SIZE;
+    uint8_t append = target.fuses[UPDI_FUSE_APPEND];
+    uint8_t bootend = target.fuses[UPDI_FUSE_BOOTEND];
+    uint16_t expected_pages = 0;
+
+    target.fuses[UPDI_FUSE_APPEND] = 0;
+    target.fuses[UPDI_FUSE_BOOTEND] = BENCH_BOOT_SIZE / block;
+
+    for(uint32_t i = 0; i < target.cfg.flash_size; i++) target.flash[i] = (i < BENCH_BOOT_SIZE) ? ~image[i] : 0x00;
+
+    memcpy(patched, target.flash, target.cfg.flash_size);
+    memset(patched + BENCH_BOOT_SIZE, 0xFF, target.cfg.flash_size - BENCH_BOOT_SIZE);
+    for(uint32_t page = BENCH_BOOT_SIZE; page < image_length; page += pagesize){
+        memcpy(patched + page, image + page, (image_length - page < pagesize) ? image_length - page : pagesize);
+        expected_pages++;
+    }
+
+    updi.args = UPDI_PROCESS_WRITE_FLASH | UPDI_PROCESS_VERIFY_FLASH;
+    updi.keep_boot = true;
+    bool ok = updi_process(&updi);
+    uint16_t app_pages = updi.stats.app_pages;
+
+    //a locked part would need the chip erase keep_boot is there to avoid, the write has to be refused with flash left as it is
+    target.locked = true;
+    ok = ok && !updi_process(&updi);
+    target.locked = false;
+
+    target.fuses[UPDI_FUSE_APPEND] = append;
+    target.fuses[UPDI_FUSE_BOOTEND] = bootend;
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"app_pages\":%u", app_pages);
+
+    return ok && app_pages == expected_pages && memcmp(patched, target.flash, target.cfg.flash_size) == 0;
+}
+
+/*
+Write the image through a daemon on the bench port from this thread as a client, the fixture going through a production line's cycle: a board,
+the same board left in, the fixture empty and the next board, the stuck target standing in for an empty fixture. Only the first and the last
+job may get a target, the other two are DAEMON_FLAG_NO_WAIT and have to come back without one. The port has to be opened once for all of them
+and the next board, blank when it goes in, left holding the image
+*/
+static bool run_daemon(void){
+    static const struct {bool board; uint8_t flags; uint8_t status;} steps[BENCH_DAEMON_JOBS] = {
+        {true, 0, DAEMON_OK}, {true, DAEMON_FLAG_NO_WAIT, DAEMON_NO_TARGET}, {false, DAEMON_FLAG_NO_WAIT, DAEMON_NO_TARGET}, {true, 0, DAEMON_OK},
+    };
+    DaemonRequest request = {DAEMON_CMD_JOB, BENCH_COM_PORT, updi.dev, UPDI_PROCESS_WRITE_FLASH, 0, updi.baudrate, ""};
+    DaemonReply reply;
+    uint32_t first_us = 0;
+    uint32_t warm_us = 0;      //the last job that ran
+    uint32_t ran = 0;
+    bool ok = true;
+
+    strcpy(request.image, updi.hex_filename);
+
+    if(!daemon_add_port(BENCH_COM_PORT, updi.transport) || !daemon_start(BENCH_DAEMON_SOCKET)) return false;
+
+    for(uint8_t i = 0; i < BENCH_DAEMON_JOBS && ok; i++){
+        if(i > 0 && steps[i].board && !steps[i - 1].board) memset(target.flash, 0xFF, target.cfg.flash_size);
+        target.stuck = !steps[i].board;
+
+        request.flags = steps[i].flags | (updi.full_duplex ? DAEMON_FLAG_DUPLEX : 0);
+        ok = daemon_submit(BENCH_DAEMON_SOCKET, &request, &reply) && reply.status == steps[i].status;
+        if(reply.status != DAEMON_OK) continue;
+
+        if(ran++ == 0) first_us = reply.wait_us + reply.run_us;
+        warm_us = reply.wait_us + reply.run_us;
+    }
+    target.stuck = false;
+
+    daemon_stop();
+
+    DaemonStats *stats = daemon_stats(BENCH_COM_PORT);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"jobs\":%lu,\"first_job_us\":%lu,\"warm_job_us\":%lu,\"daemon_opens\":%lu",
+             (unsigned long)stats->jobs, (unsigned long)first_us, (unsigned long)warm_us, (unsigned long)stats->opens);
+
+    return ok && ran == 2 && stats->jobs == 2 && stats->opens == 1;
+}
+
+/*
+Probe the bench port, the second target and the dead one together with updi_discover(), the first two have to be found with their SIB
+families. Over --tcp only the bench port is served, so only it is probed
+*/
+static bool run_discover(void){
+    uint8_t ports[3] = {BENCH_COM_PORT, BENCH_PROBE_PORT, BENCH_DEAD_PORT};
+    bool tcp = (updi.transport == &tcp_transport);
+    UPDIProbe found[3];
+
+    uint8_t count = updi_discover(updi.transport, updi.baudrate, ports, tcp ? 1 : 3, found);
+
+    snprintf(bench_extra, sizeof(bench_extra), ",\"found\":%u", count);
+
+    if(count != (tcp ? 1 : 2)) return false;
+    if(found[0].com_port != BENCH_COM_PORT || memcmp(found[0].family, target.cfg.sib, 7) != 0) return false;
+
+    return tcp || (found[1].com_port == BENCH_PROBE_PORT && memcmp(found[1].family, probe_target.cfg.sib, 7) == 0);
+}
+
+#if defined UPDI_SMALL
+static bool read_page(void *ctx, uint32_t offset, uint8_t *data, uint16_t len){
+    if(offset + len > UPDI_MAX_FLASH_SIZE) return false;
+    memcpy(flash_read + offset, data, len);
+    return true;
+}
+#endif
@@ -0,0 +1,680 @@
+/*
+C_UPDI daemon.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Programmer daemon, see daemon.h. Jobs run on a port through warm_transport, which opens the port's real transport the first time and from
+then on only hands its transfers, breaks and duplex switches through, so updi_process() opening and closing the port costs nothing and the
+latency measured by transport.c carries over from one job to the next. The accept thread parses images and queues jobs, each port's worker
+takes them off its own single producer / single consumer ring, so the only state shared between threads is the ring and an image's users.
+*/
+
+#if defined _WIN32
+    #include <winsock2.h>
+    #include <afunix.h>
+    typedef SOCKET DaemonSocket;
+    #define DAEMON_NO_SOCKET        INVALID_SOCKET
+    #define daemon_close_socket(s)  closesocket(s)
+#else
+    #define _POSIX_C_SOURCE 200112L
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/time.h>
+    #include <sys/select.h>
+    #include <sys/un.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    typedef int DaemonSocket;
+    #define DAEMON_NO_SOCKET        (-1)
+    #define daemon_close_socket(s)  close(s)
+#endif
+
+#if defined MSG_NOSIGNAL
+    #define DAEMON_SEND_FLAGS       MSG_NOSIGNAL    //a client that went away is an error, not SIGPIPE
+#else
+    #define DAEMON_SEND_FLAGS       0
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "updi.h"
+#include "daemon.h"
+
+typedef struct {
+    char filename[DAEMON_NAME_LEN + 1];     //"" while the slot is free
+    uint8_t data[UPDI_MAX_FLASH_SIZE];
+    uint32_t length;
+    atomic_uint users;                      //jobs queued or running with it, only replaced at 0
+    uint64_t last_used_us;
+} DaemonImage;
+
+typedef struct {
+    uint32_t id;
+    DaemonSocket client;
+    DaemonRequest request;
+    DaemonImage *image;                     //NULL when the job doesnt write flash
+    uint64_t queued_us;
+} DaemonJob;
+
+typedef struct {
+    bool used;
+    uint8_t com_port;
+    const SerialTransport *transport;
+    Serial inner;                           //the real port, open from the first job until daemon_stop()
+    DaemonStats stats;
+
+    Thread thread;
+    DaemonJob queue[DAEMON_QUEUE_SIZE];
+    atomic_uint head;                       //only stored by the accept thread
+    atomic_uint tail;                       //only stored by the port's worker
+    bool present;                           //the last job's target still answers, worker only
+
+    UPDI updi;
+#if defined UPDI_SMALL
+    UPDIArena arena;
+#endif
+} DaemonPort;
+
+static DaemonPort daemon_ports[DAEMON_MAX_PORTS];
+static DaemonImage daemon_images[DAEMON_MAX_IMAGES];
+static ImageStream daemon_parse;            //accept thread only
+static uint32_t daemon_jobs = 0;
+
+static DaemonSocket daemon_listener = DAEMON_NO_SOCKET;
+static char daemon_path[DAEMON_NAME_LEN + 1];
+static Thread daemon_thread;
+static bool daemon_serving = false;         //accept thread not joined yet
+static atomic_bool daemon_quit;
+
+static bool        warm_open(Serial *serial);
+static void        warm_close(Serial *serial);
+static bool        warm_set_baud(Serial *serial, uint32_t baudrate);
+static bool        warm_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        warm_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static bool        warm_start_duplex(Serial *serial);
+static void        warm_stop_duplex(Serial *serial);
+static bool        warm_sync(Serial *serial);
+static DaemonPort  *find_port(uint8_t com_port);
+static void        worker(void *arg);
+static void        serve(void *arg);
+static void        queue_job(DaemonSocket client);
+static DaemonImage *get_image(const char *filename, bool reload);
+static void        send_reply(DaemonSocket client, DaemonReply *reply);
+static bool        sockets_start(void);
+static bool        unix_address(const char *path, struct sockaddr_un *address);
+static void        remove_socket(const char *path);
+static bool        socket_read(DaemonSocket s, uint8_t *data, uint32_t len);
+static bool        socket_write(DaemonSocket s, uint8_t *data, uint32_t len);
+static void        put_u32(uint8_t *data, uint32_t value);
+static uint32_t    get_u32(uint8_t *data);
+
+static const SerialTransport warm_transport = {
+    "warm", warm_open, warm_close, warm_set_baud, warm_transfer, warm_send_break, warm_start_duplex, warm_stop_duplex, warm_sync
+};
+
+/*
+Serve jobs for com_port, opened through transport (the platform serial port, tcp_transport...). Ports are added before daemon_start(),
+adding one again only changes its transport
+*/
+bool daemon_add_port(uint8_t com_port, const SerialTransport *transport){
+    DaemonPort *port = find_port(com_port);
+
+    for(uint8_t i = 0; i < DAEMON_MAX_PORTS && port == NULL; i++){
+        if(!daemon_ports[i].used) port = &(daemon_ports[i]);
+    }
+
+    if(port == NULL || daemon_serving){
+        log_error("daemon error, too many ports or the daemon is running\r\n");
+        return false;
+    }
+
+    port->used = true;
+    port->com_port = com_port;
+    port->transport = transport;
+    port->inner.port = NULL;
+
+    return true;
+}
+
+DaemonStats *daemon_stats(uint8_t com_port){
+    DaemonPort *port = find_port(com_port);
+    if(port == NULL) return NULL;
+    return &(port->stats);
+}
+
+/*
+Listen on socket_path, which is replaced if a socket is there already (anything else there makes the bind fail), and start the accept thread and a worker for every port
+*/
+bool daemon_start(const char *socket_path){
+    struct sockaddr_un address;
+
+    if(daemon_serving || !sockets_start() || !unix_address(socket_path, &address)){
+        log_error("daemon error, already running or bad socket path\r\n");
+        return false;
+    }
+
+    strcpy(daemon_path, socket_path);
+    remove_socket(daemon_path);
+
+    daemon_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(daemon_listener == DAEMON_NO_SOCKET){
+        log_error("daemon error, cant create the socket\r\n");
+        return false;
+    }
+
+    if(bind(daemon_listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(daemon_listener, DAEMON_QUEUE_SIZE) != 0){
+        log_error("daemon error, cant listen on the socket\r\n");
+        daemon_close_socket(daemon_listener);
+        daemon_listener = DAEMON_NO_SOCKET;
+        return false;
+    }
+
+    atomic_store(&daemon_quit, false);
+    daemon_jobs = 0;
+
+    for(uint8_t i = 0; i < DAEMON_MAX_PORTS; i++){
+        DaemonPort *port = &(daemon_ports[i]);
+        if(!port->used) continue;
+
+        memset(&(port->stats), 0, sizeof(DaemonStats));
+        atomic_store(&(port->head), 0);
+        atomic_store(&(port->tail), 0);
+        port->present = false;
+
+        if(!thread_start(&(port->thread), worker, port)){
+            log_error("daemon error, cant start a worker\r\n");
+            port->used = false;
+        }
+    }
+
+    if(!thread_start(&daemon_thread, serve, NULL)){
+        log_error("daemon error, cant start the accept thread\r\n");
+        daemon_stop();
+        return false;
+    }
+    daemon_serving = true;
+
+    log_important("daemon listening\r\n");
+
+    return true;
+}
+
+//Block until a DAEMON_CMD_QUIT request comes in
+void daemon_wait(void){
+    if(daemon_serving){
+        thread_join(&daemon_thread);
+        daemon_serving = false;
+    }
+    return;
+}
+
+/*
+Stop accepting, let each worker finish the job it is on, reject whatever is still queued and close the ports
+*/
+void daemon_stop(void){
+    if(daemon_listener == DAEMON_NO_SOCKET) return;
+
+    atomic_store(&daemon_quit, true);
+    daemon_wait();
+
+    for(uint8_t i = 0; i < DAEMON_MAX_PORTS; i++){
+        DaemonPort *port = &(daemon_ports[i]);
+        if(!port->used) continue;
+
+        thread_join(&(port->thread));
+
+        unsigned int head = atomic_load(&(port->head));
+        for(unsigned int tail = atomic_load(&(port->tail)); tail != head; tail++){
+            DaemonJob *job = &(port->queue[tail % DAEMON_QUEUE_SIZE]);
+            DaemonReply reply = {DAEMON_REJECTED, job->id, 0, 0};
+
+            if(job->image != NULL) atomic_fetch_sub(&(job->image->users), 1);
+            send_reply(job->client, &reply);
+        }
+        atomic_store(&(port->tail), head);
+
+        if(port->inner.port != NULL){
+            serial_close(&(port->inner));
+            port->inner.port = NULL;
+        }
+    }
+
+    daemon_close_socket(daemon_listener);
+    daemon_listener = DAEMON_NO_SOCKET;
+    remove_socket(daemon_path);
+
+    log_flush();
+
+    return;
+}
+
+/*
+Client side, send request to the daemon at socket_path and wait for its reply, which comes once the job has run. Returns false when the daemon
+couldnt be reached, otherwise reply->status says how the job went
+*/
+bool daemon_submit(const char *socket_path, const DaemonRequest *request, DaemonReply *reply){
+    struct sockaddr_un address;
+    uint8_t data[DAEMON_REQUEST_SIZE + DAEMON_NAME_LEN];
+    size_t name_len = strlen(request->image);
+
+    if(name_len > DAEMON_NAME_LEN || !sockets_start() || !unix_address(socket_path, &address)){
+        log_error("daemon error, bad socket path or image name\r\n");
+        return false;
+    }
+
+    DaemonSocket s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s == DAEMON_NO_SOCKET) return false;
+
+    if(connect(s, (struct sockaddr*)&address, sizeof(address)) != 0){
+        log_error("daemon error, cant connect to the daemon\r\n");
+        daemon_close_socket(s);
+        return false;
+    }
+
+    data[0] = 'U';
+    data[1] = 'D';
+    data[2] = DAEMON_VERSION;
+    data[3] = request->command;
+    data[4] = request->com_port;
+    data[5] = request->dev;
+    data[6] = request->args;
+    data[7] = request->flags;
+    put_u32(&(data[8]), request->baudrate);
+    data[12] = (uint8_t)name_len;
+    memcpy(&(data[DAEMON_REQUEST_SIZE]), request->image, name_len);
+
+    bool ok = socket_write(s, data, DAEMON_REQUEST_SIZE + (uint32_t)name_len) && socket_read(s, data, DAEMON_REPLY_SIZE);
+    daemon_close_socket(s);
+
+    if(!ok || data[0] != 'U' || data[1] != 'R' || data[2] != DAEMON_VERSION){
+        log_error("daemon error, no reply\r\n");
+        return false;
+    }
+
+    reply->status = data[3];
+    reply->job = get_u32(&(data[4]));
+    reply->wait_us = get_u32(&(data[8]));
+    reply->run_us = get_u32(&(data[12]));
+
+    return true;
+}
+
+static DaemonPort *find_port(uint8_t com_port){
+    for(uint8_t i = 0; i < DAEMON_MAX_PORTS; i++){
+        if(daemon_ports[i].used && daemon_ports[i].com_port == com_port) return &(daemon_ports[i]);
+    }
+    return NULL;
+}
+
+/*
+A port's jobs one at a time, each waiting until updi_detect() sees a target so the next board can go on while the queue is waiting.
+The board a job ran on still answers until it is taken away, so after a job updi_detect() has to fail once before a target counts again.
+The UPDI struct is the port's own and is set up again for every job
+*/
+static void worker(void *arg){
+    DaemonPort *port = (DaemonPort*)arg;
+    UPDI *updi = &(port->updi);
+
+    while(!atomic_load(&daemon_quit)){
+        unsigned int tail = atomic_load_explicit(&(port->tail), memory_order_relaxed);
+        if(tail == atomic_load_explicit(&(port->head), memory_order_acquire)){
+            thread_sleep_ms(DAEMON_IDLE_MS);
+            continue;
+        }
+
+        DaemonJob *job = &(port->queue[tail % DAEMON_QUEUE_SIZE]);
+        DaemonRequest *request = &(job->request);
+        DaemonReply reply = {DAEMON_NO_TARGET, job->id, 0, 0};
+        bool found = false;
+
+        updi_init(updi, port->com_port, request->baudrate, request->dev, request->args, request->image, (uint8_t)strlen(request->image));
+        updi->transport = &warm_transport;
+        updi->full_duplex = (request->flags & DAEMON_FLAG_DUPLEX) != 0;
+        updi->keep_boot = (request->flags & DAEMON_FLAG_KEEP_BOOT) != 0;
+#if defined UPDI_SMALL
+        updi->arena = &(port->arena);
+#endif
+
+        while(!atomic_load(&daemon_quit)){
+            port->stats.probes++;
+            found = updi_detect(updi);
+            if(!found) port->present = false;
+            found = found && !port->present;
+            if(found || (request->flags & DAEMON_FLAG_NO_WAIT)) break;
+            thread_sleep_ms(DAEMON_POLL_MS);
+        }
+
+        uint64_t start = micros();
+        reply.wait_us = (uint32_t)(start - job->queued_us);
+
+        if(found){
+            if(job->image != NULL) image_start_memory(&(updi->image), job->image->data, job->image->length);
+
+            bool ok = updi_process(updi);
+            updi_cleanup(updi);
+            port->present = true;
+
+            reply.status = ok ? DAEMON_OK : DAEMON_FAILED;
+            reply.run_us = (uint32_t)(micros() - start);
+            port->stats.jobs++;
+            if(!ok) port->stats.failed++;
+        }else if(atomic_load(&daemon_quit)){
+            reply.status = DAEMON_REJECTED;
+        }
+
+        if(job->image != NULL) atomic_fetch_sub(&(job->image->users), 1);
+        send_reply(job->client, &reply);
+
+        atomic_store_explicit(&(port->tail), tail + 1, memory_order_release);
+    }
+
+    return;
+}
+
+//Accept thread, one request per connection, checking for daemon_stop() every DAEMON_ACCEPT_MS
+static void serve(void *arg){
+    (void)arg;
+
+    while(!atomic_load(&daemon_quit)){
+        fd_set ready;
+        struct timeval wait = {0, DAEMON_ACCEPT_MS * 1000};
+
+        FD_ZERO(&ready);
+        FD_SET(daemon_listener, &ready);
+        if(select((int)daemon_listener + 1, &ready, NULL, NULL, &wait) <= 0) continue;
+
+        DaemonSocket client = accept(daemon_listener, NULL, NULL);
+        if(client == DAEMON_NO_SOCKET) continue;
+
+        queue_job(client);
+    }
+
+    return;
+}
+
+/*
+Read one request from client and queue it on its port, loading the image first if the job writes flash. Anything wrong is answered straight
+away, otherwise the worker replies and closes client once the job has run
+*/
+static void queue_job(DaemonSocket client){
+    uint8_t data[DAEMON_REQUEST_SIZE];
+    DaemonRequest request;
+    DaemonReply reply = {DAEMON_REJECTED, 0, 0, 0};
+
+#if defined _WIN32
+    DWORD timeout = DAEMON_TIMEOUT_MS;
+#else
+    struct timeval timeout = {DAEMON_TIMEOUT_MS / 1000, (DAEMON_TIMEOUT_MS % 1000) * 1000};
+#endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    if(!socket_read(client, data, DAEMON_REQUEST_SIZE) || data[0] != 'U' || data[1] != 'D' || data[2] != DAEMON_VERSION
+        || !socket_read(client, (uint8_t*)request.image, data[12])){
+        log_error("daemon error, bad request\r\n");
+        send_reply(client, &reply);
+        return;
+    }
+
+    request.command = data[3];
+    request.com_port = data[4];
+    request.dev = data[5];
+    request.args = data[6];
+    request.flags = data[7];
+    request.baudrate = get_u32(&(data[8]));
+    request.image[data[12]] = '\0';
+
+    if(request.command == DAEMON_CMD_QUIT){
+        atomic_store(&daemon_quit, true);
+        reply.status = DAEMON_OK;
+        send_reply(client, &reply);
+        return;
+    }
+
+    DaemonPort *port = find_port(request.com_port);
+    if(request.command != DAEMON_CMD_JOB || port == NULL){
+        log_error("daemon error, unknown command or port %d\r\n", request.com_port);
+        send_reply(client, &reply);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&(port->head), memory_order_relaxed);
+    if(head - atomic_load_explicit(&(port->tail), memory_order_acquire) >= DAEMON_QUEUE_SIZE){
+        log_error("daemon error, queue full on port %d\r\n", request.com_port);
+        send_reply(client, &reply);
+        return;
+    }
+
+    DaemonImage *image = NULL;
+    if(request.args & UPDI_PROCESS_WRITE_FLASH){
+        image = get_image(request.image, (request.flags & DAEMON_FLAG_RELOAD) != 0);
+        if(image == NULL){
+            send_reply(client, &reply);
+            return;
+        }
+    }
+
+    DaemonJob *job = &(port->queue[head % DAEMON_QUEUE_SIZE]);
+    job->id = ++daemon_jobs;
+    job->client = client;
+    job->request = request;
+    job->image = image;
+    job->queued_us = micros();
+
+    atomic_store_explicit(&(port->head), head + 1, memory_order_release);
+
+    return;
+}
+
+/*
+The cached image for filename, parsed now if it isnt cached or reload is set, with one more user. A reloaded image still in use by a queued
+job is left to that job and the new parse goes in another slot. NULL if the file doesnt parse or every slot is in use
+*/
+static DaemonImage *get_image(const char *filename, bool reload){
+    DaemonImage *image = NULL;
+
+    for(uint8_t i = 0; i < DAEMON_MAX_IMAGES; i++){
+        DaemonImage *cached = &(daemon_images[i]);
+        if(cached->filename[0] == '\0' || strcmp(cached->filename, filename) != 0) continue;
+
+        if(!reload){
+            atomic_fetch_add(&(cached->users), 1);
+            cached->last_used_us = micros();
+            return cached;
+        }
+
+        cached->filename[0] = '\0';
+    }
+
+    //free slot first, then the least recently used one no job is holding
+    for(uint8_t i = 0; i < DAEMON_MAX_IMAGES; i++){
+        DaemonImage *slot = &(daemon_images[i]);
+        if(atomic_load(&(slot->users)) != 0) continue;
+
+        if(image == NULL || slot->filename[0] == '\0' || (image->filename[0] != '\0' && slot->last_used_us < image->last_used_us)){
+            image = slot;
+        }
+    }
+
+    if(image == NULL){
+        log_error("daemon error, every image is in use\r\n");
+        return NULL;
+    }
+
+    strcpy(image->filename, filename);
+    if(!image_load(&daemon_parse, image->filename, image->data, UPDI_MAX_FLASH_SIZE, &(image->length))){
+        log_error("daemon error, cant load the image\r\n");
+        image->filename[0] = '\0';
+        return NULL;
+    }
+
+    atomic_store(&(image->users), 1);
+    image->last_used_us = micros();
+
+    return image;
+}
+
+//reply and close, the client is gone if this fails and there is no one left to tell
+static void send_reply(DaemonSocket client, DaemonReply *reply){
+    uint8_t data[DAEMON_REPLY_SIZE] = {'U', 'R', DAEMON_VERSION, reply->status};
+
+    put_u32(&(data[4]), reply->job);
+    put_u32(&(data[8]), reply->wait_us);
+    put_u32(&(data[12]), reply->run_us);
+
+    socket_write(client, data, DAEMON_REPLY_SIZE);
+    daemon_close_socket(client);
+
+    return;
+}
+
+static bool sockets_start(void){
+#if defined _WIN32
+    static bool wsa_started = false;
+    WSADATA wsa;
+    if(!wsa_started){
+        if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+            log_error("daemon error, WSAStartup failed\r\n");
+            return false;
+        }
+        wsa_started = true;
+    }
+#endif
+    return true;
+}
+
+static bool unix_address(const char *path, struct sockaddr_un *address){
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    if(strlen(path) == 0 || strlen(path) >= sizeof(address->sun_path)) return false;
+    strcpy(address->sun_path, path);
+
+    return true;
+}
+
+//Delete path only if it is a socket, a mistyped path to a regular file is left alone. Win32 AF_UNIX sockets are reparse points
+static void remove_socket(const char *path){
+#if defined _WIN32
+    DWORD attributes = GetFileAttributesA(path);
+    if(attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT)) DeleteFileA(path);
+#else
+    struct stat st;
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+#endif
+    return;
+}
+
+static bool socket_read(DaemonSocket s, uint8_t *data, uint32_t len){
+    while(len > 0){
+        int got = recv(s, (char*)data, (int)len, 0);
+        if(got <= 0) return false;
+        data += got;
+        len -= (uint32_t)got;
+    }
+    return true;
+}
+
+static bool socket_write(DaemonSocket s, uint8_t *data, uint32_t len){
+    while(len > 0){
+        int sent = send(s, (const char*)data, (int)len, DAEMON_SEND_FLAGS);
+        if(sent <= 0) return false;
+        data += sent;
+        len -= (uint32_t)sent;
+    }
+    return true;
+}
+
+static void put_u32(uint8_t *data, uint32_t value){
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+    data[2] = (uint8_t)(value >> 16);
+    data[3] = (uint8_t)(value >> 24);
+    return;
+}
+
+static uint32_t get_u32(uint8_t *data){
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/*
+warm_transport, serial->port is the DaemonPort and every call goes to port->inner. Opening only really opens the first time or changes the
+baud rate, closing leaves the line idle and half-duplex for the next job
+*/
+static bool warm_open(Serial *serial){
+    DaemonPort *port = find_port(serial->com_port);
+    if(port == NULL){
+        log_error("error opening daemon port, not added\r\n");
+        return false;
+    }
+
+    if(port->inner.port == NULL){
+        port->inner.transport = port->transport;
+        port->inner.com_port = port->com_port;
+        port->inner.baudrate = serial->baudrate;
+        if(!serial_init(&(port->inner))){
+            port->inner.port = NULL;
+            return false;
+        }
+        port->stats.opens++;
+    }else if(port->inner.baudrate != serial->baudrate){
+        if(!serial_change_baud(&(port->inner), serial->baudrate)) return false;
+        port->inner.baudrate = serial->baudrate;
+    }
+
+    serial->port = port;
+    serial->latency_us = port->inner.latency_us;
+
+    return true;
+}
+
+static void warm_close(Serial *serial){
+    DaemonPort *port = serial->port;
+
+    serial_sync(&(port->inner));
+    serial_stop_duplex(&(port->inner));
+    port->inner.latency_us = serial->latency_us;
+
+    return;
+}
+
+static bool warm_set_baud(Serial *serial, uint32_t baudrate){
+    DaemonPort *port = serial->port;
+
+    if(!serial_change_baud(&(port->inner), baudrate)) return false;
+    port->inner.baudrate = baudrate;
+
+    return true;
+}
+
+//straight to the inner transport, serial_transfer() on the outer Serial already traced and timed it
+static bool warm_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    DaemonPort *port = serial->port;
+
+    port->inner.latency_us = serial->latency_us;
+
+    return port->inner.transport->transfer(&(port->inner), tx, tx_count, rx, rx_count);
+}
+
+static bool warm_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    DaemonPort *port = serial->port;
+    return serial_send_break(&(port->inner), duration_us, count);
+}
+
+static bool warm_start_duplex(Serial *serial){
+    DaemonPort *port = serial->port;
+    return serial_start_duplex(&(port->inner));
+}
+
+static void warm_stop_duplex(Serial *serial){
+    DaemonPort *port = serial->port;
+    serial_stop_duplex(&(port->inner));
+    return;
+}
+
+static bool warm_sync(Serial *serial){
+    DaemonPort *port = serial->port;
+    return serial_sync(&(port->inner));
+}
@@ -0,0 +1,85 @@
+/*
+C_UPDI daemon.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Long running programmer for a production line, see daemon.c. Each port added with daemon_add_port() is opened once and stays open between jobs,
+every image file is parsed once and kept in memory, and each port has a worker thread that waits for a target to answer before it starts the next
+job queued for it. The board the last job ran on doesnt count until it has been taken away, so a queue never runs twice on one board. Jobs come
+in over a local (AF_UNIX) socket, one request per connection, and the reply is sent once the job is done.
+
+Request, little endian:   'U' 'D' version command com_port dev args flags baudrate[4] name_len, then name_len bytes of image file name
+Reply:                    'U' 'R' version status job[4] wait_us[4] run_us[4]
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "transport.h"
+
+#define DAEMON_MAX_PORTS            4
+#define DAEMON_MAX_IMAGES           4           //parsed images kept, the least recently used one not queued is replaced
+#define DAEMON_QUEUE_SIZE           16          //jobs waiting per port, power of 2
+#define DAEMON_NAME_LEN             255
+#define DAEMON_POLL_MS              10          //between probes for a target while a job waits
+#define DAEMON_IDLE_MS              2           //worker sleep with nothing queued
+#define DAEMON_ACCEPT_MS            100         //how long daemon_stop() can take to be noticed
+#define DAEMON_TIMEOUT_MS           1000        //for reading a request
+
+#define DAEMON_VERSION              1
+#define DAEMON_REQUEST_SIZE         13
+#define DAEMON_REPLY_SIZE           16
+
+//commands
+#define DAEMON_CMD_JOB              1
+#define DAEMON_CMD_QUIT             2           //daemon_wait() returns, jobs still queued are rejected by daemon_stop()
+
+//job flags
+#define DAEMON_FLAG_RELOAD          0x01        //parse the image file again even if it is cached
+#define DAEMON_FLAG_DUPLEX          0x02        //run the job with updi.full_duplex set
+#define DAEMON_FLAG_NO_WAIT         0x04        //fail at once when no new target answers instead of waiting for one
+#define DAEMON_FLAG_KEEP_BOOT       0x08        //run the job with updi.keep_boot set, only the application section is written
+
+//reply status
+#define DAEMON_OK                   0
+#define DAEMON_FAILED               1           //the job ran and updi_process() failed
+#define DAEMON_REJECTED             2           //bad request, unknown port, queue full, image wouldnt load or the daemon stopped
+#define DAEMON_NO_TARGET            3           //DAEMON_FLAG_NO_WAIT and nothing answered but the last job's board
+
+typedef struct {
+    uint8_t     command;
+    uint8_t     com_port;
+    uint8_t     dev;
+    uint8_t     args;           //updi_process() args, UPDI_PROCESS_WRITE_FLASH needs an image
+    uint8_t     flags;
+    uint32_t    baudrate;
+    char        image[DAEMON_NAME_LEN + 1];
+} DaemonRequest;
+
+typedef struct {
+    uint8_t     status;
+    uint32_t    job;            //numbered as they are queued
+    uint32_t    wait_us;        //queued until a target answered
+    uint32_t    run_us;         //updi_process()
+} DaemonReply;
+
+typedef struct {
+    uint32_t    jobs;
+    uint32_t    failed;
+    uint32_t    probes;         //updi_detect() calls
+    uint32_t    opens;          //times the port was really opened
+} DaemonStats;
+
+bool        daemon_add_port(uint8_t com_port, const SerialTransport *transport);
+bool        daemon_start(const char *socket_path);
+void        daemon_wait(void);
+void        daemon_stop(void);
+DaemonStats *daemon_stats(uint8_t com_port);
+
+bool        daemon_submit(const char *socket_path, const DaemonRequest *request, DaemonReply *reply);
+
+#endif
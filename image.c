@@ -0,0 +1,382 @@
+/*
+C_UPDI image.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Parses a firmware image on a worker thread, see image.h. Every byte the file sets goes into the block being built, and that block is queued as soon
+as a byte for a different block turns up, so a file in address order (as avr-gcc / objcopy write them) comes out as each block in turn.
+A file that goes back to an earlier block just queues that block again with only the new bytes set, the reader merges them.
+
+Intel hex follows extended segment / linear address records (types 02 / 04) so images above 64K load, start address records (03 / 05) are ignored.
+ELF files are recognised by their magic, the file contents of every PT_LOAD segment are loaded at its physical (load) address, which is the flash
+address for .text and the initialised .data copied out of flash, segments above IMAGE_ELF_FLASH_END aren't flash and are skipped.
+*/
+
+#include <string.h>
+
+#include "updi.h"
+
+#define ELF_HEADER_SIZE             52
+#define ELF_PHDR_SIZE               32
+#define ELF_PT_LOAD                 1
+#define ELF_CLASS_32                1
+#define ELF_DATA_LSB                1
+
+typedef struct {
+    ImageStream *stream;
+    ImageBlock block;       //being built, nothing set yet while len is 0
+    uint32_t length;
+} ImageParser;
+
+static void        image_run(void *arg);
+static ImageBlock  *memory_block(ImageStream *stream);
+static bool        parse_ihex(ImageParser *parser, File *file);
+static bool        parse_elf(ImageParser *parser, File *file);
+static bool        put_data(ImageParser *parser, uint32_t address, uint8_t *data, uint32_t len);
+static bool        queue_block(ImageParser *parser);
+static uint32_t    get_le(uint8_t *buf, uint8_t bytes);
+
+
+/*
+Start parsing filename on a worker thread, blocks are then taken with image_next() / image_release() and image_finish() ends it.
+Data at or beyond max_len fails the parse
+*/
+bool image_start(ImageStream *stream, char *filename, uint32_t max_len){
+    stream->filename = filename;
+    stream->memory = NULL;
+    stream->max_len = max_len;
+    stream->length = 0;
+
+    atomic_store(&(stream->head), 0);
+    atomic_store(&(stream->tail), 0);
+    atomic_store(&(stream->done), false);
+    atomic_store(&(stream->ok), false);
+    atomic_store(&(stream->stop), false);
+
+    stream->started = thread_start(&(stream->thread), image_run, stream);
+
+    return stream->started;
+}
+
+/*
+Wait for the next block, NULL once the parser has finished and everything it queued has been taken. The block stays valid until image_release()
+*/
+ImageBlock *image_next(ImageStream *stream){
+    if(stream->memory != NULL) return memory_block(stream);
+
+    unsigned int tail = atomic_load_explicit(&(stream->tail), memory_order_relaxed);
+
+    while(tail == atomic_load_explicit(&(stream->head), memory_order_acquire)){
+        //head is stored before done, so a done parser with nothing left really is empty
+        if(atomic_load_explicit(&(stream->done), memory_order_acquire)){
+            if(tail == atomic_load_explicit(&(stream->head), memory_order_acquire)) return NULL;
+            break;
+        }
+        thread_sleep_ms(1);
+    }
+
+    return &(stream->blocks[tail % IMAGE_QUEUE_BLOCKS]);
+}
+
+void image_release(ImageStream *stream){
+    unsigned int tail = atomic_load_explicit(&(stream->tail), memory_order_relaxed);
+    atomic_store_explicit(&(stream->tail), tail + 1, memory_order_release);
+
+    return;
+}
+
+/*
+Stop the parser if it is still going and wait for it, returns whether the whole file parsed and its length (highest address set + 1) if length isnt NULL.
+Safe to call again or on a stream that never started
+*/
+bool image_finish(ImageStream *stream, uint32_t *length){
+    if(stream->started && stream->memory == NULL){
+        atomic_store(&(stream->stop), true);
+        thread_join(&(stream->thread));
+    }
+    stream->started = false;
+
+    if(length != NULL) *length = stream->length;
+
+    return atomic_load(&(stream->done)) && atomic_load(&(stream->ok));
+}
+
+/*
+Serve an image already in memory, length bytes from the start of flash with 0xFF where nothing is set, through the same image_next() /
+image_release() / image_finish() as a file. data has to stay as it is until image_finish()
+*/
+bool image_start_memory(ImageStream *stream, const uint8_t *data, uint32_t length){
+    stream->filename = NULL;
+    stream->memory = data;
+    stream->max_len = length;
+    stream->length = length;
+
+    atomic_store(&(stream->head), 0);
+    atomic_store(&(stream->tail), 0);
+    atomic_store(&(stream->done), true);
+    atomic_store(&(stream->ok), true);
+    atomic_store(&(stream->stop), false);
+
+    stream->started = true;
+
+    return true;
+}
+
+/*
+Parse the whole of filename into data, 0xFF wherever the file sets nothing, for an image that is kept to be served with image_start_memory().
+Returns whether the file parsed and its length if length isnt NULL
+*/
+bool image_load(ImageStream *stream, char *filename, uint8_t *data, uint32_t max_len, uint32_t *length){
+    ImageBlock *block;
+
+    memset(data, 0xFF, max_len);
+
+    if(!image_start(stream, filename, max_len)) return false;
+
+    while((block = image_next(stream)) != NULL){
+        for(uint16_t i = 0; i < block->len; i++) data[block->address + i] &= block->data[i];
+        image_release(stream);
+    }
+
+    return image_finish(stream, length);
+}
+
+//image_next() for image_start_memory(), tail counts blocks from the start of the image and the ones that are all 0xFF are skipped
+static ImageBlock *memory_block(ImageStream *stream){
+    unsigned int tail = atomic_load_explicit(&(stream->tail), memory_order_relaxed);
+    ImageBlock *block = &(stream->blocks[0]);
+
+    for(uint32_t address = tail * IMAGE_BLOCK_SIZE; address < stream->length; address += IMAGE_BLOCK_SIZE, tail++){
+        const uint8_t *data = stream->memory + address;
+        uint16_t len = (stream->length - address < IMAGE_BLOCK_SIZE) ? stream->length - address : IMAGE_BLOCK_SIZE;
+
+        while(len > 0 && data[len - 1] == 0xFF) len--;
+        if(len == 0) continue;
+
+        block->address = address;
+        block->len = len;
+        memcpy(block->data, data, len);
+        memset(block->data + len, 0xFF, IMAGE_BLOCK_SIZE - len);
+
+        atomic_store_explicit(&(stream->tail), tail, memory_order_relaxed);
+        return block;
+    }
+
+    atomic_store_explicit(&(stream->tail), tail, memory_order_relaxed);
+    return NULL;
+}
+
+static void image_run(void *arg){
+    ImageStream *stream = (ImageStream*)arg;
+    ImageParser parser;
+    File file;
+    uint8_t magic[4] = {0};
+    bool ok = false;
+
+    parser.stream = stream;
+    parser.block.len = 0;
+    parser.length = 0;
+
+    if(!open_file(&file, stream->filename)){
+        log_error("Couldnt open file\r\n");
+    }else{
+        if(file_read(&file, magic, 4) == 4 && magic[0] == 0x7F && magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F'){
+            ok = parse_elf(&parser, &file);
+        }else{
+            ok = file_seek(&file, 0) && parse_ihex(&parser, &file);
+        }
+
+        close_file(&file);
+    }
+
+    //the last block only goes once the file is known to be good
+    if(ok && parser.block.len > 0) ok = queue_block(&parser);
+
+    stream->length = parser.length;
+    atomic_store(&(stream->ok), ok);
+    atomic_store_explicit(&(stream->done), true, memory_order_release);
+
+    return;
+}
+
+static bool parse_ihex(ImageParser *parser, File *file){
+    uint32_t base_address = 0;
+
+    char line[256];
+    memset(line, 0, sizeof(line));
+    while(file_read_line(file, line, sizeof(line))){
+        //21 bytes max size we'll encounter
+        uint8_t record_bin[21];
+        uint8_t record_bin_index = 0;
+        memset(record_bin, 0, 21);
+        uint8_t data_length = 0;
+        uint16_t address = 0;
+        uint8_t type = 0;
+
+       //i = 1 to skip ':' at start of record
+        for(int i = 1; i < strlen(line) && record_bin_index < sizeof(record_bin); i += 2){
+            uint8_t bin_value = 0;
+
+            if(line[i] == '\r' || line[i] == '\n' || line[i+1] == '\r' || line[i+1] == '\n') break;
+
+            if(line[i] >= '0' && line[i] <= '9'){
+                bin_value += ((uint8_t)(line[i]) - 48) * 16;
+            }else if(line[i] >= 'A' && line[i] <= 'F'){
+                bin_value += ((uint8_t)(line[i]) - 55) * 16;
+            }
+
+            if(line[i+1] >= '0' && line[i+1] <= '9'){
+                bin_value += ((uint8_t)(line[i+1]) - 48);
+            }else if(line[i+1] >= 'A' && line[i+1] <= 'F'){
+                bin_value += ((uint8_t)(line[i+1]) - 55);
+            }
+
+            record_bin[record_bin_index++] = bin_value;
+        }
+
+        data_length = record_bin[0];
+        address = record_bin[1] * 256 + record_bin[2];
+        type = record_bin[3];
+
+        if(type == 0){
+            //data
+            if(data_length > sizeof(record_bin) - 4){
+                log_error("load image error, hex record too long\r\n");
+                return false;
+            }
+
+            if(!put_data(parser, base_address + address, record_bin + 4, data_length)) return false;
+        }else if(type == 1){
+            //End of records
+            log_str("End of records reached\r\n");
+        }else if(type == 2){
+            //Extended segment address, bits 4-19
+            base_address = (uint32_t)((record_bin[4] << 8) | record_bin[5]) << 4;
+        }else if(type == 4){
+            //Extended linear address, bits 16-31
+            base_address = (uint32_t)((record_bin[4] << 8) | record_bin[5]) << 16;
+        }else if(type == 3 || type == 5){
+            //Start address, nothing to do
+        }else{
+            log_error("load image error, unsupported hex file\r\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//32-bit little endian ELF only, which is all avr-gcc produces
+static bool parse_elf(ImageParser *parser, File *file){
+    uint8_t header[ELF_HEADER_SIZE];
+    uint8_t phdr[ELF_PHDR_SIZE];
+    uint8_t buf[256];
+
+    if(!file_seek(file, 0) || file_read(file, header, ELF_HEADER_SIZE) != ELF_HEADER_SIZE){
+        log_error("load image error, ELF header too short\r\n");
+        return false;
+    }
+
+    if(header[4] != ELF_CLASS_32 || header[5] != ELF_DATA_LSB){
+        log_error("load image error, unsupported ELF file\r\n");
+        return false;
+    }
+
+    uint32_t phoff = get_le(header + 28, 4);
+    uint16_t phentsize = get_le(header + 42, 2);
+    uint16_t phnum = get_le(header + 44, 2);
+
+    if(phnum > 0 && phentsize < ELF_PHDR_SIZE){
+        log_error("load image error, unsupported ELF file\r\n");
+        return false;
+    }
+
+    for(uint16_t i = 0; i < phnum; i++){
+        if(!file_seek(file, phoff + (uint32_t)i * phentsize) || file_read(file, phdr, ELF_PHDR_SIZE) != ELF_PHDR_SIZE){
+            log_error("load image error, ELF program header missing\r\n");
+            return false;
+        }
+
+        uint32_t type = get_le(phdr, 4);
+        uint32_t offset = get_le(phdr + 4, 4);
+        uint32_t paddr = get_le(phdr + 12, 4);
+        uint32_t filesz = get_le(phdr + 16, 4);
+
+        if(type != ELF_PT_LOAD || filesz == 0 || paddr >= IMAGE_ELF_FLASH_END) continue;
+
+        if(!file_seek(file, offset)){
+            log_error("load image error, ELF segment missing\r\n");
+            return false;
+        }
+
+        for(uint32_t done = 0; done < filesz;){
+            int chunk = (filesz - done < sizeof(buf)) ? filesz - done : sizeof(buf);
+
+            if(file_read(file, buf, chunk) != chunk){
+                log_error("load image error, ELF segment truncated\r\n");
+                return false;
+            }
+
+            if(!put_data(parser, paddr + done, buf, chunk)) return false;
+            done += chunk;
+        }
+    }
+
+    return true;
+}
+
+//Set len bytes from address, queueing the block being built whenever the data moves on to another one
+static bool put_data(ImageParser *parser, uint32_t address, uint8_t *data, uint32_t len){
+    ImageBlock *block = &(parser->block);
+
+    if(address + len > parser->stream->max_len){
+        log_error("load image error, data beyond end of flash\r\n");
+        return false;
+    }
+
+    for(uint32_t i = 0; i < len; i++, address++){
+        uint32_t start = address / IMAGE_BLOCK_SIZE * IMAGE_BLOCK_SIZE;
+        uint16_t offset = address - start;
+
+        if(block->len > 0 && block->address != start && !queue_block(parser)) return false;
+
+        if(block->len == 0){
+            block->address = start;
+            memset(block->data, 0xFF, IMAGE_BLOCK_SIZE);
+        }
+
+        block->data[offset] = data[i];
+        if(offset + 1 > block->len) block->len = offset + 1;
+    }
+
+    if(address > parser->length) parser->length = address;
+
+    return true;
+}
+
+//Hand the block being built to the reader, waiting while the queue is full. Fails if the reader has given up
+static bool queue_block(ImageParser *parser){
+    ImageStream *stream = parser->stream;
+    unsigned int head = atomic_load_explicit(&(stream->head), memory_order_relaxed);
+
+    while(head - atomic_load_explicit(&(stream->tail), memory_order_acquire) >= IMAGE_QUEUE_BLOCKS){
+        if(atomic_load_explicit(&(stream->stop), memory_order_relaxed)) return false;
+        thread_sleep_ms(1);
+    }
+
+    stream->blocks[head % IMAGE_QUEUE_BLOCKS] = parser->block;
+    atomic_store_explicit(&(stream->head), head + 1, memory_order_release);
+
+    parser->block.len = 0;
+
+    return true;
+}
+
+static uint32_t get_le(uint8_t *buf, uint8_t bytes){
+    uint32_t value = 0;
+
+    for(uint8_t i = bytes; i > 0; i--) value = (value << 8) | buf[i - 1];
+
+    return value;
+}
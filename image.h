@@ -0,0 +1,64 @@
+/*
+C_UPDI image.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Firmware image loading for updi.c. The file, intel hex or ELF, is parsed on a worker thread and handed over as fixed size blocks through a bounded
+single producer / single consumer queue, so programming can start on the first page while the rest of the file is still being decoded and memory
+used by the parse doesn't grow with the image. Included through updi.h, which provides the platform Thread.
+An image kept in memory, parsed once with image_load(), goes through the same calls after image_start_memory() (see daemon.c).
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define IMAGE_BLOCK_SIZE            64          //smallest flash page of the supported parts, so every page is a whole number of blocks
+
+//blocks the parser can get ahead of the programmer, power of 2
+#ifndef IMAGE_QUEUE_BLOCKS
+    #if defined UPDI_SMALL
+        #define IMAGE_QUEUE_BLOCKS  8
+    #else
+        #define IMAGE_QUEUE_BLOCKS  64
+    #endif
+#endif
+
+//ELF load addresses from here up are the data space, eeprom, fuses etc. rather than flash and are skipped
+#define IMAGE_ELF_FLASH_END         0x800000
+
+typedef struct {
+    uint32_t address;                   //from the start of flash, block aligned
+    uint16_t len;                       //bytes from the start of the block up to the last one the file sets
+    uint8_t data[IMAGE_BLOCK_SIZE];     //0xFF wherever the file sets nothing
+} ImageBlock;
+
+typedef struct {
+    Thread thread;
+    char *filename;
+    const uint8_t *memory;              //set by image_start_memory(), blocks come straight from it and there is no parser thread
+    uint32_t max_len;
+    bool started;
+
+    ImageBlock blocks[IMAGE_QUEUE_BLOCKS];
+    atomic_uint head;       //only stored by the parser
+    atomic_uint tail;       //only stored by the programmer
+    atomic_bool done;       //parser finished, ok and length are set before it
+    atomic_bool ok;
+    atomic_bool stop;       //programmer gave up, the parser exits instead of waiting for space
+    uint32_t length;        //highest address set + 1
+} ImageStream;
+
+bool        image_start(ImageStream *stream, char *filename, uint32_t max_len);
+ImageBlock  *image_next(ImageStream *stream);
+void        image_release(ImageStream *stream);
+bool        image_finish(ImageStream *stream, uint32_t *length);
+
+bool        image_start_memory(ImageStream *stream, const uint8_t *data, uint32_t length);
+bool        image_load(ImageStream *stream, char *filename, uint8_t *data, uint32_t max_len, uint32_t *length);
+
+#endif
@@ -4,116 +4,274 @@ Author: Jonty   www.tyjean.com
                 https://github.com/jarl93rsa
 (2020)
 
-Logging functions called from updi.c, change these to however you want to display output, as an example I have filled out the functions to 
-resemble a basic printf() structure, and to only output log_str if VERBOSE = true, but always to output log_error() and log_important()
-The reason for its existance is to not have to change all output in updi.c if you implement c_updi into new projects, a GUI for example
+Logging functions called from updi.c, change log_output() to however you want to display output, as an example it prints to stdout
+with "ERROR: " in front of errors. The reason for its existance is to not have to change all output in updi.c if you implement c_updi into new projects, a GUI for example
+
+log_str / log_important / log_error (see log.h) end up in log_record(), which only copies the format pointer and int arguments into a ring buffer owned by the
+calling thread. Each ring is single producer / single consumer and lock-free, a background writer thread started on first use drains every ring,
+formats the records and passes whole lines to log_output(). log_flush() waits until everything logged so far has been output.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 
+#include "updi.h"
 #include "log.h"
 
+#ifndef LOG_RING_SIZE
+    #define LOG_RING_SIZE           256     //records per thread
+#endif
+
+#ifndef LOG_MAX_THREADS
+    #define LOG_MAX_THREADS         8       //threads logging at once, any more format and output directly
+#endif
+
+#define LOG_LINE_SIZE               256
+
+#define LOG_RING_FREE               0
+#define LOG_RING_USED               1
+#define LOG_RING_RELEASED           2
+
+typedef struct {
+    const char *str;
+    int level;
+    int nargs;
+    int args[LOG_MAX_ARGS];
+} LogRecord;
+
+typedef struct {
+    LogRecord records[LOG_RING_SIZE];
+    atomic_uint head;       //only stored by the owning thread
+    atomic_uint tail;       //only stored by the writer thread
+    atomic_int state;
+} LogRing;
+
+bool LOG_VERBOSE = false;
+
+static LogRing log_rings[LOG_MAX_THREADS];
+static _Thread_local LogRing *log_ring = NULL;
+
+static Thread log_writer;
+static atomic_flag log_writer_started = ATOMIC_FLAG_INIT;
+static atomic_bool log_writer_running;
+static atomic_bool log_writer_stop;
+static atomic_uint log_dropped;
+
+static bool        log_start(void);
+static LogRing     *log_claim_ring(void);
+static void        log_writer_run(void *arg);
+static bool        log_drain(void);
+static void        log_emit(LogRecord *record);
+static void        log_format(char *line, const char *str, int nargs, const int *args);
+static void        log_output(int level, const char *line);
+
 
 /*
-Generic messages sent here
-Chosen here to only output when VERBOSE = true
+Capture a log call, called through the log_str / log_important / log_error macros
 */
-void log_str(char *str, ...){
-    if(!LOG_VERBOSE) return;
-
+void log_record(int level, int nargs, const char *str, ...){
+    LogRecord *record;
+    LogRecord direct;
+    unsigned int head = 0;
     va_list argp;
-    va_start(argp, str);
 
-    while(*str != '\0'){
-        if(*str == '%'){
-            str++;
-            if(*str == '%'){
-                printf("%%");
-            }else if(*str == 'c'){
-                char chr = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%c", chr);
-            }else if(*str == 'd'){
-                int num = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%d", num);
-            }else{
-                printf("%c", *str);
+    if(nargs > LOG_MAX_ARGS) nargs = LOG_MAX_ARGS;
+
+    if(log_ring == NULL) log_ring = log_claim_ring();
+
+    if(log_ring == NULL || !atomic_load_explicit(&log_writer_running, memory_order_relaxed)){
+        //no ring or no writer, format and output on this thread
+        record = &direct;
+    }else{
+        head = atomic_load_explicit(&(log_ring->head), memory_order_relaxed);
+
+        //ring full, verbose output is dropped rather than stalling the caller, anything more important waits for the writer
+        while(head - atomic_load_explicit(&(log_ring->tail), memory_order_acquire) >= LOG_RING_SIZE){
+            if(level == LOG_LEVEL_VERBOSE){
+                atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+                return;
             }
-        }else{
-            printf("%c", *str);
-        }        
-        str++;
+            thread_sleep_ms(1);
+        }
+
+        record = &(log_ring->records[head % LOG_RING_SIZE]);
     }
 
+    record->str = str;
+    record->level = level;
+    record->nargs = nargs;
+
+    va_start(argp, str);
+    for(int i = 0; i < nargs; i++) record->args[i] = va_arg(argp, int); //types narrower than int promoted to int
     va_end(argp);
-    
+
+    if(record == &direct){
+        log_emit(record);
+    }else{
+        atomic_store_explicit(&(log_ring->head), head + 1, memory_order_release);
+    }
+
     return;
 }
 
-
 /*
-Important messages / updates sent here
+Wait until everything logged so far has been passed to log_output()
 */
-void log_important(char *str, ...){
-    va_list argp;
-    va_start(argp, str);
+void log_flush(void){
+    if(!atomic_load(&log_writer_running)) return;
 
-    while(*str != '\0'){
-        if(*str == '%'){
-            str++;
-            if(*str == '%'){
-                printf("%%");
-            }else if(*str == 'c'){
-                char chr = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%c", chr);
-            }else if(*str == 'd'){
-                int num = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%d", num);
-            }else{
-                printf("%c", *str);
-            }
-        }else{
-            printf("%c", *str);
-        }        
-        str++;
+    for(int i = 0; i < LOG_MAX_THREADS; i++){
+        LogRing *ring = &(log_rings[i]);
+        while(atomic_load(&(ring->state)) != LOG_RING_FREE && atomic_load(&(ring->tail)) != atomic_load(&(ring->head))){
+            thread_sleep_ms(1);
+        }
     }
 
-    va_end(argp);
+    return;
+}
+
+/*
+Drain everything and stop the writer thread, registered with atexit() when the writer starts.
+Anything logged afterwards is output directly by the calling thread
+*/
+void log_stop(void){
+    if(!atomic_exchange(&log_writer_running, false)) return;
+
+    atomic_store(&log_writer_stop, true);
+    thread_join(&log_writer);
+    log_drain();
 
     return;
 }
 
 /*
-Error messages sent here
+Give the calling thread's ring back once the writer has drained it, called by the platform thread functions when a thread finishes
 */
-void log_error(char *str, ...){
+void log_thread_exit(void){
+    if(log_ring == NULL) return;
 
-    printf("ERROR: ");
+    atomic_store(&(log_ring->state), LOG_RING_RELEASED);
+    log_ring = NULL;
 
-    va_list argp;
-    va_start(argp, str);
+    return;
+}
+
+static bool log_start(void){
+    if(!atomic_flag_test_and_set(&log_writer_started)){
+        atomic_store(&log_writer_stop, false);
+        if(thread_start(&log_writer, log_writer_run, NULL)){
+            atomic_store(&log_writer_running, true);
+            atexit(log_stop);
+        }
+    }
+
+    return atomic_load(&log_writer_running);
+}
+
+static LogRing *log_claim_ring(void){
+    if(!log_start()) return NULL;
+
+    for(int i = 0; i < LOG_MAX_THREADS; i++){
+        int expected = LOG_RING_FREE;
+        if(atomic_compare_exchange_strong(&(log_rings[i].state), &expected, LOG_RING_USED)){
+            return &(log_rings[i]);
+        }
+    }
+
+    return NULL;
+}
+
+static void log_writer_run(void *arg){
+    while(!atomic_load(&log_writer_stop)){
+        if(!log_drain()) thread_sleep_ms(1);
+    }
+
+    return;
+}
+
+//Output every record currently in the rings, returns false if there was nothing to do
+static bool log_drain(void){
+    bool output = false;
+
+    for(int i = 0; i < LOG_MAX_THREADS; i++){
+        LogRing *ring = &(log_rings[i]);
+        int state = atomic_load_explicit(&(ring->state), memory_order_acquire);
+
+        if(state == LOG_RING_FREE) continue;
+
+        unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+
+        while(tail != head){
+            log_emit(&(ring->records[tail % LOG_RING_SIZE]));
+            tail++;
+            atomic_store_explicit(&(ring->tail), tail, memory_order_release);
+            output = true;
+        }
+
+        if(state == LOG_RING_RELEASED) atomic_store(&(ring->state), LOG_RING_FREE);
+    }
 
-    while(*str != '\0'){
+    unsigned int dropped = atomic_exchange(&log_dropped, 0);
+    if(dropped > 0){
+        LogRecord record = {"%d log messages dropped\r\n", LOG_LEVEL_IMPORTANT, 1, {(int)dropped}};
+        log_emit(&record);
+        output = true;
+    }
+
+    if(output) fflush(stdout);
+
+    return output;
+}
+
+static void log_emit(LogRecord *record){
+    char line[LOG_LINE_SIZE];
+
+    log_format(line, record->str, record->nargs, record->args);
+    log_output(record->level, line);
+
+    return;
+}
+
+//Expand %d, %c and %% into line, anything else after a % is output as is
+static void log_format(char *line, const char *str, int nargs, const int *args){
+    int n = 0;
+    int arg = 0;
+
+    while(*str != '\0' && n < LOG_LINE_SIZE - 12){
         if(*str == '%'){
             str++;
-            if(*str == '%'){
-                printf("%%");
-            }else if(*str == 'c'){
-                char chr = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%c", chr);
-            }else if(*str == 'd'){
-                int num = va_arg(argp, int); //types narrower than int promoted to int
-                printf("%d", num);
+            if(*str == '\0') break;
+
+            if(*str == 'c' && arg < nargs){
+                line[n++] = (char)args[arg++];
+            }else if(*str == 'd' && arg < nargs){
+                n += sprintf(line + n, "%d", args[arg++]);
             }else{
-                printf("%c", *str);
+                line[n++] = *str;
             }
         }else{
-            printf("%c", *str);
-        }        
+            line[n++] = *str;
+        }
         str++;
     }
 
-    va_end(argp);
+    line[n] = '\0';
 
     return;
-}
\ No newline at end of file
+}
+
+/*
+All output ends up here as whole lines, change this to however you want to display it
+*/
+static void log_output(int level, const char *line){
+    if(level == LOG_LEVEL_ERROR){
+        fputs("ERROR: ", stdout);
+    }
+
+    fputs(line, stdout);
+
+    return;
+}
@@ -5,6 +5,12 @@ Author: Jonty   www.tyjean.com
 (2020)
 
 Basic logging functions to control which and how output is displayed from the updi process, to be implemented however you choose
+
+log_str / log_important / log_error are macros so that levels above LOG_LEVEL are stripped at compile time, arguments and all.
+e.g. build with -DLOG_LEVEL=LOG_LEVEL_IMPORTANT and none of the log_str calls in updi.c exist in the binary.
+Calls that are left in only capture the format pointer and the arguments into a per-thread ring buffer, the formatting and output happen on a
+background writer thread, so logging from inside the serial hot paths doesn't change their timing.
+Formats only understand %d, %c and %%, and every argument has to be an int (or narrower, which gets promoted).
 */
 
 #ifndef LOG_H
@@ -12,10 +18,45 @@ Basic logging functions to control which and how output is displayed from the up
 
 #include <stdbool.h>
 
-bool LOG_VERBOSE;
+#define LOG_LEVEL_NONE              0
+#define LOG_LEVEL_ERROR             1
+#define LOG_LEVEL_IMPORTANT         2
+#define LOG_LEVEL_VERBOSE           3
+
+#ifndef LOG_LEVEL
+    #define LOG_LEVEL               LOG_LEVEL_VERBOSE
+#endif
+
+#define LOG_MAX_ARGS                6
+
+//count the arguments after the format string, up to LOG_MAX_ARGS
+#define LOG_NARGS(...)              LOG_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG_NARGS_(fmt, a1, a2, a3, a4, a5, a6, n, ...) n
+
+#if LOG_LEVEL >= LOG_LEVEL_VERBOSE
+    #define log_str(...)            (LOG_VERBOSE ? log_record(LOG_LEVEL_VERBOSE, LOG_NARGS(__VA_ARGS__), __VA_ARGS__) : (void)0)
+#else
+    #define log_str(...)            ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_IMPORTANT
+    #define log_important(...)      log_record(LOG_LEVEL_IMPORTANT, LOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+#else
+    #define log_important(...)      ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+    #define log_error(...)          log_record(LOG_LEVEL_ERROR, LOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+#else
+    #define log_error(...)          ((void)0)
+#endif
+
+//runtime switch for log_str output, only checked when log_str is compiled in
+extern bool LOG_VERBOSE;
 
-void log_str(char *str, ...);
-void log_important(char *str, ...);
-void log_error(char *str, ...);
+void log_record(int level, int nargs, const char *str, ...);
+void log_flush(void);
+void log_stop(void);
+void log_thread_exit(void);
 
-#endif
\ No newline at end of file
+#endif
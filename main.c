@@ -12,14 +12,18 @@ Basic Usage:
     -DUPDI_WIN32    
     Will make a generic linux one soon
 
-Eg build with gcc:  gcc main.c -DUPDI_WIN32 win32\file.c win32\serial.c win32\time.c log.c updi.c -o main
-                    gcc main.c -DUPDI_LINUX linux\file.c linux\serial.c linux\time.c log.c updi.c -o main
+Eg build with gcc:  gcc main.c -DUPDI_WIN32 win32\file.c win32\serial.c win32\time.c win32\thread.c log.c trace.c image.c transport.c updi.c -o main
+                    gcc main.c -DUPDI_LINUX linux\file.c linux\serial.c linux\time.c linux\thread.c log.c trace.c image.c transport.c updi.c -o main
     
 
 -Check updi.h for available process args not covered in the basic example below
--Check updi.h for available device list
+-updi_process() runs whatever is set in the process args in one session. To run your own sequence instead, call updi_open() once, then any of
+ updi_get_info() / updi_read_fuses() / updi_write_fuses() / updi_read_flash() / updi_erase() / updi_write_flash() and finish with updi_close().
+ Only the process args that allow erasing a locked device (UPDI_PROCESS_ERASE, UPDI_PROCESS_WRITE_FLASH) matter to updi_open()
+-Check updi.h for available device list, or pass UPDI_DEVICE_AUTO as the device and it is picked from the signature once connected.
+ When a device is given its signature is checked before anything is read or written
 
-To port to a new operating system add a folder for the time / file / serial files, make a define and add to the #if, #elif, #else in updi.h
+To port to a new operating system add a folder for the time / file / serial / thread files, make a define and add to the #if, #elif, #else in updi.h
 */
 
 #include "updi.h"
@@ -29,6 +33,7 @@ void example_read_flash();
 void example_read_write_fuses();
 void example_erase_flash();
 void example_get_device_info();
+void example_write_userrow();
 
 
 /*
@@ -42,6 +47,7 @@ int main(){
     //example_read_flash();
     //example_read_write_fuses();
     //example_erase_flash();
+    //example_write_userrow();
 
     return 0;
 }
@@ -100,31 +106,30 @@ void example_read_flash(){
 }
 
 /*
-Read fuse values, then write them back
+Read fuse values, then write them back, in one session so the port is opened and progmode entered only once
 */
 void example_read_write_fuses(){
     UPDI updi;     
-    updi_init(&updi, 5, 115200, ATMEGA4809, UPDI_PROCESS_READ_FUSES, NULL, 0); //updi, comport, baudrate, device, process args, filename, filename length
+    updi_init(&updi, 5, 115200, ATMEGA4809, 0, NULL, 0); //updi, comport, baudrate, device, process args, filename, filename length
     long unsigned int start = millis();
-    updi_process(&updi);
-    printf("\r\nELAPSED TIME: %ld ms\r\n", millis() - start);
 
-    printf("FUSES: fuse:value\r\n");
-    uint8_t fuses[updi.device.num_fuses];
-    memcpy(fuses, updi.fuse_values_read, updi.device.num_fuses);    //read fuse values saved in updi.fuse_values_read
+    if(!updi_open(&updi)){
+        return;
+    }
+
+    updi_read_fuses(&updi);
 
+    printf("FUSES: fuse:value\r\n");
     for(int i = 0; i < updi.device.num_fuses; i++){
-        printf("%d:%d\r\n", i, fuses[i]);
+        printf("%d:%d\r\n", i, updi.fuse_values_read[i]);     //read fuse values saved in updi.fuse_values_read
     }
 
     //write same values back
     printf("\r\nWriting values back:\r\n");    
+    memcpy(updi.fuse_values_write, updi.fuse_values_read, updi.device.num_fuses);   //write in values you want to updi.fuse_values_write
 
-    updi_init(&updi, 5, 115200, ATMEGA4809, UPDI_PROCESS_WRITE_FUSES, NULL, 0);
-    memcpy(updi.fuse_values_write, fuses, updi.device.num_fuses);   //write in values you want to updi.fuse_values_write after calling init()
-
-    start = millis();
-    updi_process(&updi);
+    updi_write_fuses(&updi);
+    updi_close(&updi);
     printf("\r\nELAPSED TIME: %ld ms\r\n", millis() - start);
 
     return;
@@ -143,4 +148,24 @@ void example_erase_flash(){
     return;
 }
 
+/*
+Write per-unit data (here a serial number) to the USERROW. Works on a locked device too, without erasing it, as long as the device is given rather
+than UPDI_DEVICE_AUTO
+*/
+void example_write_userrow(){
+    UPDI updi;     
+    updi_init(&updi, 5, 115200, ATMEGA4809, UPDI_PROCESS_WRITE_USERROW, NULL, 0); //updi, comport, baudrate, device, process args, filename, filename length
+
+    uint32_t serial_number = 12345;
+    for(int i = 0; i < 4; i++){
+        updi.userrow_write[i] = serial_number >> (8 * i);      //write in values you want to updi.userrow_write after calling init(), the rest stays 0xFF
+    }
+
+    long unsigned int start = millis();
+    updi_process(&updi);
+    printf("\r\nELAPSED TIME: %ld ms\r\n", millis() - start);
+
+    return;
+}
+
 
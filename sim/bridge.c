@@ -0,0 +1,356 @@
+/*
+C_UPDI bridge.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Network serial server in front of a SimTarget, see bridge.h. Each chunk received is run through the target byte by byte and everything it
+produces, echoes and replies, goes back in one send(), much like a server forwarding whatever its UART has received since it last looked.
+*/
+
+#if defined _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    typedef SOCKET BridgeSocket;
+    #define BRIDGE_NO_SOCKET        INVALID_SOCKET
+    #define bridge_close_socket(s)  closesocket(s)
+#else
+    #define _POSIX_C_SOURCE 200112L
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/select.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    typedef int BridgeSocket;
+    #define BRIDGE_NO_SOCKET        (-1)
+    #define bridge_close_socket(s)  close(s)
+#endif
+
+#include <string.h>
+
+#include "../updi.h"
+#include "bridge.h"
+
+#define BRIDGE_BUFFER_SIZE          4096
+#define BRIDGE_POLL_MS              50          //how often a waiting bridge looks at stop
+
+#define TELNET_IAC                  255
+#define TELNET_WILL                 251
+#define TELNET_DO                   253
+#define TELNET_SB                   250
+#define TELNET_SE                   240
+#define TELNET_BINARY               0
+#define TELNET_SGA                  3
+#define TELNET_TTYPE                24
+#define TELNET_COM_PORT             44
+#define RFC2217_SET_CONTROL         5
+#define RFC2217_BREAK_ON            5
+#define RFC2217_BREAK_OFF           6
+
+typedef struct {
+    SimBridge *bridge;
+    BridgeSocket socket;
+
+    uint8_t in[BRIDGE_BUFFER_SIZE];     //here rather than on serve()'s stack, conn is static
+    uint8_t out[BRIDGE_BUFFER_SIZE];
+    uint32_t out_len;
+    bool dead;
+
+    //telnet parser, an IAC SB ... IAC SE is collected in sub
+    uint8_t state;
+    uint8_t sub[8];
+    uint8_t sub_len;
+    bool in_break;
+    uint64_t break_start_ns;
+    bool binary_in;                     //client WILL BINARY, until then a CR NUL from it is a CR
+    bool binary_out;                    //client DO BINARY, until then a CR to it goes as CR NUL
+    bool cr;                            //last data byte from the client was a CR
+} BridgeConnection;
+
+enum {BRIDGE_DATA, BRIDGE_COMMAND, BRIDGE_OPTION, BRIDGE_SUB, BRIDGE_SUB_IAC};
+
+static void        bridge_run(void *arg);
+static void        serve(BridgeConnection *conn);
+static void        receive_byte(BridgeConnection *conn, uint8_t byte);
+static void        sub_complete(BridgeConnection *conn);
+static void        put_option(BridgeConnection *conn, uint8_t verb, uint8_t option);
+static void        put(BridgeConnection *conn, uint8_t byte);
+static bool        send_out(BridgeConnection *conn);
+static bool        wait_readable(BridgeSocket socket, uint32_t ms);
+static uint64_t    bridge_now_ns(SimBridge *bridge);
+
+/*
+Listen on 127.0.0.1:port (0 for any free port, bridge->port is then the one picked) and start serving on a thread
+*/
+bool bridge_start(SimBridge *bridge, SimTarget *target, uint16_t port, bool rfc2217){
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    BridgeSocket listener;
+
+#if defined _WIN32
+    WSADATA wsa;
+    if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+        log_error("bridge error, WSAStartup failed\r\n");
+        return false;
+    }
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener == BRIDGE_NO_SOCKET){
+        log_error("bridge error, cant create socket\r\n");
+        return false;
+    }
+
+    if(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0
+        || getsockname(listener, (struct sockaddr*)&addr, &addr_len) != 0){
+        log_error("bridge error, cant listen on port %d\r\n", port);
+        bridge_close_socket(listener);
+        return false;
+    }
+
+    bridge->target = target;
+    bridge->port = ntohs(addr.sin_port);
+    bridge->rfc2217 = rfc2217;
+    bridge->listener = (intptr_t)listener;
+    bridge->epoch_ns = sim_host_time_ns();
+    bridge->connections = 0;
+    bridge->segments = 0;
+    atomic_store(&(bridge->stop), false);
+    atomic_store(&(bridge->drop_countdown), 0);
+
+    if(!thread_start(&(bridge->thread), bridge_run, bridge)){
+        log_error("bridge error, cant start thread\r\n");
+        bridge_close_socket(listener);
+        return false;
+    }
+
+    return true;
+}
+
+//Stop serving, a connection still open is dropped
+void bridge_stop(SimBridge *bridge){
+    atomic_store(&(bridge->stop), true);
+    thread_join(&(bridge->thread));
+    bridge_close_socket((BridgeSocket)bridge->listener);
+
+    return;
+}
+
+/*
+The nth data byte received from now on never reaches the target although its echo still goes back. 0 cancels
+*/
+void bridge_drop_byte(SimBridge *bridge, uint32_t nth){
+    atomic_store(&(bridge->drop_countdown), nth);
+    return;
+}
+
+static void bridge_run(void *arg){
+    SimBridge *bridge = (SimBridge*)arg;
+    BridgeSocket listener = (BridgeSocket)bridge->listener;
+    static BridgeConnection conn;
+
+    while(!atomic_load(&(bridge->stop))){
+        if(!wait_readable(listener, BRIDGE_POLL_MS)) continue;
+
+        BridgeSocket client = accept(listener, NULL, NULL);
+        if(client == BRIDGE_NO_SOCKET) continue;
+
+        int nodelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+
+        memset(&conn, 0, sizeof(conn));
+        conn.bridge = bridge;
+        conn.socket = client;
+        bridge->connections++;
+
+        //what a telnet server asks for first, SGA is agreed to and the terminal type refused
+        if(bridge->rfc2217){
+            put_option(&conn, TELNET_WILL, TELNET_SGA);
+            put_option(&conn, TELNET_DO, TELNET_TTYPE);
+            send_out(&conn);
+        }
+
+        serve(&conn);
+
+        bridge_close_socket(client);
+    }
+
+    return;
+}
+
+static void serve(BridgeConnection *conn){
+    SimBridge *bridge = conn->bridge;
+
+    while(!atomic_load(&(bridge->stop))){
+        if(!wait_readable(conn->socket, BRIDGE_POLL_MS)) continue;
+
+        int n = recv(conn->socket, (char*)conn->in, sizeof(conn->in), 0);
+        if(n <= 0) return;
+
+        bridge->segments++;
+
+        for(int i = 0; i < n; i++) receive_byte(conn, conn->in[i]);
+
+        if(!send_out(conn)) return;
+    }
+
+    return;
+}
+
+static void receive_byte(BridgeConnection *conn, uint8_t byte){
+    SimBridge *bridge = conn->bridge;
+    uint8_t resp[SIM_MAX_RESPONSE];
+
+    if(bridge->rfc2217){
+        switch(conn->state){
+            case BRIDGE_DATA:{
+                if(byte == TELNET_IAC){
+                    conn->state = BRIDGE_COMMAND;
+                    return;
+                }
+                break;
+            }
+
+            case BRIDGE_COMMAND:{
+                if(byte == TELNET_IAC){
+                    conn->state = BRIDGE_DATA;
+                    break;
+                }
+
+                if(byte == TELNET_SB){
+                    conn->sub_len = 0;
+                    conn->state = BRIDGE_SUB;
+                }else{
+                    conn->state = (byte >= TELNET_WILL) ? BRIDGE_OPTION : BRIDGE_DATA;
+                    conn->sub[0] = byte;
+                }
+                return;
+            }
+
+            //the com port option and BINARY are agreed to, anything else is taken for an answer
+            case BRIDGE_OPTION:{
+                if(conn->sub[0] == TELNET_WILL && byte == TELNET_COM_PORT){
+                    put_option(conn, TELNET_DO, TELNET_COM_PORT);
+                }else if(conn->sub[0] == TELNET_WILL && byte == TELNET_BINARY && !conn->binary_in){
+                    conn->binary_in = true;
+                    put_option(conn, TELNET_DO, TELNET_BINARY);
+                }else if(conn->sub[0] == TELNET_DO && byte == TELNET_BINARY && !conn->binary_out){
+                    conn->binary_out = true;
+                    put_option(conn, TELNET_WILL, TELNET_BINARY);
+                }
+                conn->state = BRIDGE_DATA;
+                return;
+            }
+
+            case BRIDGE_SUB:{
+                if(byte == TELNET_IAC) conn->state = BRIDGE_SUB_IAC;
+                else if(conn->sub_len < sizeof(conn->sub)) conn->sub[conn->sub_len++] = byte;
+                return;
+            }
+
+            case BRIDGE_SUB_IAC:{
+                if(byte == TELNET_SE){
+                    sub_complete(conn);
+                    conn->state = BRIDGE_DATA;
+                }else{
+                    if(conn->sub_len < sizeof(conn->sub)) conn->sub[conn->sub_len++] = byte;
+                    conn->state = BRIDGE_SUB;
+                }
+                return;
+            }
+
+            default: break;
+        }
+
+        bool after_cr = conn->cr;
+        conn->cr = (byte == '\r');
+        if(!conn->binary_in && after_cr && byte == 0) return;
+    }
+
+    //nothing gets through while the line is held low
+    if(conn->in_break) return;
+
+    put(conn, byte);
+
+    unsigned int drop = atomic_load(&(bridge->drop_countdown));
+    if(drop > 0){
+        atomic_store(&(bridge->drop_countdown), drop - 1);
+        if(drop == 1) return;
+    }
+
+    uint16_t n = sim_target_rx(bridge->target, byte, bridge_now_ns(bridge), resp);
+    for(uint16_t i = 0; i < n; i++) put(conn, resp[i]);
+
+    return;
+}
+
+//Only SET-CONTROL break on / off does anything, baud rate and framing are whatever the client wants
+static void sub_complete(BridgeConnection *conn){
+    SimBridge *bridge = conn->bridge;
+
+    if(conn->sub_len < 3 || conn->sub[0] != TELNET_COM_PORT || conn->sub[1] != RFC2217_SET_CONTROL) return;
+
+    if(conn->sub[2] == RFC2217_BREAK_ON && !conn->in_break){
+        conn->in_break = true;
+        conn->break_start_ns = bridge_now_ns(bridge);
+    }else if(conn->sub[2] == RFC2217_BREAK_OFF && conn->in_break){
+        conn->in_break = false;
+        sim_target_break(bridge->target, bridge_now_ns(bridge) - conn->break_start_ns);
+    }
+
+    return;
+}
+
+static void put_option(BridgeConnection *conn, uint8_t verb, uint8_t option){
+    if(conn->out_len + 3 > sizeof(conn->out)) send_out(conn);
+
+    conn->out[conn->out_len++] = TELNET_IAC;
+    conn->out[conn->out_len++] = verb;
+    conn->out[conn->out_len++] = option;
+
+    return;
+}
+
+static void put(BridgeConnection *conn, uint8_t byte){
+    if(conn->out_len + 2 > sizeof(conn->out)) send_out(conn);
+
+    conn->out[conn->out_len++] = byte;
+    if(conn->bridge->rfc2217 && byte == TELNET_IAC) conn->out[conn->out_len++] = TELNET_IAC;
+    if(conn->bridge->rfc2217 && byte == '\r' && !conn->binary_out) conn->out[conn->out_len++] = 0;
+
+    return;
+}
+
+//Everything produced so far goes in one send(), once the buffer is full or at the end of what was received
+static bool send_out(BridgeConnection *conn){
+    for(uint32_t sent = 0; sent < conn->out_len && !conn->dead;){
+        int n = send(conn->socket, (const char*)(conn->out + sent), conn->out_len - sent, 0);
+        if(n <= 0) conn->dead = true;
+        sent += n;
+    }
+
+    conn->out_len = 0;
+
+    return !conn->dead;
+}
+
+static bool wait_readable(BridgeSocket socket, uint32_t ms){
+    fd_set set;
+    struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
+
+    FD_ZERO(&set);
+    FD_SET(socket, &set);
+
+    return select((int)socket + 1, &set, NULL, NULL, &timeout) > 0;
+}
+
+static uint64_t bridge_now_ns(SimBridge *bridge){
+    return sim_host_time_ns() - bridge->epoch_ns;
+}
@@ -0,0 +1,47 @@
+/*
+C_UPDI bridge.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+A network serial server (ser2net style) in front of a SimTarget, for trying tcp.c without an adapter. It listens on a local TCP port
+and serves one connection at a time on its own thread, every byte received goes to the target as it would from the wire and comes back
+as its echo, followed by whatever the target replies. In rfc2217 mode the connection is telnet with the RFC 2217 com port option,
+breaks last from BREAK_ON until BREAK_OFF arrives and the other com port settings are accepted and ignored. Until the client agrees to
+BINARY each way that direction is NVT as on a real server, a CR NUL coming in reaches the target as a bare CR and a CR going out is sent as
+CR NUL, and on connect the bridge asks for SGA and a terminal type so the client has requests to answer.
+
+The target runs on the host clock, so NVM busy times are waited out for real over the connection.
+*/
+
+#ifndef SIM_BRIDGE_H
+#define SIM_BRIDGE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "target.h"
+#include "thread.h"
+
+typedef struct {
+    SimTarget *target;
+    uint16_t port;              //listening on, picked by the OS if 0 was asked for
+    bool rfc2217;
+
+    Thread thread;
+    intptr_t listener;
+    atomic_bool stop;
+    uint64_t epoch_ns;
+
+    atomic_uint drop_countdown;
+
+    uint32_t connections;
+    uint32_t segments;          //recv() calls that returned data, so segments as they arrived
+} SimBridge;
+
+bool    bridge_start(SimBridge *bridge, SimTarget *target, uint16_t port, bool rfc2217);
+void    bridge_stop(SimBridge *bridge);
+void    bridge_drop_byte(SimBridge *bridge, uint32_t nth);
+
+#endif
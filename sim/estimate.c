@@ -0,0 +1,392 @@
+/*
+C_UPDI estimate.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Dry run transport and cost estimate, see estimate.h. The link is modelled the same way as sim/serial.c models it, bytes clocked onto the wire at
+the baud rate after the write latency, echoed, answered after the guard time and a read returning once its last byte is in plus the read latency,
+only on a clock of the estimate's own (EstimatePort.now_ns) instead of the sim platform's one. Every byte the target takes that leaves its NVM busy starts an NVM wait.
+*/
+
+#include <string.h>
+
+#include "../updi.h"
+#include "estimate.h"
+
+#define ESTIMATE_NS_PER_US          1000ULL
+#define ESTIMATE_BREAK_GAP_US       1000
+#define ESTIMATE_CHAR_BITS          12
+
+typedef struct {
+    EstimateModel model;
+    Estimate estimate;
+
+    uint64_t now_ns;
+    uint64_t host_us;               //micros() when the last call returned, what updi.c does until the next one is added to now_ns
+    uint64_t wire_free_ns;
+    uint32_t baudrate;
+    bool duplex;
+    uint32_t pending_echo;
+
+    uint8_t rx_fifo[ESTIMATE_FIFO_SIZE];
+    uint64_t rx_time[ESTIMATE_FIFO_SIZE];
+    uint16_t rx_head;
+    uint16_t rx_count;
+} EstimatePort;
+
+static EstimatePort estimate_port;
+static SimTarget estimate_target;
+
+static bool        estimate_open(Serial *serial);
+static void        estimate_close(Serial *serial);
+static bool        estimate_set_baud(Serial *serial, uint32_t baudrate);
+static bool        estimate_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        estimate_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static bool        estimate_start_duplex(Serial *serial);
+static void        estimate_stop_duplex(Serial *serial);
+static bool        estimate_sync(Serial *serial);
+static void        host_gap(EstimatePort *port);
+static void        advance(EstimatePort *port, uint64_t until_ns);
+static void        wire_write(EstimatePort *port, uint8_t *data, uint16_t length);
+static bool        wire_read(Serial *serial, uint32_t skip, SerialIov *rx, uint8_t rx_count);
+static void        fifo_push(EstimatePort *port, uint8_t byte, uint64_t time_ns);
+
+const SerialTransport estimate_transport = {
+    "estimate", estimate_open, estimate_close, estimate_set_baud, estimate_transfer, estimate_send_break, estimate_start_duplex, estimate_stop_duplex, estimate_sync
+};
+
+/*
+Run updi_process() on updi without hardware and fill in what it would cost on a link and target described by model. updi has to be set up with
+updi_init() for a known device (not UPDI_DEVICE_AUTO), with the process args, image and flags (full_duplex, stream_write...) to estimate.
+Returns what updi_process() did, its transport is put back afterwards
+*/
+bool estimate_process(UPDI *updi, const EstimateModel *model, Estimate *estimate){
+    SimTargetConfig cfg;
+    EstimatePort *port = &estimate_port;
+
+    if(!estimate_target_config(updi, &cfg)){
+        log_error("estimate error, the device has to be known\r\n");
+        return false;
+    }
+
+    cfg.page_write_us = model->page_write_us;
+    cfg.page_erase_us = model->page_erase_us;
+    cfg.chip_erase_us = model->chip_erase_us;
+    cfg.fuse_write_us = model->fuse_write_us;
+    sim_target_init(&estimate_target, &cfg);
+
+    memset(port, 0, sizeof(EstimatePort));
+    port->model = *model;
+    port->host_us = micros();
+
+    const SerialTransport *transport = updi->transport;
+    updi->transport = &estimate_transport;
+
+    bool ok = updi_process(updi);
+
+    host_gap(port);
+    updi->transport = transport;
+
+    port->estimate.total_us = (uint32_t)(port->now_ns / ESTIMATE_NS_PER_US);
+    *estimate = port->estimate;
+
+    log_str("estimate %d us, %d round trips, %d NVM waits\r\n", (int)estimate->total_us, (int)estimate->round_trips, (int)estimate->nvm_waits);
+
+    return ok;
+}
+
+/*
+Fill in a SimTargetConfig for the device updi_init() was given, everything but the NVM busy times. False when the device isnt known
+*/
+bool estimate_target_config(const UPDI *updi, SimTargetConfig *cfg){
+    const Device *device = &(updi->device);
+
+    if(updi->dev == UPDI_DEVICE_AUTO || device->flash_size == 0) return false;
+
+    cfg->flash_start = device->flash_start;
+    cfg->flash_size = device->flash_size;
+    cfg->flash_pagesize = device->flash_pagesize;
+    cfg->syscfg_address = device->syscfg_address;
+    cfg->nvmctrl_address = device->nvmctrl_address;
+    cfg->sigrow_address = device->sigrow_address;
+    cfg->fuses_address = device->fuses_address;
+    cfg->userrow_address = device->userrow_address;
+    cfg->num_fuses = device->num_fuses;
+    cfg->userrow_size = device->userrow_size;
+    cfg->nvm_version = device->nvm_version;
+    memcpy(cfg->signature, device->signature, 3);
+    cfg->revision = 0;
+    cfg->locked = false;
+    cfg->stuck = false;
+
+    //the top of SRAM, which every part in a family has, and the RTC where it always is
+    if(updi->dev <= ATMEGA3209){
+        strcpy(cfg->sib, "megaAVR P:0D:1-3");
+        cfg->sram_address = 0x3800;
+        cfg->sram_size = 0x0800;
+    }else if(updi->dev <= ATTINY214){
+        strcpy(cfg->sib, "tinyAVR P:0D:1-3");
+        cfg->sram_address = 0x3F80;
+        cfg->sram_size = 0x0080;
+    }else{
+        strcpy(cfg->sib, "    AVR P:2D:1-3");
+        cfg->sram_address = 0x7800;
+        cfg->sram_size = 0x0800;
+    }
+    cfg->rtc_address = 0x0140;
+
+    return true;
+}
+
+static bool estimate_open(Serial *serial){
+    EstimatePort *port = &estimate_port;
+
+    host_gap(port);
+
+    serial->port = port;
+    port->baudrate = serial->baudrate;
+    port->duplex = false;
+    port->pending_echo = 0;
+    port->rx_count = 0;
+    port->estimate.opens++;
+
+    advance(port, port->now_ns + port->model.open_us * ESTIMATE_NS_PER_US);
+    if(port->wire_free_ns < port->now_ns) port->wire_free_ns = port->now_ns;
+
+    port->host_us = micros();
+
+    return true;
+}
+
+static void estimate_close(Serial *serial){
+    EstimatePort *port = serial->port;
+
+    estimate_sync(serial);
+    port->duplex = false;
+    port->rx_count = 0;
+
+    return;
+}
+
+//Reconfiguring the port costs as much as opening it
+static bool estimate_set_baud(Serial *serial, uint32_t baudrate){
+    EstimatePort *port = serial->port;
+
+    host_gap(port);
+
+    port->baudrate = baudrate;
+    port->rx_count = 0;
+    advance(port, port->now_ns + port->model.open_us * ESTIMATE_NS_PER_US);
+    if(port->wire_free_ns < port->now_ns) port->wire_free_ns = port->now_ns;
+
+    port->host_us = micros();
+
+    return true;
+}
+
+//The line held low count times with ESTIMATE_BREAK_GAP_US of idle in between and after, anything received meanwhile dropped
+static bool estimate_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    EstimatePort *port = serial->port;
+
+    estimate_sync(serial);
+    host_gap(port);
+
+    uint64_t t = port->now_ns + port->model.write_latency_us * ESTIMATE_NS_PER_US;
+    if(t < port->wire_free_ns) t = port->wire_free_ns;
+
+    for(uint8_t i = 0; i < count; i++){
+        if(i > 0) t += ESTIMATE_BREAK_GAP_US * ESTIMATE_NS_PER_US;
+        t += duration_us * ESTIMATE_NS_PER_US;
+        sim_target_break(&estimate_target, duration_us * ESTIMATE_NS_PER_US);
+    }
+
+    t += ESTIMATE_BREAK_GAP_US * ESTIMATE_NS_PER_US;
+    port->wire_free_ns = t;
+    port->rx_count = 0;
+    port->estimate.breaks += count;
+
+    advance(port, t);
+    port->host_us = micros();
+
+    return true;
+}
+
+static bool estimate_start_duplex(Serial *serial){
+    EstimatePort *port = serial->port;
+
+    port->duplex = true;
+    port->pending_echo = 0;
+
+    return true;
+}
+
+static void estimate_stop_duplex(Serial *serial){
+    EstimatePort *port = serial->port;
+
+    port->duplex = false;
+    port->pending_echo = 0;
+
+    return;
+}
+
+static bool estimate_sync(Serial *serial){
+    EstimatePort *port = serial->port;
+
+    if(!port->duplex || port->pending_echo == 0) return true;
+
+    uint32_t pending = port->pending_echo;
+    port->pending_echo = 0;
+
+    host_gap(port);
+    bool ok = wire_read(serial, pending, NULL, 0);
+    port->host_us = micros();
+
+    return ok;
+}
+
+//Same as sim/serial.c, in full-duplex mode a transfer with only echoes to read returns once written and they are skipped by the next read
+static bool estimate_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    EstimatePort *port = serial->port;
+    bool ok;
+
+    host_gap(port);
+    port->estimate.transfers++;
+
+    for(uint8_t i = 0; i < tx_count; i++) wire_write(port, tx[i].data, tx[i].len);
+
+    uint32_t skip = 0;
+    uint8_t i = 0;
+
+    if(port->duplex){
+        uint32_t echo = 0;
+        for(i = 0; i < rx_count && rx[i].data == NULL; i++) echo += rx[i].len;
+
+        if(i == rx_count){
+            port->pending_echo += echo;
+            port->host_us = micros();
+            return true;
+        }
+
+        skip = port->pending_echo;
+        port->pending_echo = 0;
+    }
+
+    ok = wire_read(serial, skip, rx, rx_count);
+    port->host_us = micros();
+
+    return ok;
+}
+
+//what updi.c spent since the port last returned goes on the clock
+static void host_gap(EstimatePort *port){
+    uint64_t now_us = micros();
+    uint64_t gap_ns = (now_us - port->host_us) * ESTIMATE_NS_PER_US;
+
+    port->estimate.host_us += (uint32_t)(now_us - port->host_us);
+    port->now_ns += gap_ns;
+    port->host_us = now_us;
+
+    return;
+}
+
+static void advance(EstimatePort *port, uint64_t until_ns){
+    if(until_ns > port->now_ns) port->now_ns = until_ns;
+    return;
+}
+
+//Clock bytes onto the wire, the target sees each one as its last bit arrives, an NVM wait is counted each time one leaves it newly busy
+static void wire_write(EstimatePort *port, uint8_t *data, uint16_t length){
+    uint64_t bit_ns = 1000000000ULL / port->baudrate;
+    uint64_t char_ns = bit_ns * ESTIMATE_CHAR_BITS;
+    uint64_t t = port->now_ns + port->model.write_latency_us * ESTIMATE_NS_PER_US;
+    uint8_t resp[SIM_MAX_RESPONSE];
+
+    if(t < port->wire_free_ns) t = port->wire_free_ns;
+
+    for(uint16_t i = 0; i < length; i++){
+        uint64_t busy_until_ns = estimate_target.busy_until_ns;
+
+        t += char_ns;
+        fifo_push(port, data[i], t);
+
+        uint16_t n = sim_target_rx(&estimate_target, data[i], t, resp);
+        if(n > 0){
+            t += port->model.guard_bits * bit_ns;
+            for(uint16_t j = 0; j < n; j++){
+                t += char_ns;
+                fifo_push(port, resp[j], t);
+            }
+        }
+
+        if(estimate_target.busy_until_ns != busy_until_ns && estimate_target.busy_until_ns > t){
+            port->estimate.nvm_waits++;
+            port->estimate.nvm_us += (uint32_t)((estimate_target.busy_until_ns - t) / ESTIMATE_NS_PER_US);
+        }
+
+        port->estimate.wire_us += (uint32_t)(((1 + n) * char_ns + (n > 0 ? port->model.guard_bits * bit_ns : 0)) / ESTIMATE_NS_PER_US);
+    }
+
+    port->wire_free_ns = t;
+    port->estimate.tx_bytes += length;
+
+    return;
+}
+
+/*
+One blocking read, skip bytes discarded then each rx segment filled in turn. Bytes that never come cost serial_timeout_us() like they would on a
+real port, a late reply is not failed here, the estimate is of the run going through
+*/
+static bool wire_read(Serial *serial, uint32_t skip, SerialIov *rx, uint8_t rx_count){
+    EstimatePort *port = serial->port;
+    uint32_t total = skip;
+    uint64_t last_ns = 0;
+
+    for(uint8_t i = 0; i < rx_count; i++) total += rx[i].len;
+
+    port->estimate.round_trips++;
+
+    if(port->rx_count < total){
+        port->estimate.timeouts++;
+        port->rx_count = 0;
+        advance(port, port->now_ns + serial_timeout_us(serial, total) * ESTIMATE_NS_PER_US);
+        return false;
+    }
+
+    for(uint32_t j = 0; j < skip; j++){
+        last_ns = port->rx_time[port->rx_head];
+        port->rx_head = (port->rx_head + 1) % ESTIMATE_FIFO_SIZE;
+        port->rx_count--;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++){
+        for(uint16_t j = 0; j < rx[i].len; j++){
+            if(rx[i].data != NULL) rx[i].data[j] = port->rx_fifo[port->rx_head];
+            last_ns = port->rx_time[port->rx_head];
+            port->rx_head = (port->rx_head + 1) % ESTIMATE_FIFO_SIZE;
+            port->rx_count--;
+        }
+    }
+
+    if(total > 0){
+        advance(port, last_ns + port->model.read_latency_us * ESTIMATE_NS_PER_US);
+        port->estimate.latency_us += port->model.write_latency_us + port->model.read_latency_us;
+    }
+    port->estimate.rx_bytes += total;
+
+    return true;
+}
+
+static void fifo_push(EstimatePort *port, uint8_t byte, uint64_t time_ns){
+    if(port->rx_count >= ESTIMATE_FIFO_SIZE){
+        log_error("estimate rx fifo overflow\r\n");
+        return;
+    }
+
+    uint16_t tail = (port->rx_head + port->rx_count) % ESTIMATE_FIFO_SIZE;
+    port->rx_fifo[tail] = byte;
+    port->rx_time[tail] = time_ns;
+    port->rx_count++;
+
+    return;
+}
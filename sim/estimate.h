@@ -0,0 +1,61 @@
+/*
+C_UPDI estimate.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Dry run of updi_process() for sizing a fixture or reviewing a change without any hardware. estimate_process() runs the caller's UPDI, set up with
+updi_init() for a device, image and flags as usual, against a SimTarget of that device through estimate_transport, which plays out every transfer
+on a clock of its own from an EstimateModel of the adapter, baud rate and NVM busy times. updi.c runs exactly as it would on a real port, so the
+instructions, round trips, bytes each way and NVM waits are the ones a real run would have, and the clock at the end is the estimated wall time.
+Time updi.c spends between transfers (its own sleeps, the image parse) is added to the clock as it is measured with micros().
+Works on any platform, build sim/estimate.c and sim/target.c alongside it. The target is unlocked, erased and answers every byte.
+*/
+
+#ifndef SIM_ESTIMATE_H
+#define SIM_ESTIMATE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "../updi.h"
+#include "target.h"
+
+#define ESTIMATE_FIFO_SIZE          4096
+
+//a USB-UART adapter with its latency timer at 1ms and the NVM times from the datasheets (page erase + write about 4ms)
+#define ESTIMATE_DEFAULT_MODEL      {1000, 1000, 10000, 128, 2000, 2000, 4000, 2000}
+
+typedef struct {
+    uint32_t    write_latency_us;   //host write until the first byte is on the wire
+    uint32_t    read_latency_us;    //last byte received until the host read returns
+    uint32_t    open_us;            //opening or reconfiguring the port
+    uint16_t    guard_bits;         //target guard time before responding
+    uint32_t    page_write_us;
+    uint32_t    page_erase_us;
+    uint32_t    chip_erase_us;
+    uint32_t    fuse_write_us;
+} EstimateModel;
+
+typedef struct {
+    uint32_t    total_us;           //estimated wall time of the whole updi_process()
+    uint32_t    round_trips;        //transfers that waited for a reply
+    uint32_t    transfers;
+    uint32_t    opens;
+    uint32_t    breaks;
+    uint32_t    timeouts;
+    uint32_t    tx_bytes;
+    uint32_t    rx_bytes;
+    uint32_t    nvm_waits;          //NVM operations started, each page write / erase, chip erase and fuse write
+    uint32_t    nvm_us;             //their busy time, the part of total_us that polling overlaps
+    uint32_t    wire_us;            //characters on the wire both ways
+    uint32_t    latency_us;         //adapter latency paid by the round trips
+    uint32_t    host_us;            //updi.c between transfers
+} Estimate;
+
+extern const SerialTransport estimate_transport;
+
+bool        estimate_process(UPDI *updi, const EstimateModel *model, Estimate *estimate);
+bool        estimate_target_config(const UPDI *updi, SimTargetConfig *cfg);
+
+#endif
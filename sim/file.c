@@ -0,0 +1,58 @@
+/*
+C_UPDI file.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide file functions for the sim platform, plain stdio so the same code runs wherever the simulator is built.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "file.h"
+#include "../log.h"
+
+
+bool open_file(File *file, char *fname){
+
+    file->fp = fopen(fname, "rb");
+
+    if(file->fp == NULL){
+        log_str("couldnt open file\r\n");
+        return false;
+    }
+
+    log_str("opened file\r\n");
+    
+    return true;
+}
+
+/*
+Read lines up until EOF
+*/
+bool file_read_line(File *file, char *buffer, int length){
+
+    if(fgets(buffer, length, file->fp) != NULL){
+        return true;
+    }
+
+    return false;
+}
+
+/*
+Read up to length bytes, returns how many were read
+*/
+int file_read(File *file, uint8_t *buffer, int length){
+    return (int)fread(buffer, 1, length, file->fp);
+}
+
+bool file_seek(File *file, uint32_t offset){
+    return fseek(file->fp, (long)offset, SEEK_SET) == 0;
+}
+
+void close_file(File *file){
+    fclose(file->fp);
+    return;
+}
+
@@ -0,0 +1,31 @@
+/*
+C_UPDI file.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+
+Provide file functions for the sim platform, plain stdio so the same code runs wherever the simulator is built.
+*/
+
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+//Non OS-specific struct for updi.c to access file handle, containing OS-specific handle
+typedef struct {
+    FILE *fp;
+} File;
+
+
+bool open_file(File *file, char *fname);
+bool file_read_line(File *file, char *buffer, int length);
+int file_read(File *file, uint8_t *buffer, int length);
+bool file_seek(File *file, uint32_t offset);
+void close_file(File *file);
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,162 @@
+/*
+C_UPDI loopback.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+In-process loopback transport, see loopback.h. Each com_port number is attached to a SimTarget, a transfer writes its bytes to the target one at
+a time, queueing each echo and then whatever the target replies, and the read takes everything it wants from that queue or fails at once.
+*/
+
+#include <string.h>
+
+#include "../updi.h"
+#include "loopback.h"
+
+typedef struct {
+    SimTarget *target;
+    LoopbackStats stats;
+    bool open;
+    uint32_t drop_countdown;
+
+    uint8_t fifo[LOOPBACK_FIFO_SIZE];
+    uint16_t head;
+    uint16_t count;
+} LoopbackPort;
+
+static LoopbackPort loopback_ports[LOOPBACK_MAX_PORTS];
+
+static bool        loopback_open(Serial *serial);
+static void        loopback_close(Serial *serial);
+static bool        loopback_set_baud(Serial *serial, uint32_t baudrate);
+static bool        loopback_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        loopback_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static void        fifo_push(LoopbackPort *port, uint8_t byte);
+
+//no full-duplex mode, with nothing in flight there is nothing for it to overlap
+const SerialTransport loopback_transport = {
+    "loopback", loopback_open, loopback_close, loopback_set_baud, loopback_transfer, loopback_send_break, NULL, NULL, NULL
+};
+
+/*
+Attach a simulated target to a com port number, opening that port through loopback_transport will then talk to it
+*/
+bool loopback_attach(uint8_t com_port, SimTarget *target){
+    if(com_port >= LOOPBACK_MAX_PORTS){
+        log_error("loopback_attach error, com port out of range\r\n");
+        return false;
+    }
+
+    memset(&(loopback_ports[com_port]), 0, sizeof(LoopbackPort));
+    loopback_ports[com_port].target = target;
+
+    return true;
+}
+
+LoopbackStats *loopback_stats(uint8_t com_port){
+    if(com_port >= LOOPBACK_MAX_PORTS) return NULL;
+    return &(loopback_ports[com_port].stats);
+}
+
+/*
+The nth byte written from now on never reaches the target although its echo still comes back. 0 cancels
+*/
+void loopback_drop_byte(uint8_t com_port, uint32_t nth){
+    if(com_port >= LOOPBACK_MAX_PORTS) return;
+    loopback_ports[com_port].drop_countdown = nth;
+}
+
+static bool loopback_open(Serial *serial){
+    if(serial->com_port >= LOOPBACK_MAX_PORTS || loopback_ports[serial->com_port].target == NULL){
+        log_error("error opening loopback port\r\n");
+        return false;
+    }
+
+    LoopbackPort *port = &(loopback_ports[serial->com_port]);
+    port->open = true;
+    port->count = 0;
+    port->stats.opens++;
+    serial->port = port;
+
+    return true;
+}
+
+static void loopback_close(Serial *serial){
+    LoopbackPort *port = serial->port;
+
+    port->open = false;
+    port->count = 0;
+
+    return;
+}
+
+static bool loopback_set_baud(Serial *serial, uint32_t baudrate){
+    return true;
+}
+
+static bool loopback_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    LoopbackPort *port = serial->port;
+    uint8_t resp[SIM_MAX_RESPONSE];
+    uint64_t now_ns = micros() * 1000;
+    uint32_t total = 0;
+
+    for(uint8_t i = 0; i < tx_count; i++){
+        for(uint16_t j = 0; j < tx[i].len; j++){
+            fifo_push(port, tx[i].data[j]);
+
+            if(port->drop_countdown > 0 && --port->drop_countdown == 0){
+                port->stats.dropped++;
+                continue;
+            }
+
+            uint16_t n = sim_target_rx(port->target, tx[i].data[j], now_ns, resp);
+            for(uint16_t k = 0; k < n; k++) fifo_push(port, resp[k]);
+        }
+        port->stats.tx_bytes += tx[i].len;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++) total += rx[i].len;
+
+    port->stats.round_trips++;
+
+    if(port->count < total){
+        port->stats.timeouts++;
+        port->count = 0;
+        return false;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++){
+        for(uint16_t j = 0; j < rx[i].len; j++){
+            if(rx[i].data != NULL) rx[i].data[j] = port->fifo[port->head];
+            port->head = (port->head + 1) % LOOPBACK_FIFO_SIZE;
+            port->count--;
+        }
+    }
+
+    port->stats.rx_bytes += total;
+
+    return true;
+}
+
+static bool loopback_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    LoopbackPort *port = serial->port;
+
+    for(uint8_t i = 0; i < count; i++) sim_target_break(port->target, (uint64_t)duration_us * 1000);
+
+    port->count = 0;
+    port->stats.breaks += count;
+
+    return true;
+}
+
+static void fifo_push(LoopbackPort *port, uint8_t byte){
+    if(port->count >= LOOPBACK_FIFO_SIZE){
+        log_error("loopback fifo overflow\r\n");
+        return;
+    }
+
+    port->fifo[(port->head + port->count) % LOOPBACK_FIFO_SIZE] = byte;
+    port->count++;
+
+    return;
+}
@@ -0,0 +1,41 @@
+/*
+C_UPDI loopback.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+An in-process SerialTransport with no link at all: every byte written goes straight to a SimTarget, and its echo and any reply are queued for the
+next read. There are no syscalls, no link model and no waiting, so updi.c driven through it costs only its own protocol code, which is what
+benchmarks and tests want to measure. The target's NVM busy times still run on micros(), they are waited out by the usual polling.
+Works on any platform, build sim/loopback.c and sim/target.c alongside it and set updi.transport = &loopback_transport after updi_init().
+*/
+
+#ifndef SIM_LOOPBACK_H
+#define SIM_LOOPBACK_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "../transport.h"
+#include "target.h"
+
+#define LOOPBACK_MAX_PORTS          8
+#define LOOPBACK_FIFO_SIZE          4096
+
+typedef struct {
+    uint32_t    round_trips;
+    uint32_t    opens;
+    uint32_t    breaks;
+    uint32_t    timeouts;       //reads that found fewer bytes than they wanted, they fail straight away
+    uint32_t    tx_bytes;
+    uint32_t    rx_bytes;
+    uint32_t    dropped;
+} LoopbackStats;
+
+extern const SerialTransport loopback_transport;
+
+bool            loopback_attach(uint8_t com_port, SimTarget *target);
+LoopbackStats   *loopback_stats(uint8_t com_port);
+void            loopback_drop_byte(uint8_t com_port, uint32_t nth);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+C_UPDI serial.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide the simulated serial port as a SerialTransport for updi.c, see transport.h.
+
+Bytes written by the host are clocked onto a modelled single-wire link at the configured baud rate, fed to the SimTarget as they arrive and echoed back,
+with any target responses following after the guard time. Each byte in the receive fifo is stamped with its arrival time, and a read only returns
+once the last byte it needs has arrived plus the adapter read latency, so every blocking read is one round trip on the virtual clock.
+
+Full-duplex mode needs no receive thread here, the fifo already fills independently of the reader. Writes with nothing to receive return straight
+away and only the transfers that wait for a reply block, on the arrival time of that reply.
+*/
+
+#include <string.h>
+
+#include "../log.h"
+#include "serial.h"
+#include "time.h"
+
+#define SIM_NS_PER_US               1000ULL
+#define SIM_NS_PER_MS               1000000ULL
+
+typedef struct {
+    SimTarget *target;
+    SimLinkModel model;
+    SimStats stats;
+
+    bool open;
+    uint32_t baudrate;
+    uint8_t char_bits;
+    uint64_t wire_free_ns;
+    uint32_t drop_countdown;
+
+    //full-duplex mode, echoes of writes with nothing to receive are left in the fifo and counted here
+    bool duplex;
+    uint32_t pending_echo;
+
+    uint8_t rx_fifo[SIM_RX_FIFO_SIZE];
+    uint64_t rx_time[SIM_RX_FIFO_SIZE];
+    uint16_t rx_head;
+    uint16_t rx_count;
+} SimPort;
+
+static SimPort sim_ports[SIM_MAX_PORTS];
+
+static bool        sim_open(Serial *serial);
+static void        sim_close(Serial *serial);
+static bool        sim_set_baud(Serial *serial, uint32_t baudrate);
+static bool        sim_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        sim_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static bool        sim_start_duplex(Serial *serial);
+static void        sim_stop_duplex(Serial *serial);
+static bool        sim_sync(Serial *serial);
+static bool        open_port(Serial *serial, uint32_t baudrate, uint8_t char_bits);
+static void        sim_write(SimPort *port, uint8_t *data, uint16_t length);
+static bool        sim_read(Serial *serial, uint32_t skip, SerialIov *rx, uint8_t rx_count);
+static void        fifo_push(SimPort *port, uint8_t byte, uint64_t time_ns);
+
+const SerialTransport sim_serial_transport = {
+    "sim", sim_open, sim_close, sim_set_baud, sim_transfer, sim_send_break, sim_start_duplex, sim_stop_duplex, sim_sync
+};
+
+/*
+Attach a simulated target to a com port number, opening that port through sim_serial_transport will then talk to it
+*/
+bool sim_attach(uint8_t com_port, SimTarget *target, const SimLinkModel *model){
+    if(com_port >= SIM_MAX_PORTS){
+        log_error("sim_attach error, com port out of range\r\n");
+        return false;
+    }
+
+    SimPort *port = &(sim_ports[com_port]);
+    memset(port, 0, sizeof(SimPort));
+    port->target = target;
+    port->model = *model;
+
+    return true;
+}
+
+SimStats *sim_stats(uint8_t com_port){
+    if(com_port >= SIM_MAX_PORTS) return NULL;
+    return &(sim_ports[com_port].stats);
+}
+
+/*
+Glitch the link once, the nth byte written from now on never reaches the target although its echo still comes back. 0 cancels
+*/
+void sim_drop_byte(uint8_t com_port, uint32_t nth){
+    if(com_port >= SIM_MAX_PORTS) return;
+    sim_ports[com_port].drop_countdown = nth;
+}
+
+//The com port numbers with a target attached, for UPDI_LIST_PORTS()
+uint8_t sim_list_ports(uint8_t *com_ports, uint8_t max){
+    uint8_t count = 0;
+
+    for(uint8_t i = 0; i < SIM_MAX_PORTS && count < max; i++){
+        if(sim_ports[i].target != NULL) com_ports[count++] = i;
+    }
+
+    return count;
+}
+
+/*
+Open serial connection at desired settings, 8E2
+*/
+static bool sim_open(Serial *serial){
+    return open_port(serial, serial->baudrate, 12);
+}
+
+/*
+Change the baud rate of serial connection
+*/
+static bool sim_set_baud(Serial *serial, uint32_t baudrate){
+    return open_port(serial, baudrate, 12);
+}
+
+/*
+Hold the line low for duration_us, count times with SERIAL_BREAK_GAP_US of idle in between. Setting the break costs the same as a write to reach the wire,
+the call returns once the line has been idle for the gap after the last break and anything received meanwhile is dropped
+*/
+static bool sim_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    SimPort *port = serial->port;
+
+    sim_sync(serial);
+
+    if(!port->open) return false;
+
+    uint64_t t = sim_time_ns() + port->model.write_latency_us * SIM_NS_PER_US;
+    if(t < port->wire_free_ns) t = port->wire_free_ns;
+
+    for(uint8_t i = 0; i < count; i++){
+        if(i > 0) t += SERIAL_BREAK_GAP_US * SIM_NS_PER_US;
+        t += duration_us * SIM_NS_PER_US;
+        sim_target_break(port->target, duration_us * SIM_NS_PER_US);
+    }
+
+    t += SERIAL_BREAK_GAP_US * SIM_NS_PER_US;
+    port->wire_free_ns = t;
+    port->rx_count = 0;
+    port->stats.breaks += count;
+
+    sim_time_advance(t);
+
+    return true;
+}
+
+static void sim_close(Serial *serial){
+    SimPort *port = serial->port;
+
+    if(port->duplex){
+        sim_sync(serial);
+        sim_stop_duplex(serial);
+    }
+
+    port->open = false;
+    port->rx_count = 0;
+}
+
+/*
+Switch to full-duplex mode, transfers that only discard echoes return once written and their echoes are consumed by the next transfer that waits
+*/
+static bool sim_start_duplex(Serial *serial){
+    SimPort *port = serial->port;
+
+    port->duplex = true;
+    port->pending_echo = 0;
+    log_str("serial full-duplex mode\r\n");
+
+    return true;
+}
+
+static void sim_stop_duplex(Serial *serial){
+    SimPort *port = serial->port;
+
+    port->duplex = false;
+    port->pending_echo = 0;
+
+    return;
+}
+
+/*
+Consume the echoes of everything written ahead, returns false if any of them didnt come back
+*/
+static bool sim_sync(Serial *serial){
+    SimPort *port = serial->port;
+
+    if(!port->duplex || port->pending_echo == 0) return true;
+
+    uint32_t pending = port->pending_echo;
+    port->pending_echo = 0;
+
+    if(!sim_read(serial, pending, NULL, 0)){
+        log_error("serial_sync error, echo of written bytes missing\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Scatter/gather transfer, all tx segments go out back to back and the rx segments are filled in order by one blocking read.
+rx segments with a NULL data pointer are discarded
+*/
+static bool sim_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    SimPort *port = serial->port;
+
+    if(port->duplex){
+        uint32_t total = 0;
+        for(uint8_t i = 0; i < tx_count; i++) total += tx[i].len;
+
+        //keep what is written ahead well inside the fifo
+        if(port->pending_echo + total > SIM_RX_FIFO_SIZE / 2 && !sim_sync(serial)) return false;
+    }
+
+    for(uint8_t i = 0; i < tx_count; i++) sim_write(port, tx[i].data, tx[i].len);
+
+    if(port->duplex){
+        uint32_t echo = 0;
+        uint8_t i;
+
+        for(i = 0; i < rx_count && rx[i].data == NULL; i++) echo += rx[i].len;
+
+        if(i == rx_count){
+            port->pending_echo += echo;
+            return true;
+        }
+
+        //everything written ahead comes back first, skip it in the same read as the reply
+        uint32_t pending = port->pending_echo;
+        port->pending_echo = 0;
+
+        return sim_read(serial, pending, rx, rx_count);
+    }
+
+    return sim_read(serial, 0, rx, rx_count);
+}
+
+static bool open_port(Serial *serial, uint32_t baudrate, uint8_t char_bits){
+    if(serial->com_port >= SIM_MAX_PORTS || sim_ports[serial->com_port].target == NULL){
+        log_error("error opening serial port\r\n");
+        return false;
+    }
+
+    SimPort *port = &(sim_ports[serial->com_port]);
+    serial->port = port;
+    port->duplex = false;
+    port->pending_echo = 0;
+
+    port->open = true;
+    port->baudrate = baudrate;
+    port->char_bits = char_bits;
+    port->rx_count = 0;
+    port->stats.opens++;
+
+    sim_time_advance(sim_time_ns() + port->model.open_us * SIM_NS_PER_US);
+    if(port->wire_free_ns < sim_time_ns()) port->wire_free_ns = sim_time_ns();
+
+    log_str("opened serial port\r\n");
+
+    return true;
+}
+
+//Clock bytes onto the wire, the target sees each one as its last bit arrives and its echo is received at the same time
+static void sim_write(SimPort *port, uint8_t *data, uint16_t length){
+    uint64_t bit_ns = 1000000000ULL / port->baudrate;
+    uint64_t char_ns = bit_ns * port->char_bits;
+    uint64_t t = sim_time_ns() + port->model.write_latency_us * SIM_NS_PER_US;
+    uint8_t resp[SIM_MAX_RESPONSE];
+
+    if(!port->open) return;
+    if(t < port->wire_free_ns) t = port->wire_free_ns;
+
+    for(uint16_t i = 0; i < length; i++){
+        t += char_ns;
+        fifo_push(port, data[i], t);
+
+        if(port->drop_countdown > 0 && --port->drop_countdown == 0){
+            port->stats.dropped++;
+            continue;
+        }
+
+        uint16_t n = sim_target_rx(port->target, data[i], t, resp);
+        if(n > 0){
+            t += port->model.guard_bits * bit_ns;
+            for(uint16_t j = 0; j < n; j++){
+                t += char_ns;
+                fifo_push(port, resp[j], t);
+            }
+        }
+    }
+
+    port->wire_free_ns = t;
+    port->stats.tx_bytes += length;
+
+    return;
+}
+
+/*
+One blocking read, skip bytes discarded then each rx segment filled in turn. Times out after serial_timeout_us() when bytes are missing, and
+also when they would only all be in after that, so a timeout too tight for the modelled link fails the read like it would on a real one
+*/
+static bool sim_read(Serial *serial, uint32_t skip, SerialIov *rx, uint8_t rx_count){
+    SimPort *port = serial->port;
+    uint32_t total = skip;
+    uint64_t last_ns = 0;
+
+    for(uint8_t i = 0; i < rx_count; i++) total += rx[i].len;
+
+    uint64_t deadline_ns = sim_time_ns() + serial_timeout_us(serial, total) * SIM_NS_PER_US;
+
+    port->stats.round_trips++;
+
+    if(!port->open || port->rx_count < total ||
+       (total > 0 && port->rx_time[(port->rx_head + total - 1) % SIM_RX_FIFO_SIZE] + port->model.read_latency_us * SIM_NS_PER_US > deadline_ns)){
+        port->stats.timeouts++;
+        port->rx_count = 0;
+        sim_time_advance(deadline_ns);
+        return false;
+    }
+
+    for(uint32_t j = 0; j < skip; j++){
+        last_ns = port->rx_time[port->rx_head];
+        port->rx_head = (port->rx_head + 1) % SIM_RX_FIFO_SIZE;
+        port->rx_count--;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++){
+        for(uint16_t j = 0; j < rx[i].len; j++){
+            if(rx[i].data != NULL) rx[i].data[j] = port->rx_fifo[port->rx_head];
+            last_ns = port->rx_time[port->rx_head];
+            port->rx_head = (port->rx_head + 1) % SIM_RX_FIFO_SIZE;
+            port->rx_count--;
+        }
+    }
+
+    if(total > 0) sim_time_advance(last_ns + port->model.read_latency_us * SIM_NS_PER_US);
+    port->stats.rx_bytes += total;
+
+    return true;
+}
+
+static void fifo_push(SimPort *port, uint8_t byte, uint64_t time_ns){
+    if(port->rx_count >= SIM_RX_FIFO_SIZE){
+        log_error("sim rx fifo overflow\r\n");
+        return;
+    }
+
+    uint16_t tail = (port->rx_head + port->rx_count) % SIM_RX_FIFO_SIZE;
+    port->rx_fifo[tail] = byte;
+    port->rx_time[tail] = time_ns;
+    port->rx_count++;
+
+    return;
+}
@@ -0,0 +1,51 @@
+/*
+C_UPDI serial.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide the simulated serial port as a SerialTransport, sim_serial_transport, the default transport of the sim platform.
+Instead of a COM port each com_port number is attached to an in-process SimTarget, with a link model describing the USB-UART adapter.
+All transfers run on the virtual clock in sim/time.c.
+*/
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "../transport.h"
+#include "target.h"
+
+#define SIM_MAX_PORTS               8
+#define SIM_RX_FIFO_SIZE            4096
+
+//line idle between the breaks of a serial_send_break() and after the last one
+#define SERIAL_BREAK_GAP_US         1000
+
+typedef struct {
+    uint32_t    write_latency_us;   //host write until the first byte is on the wire, eg one USB frame
+    uint32_t    read_latency_us;    //last byte received until the host read returns, eg the adapter latency timer
+    uint32_t    open_us;            //cost of opening and configuring the port
+    uint16_t    guard_bits;         //guard time the target inserts before responding, in bit times
+} SimLinkModel;
+
+typedef struct {
+    uint32_t    round_trips;
+    uint32_t    opens;
+    uint32_t    breaks;
+    uint32_t    timeouts;
+    uint32_t    tx_bytes;
+    uint32_t    rx_bytes;
+    uint32_t    dropped;
+} SimStats;
+
+extern const SerialTransport sim_serial_transport;
+
+bool        sim_attach(uint8_t com_port, SimTarget *target, const SimLinkModel *model);
+SimStats    *sim_stats(uint8_t com_port);
+void        sim_drop_byte(uint8_t com_port, uint32_t nth);
+uint8_t     sim_list_ports(uint8_t *com_ports, uint8_t max);
+
+#endif
@@ -0,0 +1,749 @@
+/*
+C_UPDI target.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+In-process model of a UPDI target, fed one byte at a time by sim/serial.c.
+Only the parts of the UPDI and NVM controller behaviour that updi.c relies on are modelled, it is a timing and protocol model rather than a full device emulator.
+*/
+
+#include <string.h>
+
+#include "../updi.h"
+#include "target.h"
+
+#define SIM_STATE_IDLE          0
+#define SIM_STATE_OPCODE        1
+#define SIM_STATE_OPERAND       2
+#define SIM_STATE_DATA          3
+
+#define SIM_US                  1000ULL
+
+static uint16_t    decode_opcode(SimTarget *target, uint8_t opcode, uint64_t now_ns, uint8_t *resp);
+static uint16_t    operand_complete(SimTarget *target, uint64_t now_ns, uint8_t *resp);
+static uint16_t    data_complete(SimTarget *target, uint64_t now_ns, uint8_t *resp);
+static bool        acks_enabled(SimTarget *target);
+
+static uint8_t     cs_read(SimTarget *target, uint8_t address, uint64_t now_ns);
+static void        cs_write(SimTarget *target, uint8_t address, uint8_t value, uint64_t now_ns);
+static void        release_reset(SimTarget *target, uint64_t now_ns);
+static void        key_received(SimTarget *target);
+
+static uint8_t     data_read(SimTarget *target, uint32_t address, uint64_t now_ns);
+static void        data_write(SimTarget *target, uint32_t address, uint8_t value, uint64_t now_ns);
+static void        nvm_command(SimTarget *target, uint8_t command, uint64_t now_ns);
+static void        nvm_command_v2(SimTarget *target, uint8_t command, uint64_t now_ns);
+static void        nvm_flash_write_v2(SimTarget *target, uint32_t offset, uint8_t value, uint64_t now_ns);
+static void        nvm_commit_page(SimTarget *target, bool erase, bool write);
+
+
+void sim_target_init(SimTarget *target, const SimTargetConfig *cfg){
+    memset(target, 0, sizeof(SimTarget));
+    target->cfg = *cfg;
+    if(target->cfg.sram_size > SIM_MAX_SRAM_SIZE) target->cfg.sram_size = SIM_MAX_SRAM_SIZE;
+
+    memset(target->flash, 0xFF, sizeof(target->flash));
+    memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+    memset(target->userrow, 0xFF, sizeof(target->userrow));
+
+    //signature and a made up serial number, SERNUM follows the signature on NVMv0 and starts at 0x10 on NVMv2
+    for(uint8_t i = 0; i < 3; i++) target->sigrow[i] = cfg->signature[i];
+    if(cfg->nvm_version == UPDI_NVM_V2){
+        for(uint8_t i = 0x10; i < 0x20; i++) target->sigrow[i] = 0x11 * i;
+    }else{
+        for(uint8_t i = 3; i < 13; i++) target->sigrow[i] = 0x11 * i;
+    }
+
+    target->locked = cfg->locked;
+    target->stuck = cfg->stuck;
+
+    //UPDI revision 1, 2 on the NVMv2 parts, the pin starts disabled until the first break
+    target->cs[UPDI_CS_STATUSA] = ((cfg->nvm_version == UPDI_NVM_V2) ? 2 : 1) << UPDI_ASI_STATUSA_REVID;
+    target->disabled = true;
+
+    return;
+}
+
+/*
+A break resets the UPDI instruction decoder and re-enables the interface, keys and reset state are kept.
+A stuck target only sees a break that lasts at least SIM_STUCK_BREAK_US
+*/
+void sim_target_break(SimTarget *target, uint64_t duration_ns){
+    if(target->stuck){
+        if(duration_ns < SIM_STUCK_BREAK_US * SIM_US) return;
+        target->stuck = false;
+    }
+
+    target->state = SIM_STATE_IDLE;
+    target->repeat = 0;
+    target->disabled = false;
+    target->cs[UPDI_CS_CTRLA] = 0;
+    target->cs[UPDI_CS_CTRLB] = 0;
+
+    return;
+}
+
+/*
+Feed one byte from the wire into the target. Any response bytes are written into resp and their count is returned.
+now_ns is the time at which the last bit of the byte reached the target.
+*/
+uint16_t sim_target_rx(SimTarget *target, uint8_t byte, uint64_t now_ns, uint8_t *resp){
+    if(target->locked && target->unlock_at_ns != 0 && now_ns >= target->unlock_at_ns){
+        target->locked = false;
+        target->unlock_at_ns = 0;
+    }
+
+    switch(target->state){
+        case SIM_STATE_IDLE:{
+            if(target->stuck){
+                return 0;
+            }else if(byte == UPDI_BREAK){
+                sim_target_break(target, 0);   //a 0x00 character, only as long as a short break
+            }else if(!target->disabled && byte == UPDI_PHY_SYNC){
+                target->state = SIM_STATE_OPCODE;
+            }
+            return 0;
+        }
+
+        case SIM_STATE_OPCODE:{
+            return decode_opcode(target, byte, now_ns, resp);
+        }
+
+        case SIM_STATE_OPERAND:{
+            target->operand[target->operand_pos++] = byte;
+            if(target->operand_pos < target->operand_len) return 0;
+            return operand_complete(target, now_ns, resp);
+        }
+
+        case SIM_STATE_DATA:{
+            target->operand[target->operand_pos++] = byte;
+            if(target->operand_pos < target->operand_len) return 0;
+            return data_complete(target, now_ns, resp);
+        }
+
+        default: break;
+    }
+
+    target->state = SIM_STATE_IDLE;
+    return 0;
+}
+
+static bool acks_enabled(SimTarget *target){
+    return !(target->cs[UPDI_CS_CTRLA] & (1 << UPDI_CTRLA_RSD_BIT));
+}
+
+//Decode an instruction, either respond straight away or set up collection of its operand / data bytes
+static uint16_t decode_opcode(SimTarget *target, uint8_t opcode, uint64_t now_ns, uint8_t *resp){
+    uint8_t size = (opcode & 0x03) + 1;
+    uint16_t n = 0;
+
+    target->opcode = opcode;
+    target->operand_pos = 0;
+    target->state = SIM_STATE_IDLE;
+
+    switch(opcode & 0xE0){
+        case UPDI_LDS:
+        case UPDI_STS:{
+            target->operand_len = ((opcode >> 2) & 0x03) + 1;
+            target->state = SIM_STATE_OPERAND;
+            break;
+        }
+
+        case UPDI_LD:{
+            if((opcode & 0x0C) == UPDI_PTR_ADDRESS){
+                for(uint8_t i = 0; i < size; i++) resp[n++] = (target->ptr >> (8 * i)) & 0xFF;
+                break;
+            }
+
+            for(uint16_t r = 0; r <= target->repeat && n + size <= SIM_MAX_RESPONSE; r++){
+                for(uint8_t i = 0; i < size; i++) resp[n++] = data_read(target, target->ptr + i, now_ns);
+                if((opcode & 0x0C) == UPDI_PTR_INC) target->ptr += size;
+            }
+            target->repeat = 0;
+            break;
+        }
+
+        case UPDI_ST:{
+            target->operand_len = size;
+            if((opcode & 0x0C) == UPDI_PTR_ADDRESS){
+                target->state = SIM_STATE_OPERAND;
+            }else{
+                target->units_left = target->repeat + 1;
+                target->repeat = 0;
+                target->state = SIM_STATE_DATA;
+            }
+            break;
+        }
+
+        case UPDI_LDCS:{
+            resp[n++] = cs_read(target, opcode & 0x0F, now_ns);
+            break;
+        }
+
+        case UPDI_STCS:{
+            target->operand_len = 1;
+            target->state = SIM_STATE_OPERAND;
+            break;
+        }
+
+        case UPDI_REPEAT:{
+            target->operand_len = size;
+            target->state = SIM_STATE_OPERAND;
+            break;
+        }
+
+        case UPDI_KEY:{
+            uint8_t len = 8 << (opcode & 0x03);
+            if(len > sizeof(target->operand)) len = sizeof(target->operand);
+
+            if(opcode & UPDI_KEY_SIB){
+                for(uint8_t i = 0; i < len; i++) resp[n++] = (i < 16) ? (uint8_t)target->cfg.sib[i] : 0;
+            }else{
+                target->operand_len = len;
+                target->state = SIM_STATE_OPERAND;
+            }
+            break;
+        }
+
+        default: break;
+    }
+
+    return n;
+}
+
+//All operand bytes for the current instruction have arrived
+static uint16_t operand_complete(SimTarget *target, uint64_t now_ns, uint8_t *resp){
+    uint32_t value = 0;
+    uint16_t n = 0;
+
+    for(uint8_t i = 0; i < target->operand_len && i < 4; i++) value |= (uint32_t)target->operand[i] << (8 * i);
+
+    target->state = SIM_STATE_IDLE;
+
+    switch(target->opcode & 0xE0){
+        case UPDI_LDS:{
+            uint8_t size = (target->opcode & 0x03) + 1;
+            for(uint8_t i = 0; i < size; i++) resp[n++] = data_read(target, value + i, now_ns);
+            break;
+        }
+
+        case UPDI_STS:{
+            target->address = value;
+            target->operand_len = (target->opcode & 0x03) + 1;
+            target->operand_pos = 0;
+            target->units_left = 1;
+            target->state = SIM_STATE_DATA;
+            if(acks_enabled(target)) resp[n++] = UPDI_PHY_ACK;
+            break;
+        }
+
+        case UPDI_ST:{
+            target->ptr = value;
+            if(acks_enabled(target)) resp[n++] = UPDI_PHY_ACK;
+            break;
+        }
+
+        case UPDI_STCS:{
+            cs_write(target, target->opcode & 0x0F, target->operand[0], now_ns);
+            break;
+        }
+
+        case UPDI_REPEAT:{
+            target->repeat = value;
+            break;
+        }
+
+        case UPDI_KEY:{
+            key_received(target);
+            break;
+        }
+
+        default: break;
+    }
+
+    return n;
+}
+
+//A data unit for STS or ST *ptr has arrived
+static uint16_t data_complete(SimTarget *target, uint64_t now_ns, uint8_t *resp){
+    uint16_t n = 0;
+
+    if((target->opcode & 0xE0) == UPDI_STS){
+        for(uint8_t i = 0; i < target->operand_len; i++) data_write(target, target->address + i, target->operand[i], now_ns);
+        target->state = SIM_STATE_IDLE;
+        if(acks_enabled(target)) resp[n++] = UPDI_PHY_ACK;
+        return n;
+    }
+
+    for(uint8_t i = 0; i < target->operand_len; i++) data_write(target, target->ptr + i, target->operand[i], now_ns);
+    if((target->opcode & 0x0C) == UPDI_PTR_INC) target->ptr += target->operand_len;
+
+    target->operand_pos = 0;
+    if(--target->units_left == 0) target->state = SIM_STATE_IDLE;
+    if(acks_enabled(target)) resp[n++] = UPDI_PHY_ACK;
+
+    return n;
+}
+
+static uint8_t cs_read(SimTarget *target, uint8_t address, uint64_t now_ns){
+    switch(address){
+        case UPDI_ASI_KEY_STATUS:{
+            return target->key_status;
+        }
+
+        case UPDI_ASI_SYS_STATUS:{
+            uint8_t value = 0;
+            if(target->locked) value |= 1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS;
+            if(target->progmode && !target->locked) value |= 1 << UPDI_ASI_SYS_STATUS_NVMPROG;
+            if(target->urowprog || (target->page_is_userrow && now_ns < target->busy_until_ns)) value |= 1 << UPDI_ASI_SYS_STATUS_UROWPROG;
+            if(target->in_reset) value |= 1 << UPDI_ASI_SYS_STATUS_RSTSYS;
+            return value;
+        }
+
+        default: break;
+    }
+
+    return target->cs[address & 0x0F];
+}
+
+static void cs_write(SimTarget *target, uint8_t address, uint8_t value, uint64_t now_ns){
+    switch(address){
+        case UPDI_CS_STATUSA:
+        case UPDI_CS_STATUSB:
+        case UPDI_ASI_SYS_STATUS:{
+            break;
+        }
+
+        case UPDI_CS_CTRLB:{
+            target->cs[address] = value;
+            if(value & (1 << UPDI_CTRLB_UPDIDIS_BIT)){
+                target->disabled = true;
+                target->key_status = 0;
+                target->progmode = false;
+            }
+            break;
+        }
+
+        case UPDI_ASI_KEY_STATUS:{
+            target->key_status &= ~value;
+            break;
+        }
+
+        //the row loaded in user row programming is written out, UROWPROG stays set until that finishes
+        case UPDI_ASI_SYS_CTRLA:{
+            target->cs[address] = value;
+            if(target->urowprog && (value & (1 << UPDI_ASI_SYS_CTRLA_UROWWRITE_FINAL))){
+                nvm_commit_page(target, true, true);
+                target->urowprog = false;
+                target->busy_until_ns = now_ns + (target->cfg.page_erase_us + target->cfg.page_write_us) * SIM_US;
+            }
+            break;
+        }
+
+        case UPDI_ASI_RESET_REQ:{
+            if(value == UPDI_RESET_REQ_VALUE){
+                target->in_reset = true;
+            }else if(target->in_reset){
+                target->in_reset = false;
+                release_reset(target, now_ns);
+            }
+            break;
+        }
+
+        default:{
+            target->cs[address] = value;
+            break;
+        }
+    }
+
+    return;
+}
+
+//Keys entered before a reset take effect when the reset is released
+static void release_reset(SimTarget *target, uint64_t now_ns){
+    target->resets++;
+
+    if(target->key_status & (1 << UPDI_ASI_KEY_STATUS_CHIPERASE)){
+        memset(target->flash, 0xFF, sizeof(target->flash));
+        target->key_status &= ~(1 << UPDI_ASI_KEY_STATUS_CHIPERASE);
+        target->busy_until_ns = now_ns + target->cfg.chip_erase_us * SIM_US;
+
+        if(target->locked) target->unlock_at_ns = target->busy_until_ns;
+    }
+
+    //a reset clears the NVM controller's command and status, not whatever it is still busy with
+    target->nvm_error = false;
+    target->nvm_regs[UPDI_NVMCTRL_CTRLA] = 0;
+    target->page_pending = false;
+
+    target->progmode = (target->key_status & (1 << UPDI_ASI_KEY_STATUS_NVMPROG)) != 0;
+    target->urowprog = target->locked && (target->key_status & (1 << UPDI_ASI_KEY_STATUS_UROWWRITE)) != 0;
+
+    if(target->urowprog){
+        memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+        target->page_address = 0;
+        target->page_is_userrow = true;
+    }
+
+    return;
+}
+
+//Keys are shifted out reversed by updi.c
+static void key_received(SimTarget *target){
+    char key[16];
+    uint8_t len = target->operand_len;
+
+    for(uint8_t i = 0; i < len; i++) key[i] = target->operand[len - 1 - i];
+
+    if(len != 8) return;
+
+    if(memcmp(key, UPDI_KEY_NVM, 8) == 0){
+        target->key_status |= 1 << UPDI_ASI_KEY_STATUS_NVMPROG;
+    }else if(memcmp(key, UPDI_KEY_CHIPERASE, 8) == 0){
+        target->key_status |= 1 << UPDI_ASI_KEY_STATUS_CHIPERASE;
+    }else if(memcmp(key, UPDI_KEY_USERROW_WRITE, 8) == 0){
+        target->key_status |= 1 << UPDI_ASI_KEY_STATUS_UROWWRITE;
+    }
+
+    return;
+}
+
+static uint8_t data_read(SimTarget *target, uint32_t address, uint64_t now_ns){
+    SimTargetConfig *cfg = &(target->cfg);
+
+    if(target->locked) return 0;
+
+    if(address >= cfg->flash_start && address < cfg->flash_start + cfg->flash_size){
+        return target->flash[address - cfg->flash_start];
+    }
+
+    if(address >= cfg->nvmctrl_address && address < (uint32_t)cfg->nvmctrl_address + 16){
+        uint8_t offset = address - cfg->nvmctrl_address;
+
+        if(offset == UPDI_NVMCTRL_STATUS){
+            uint8_t status = 0;
+            if(now_ns < target->busy_until_ns) status |= 1 << UPDI_NVM_STATUS_FLASH_BUSY;
+            if(target->nvm_error) status |= (cfg->nvm_version == UPDI_NVM_V2) ? 0x10 : 1 << UPDI_NVM_STATUS_WRITE_ERROR;
+            return status;
+        }
+        return target->nvm_regs[offset];
+    }
+
+    if(address >= cfg->sigrow_address && address < (uint32_t)cfg->sigrow_address + SIM_SIGROW_SIZE){
+        return target->sigrow[address - cfg->sigrow_address];
+    }
+
+    if(address >= cfg->fuses_address && address < (uint32_t)cfg->fuses_address + cfg->num_fuses){
+        return target->fuses[address - cfg->fuses_address];
+    }
+
+    if(address >= cfg->userrow_address && address < (uint32_t)cfg->userrow_address + cfg->userrow_size){
+        return target->userrow[address - cfg->userrow_address];
+    }
+
+    //SYSCFG.REVID
+    if(address == (uint32_t)cfg->syscfg_address + 1){
+        return cfg->revision;
+    }
+
+    if(address >= cfg->sram_address && address < (uint32_t)cfg->sram_address + cfg->sram_size){
+        return target->sram[address - cfg->sram_address];
+    }
+
+    if(cfg->rtc_address != 0 && address == (uint32_t)cfg->rtc_address + SIM_RTC_CNT){
+        uint16_t cnt = (uint16_t)(now_ns * SIM_RTC_HZ / 1000000000ull);
+        target->rtc_temp = cnt >> 8;
+        return cnt & 0xFF;
+    }
+
+    if(cfg->rtc_address != 0 && address == (uint32_t)cfg->rtc_address + SIM_RTC_CNT + 1){
+        return target->rtc_temp;
+    }
+
+    return 0;
+}
+
+static void data_write(SimTarget *target, uint32_t address, uint8_t value, uint64_t now_ns){
+    SimTargetConfig *cfg = &(target->cfg);
+
+    //a locked device only takes the row being loaded in user row programming
+    if(target->locked){
+        if(target->urowprog && address >= cfg->userrow_address && address < (uint32_t)cfg->userrow_address + cfg->userrow_size){
+            target->page_buffer[address - cfg->userrow_address] = value;
+        }
+        return;
+    }
+
+    if(address >= cfg->flash_start && address < cfg->flash_start + cfg->flash_size){
+        if(!target->progmode) return;
+
+        uint32_t offset = address - cfg->flash_start;
+
+        if(cfg->nvm_version == UPDI_NVM_V2){
+            nvm_flash_write_v2(target, offset, value, now_ns);
+            return;
+        }
+
+        target->page_buffer[offset % cfg->flash_pagesize] = value;
+        target->page_address = offset - (offset % cfg->flash_pagesize);
+        target->page_is_userrow = false;
+        return;
+    }
+
+    if(address >= cfg->userrow_address && address < (uint32_t)cfg->userrow_address + cfg->userrow_size){
+        if(!target->progmode) return;
+
+        uint16_t offset = address - cfg->userrow_address;
+
+        //NVMv2 takes the row under EEPROM_ERASE_WRITE and erase/writes it once its last byte is in
+        if(cfg->nvm_version == UPDI_NVM_V2){
+            if(target->nvm_regs[UPDI_NVMCTRL_CTRLA] != UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE || now_ns < target->busy_until_ns){
+                target->nvm_error = true;
+                return;
+            }
+
+            target->page_buffer[offset] = value;
+            target->page_address = 0;
+            target->page_is_userrow = true;
+            target->page_pending = true;
+
+            if(offset == cfg->userrow_size - 1u){
+                nvm_commit_page(target, true, true);
+                memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+                target->page_pending = false;
+                target->busy_until_ns = now_ns + (cfg->page_erase_us + cfg->page_write_us) * SIM_US;
+            }
+            return;
+        }
+
+        target->page_buffer[offset] = value;
+        target->page_address = 0;
+        target->page_is_userrow = true;
+        return;
+    }
+
+    //NVMv2 fuses are written directly while EEPROM_ERASE_WRITE is set
+    if(address >= cfg->fuses_address && address < (uint32_t)cfg->fuses_address + cfg->num_fuses){
+        if(!target->progmode || cfg->nvm_version != UPDI_NVM_V2) return;
+
+        if(target->nvm_regs[UPDI_NVMCTRL_CTRLA] != UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE || now_ns < target->busy_until_ns){
+            target->nvm_error = true;
+            return;
+        }
+
+        target->fuses[address - cfg->fuses_address] = value;
+        target->busy_until_ns = now_ns + cfg->fuse_write_us * SIM_US;
+        return;
+    }
+
+    if(address >= cfg->nvmctrl_address && address < (uint32_t)cfg->nvmctrl_address + 16){
+        uint8_t offset = address - cfg->nvmctrl_address;
+
+        if(offset == UPDI_NVMCTRL_CTRLA){
+            if(!target->progmode) return;
+
+            if(cfg->nvm_version == UPDI_NVM_V2){
+                nvm_command_v2(target, value, now_ns);
+            }else{
+                nvm_command(target, value, now_ns);
+            }
+        }else if(offset != UPDI_NVMCTRL_STATUS){
+            target->nvm_regs[offset] = value;
+        }
+        return;
+    }
+
+    if(address >= cfg->sram_address && address < (uint32_t)cfg->sram_address + cfg->sram_size){
+        target->sram[address - cfg->sram_address] = value;
+        return;
+    }
+
+    return;
+}
+
+static void nvm_command(SimTarget *target, uint8_t command, uint64_t now_ns){
+    SimTargetConfig *cfg = &(target->cfg);
+
+    //commands issued while busy are dropped and flagged
+    if(now_ns < target->busy_until_ns){
+        target->nvm_error = true;
+        return;
+    }
+
+    target->nvm_error = false;
+
+    switch(command){
+        case UPDI_NVMCTRL_CTRLA_NOP:{
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_WRITE_PAGE:{
+            nvm_commit_page(target, false, true);
+            target->busy_until_ns = now_ns + cfg->page_write_us * SIM_US;
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_ERASE_PAGE:{
+            nvm_commit_page(target, true, false);
+            target->busy_until_ns = now_ns + cfg->page_erase_us * SIM_US;
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_ERASE_WRITE_PAGE:{
+            nvm_commit_page(target, true, true);
+            target->busy_until_ns = now_ns + (cfg->page_erase_us + cfg->page_write_us) * SIM_US;
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_PAGE_BUFFER_CLR:{
+            memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_CHIP_ERASE:{
+            memset(target->flash, 0xFF, sizeof(target->flash));
+            target->busy_until_ns = now_ns + cfg->chip_erase_us * SIM_US;
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_ERASE_EEPROM:{
+            target->busy_until_ns = now_ns + cfg->page_erase_us * SIM_US;
+            break;
+        }
+
+        case UPDI_NVMCTRL_CTRLA_WRITE_FUSE:{
+            uint16_t address = target->nvm_regs[UPDI_NVMCTRL_ADDRL] | (target->nvm_regs[UPDI_NVMCTRL_ADDRH] << 8);
+            if(address >= cfg->fuses_address && address < (uint32_t)cfg->fuses_address + cfg->num_fuses){
+                target->fuses[address - cfg->fuses_address] = target->nvm_regs[UPDI_NVMCTRL_DATAL];
+            }
+            target->busy_until_ns = now_ns + cfg->fuse_write_us * SIM_US;
+            break;
+        }
+
+        default:{
+            target->nvm_error = true;
+            break;
+        }
+    }
+
+    return;
+}
+
+//NVMv2 commands stay set in CTRLA until changed, and only NOCMD / NOOP can replace another command
+static void nvm_command_v2(SimTarget *target, uint8_t command, uint64_t now_ns){
+    SimTargetConfig *cfg = &(target->cfg);
+    uint8_t current = target->nvm_regs[UPDI_NVMCTRL_CTRLA];
+
+    if(now_ns < target->busy_until_ns){
+        target->nvm_error = true;
+        return;
+    }
+
+    if(command != UPDI_V2_NVMCTRL_CTRLA_NOCMD && command != UPDI_V2_NVMCTRL_CTRLA_NOOP &&
+       current != UPDI_V2_NVMCTRL_CTRLA_NOCMD && current != UPDI_V2_NVMCTRL_CTRLA_NOOP){
+        target->nvm_error = true;
+        return;
+    }
+
+    target->nvm_error = false;
+
+    //leaving flash write (or a part written USERROW) commits whatever is left of the last page
+    if((current == UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE || current == UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE) && target->page_pending){
+        nvm_commit_page(target, target->page_is_userrow, true);
+        target->page_pending = false;
+        target->busy_until_ns = now_ns + cfg->page_write_us * SIM_US;
+    }
+
+    switch(command){
+        case UPDI_V2_NVMCTRL_CTRLA_NOCMD:
+        case UPDI_V2_NVMCTRL_CTRLA_NOOP:
+        case UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE:
+        case UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE:
+        case UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE:{
+            memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+            break;
+        }
+
+        case UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE:{
+            memset(target->flash, 0xFF, sizeof(target->flash));
+            target->busy_until_ns = now_ns + cfg->chip_erase_us * SIM_US;
+            break;
+        }
+
+        default:{
+            target->nvm_error = true;
+            return;
+        }
+    }
+
+    target->nvm_regs[UPDI_NVMCTRL_CTRLA] = command;
+
+    return;
+}
+
+//NVMv2 flash data write, with FLASH_WRITE set bytes collect in the buffer and the page is programmed when its last byte arrives.
+//With FLASH_PAGE_ERASE set any write erases the page it lands in
+static void nvm_flash_write_v2(SimTarget *target, uint32_t offset, uint8_t value, uint64_t now_ns){
+    SimTargetConfig *cfg = &(target->cfg);
+    uint8_t command = target->nvm_regs[UPDI_NVMCTRL_CTRLA];
+    uint32_t page_address = offset - (offset % cfg->flash_pagesize);
+
+    if(now_ns < target->busy_until_ns){
+        target->nvm_error = true;
+        return;
+    }
+
+    if(command == UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE){
+        target->page_address = page_address;
+        target->page_is_userrow = false;
+        nvm_commit_page(target, true, false);
+        target->busy_until_ns = now_ns + cfg->page_erase_us * SIM_US;
+        return;
+    }
+
+    if(command != UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE){
+        target->nvm_error = true;
+        return;
+    }
+
+    if(target->page_pending && target->page_address != page_address){
+        nvm_commit_page(target, false, true);
+        memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+    }
+
+    target->page_address = page_address;
+    target->page_is_userrow = false;
+    target->page_buffer[offset % cfg->flash_pagesize] = value;
+    target->page_pending = true;
+
+    if(offset % cfg->flash_pagesize == cfg->flash_pagesize - 1u){
+        nvm_commit_page(target, false, true);
+        memset(target->page_buffer, 0xFF, sizeof(target->page_buffer));
+        target->page_pending = false;
+        target->busy_until_ns = now_ns + cfg->page_write_us * SIM_US;
+    }
+
+    return;
+}
+
+//Commit the page buffer to the page last written to, flash programming can only clear bits
+static void nvm_commit_page(SimTarget *target, bool erase, bool write){
+    uint8_t *page;
+    uint16_t size;
+
+    if(target->page_is_userrow){
+        page = target->userrow;
+        size = target->cfg.userrow_size;
+    }else{
+        page = target->flash + target->page_address;
+        size = target->cfg.flash_pagesize;
+    }
+
+    for(uint16_t i = 0; i < size; i++){
+        if(erase) page[i] = 0xFF;
+        if(write) page[i] &= target->page_buffer[i];
+    }
+
+    return;
+}
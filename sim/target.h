@@ -0,0 +1,110 @@
+/*
+C_UPDI target.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+In-process model of a UPDI target, used by the sim platform so that updi.c can be exercised and timed without any hardware attached.
+The model decodes the UPDI instruction stream byte by byte, keeps the CS/ASI registers, keys, reset and lock state, and implements the NVM controller
+page buffer and commands with configurable busy times. Both the NVMv0 controller (tinyAVR / megaAVR 0) and the NVMv2 one (AVR Dx, flash above 64K
+in the UPDI address space) are modelled, picked by nvm_version.
+*/
+
+#ifndef SIM_TARGET_H
+#define SIM_TARGET_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define SIM_MAX_FLASH_SIZE          (128*1024)
+#define SIM_MAX_PAGESIZE            512
+#define SIM_MAX_FUSES               16
+#define SIM_MAX_USERROW_SIZE        64
+#define SIM_SIGROW_SIZE             64
+#define SIM_MAX_RESPONSE            512
+#define SIM_MAX_SRAM_SIZE           (16*1024)
+
+//RTC.CNT, running at 32.768kHz for whatever is watching it, read low byte first like the real 16-bit register
+#define SIM_RTC_CNT                 0x08
+#define SIM_RTC_HZ                  32768
+
+//longest break UPDI can need to see, at its slowest clock
+#define SIM_STUCK_BREAK_US          24600
+
+typedef struct {
+    uint32_t    flash_start;
+    uint32_t    flash_size;
+    uint16_t    flash_pagesize;
+    uint16_t    syscfg_address;
+    uint16_t    nvmctrl_address;
+    uint16_t    sigrow_address;
+    uint16_t    fuses_address;
+    uint16_t    userrow_address;
+    uint8_t     num_fuses;
+    uint8_t     userrow_size;
+    uint8_t     nvm_version;
+    uint16_t    sram_address;
+    uint16_t    sram_size;
+    uint16_t    rtc_address;        //0 for no RTC
+
+    uint8_t     signature[3];
+    uint8_t     revision;
+    char        sib[17];
+    bool        locked;
+    bool        stuck;              //UPDI starts out of step with the host, eg a clock or baud mismatch, only a break of SIM_STUCK_BREAK_US or longer recovers it
+
+    //NVM busy times in microseconds
+    uint32_t    page_write_us;
+    uint32_t    page_erase_us;
+    uint32_t    chip_erase_us;
+    uint32_t    fuse_write_us;
+} SimTargetConfig;
+
+typedef struct {
+    SimTargetConfig cfg;
+
+    uint8_t     flash[SIM_MAX_FLASH_SIZE];
+    uint8_t     page_buffer[SIM_MAX_PAGESIZE];
+    uint8_t     fuses[SIM_MAX_FUSES];
+    uint8_t     userrow[SIM_MAX_USERROW_SIZE];
+    uint8_t     sigrow[SIM_SIGROW_SIZE];
+    uint8_t     sram[SIM_MAX_SRAM_SIZE];    //readable and writable whatever mode UPDI is in, as on an unlocked part
+    uint8_t     rtc_temp;                   //RTC.CNT high byte, latched when the low byte is read
+
+    //UPDI link state
+    uint8_t     cs[16];
+    uint8_t     key_status;
+    bool        disabled;
+    bool        stuck;
+    bool        in_reset;
+    bool        progmode;
+    bool        urowprog;           //user row programming, entered with the USERROW write key on a locked device
+    bool        locked;
+    uint64_t    unlock_at_ns;
+    uint32_t    resets;             //system resets released, so a test can tell whether the application was disturbed
+
+    //NVM controller state
+    uint8_t     nvm_regs[16];
+    uint32_t    page_address;
+    bool        page_is_userrow;
+    bool        page_pending;       //NVMv2, flash write data in the buffer not committed yet
+    uint64_t    busy_until_ns;
+    bool        nvm_error;
+
+    //instruction decoder state
+    uint8_t     state;
+    uint8_t     opcode;
+    uint8_t     operand[16];
+    uint8_t     operand_pos;
+    uint8_t     operand_len;
+    uint32_t    address;
+    uint32_t    ptr;
+    uint16_t    repeat;
+    uint16_t    units_left;
+} SimTarget;
+
+void        sim_target_init(SimTarget *target, const SimTargetConfig *cfg);
+void        sim_target_break(SimTarget *target, uint64_t duration_ns);
+uint16_t    sim_target_rx(SimTarget *target, uint8_t byte, uint64_t now_ns, uint8_t *resp);
+
+#endif
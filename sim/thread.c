@@ -0,0 +1,73 @@
+/*
+C_UPDI thread.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide thread functions start/join/sleep for the sim platform, using a common struct Thread.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#if !defined _WIN32
+    #include <time.h>
+#endif
+
+#include "../log.h"
+#include "thread.h"
+
+#if defined _WIN32
+static DWORD WINAPI thread_entry(LPVOID param){
+#else
+static void *thread_entry(void *param){
+#endif
+    Thread *thread = (Thread*)param;
+    thread->func(thread->arg);
+
+    //hand this thread's log ring back before it goes away
+    log_thread_exit();
+
+    return 0;
+}
+
+/*
+Start func(arg) on a new thread, the Thread struct must stay valid until thread_join()
+*/
+bool thread_start(Thread *thread, ThreadFunc func, void *arg){
+    thread->func = func;
+    thread->arg = arg;
+
+#if defined _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    if(thread->handle == NULL){
+#else
+    if(pthread_create(&(thread->handle), NULL, thread_entry, thread) != 0){
+#endif
+        log_error("couldnt start thread\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+void thread_join(Thread *thread){
+#if defined _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+
+    return;
+}
+
+void thread_sleep_ms(uint32_t ms){
+#if defined _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
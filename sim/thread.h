@@ -0,0 +1,39 @@
+/*
+C_UPDI thread.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide thread functions start/join/sleep for the sim platform, using a common struct Thread.
+Threads are real host threads, CreateThread on windows and pthreads everywhere else, only time on the serial link is virtual.
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#if defined _WIN32
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+typedef void (*ThreadFunc)(void *arg);
+
+typedef struct {
+#if defined _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    ThreadFunc func;
+    void *arg;
+} Thread;
+
+bool thread_start(Thread *thread, ThreadFunc func, void *arg);
+void thread_join(Thread *thread);
+void thread_sleep_ms(uint32_t ms);
+
+#endif
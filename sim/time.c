@@ -0,0 +1,127 @@
+/*
+C_UPDI time.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide the arduino-style millis() / micros() clocks and the deadline / sleep API for the sim platform, driven by a virtual clock that the simulated
+serial port advances. The clock only moves forward and is atomic, so ports probed from several threads at once (updi_discover()) can all advance it.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#if defined _WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+#include <stdatomic.h>
+
+#include "time.h"
+
+static _Atomic uint64_t sim_now_ns = 0;
+static bool sim_realtime = false;
+static uint64_t sim_host_epoch_ns = 0;
+
+static void        catch_up(void);
+static void        move_to(uint64_t until_ns);
+
+unsigned long int millis(void){
+    catch_up();
+    return (unsigned long int)(sim_now_ns / 1000000ULL);
+}
+
+uint64_t micros(void){
+    catch_up();
+    return sim_now_ns / 1000ULL;
+}
+
+uint64_t deadline(uint32_t timeout_us){
+    return micros() + timeout_us;
+}
+
+bool deadline_passed(uint64_t deadline_us){
+    return micros() >= deadline_us;
+}
+
+uint32_t deadline_remaining_us(uint64_t deadline_us){
+    uint64_t now = micros();
+    return (now >= deadline_us) ? 0 : (uint32_t)(deadline_us - now);
+}
+
+void sleep_us(uint32_t us){
+    catch_up();
+    sim_time_advance(sim_now_ns + (uint64_t)us * 1000ULL);
+}
+
+uint64_t sim_time_ns(void){
+    return sim_now_ns;
+}
+
+/*
+Move the virtual clock forward, in realtime mode sleep until the host clock has caught up with it
+*/
+void sim_time_advance(uint64_t until_ns){
+    move_to(until_ns);
+
+    if(!sim_realtime) return;
+
+    uint64_t host_ns = sim_host_time_ns();
+    uint64_t wake_ns = sim_host_epoch_ns + until_ns;
+    if(host_ns >= wake_ns) return;
+
+#if defined _WIN32
+    Sleep((DWORD)((wake_ns - host_ns) / 1000000ULL));
+#else
+    struct timespec ts;
+    ts.tv_sec = (wake_ns - host_ns) / 1000000000ULL;
+    ts.tv_nsec = (wake_ns - host_ns) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+#endif
+
+    return;
+}
+
+//In realtime mode the virtual clock doesnt fall behind the host clock either, so time nothing modelled (a real TCP round trip to sim/bridge.c)
+//still counts and sleeps from then on are real
+static void catch_up(void){
+    if(!sim_realtime) return;
+
+    uint64_t host_ns = sim_host_time_ns() - sim_host_epoch_ns;
+    move_to(host_ns);
+
+    return;
+}
+
+//Set the clock to until_ns unless another thread has moved it past that already
+static void move_to(uint64_t until_ns){
+    uint64_t now_ns = atomic_load(&sim_now_ns);
+
+    while(until_ns > now_ns && !atomic_compare_exchange_weak(&sim_now_ns, &now_ns, until_ns));
+
+    return;
+}
+
+void sim_time_set_realtime(bool realtime){
+    sim_realtime = realtime;
+    sim_host_epoch_ns = sim_host_time_ns() - sim_now_ns;
+
+    return;
+}
+
+/*
+Monotonic host clock, used to measure how long a simulated run really took
+*/
+uint64_t sim_host_time_ns(void){
+#if defined _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
@@ -0,0 +1,31 @@
+/*
+C_UPDI time.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide the arduino-style millis() / micros() clocks and the deadline / sleep API for the sim platform, driven by a virtual clock that the simulated
+serial port advances. sleep_us() just moves the virtual clock forward.
+In realtime mode every advance of the virtual clock also waits on the host clock, so a simulated run takes as long as the modelled hardware would.
+*/
+
+#ifndef TIME_H
+#define TIME_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+unsigned long int millis(void);
+uint64_t    micros(void);
+
+uint64_t    deadline(uint32_t timeout_us);
+bool        deadline_passed(uint64_t deadline_us);
+uint32_t    deadline_remaining_us(uint64_t deadline_us);
+void        sleep_us(uint32_t us);
+
+uint64_t    sim_time_ns(void);
+void        sim_time_advance(uint64_t until_ns);
+void        sim_time_set_realtime(bool realtime);
+uint64_t    sim_host_time_ns(void);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+C_UPDI tcp.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+TCP transport to a network serial server, see tcp.h. Writes are escaped (rfc2217) into tx and only sent when a transfer has something to read,
+in full-duplex mode a transfer with nothing but echoes to receive just adds them to pending_echo and returns, so they go out in front of the
+next read. Received bytes pass through a small telnet parser which unescapes 0xFF and answers the server's option requests, BINARY (RFC 856)
+is asked for both ways on connect since a server still in NVT mode may turn the 0x0D 0x00 common in page data into a bare CR.
+*/
+
+#if defined _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    typedef SOCKET TcpSocket;
+    #define TCP_NO_SOCKET           INVALID_SOCKET
+    #define tcp_close_socket(s)     closesocket(s)
+#else
+    #define _POSIX_C_SOURCE 200112L
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/time.h>
+    #include <sys/select.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <unistd.h>
+    typedef int TcpSocket;
+    #define TCP_NO_SOCKET           (-1)
+    #define tcp_close_socket(s)     close(s)
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "updi.h"
+#include "tcp.h"
+
+//telnet (RFC 854) and com port option (RFC 2217) codes
+#define TELNET_IAC                  255
+#define TELNET_DONT                 254
+#define TELNET_DO                   253
+#define TELNET_WONT                 252
+#define TELNET_WILL                 251
+#define TELNET_SB                   250
+#define TELNET_SE                   240
+#define TELNET_BINARY               0
+#define TELNET_SGA                  3
+#define TELNET_COM_PORT             44
+#define RFC2217_SET_BAUDRATE        1
+#define RFC2217_SET_DATASIZE        2
+#define RFC2217_SET_PARITY          3
+#define RFC2217_SET_STOPSIZE        4
+#define RFC2217_SET_CONTROL         5
+#define RFC2217_PARITY_EVEN         3
+#define RFC2217_STOPSIZE_2          2
+#define RFC2217_BREAK_ON            5
+#define RFC2217_BREAK_OFF           6
+
+typedef enum {
+    TELNET_DATA,
+    TELNET_COMMAND,     //after IAC
+    TELNET_OPTION,      //after IAC WILL / WONT / DO / DONT
+    TELNET_SUB,         //inside IAC SB ... IAC SE
+    TELNET_SUB_IAC,
+} TelnetState;
+
+typedef struct {
+    char host[TCP_HOST_LEN];
+    uint16_t port;
+    bool rfc2217;
+    TcpStats stats;
+
+    TcpSocket socket;
+    bool duplex;
+    uint32_t pending_echo;
+
+    uint8_t tx[TCP_BUFFER_SIZE + 2];    //room for one escaped byte past the limit
+    uint16_t tx_len;
+
+    uint8_t rx[TCP_BUFFER_SIZE];
+    uint16_t rx_pos;
+    uint16_t rx_len;
+    TelnetState telnet;
+    uint8_t telnet_verb;                //WILL / WONT / DO / DONT of the option being read
+    uint8_t local_options;              //option bits this side will do, asked for or agreed
+    uint8_t remote_options;             //and the server
+} TcpPort;
+
+static TcpPort tcp_ports[TCP_MAX_PORTS];
+
+static bool        tcp_open(Serial *serial);
+static void        tcp_close(Serial *serial);
+static bool        tcp_set_baud(Serial *serial, uint32_t baudrate);
+static bool        tcp_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        tcp_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static bool        tcp_start_duplex(Serial *serial);
+static void        tcp_stop_duplex(Serial *serial);
+static bool        tcp_sync(Serial *serial);
+static void        queue_data(TcpPort *port, uint8_t *data, uint16_t len);
+static void        queue_com_port(TcpPort *port, uint8_t command, uint8_t *value, uint8_t len);
+static bool        flush(TcpPort *port);
+static bool        receive(TcpPort *port, uint8_t *data, uint32_t len);
+static void        discard_input(TcpPort *port);
+static bool        telnet_byte(TcpPort *port, uint8_t byte);
+static void        answer_option(TcpPort *port, uint8_t verb, uint8_t option);
+static uint8_t     option_bit(uint8_t option);
+
+const SerialTransport tcp_transport = {
+    "tcp", tcp_open, tcp_close, tcp_set_baud, tcp_transfer, tcp_send_break, tcp_start_duplex, tcp_stop_duplex, tcp_sync
+};
+
+/*
+Point a com port number at a serial server, opening that port through tcp_transport then connects to it
+*/
+bool tcp_attach(uint8_t com_port, const char *host, uint16_t port, bool rfc2217){
+    if(com_port >= TCP_MAX_PORTS || strlen(host) >= TCP_HOST_LEN){
+        log_error("tcp_attach error, com port out of range or host name too long\r\n");
+        return false;
+    }
+
+    memset(&(tcp_ports[com_port]), 0, sizeof(TcpPort));
+    strcpy(tcp_ports[com_port].host, host);
+    tcp_ports[com_port].port = port;
+    tcp_ports[com_port].rfc2217 = rfc2217;
+    tcp_ports[com_port].socket = TCP_NO_SOCKET;
+
+    return true;
+}
+
+TcpStats *tcp_stats(uint8_t com_port){
+    if(com_port >= TCP_MAX_PORTS) return NULL;
+    return &(tcp_ports[com_port].stats);
+}
+
+static bool tcp_open(Serial *serial){
+    if(serial->com_port >= TCP_MAX_PORTS || tcp_ports[serial->com_port].host[0] == 0){
+        log_error("error opening tcp port, nothing attached\r\n");
+        return false;
+    }
+
+    TcpPort *port = &(tcp_ports[serial->com_port]);
+    struct addrinfo hints, *result, *ai;
+    char service[8];
+
+#if defined _WIN32
+    static bool wsa_started = false;
+    WSADATA wsa;
+    if(!wsa_started){
+        if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0){
+            log_error("error opening tcp port, WSAStartup failed\r\n");
+            return false;
+        }
+        wsa_started = true;
+    }
+#endif
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port->port);
+
+    if(getaddrinfo(port->host, service, &hints, &result) != 0){
+        log_error("error opening tcp port, cant resolve host\r\n");
+        return false;
+    }
+
+    port->socket = TCP_NO_SOCKET;
+    for(ai = result; ai != NULL; ai = ai->ai_next){
+        port->socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(port->socket == TCP_NO_SOCKET) continue;
+        if(connect(port->socket, ai->ai_addr, (int)ai->ai_addrlen) == 0) break;
+
+        tcp_close_socket(port->socket);
+        port->socket = TCP_NO_SOCKET;
+    }
+    freeaddrinfo(result);
+
+    if(port->socket == TCP_NO_SOCKET){
+        log_error("error opening tcp port, cant connect to port %d\r\n", port->port);
+        return false;
+    }
+
+    //every segment goes as soon as it is sent, this transport does its own batching
+    int nodelay = 1;
+    setsockopt(port->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+
+#if defined _WIN32
+    DWORD timeout = TCP_TIMEOUT_MS;
+#else
+    struct timeval timeout = {TCP_TIMEOUT_MS / 1000, (TCP_TIMEOUT_MS % 1000) * 1000};
+#endif
+    setsockopt(port->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    port->duplex = false;
+    port->pending_echo = 0;
+    port->tx_len = 0;
+    port->rx_pos = 0;
+    port->rx_len = 0;
+    port->telnet = TELNET_DATA;
+    port->stats.opens++;
+    serial->port = port;
+
+    if(port->rfc2217){
+        uint8_t options[9] = {TELNET_IAC, TELNET_WILL, TELNET_BINARY, TELNET_IAC, TELNET_DO, TELNET_BINARY, TELNET_IAC, TELNET_WILL, TELNET_COM_PORT};
+        uint8_t datasize = 8;
+        uint8_t parity = RFC2217_PARITY_EVEN;
+        uint8_t stopsize = RFC2217_STOPSIZE_2;
+
+        memcpy(port->tx, options, 9);
+        port->tx_len = 9;
+        port->local_options = option_bit(TELNET_BINARY) | option_bit(TELNET_COM_PORT);
+        port->remote_options = option_bit(TELNET_BINARY);
+        queue_com_port(port, RFC2217_SET_DATASIZE, &datasize, 1);
+        queue_com_port(port, RFC2217_SET_PARITY, &parity, 1);
+        queue_com_port(port, RFC2217_SET_STOPSIZE, &stopsize, 1);
+
+        if(!tcp_set_baud(serial, serial->baudrate)){
+            tcp_close(serial);
+            serial->port = NULL;
+            return false;
+        }
+    }
+
+    log_str("opened tcp port %d\r\n", port->port);
+
+    return true;
+}
+
+static void tcp_close(Serial *serial){
+    TcpPort *port = serial->port;
+
+    tcp_sync(serial);
+    tcp_close_socket(port->socket);
+    port->socket = TCP_NO_SOCKET;
+
+    return;
+}
+
+//A raw server's baud rate is whatever it was set up with
+static bool tcp_set_baud(Serial *serial, uint32_t baudrate){
+    TcpPort *port = serial->port;
+    uint8_t value[4] = {(uint8_t)(baudrate >> 24), (uint8_t)(baudrate >> 16), (uint8_t)(baudrate >> 8), (uint8_t)baudrate};
+
+    if(!port->rfc2217){
+        log_error("error changing baud, raw tcp server\r\n");
+        return false;
+    }
+
+    queue_com_port(port, RFC2217_SET_BAUDRATE, value, 4);
+
+    return flush(port);
+}
+
+static bool tcp_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    TcpPort *port = serial->port;
+    uint32_t total = 0;
+    bool echo_only = true;
+
+    for(uint8_t i = 0; i < tx_count; i++){
+        queue_data(port, tx[i].data, tx[i].len);
+        port->stats.tx_bytes += tx[i].len;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++){
+        total += rx[i].len;
+        if(rx[i].data != NULL) echo_only = false;
+    }
+
+    //written ahead, the echoes are read in front of the next reply
+    if(port->duplex && echo_only){
+        port->pending_echo += total;
+        return (port->tx_len < TCP_BUFFER_SIZE) ? true : flush(port);
+    }
+
+    port->stats.round_trips++;
+
+    bool ok = flush(port) && receive(port, NULL, port->pending_echo);
+    port->pending_echo = 0;
+
+    for(uint8_t i = 0; ok && i < rx_count; i++){
+        ok = receive(port, rx[i].data, rx[i].len);
+    }
+
+    if(!ok){
+        port->stats.timeouts++;
+        return false;
+    }
+
+    port->stats.rx_bytes += total;
+
+    return true;
+}
+
+/*
+RFC 2217 holds the line low between BREAK_ON and BREAK_OFF, on the host clock since that is all the server sees. A raw server only gets a 0x00
+character per break. Echoes and anything else already on the way are dropped
+*/
+static bool tcp_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    TcpPort *port = serial->port;
+    uint8_t on = RFC2217_BREAK_ON;
+    uint8_t off = RFC2217_BREAK_OFF;
+    uint8_t zero = UPDI_BREAK;
+    bool ok = true;
+
+    tcp_sync(serial);
+
+    for(uint8_t i = 0; ok && i < count; i++){
+        if(port->rfc2217){
+            queue_com_port(port, RFC2217_SET_CONTROL, &on, 1);
+            ok = flush(port);
+            thread_sleep_ms((duration_us + 999) / 1000);
+            queue_com_port(port, RFC2217_SET_CONTROL, &off, 1);
+            ok = ok && flush(port);
+        }else{
+            queue_data(port, &zero, 1);
+            ok = flush(port);
+            receive(port, NULL, 1);
+        }
+        port->stats.breaks++;
+    }
+
+    discard_input(port);
+
+    return ok;
+}
+
+static bool tcp_start_duplex(Serial *serial){
+    TcpPort *port = serial->port;
+
+    port->duplex = true;
+    port->pending_echo = 0;
+
+    return true;
+}
+
+static void tcp_stop_duplex(Serial *serial){
+    tcp_sync(serial);
+    ((TcpPort*)serial->port)->duplex = false;
+
+    return;
+}
+
+static bool tcp_sync(Serial *serial){
+    TcpPort *port = serial->port;
+
+    if(port->tx_len == 0 && port->pending_echo == 0) return true;
+
+    bool ok = flush(port) && receive(port, NULL, port->pending_echo);
+    port->pending_echo = 0;
+
+    if(!ok) port->stats.timeouts++;
+
+    return ok;
+}
+
+static void queue_data(TcpPort *port, uint8_t *data, uint16_t len){
+    for(uint16_t i = 0; i < len; i++){
+        if(port->tx_len >= TCP_BUFFER_SIZE) flush(port);
+
+        port->tx[port->tx_len++] = data[i];
+        if(port->rfc2217 && data[i] == TELNET_IAC) port->tx[port->tx_len++] = TELNET_IAC;
+    }
+
+    return;
+}
+
+//IAC SB COM-PORT-OPTION command value IAC SE, none of the values used here contain 0xFF
+static void queue_com_port(TcpPort *port, uint8_t command, uint8_t *value, uint8_t len){
+    if(port->tx_len + len + 6u > sizeof(port->tx)) flush(port);
+
+    port->tx[port->tx_len++] = TELNET_IAC;
+    port->tx[port->tx_len++] = TELNET_SB;
+    port->tx[port->tx_len++] = TELNET_COM_PORT;
+    port->tx[port->tx_len++] = command;
+    memcpy(port->tx + port->tx_len, value, len);
+    port->tx_len += len;
+    port->tx[port->tx_len++] = TELNET_IAC;
+    port->tx[port->tx_len++] = TELNET_SE;
+
+    return;
+}
+
+//Send everything queued, normally in one segment
+static bool flush(TcpPort *port){
+    uint16_t sent = 0;
+
+    while(sent < port->tx_len){
+        int n = send(port->socket, (const char*)(port->tx + sent), port->tx_len - sent, 0);
+        if(n <= 0){
+            log_error("tcp send error\r\n");
+            port->tx_len = 0;
+            return false;
+        }
+        sent += n;
+    }
+
+    if(port->tx_len > 0) port->stats.segments++;
+    port->tx_len = 0;
+
+    return true;
+}
+
+//Read len data bytes, telnet commands from the server are handled by telnet_byte(), data NULL discards them
+static bool receive(TcpPort *port, uint8_t *data, uint32_t len){
+    uint32_t got = 0;
+
+    while(got < len){
+        if(port->rx_pos >= port->rx_len){
+            int n = recv(port->socket, (char*)port->rx, sizeof(port->rx), 0);
+            if(n <= 0){
+                log_str("tcp receive timed out, %d of %d bytes\r\n", (int)got, (int)len);
+                return false;
+            }
+            port->rx_pos = 0;
+            port->rx_len = n;
+        }
+
+        uint8_t byte = port->rx[port->rx_pos++];
+
+        if(port->rfc2217 && !telnet_byte(port, byte)) continue;
+
+        if(data != NULL) data[got] = byte;
+        got++;
+    }
+
+    return true;
+}
+
+//Drop every data byte received so far, buffered or still waiting in the socket. A garbled stream can leave the target replying to bytes it
+//took for instructions and those replies would otherwise come out of the next read
+static void discard_input(TcpPort *port){
+    fd_set readable;
+    struct timeval none = {0, 0};
+
+    while(true){
+        FD_ZERO(&readable);
+        FD_SET(port->socket, &readable);
+        if(select((int)port->socket + 1, &readable, NULL, NULL, &none) <= 0) break;
+
+        int n = recv(port->socket, (char*)port->rx, sizeof(port->rx), 0);
+        if(n <= 0) break;
+
+        //the data goes but option requests among it still get their answer
+        for(int i = 0; port->rfc2217 && i < n; i++) telnet_byte(port, port->rx[i]);
+    }
+
+    port->rx_pos = 0;
+    port->rx_len = 0;
+
+    return;
+}
+
+//Run one byte from the server through the telnet parser. True if it is data
+static bool telnet_byte(TcpPort *port, uint8_t byte){
+    switch(port->telnet){
+        case TELNET_DATA:{
+            if(byte != TELNET_IAC) return true;
+            port->telnet = TELNET_COMMAND;
+            return false;
+        }
+
+        case TELNET_COMMAND:{
+            port->telnet = TELNET_DATA;
+            if(byte == TELNET_IAC) return true;
+
+            if(byte == TELNET_SB){
+                port->telnet = TELNET_SUB;
+            }else if(byte >= TELNET_WILL){
+                port->telnet = TELNET_OPTION;
+                port->telnet_verb = byte;
+            }
+            return false;
+        }
+
+        case TELNET_OPTION:{
+            port->telnet = TELNET_DATA;
+            answer_option(port, port->telnet_verb, byte);
+            return false;
+        }
+
+        case TELNET_SUB:{
+            if(byte == TELNET_IAC) port->telnet = TELNET_SUB_IAC;
+            return false;
+        }
+
+        case TELNET_SUB_IAC:{
+            port->telnet = (byte == TELNET_SE) ? TELNET_DATA : TELNET_SUB;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Answer a WILL / WONT / DO / DONT from the server, BINARY, SGA and COM-PORT are agreed to and anything else refused. Only a change of state gets
+an answer (RFC 854), so the server's replies to the requests sent on connect arent answered again
+*/
+static void answer_option(TcpPort *port, uint8_t verb, uint8_t option){
+    bool server = (verb == TELNET_WILL || verb == TELNET_WONT);
+    bool enable = (verb == TELNET_WILL || verb == TELNET_DO);
+    uint8_t *options = server ? &(port->remote_options) : &(port->local_options);
+    uint8_t bit = option_bit(option);
+    uint8_t answer;
+
+    if(enable && bit == 0){
+        answer = server ? TELNET_DONT : TELNET_WONT;
+    }else if(enable == ((*options & bit) != 0)){
+        return;
+    }else if(enable){
+        *options |= bit;
+        answer = server ? TELNET_DO : TELNET_WILL;
+    }else{
+        *options &= ~bit;
+        answer = server ? TELNET_DONT : TELNET_WONT;
+    }
+
+    if(port->tx_len + 3u > sizeof(port->tx)) flush(port);
+    port->tx[port->tx_len++] = TELNET_IAC;
+    port->tx[port->tx_len++] = answer;
+    port->tx[port->tx_len++] = option;
+    flush(port);
+
+    return;
+}
+
+static uint8_t option_bit(uint8_t option){
+    if(option == TELNET_BINARY) return 0x01;
+    if(option == TELNET_SGA) return 0x02;
+    if(option == TELNET_COM_PORT) return 0x04;
+    return 0;
+}
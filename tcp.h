@@ -0,0 +1,45 @@
+/*
+C_UPDI tcp.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+A SerialTransport to a USB-UART adapter behind a network serial server (ser2net style), see transport.h. Each com_port number is attached
+to a host and TCP port, the connection has TCP_NODELAY set and every write is held back until something has to be read, so a run of writes
+that only echo and the instruction whose reply is waited for go out as one segment. Over a network every round trip costs milliseconds,
+which is why updi.c sends each page as one batch (page_batch()) and why full-duplex mode (updi.full_duplex) is worth turning on here.
+
+With rfc2217 set the server is spoken to in telnet with the RFC 2217 com port option, which is what sets 8E2 and the baud rate and holds
+the line low for a break, and BINARY both ways so the data goes through untouched. A raw server passes bytes only, its port has to be set up for UPDI already and a break can only be sent as a 0x00
+character, long enough for the handshake but not for the double break that recovers a UPDI out of step.
+*/
+
+#ifndef TCP_H
+#define TCP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "transport.h"
+
+#define TCP_MAX_PORTS               4
+#define TCP_HOST_LEN                64
+#define TCP_BUFFER_SIZE             4096        //bytes written ahead before they are sent anyway, and bytes received per recv()
+#define TCP_TIMEOUT_MS              1000        //for each recv(), a network link has no per byte time to add
+
+typedef struct {
+    uint32_t    round_trips;    //transfers that waited for a reply
+    uint32_t    segments;       //send() calls
+    uint32_t    opens;
+    uint32_t    breaks;
+    uint32_t    timeouts;
+    uint32_t    tx_bytes;       //UPDI bytes, before telnet escaping
+    uint32_t    rx_bytes;
+} TcpStats;
+
+extern const SerialTransport tcp_transport;
+
+bool        tcp_attach(uint8_t com_port, const char *host, uint16_t port, bool rfc2217);
+TcpStats    *tcp_stats(uint8_t com_port);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+C_UPDI trace.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Timeline recorder, see trace.h. Spans go into the caller's array in the order they begin, each with its nesting depth, and trace_end fills in
+the duration of the innermost one still open. Once the array is full further spans are only counted, their ends still match up.
+The export is one complete ("X") event per span on a single track, Perfetto and chrome://tracing nest them from the timestamps.
+*/
+
+#include <stdio.h>
+
+#include "updi.h"
+#include "trace.h"
+
+#define TRACE_NO_SPAN               UINT32_MAX
+
+_Thread_local bool trace_recording = false;
+
+static TraceSpan *trace_spans = NULL;
+static uint32_t trace_capacity = 0;
+static uint32_t trace_used = 0;
+static uint32_t trace_lost = 0;
+
+//index of each open span, innermost last
+static uint32_t trace_stack[TRACE_MAX_DEPTH];
+static uint8_t trace_depth = 0;
+static uint32_t trace_overflow = 0;     //spans begun past TRACE_MAX_DEPTH and not yet ended
+
+
+/*
+Record spans from this thread into spans from now on, anything recorded before is discarded
+*/
+void trace_start(TraceSpan *spans, uint32_t capacity){
+    trace_spans = spans;
+    trace_capacity = capacity;
+    trace_used = 0;
+    trace_lost = 0;
+    trace_depth = 0;
+    trace_overflow = 0;
+    trace_recording = (spans != NULL && capacity > 0);
+
+    return;
+}
+
+//Stop recording, what was recorded stays for trace_export()
+void trace_stop(void){
+    trace_recording = false;
+    return;
+}
+
+uint32_t trace_count(void){
+    return trace_used;
+}
+
+uint32_t trace_dropped(void){
+    return trace_lost;
+}
+
+void trace_span_begin(const char *name, const char *arg_name, int32_t arg){
+    uint32_t index = TRACE_NO_SPAN;
+
+    //past TRACE_MAX_DEPTH the span is lost, its end only counts the overflow back down so the spans outside it still close at their own ends
+    if(trace_depth == TRACE_MAX_DEPTH){
+        trace_overflow++;
+        trace_lost++;
+        return;
+    }
+
+    if(trace_used < trace_capacity){
+        index = trace_used++;
+
+        TraceSpan *span = &(trace_spans[index]);
+        span->name = name;
+        span->arg_name = arg_name;
+        span->arg = arg;
+        span->start_us = micros();
+        span->duration_us = 0;
+        span->depth = trace_depth;
+        span->open = true;
+    }else{
+        trace_lost++;
+    }
+
+    trace_stack[trace_depth++] = index;
+
+    return;
+}
+
+void trace_span_end(void){
+    if(trace_overflow > 0){
+        trace_overflow--;
+        return;
+    }
+
+    if(trace_depth == 0) return;
+
+    uint32_t index = trace_stack[--trace_depth];
+    if(index == TRACE_NO_SPAN) return;
+
+    TraceSpan *span = &(trace_spans[index]);
+    span->duration_us = (uint32_t)(micros() - span->start_us);
+    span->open = false;
+
+    return;
+}
+
+/*
+Write the recorded spans to filename as Chrome trace event JSON. Spans still open are written as lasting until now
+*/
+bool trace_export(const char *filename){
+    FILE *fp = fopen(filename, "w");
+    if(fp == NULL){
+        log_error("trace error, cant open the trace file\r\n");
+        return false;
+    }
+
+    uint64_t now = micros();
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"spans\":%lu,\"dropped\":%lu},\"traceEvents\":[\n",
+            (unsigned long)trace_used, (unsigned long)trace_lost);
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"c_updi\"}}");
+
+    for(uint32_t i = 0; i < trace_used; i++){
+        TraceSpan *span = &(trace_spans[i]);
+        uint32_t duration = span->open ? (uint32_t)(now - span->start_us) : span->duration_us;
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"updi\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%lu,\"pid\":1,\"tid\":1",
+                span->name, (unsigned long long)span->start_us, (unsigned long)duration);
+
+        if(span->arg_name != NULL){
+            fprintf(fp, ",\"args\":{\"%s\":%ld}", span->arg_name, (long)span->arg);
+        }
+
+        fprintf(fp, "}");
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    bool ok = (ferror(fp) == 0);
+    if(fclose(fp) != 0) ok = false;
+
+    if(!ok){
+        log_error("trace error, couldnt write the trace file\r\n");
+    }
+
+    return ok;
+}
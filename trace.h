@@ -0,0 +1,56 @@
+/*
+C_UPDI trace.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Timeline recorder for finding where the time goes inside an operation. updi.c and transport.c mark spans with trace_begin / trace_end, from
+the handshake, breaks, keys, resets and unlock wait down to each page's load, commit and status poll and every serial transfer.
+Nothing is recorded until trace_start() is given somewhere to put the spans, and only spans on the thread that called it are kept.
+trace_export() writes what was recorded as Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev both open.
+
+Timestamps are micros(), so on the sim platform they are the modelled link time. Build with -DUPDI_NO_TRACE to compile every span out.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define TRACE_MAX_DEPTH             16
+
+//name and arg_name have to be string literals (or live as long as the recording), they are exported without escaping
+typedef struct {
+    const char  *name;
+    const char  *arg_name;      //NULL for no argument
+    int32_t     arg;
+    uint64_t    start_us;
+    uint32_t    duration_us;
+    uint8_t     depth;
+    bool        open;
+} TraceSpan;
+
+#if defined UPDI_NO_TRACE
+    #define trace_begin(name)                   ((void)0)
+    #define trace_begin_arg(name, key, value)   ((void)0)
+    #define trace_end()                         ((void)0)
+#else
+    #define trace_begin(name)                   (trace_recording ? trace_span_begin(name, NULL, 0) : (void)0)
+    #define trace_begin_arg(name, key, value)   (trace_recording ? trace_span_begin(name, key, (int32_t)(value)) : (void)0)
+    #define trace_end()                         (trace_recording ? trace_span_end() : (void)0)
+#endif
+
+//set on the thread recording, checked by the macros so a span costs one test when nothing is
+extern _Thread_local bool trace_recording;
+
+void        trace_start(TraceSpan *spans, uint32_t capacity);
+void        trace_stop(void);
+bool        trace_export(const char *filename);
+uint32_t    trace_count(void);
+uint32_t    trace_dropped(void);
+
+void        trace_span_begin(const char *name, const char *arg_name, int32_t arg);
+void        trace_span_end(void);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+C_UPDI transport.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Dispatch of the serial functions to the transport each Serial was opened with, see transport.h. Anything called on a closed Serial fails here,
+so a transport only ever sees its own open connections.
+*/
+
+#include <stddef.h>
+
+#include "updi.h"
+#include "transport.h"
+
+static inline uint32_t iov_bytes(SerialIov *iov, uint8_t count){
+    uint32_t bytes = 0;
+    for(uint8_t i = 0; i < count; i++) bytes += iov[i].len;
+    return bytes;
+}
+
+//bytes at 12 bits each (8E2) plus one guard time
+static inline uint32_t wire_us(Serial *serial, uint32_t bytes){
+    return (uint32_t)(((uint64_t)bytes * 12 + SERIAL_GUARD_BITS) * 1000000 / serial->baudrate);
+}
+
+/*
+Open serial connection at desired settings, through serial->transport
+*/
+bool serial_init(Serial *serial){
+    log_str("in serial.init()\r\n");
+
+    serial->port = NULL;
+    serial->latency_us = SERIAL_LATENCY_US;
+
+    if(serial->transport == NULL){
+        log_error("error opening serial port, no transport set\r\n");
+        return false;
+    }
+
+    return serial->transport->open(serial);
+}
+
+bool serial_change_baud(Serial *serial, uint32_t baudrate){
+    if(serial->port == NULL) return false;
+    return serial->transport->set_baud(serial, baudrate);
+}
+
+/*
+Close the connection, safe to call on one that never opened
+*/
+void serial_close(Serial *serial){
+    if(serial->transport == NULL || serial->port == NULL) return;
+
+    serial->transport->close(serial);
+    serial->port = NULL;
+
+    return;
+}
+
+/*
+Send bytes to serial, these will echo back
+*/
+bool serial_send(Serial *serial, uint8_t *data, uint16_t length){
+    SerialIov tx[1] = {{data, length}};
+    SerialIov rx[1] = {{NULL, length}};
+
+    if(!serial_transfer(serial, tx, 1, rx, 1)){
+        log_error("serial_send error, bytes received != bytes sent\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Send bytes to serial, read echo as well as expected reply
+*/
+bool serial_send_receive(Serial *serial, uint8_t *data, uint16_t send_len, uint8_t *recv, uint16_t recv_len){
+    SerialIov tx[1] = {{data, send_len}};
+    SerialIov rx[2] = {{NULL, send_len}, {recv, recv_len}};
+
+    if(!serial_transfer(serial, tx, 1, rx, 2)){
+        log_error("serial_send error, bytes received != bytes sent + bytes wanted\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Traced as one span with the bytes it waits for, echoes included. Each transfer that gets a reply measures the latency: a slower one raises
+it at once, faster ones bring it down an eighth at a time. Transfers with only echoes dont count, in full-duplex mode they return unread
+*/
+bool serial_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    if(serial->port == NULL) return false;
+
+    bool reply = false;
+    for(uint8_t i = 0; i < rx_count; i++) reply = reply || (rx[i].data != NULL);
+
+    uint32_t bytes = iov_bytes(rx, rx_count);
+    uint64_t start = micros();
+
+    trace_begin_arg("transfer", "bytes", bytes);
+    bool ok = serial->transport->transfer(serial, tx, tx_count, rx, rx_count);
+    trace_end();
+
+    if(ok && reply){
+        uint32_t elapsed = (uint32_t)(micros() - start);
+        uint32_t wire = wire_us(serial, bytes);
+        uint32_t sample = (elapsed > wire) ? elapsed - wire : 0;
+        uint32_t decayed = serial->latency_us - serial->latency_us / 8;
+
+        serial->latency_us = (sample > decayed) ? sample : decayed;
+    }
+
+    return ok;
+}
+
+bool serial_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    if(serial->port == NULL) return false;
+    return serial->transport->send_break(serial, duration_us, count);
+}
+
+bool serial_start_duplex(Serial *serial){
+    if(serial->port == NULL || serial->transport->start_duplex == NULL) return false;
+    return serial->transport->start_duplex(serial);
+}
+
+void serial_stop_duplex(Serial *serial){
+    if(serial->port == NULL || serial->transport->stop_duplex == NULL) return;
+    serial->transport->stop_duplex(serial);
+    return;
+}
+
+bool serial_sync(Serial *serial){
+    if(serial->port == NULL) return false;
+    if(serial->transport->sync == NULL) return true;
+    return serial->transport->sync(serial);
+}
+
+/*
+How long a blocking read of bytes (echoes included) can take before it has failed: their wire time and the guard time plus a quarter for
+gaps between bytes, twice the measured latency and SERIAL_TIMEOUT_MARGIN_US. Transports work out each read's timeout with this
+*/
+uint32_t serial_timeout_us(Serial *serial, uint32_t bytes){
+    uint32_t wire = wire_us(serial, bytes);
+    return wire + wire / 4 + 2 * serial->latency_us + SERIAL_TIMEOUT_MARGIN_US;
+}
@@ -0,0 +1,76 @@
+/*
+C_UPDI transport.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+The serial functions updi.c calls, dispatched at runtime through the SerialTransport a Serial is opened with, so a real serial port, the simulator
+and anything else (see sim/loopback.h) can be used from the same binary. Each platform provides its serial port as a SerialTransport in its
+serial.c, updi.h picks that as UPDI_DEFAULT_TRANSPORT and updi.transport can be pointed at any other one after updi_init().
+
+A transport keeps whatever it needs per connection behind serial->port, set by its open and cleared when closed. Nothing is allocated, the
+transports in this repo hand out entries of a static table.
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+//One segment of a scatter/gather transfer, a NULL data pointer on receive discards that many bytes (echo)
+typedef struct {
+    uint8_t *data;
+    uint16_t len;
+} SerialIov;
+
+typedef struct Serial Serial;
+
+//read timeouts, see serial_timeout_us()
+#define SERIAL_LATENCY_US           16000   //round trip overhead assumed until transfers have measured it, a USB-UART's default latency timer
+#define SERIAL_GUARD_BITS           128     //UPDI guard time before a reply (CTRLA GTVAL default)
+#define SERIAL_TIMEOUT_MARGIN_US    5000    //host scheduling on top of everything that can be worked out
+
+/*
+open            connect at serial->baudrate, 8E2, on serial->com_port (whatever that number means to the transport), set serial->port
+close           disconnect, waiting for anything written ahead in full-duplex mode first
+set_baud        reconfigure an open connection
+transfer        write every tx segment in order, then fill every rx segment in order with one blocking read, given serial_timeout_us()
+send_break      hold the line low for duration_us, count times, anything received meanwhile is dropped
+start_duplex    optional full-duplex mode, transfers with nothing but echoes to receive return once written (see win32/serial.c)
+stop_duplex     back to synchronous transfers
+sync            consume the echoes of everything written ahead, false if any are missing
+*/
+typedef struct {
+    const char *name;
+    bool (*open)(Serial *serial);
+    void (*close)(Serial *serial);
+    bool (*set_baud)(Serial *serial, uint32_t baudrate);
+    bool (*transfer)(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+    bool (*send_break)(Serial *serial, uint32_t duration_us, uint8_t count);
+    bool (*start_duplex)(Serial *serial);
+    void (*stop_duplex)(Serial *serial);
+    bool (*sync)(Serial *serial);
+} SerialTransport;
+
+struct Serial {
+    const SerialTransport *transport;
+    void *port;             //the transport's state for this connection, NULL while closed
+    uint8_t com_port;
+    uint32_t baudrate;
+    uint32_t latency_us;    //round trip overhead beyond the wire time, measured by serial_transfer()
+};
+
+bool serial_init(Serial *serial);
+bool serial_change_baud(Serial *serial, uint32_t baudrate);
+bool serial_send(Serial *serial, uint8_t *data, uint16_t length);
+bool serial_send_receive(Serial *serial, uint8_t *data, uint16_t send_len, uint8_t *recv, uint16_t recv_len);
+bool serial_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+void serial_close(Serial *serial);
+bool serial_start_duplex(Serial *serial);
+void serial_stop_duplex(Serial *serial);
+bool serial_sync(Serial *serial);
+bool serial_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+uint32_t serial_timeout_us(Serial *serial, uint32_t bytes);
+
+#endif
@@ -14,53 +14,229 @@ Porting this to new systems shouldn't require any changes to this file.
 
 #include "updi.h"
     
+//One st_ptr + repeat + ld_ptr_inc run of updi_watch(), its instruction bytes are built once and sent as they are for every sample
+typedef struct {
+    uint32_t    address;
+    uint16_t    size;
+    uint8_t     offset;         //where its bytes go in the sample data
+    uint8_t     cmd[12];
+    uint8_t     cmd_len;
+} WatchBurst;
+
+//Pages a streamed flash write has sent since its last checkpoint, see stream_page()
+typedef struct {
+    uint32_t    offsets[UPDI_STREAM_CHECKPOINT_PAGES];
+    uint8_t     *data[UPDI_STREAM_CHECKPOINT_PAGES];
+    uint8_t     count;
+    uint32_t    page_us;        //budget for each page write
+    bool        acks_off;       //response signatures are still off from the last page
+    bool        failed;         //a page since the last checkpoint didnt make it
+    bool        read_back;      //checkpoints read the pages back, UPDI_SMALL with verify
+} StreamWrite;
+
+//One port of updi_discover(), probed on a thread of its own
+typedef struct {
+    Serial      serial;
+    Thread      thread;
+    bool        started;
+    bool        opened;
+    bool        found;
+    UPDIProbe   probe;
+} DiscoverJob;
+
+static bool        session_check(UPDI *updi);
 static void        send_handshake(Serial *serial);
+static void        probe_port(void *arg);
+static bool        link_up(Serial *serial);
+static bool        resync(UPDI *updi, uint32_t address);
 static bool        send_double_break(Serial *serial);
 static void        init(Serial *serial);
 static bool        check(Serial *serial);
 static void        get_device_info(Serial *serial, Device device, DeviceInfo *info);
+static bool        identify_device(Serial *serial, UPDI *updi);
 
 static bool        in_prog_mode(Serial *serial);
 static bool        enter_progmode(Serial *serial);
 static void        leave_progmode(Serial *serial);    
 
 static void        apply_reset(Serial *serial, bool reset);
+static void        toggle_reset(Serial *serial);
 
 static bool        unlock_device(Serial *serial);
 static bool        chip_erase(Serial *serial, Device device);
-
-static bool        read_data(Serial *serial, uint16_t address, uint16_t size, uint8_t *ret);
-static bool        read_data_words(Serial *serial, uint16_t address, uint16_t numwords, uint8_t *buffer);
-static uint8_t     read_fuse(Serial *serial, Device device, uint8_t fuse);
-static bool        read_flash(Serial *serial, Device device, uint16_t address, uint16_t size, uint8_t *buffer);
-
-static bool        write_data(Serial *serial, uint16_t address, uint8_t *data, uint16_t len);
-static bool        write_data_words(Serial *serial, uint16_t address, uint8_t *data, uint16_t numwords);
+static bool        erase_pages(Serial *serial, Device device, uint32_t address, uint32_t count);
+
+static bool        read_data(Serial *serial, uint32_t address, uint16_t size, uint8_t *ret);
+static bool        read_data_words(Serial *serial, uint32_t address, uint16_t numwords, uint8_t *buffer);
+static bool        read_ranges(Serial *serial, UPDIReadRange *ranges, uint8_t count, uint8_t *round_trips);
+static bool        read_burst(Serial *serial, uint32_t address, bool set_ptr, uint16_t size, uint8_t *buffer, bool ackoff);
+static uint8_t     burst_command(uint8_t *cmd, uint32_t address, bool set_ptr, uint16_t size);
+static bool        read_flash(Serial *serial, Device device, uint32_t address, uint32_t size, uint8_t *buffer, UPDIPageFunc sink, void *ctx);
+static bool        watch_plan(UPDIWatch *watch, WatchBurst *bursts, uint8_t *slot);
+static bool        watch_read(Serial *serial, WatchBurst *bursts, uint8_t count, uint8_t *data);
+
+static bool        write_data(Serial *serial, uint32_t address, uint8_t *data, uint16_t len);
+static bool        write_data_words(Serial *serial, uint32_t address, uint8_t *data, uint16_t len);
 static bool        write_fuse(Serial *serial, Device device, uint8_t fuse, uint8_t value);
-static bool        write_flash(Serial *serial, Device device, uint16_t address, uint8_t *data, uint16_t len);
+static bool        write_userrow(Serial *serial, Device device, uint8_t *data);
+static bool        write_userrow_locked(Serial *serial, Device device, uint8_t *data);
+static bool        wait_urow_prog(Serial *serial, uint16_t timeout, bool active);
+static bool        write_image(UPDI *updi, bool verify, uint32_t app_start, uint32_t app_end, uint32_t *length);
+static bool        app_section(UPDI *updi, uint32_t *start, uint32_t *end);
+static bool        write_app_page(UPDI *updi, uint32_t offset, uint8_t *data);
+static bool        boot_page(UPDI *updi, uint32_t *erased, uint32_t offset, uint8_t *data, uint16_t len, bool verify);
+static bool        erase_app_pages(UPDI *updi, uint32_t *erased, uint32_t end, bool verify);
+static bool        write_image_page(UPDI *updi, uint32_t offset, uint8_t *data, uint16_t len, uint32_t prev, uint8_t *prev_data);
+static bool        image_page_buffer(UPDI *updi, uint32_t offset, uint8_t *prev_data, bool revisit, uint8_t **data);
+static bool        verify_page(UPDI *updi, uint32_t offset, uint8_t *data, uint16_t len);
+#if defined UPDI_SMALL
+static bool        read_page(Serial *serial, uint32_t address, uint16_t len, uint8_t *buffer);
+#endif
+static bool        flash_write_begin(Serial *serial, Device device);
+static bool        flash_write_page(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len);
+static bool        page_batch(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len, uint8_t command);
+static bool        flash_erase_write_page(Serial *serial, Device device, uint32_t address, uint8_t *data);
+static bool        patch_page(UPDI *updi, const UPDIPatch *patches, uint8_t count, uint32_t offset, bool verify);
+static uint8_t     page_head(uint8_t *head, Device device, uint32_t address, uint16_t numwords, bool ackoff);
+static bool        stream_page(UPDI *updi, StreamWrite *stream, uint32_t offset, uint8_t *data, uint16_t len);
+static bool        stream_checkpoint(UPDI *updi, StreamWrite *stream);
+static bool        stream_check(UPDI *updi, StreamWrite *stream);
+static bool        flash_write_end(Serial *serial, Device device);
 
-static bool        load_ihex(char *filename, uint8_t *data, uint16_t *length);
 
 static uint8_t     ldcs(Serial *serial, uint8_t address);
-static uint8_t     ld(Serial *serial, uint16_t address);
-static bool        ld16(Serial *serial, uint16_t address, uint16_t *word);
+static uint8_t     address_bytes(uint8_t *buf, uint32_t address);
+static bool        ld8(Serial *serial, uint32_t address, uint8_t *value);
+static bool        ld16(Serial *serial, uint32_t address, uint16_t *word);
 static bool        ld_ptr_inc(Serial *serial, uint8_t *buffer, uint16_t size);
 static bool        ld_ptr_inc16(Serial *serial, uint8_t *buffer, uint16_t numwords);
 
 static void        stcs(Serial *serial, uint8_t address, uint8_t value);
-static bool        st(Serial *serial, uint16_t address, uint8_t value);
-static bool        st16(Serial *serial, uint16_t address, uint16_t value);
-static bool        st_ptr(Serial *serial, uint16_t address);
+static bool        st(Serial *serial, uint32_t address, uint8_t value);
+static bool        st16(Serial *serial, uint32_t address, uint16_t value);
+static bool        st_ptr(Serial *serial, uint32_t address);
 static bool        st_ptr_inc(Serial *serial, uint8_t *data, uint16_t size);
-static void        st_ptr_inc16(Serial *serial, uint8_t *data, uint16_t numwords);
+static void        st_ptr_inc16(Serial *serial, uint8_t *data, uint16_t len);
 
 static void        repeat(Serial *serial, uint16_t repeats);
 static void        key(Serial *serial, uint8_t size, uint8_t *key);
 static bool        progmode_key(Serial *serial);
 static bool        wait_unlocked(Serial *serial, uint16_t timeout);
 static bool        wait_flash_ready(Serial *serial, Device device);
+static bool        poll_flash_ready(Serial *serial, Device device);
+static bool        clear_nvm_error(Serial *serial, Device device);
 static bool        execute_nvm_command(Serial *serial, Device device, uint8_t command);
-static bool        write_nvm(Serial *serial, Device device, uint16_t address, uint8_t *data, uint16_t len, uint8_t command, bool use_word_acess);
+static bool        write_nvm(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len, uint8_t command, bool use_word_acess);
+
+
+/*
+Device registry, one entry per supported part keyed by its SIGROW signature. Addresses that are the same across a family live in its DeviceFamily,
+the entries only add the flash geometry
+*/
+typedef struct {
+    uint32_t    flash_start;
+    uint16_t    syscfg_address;
+    uint16_t    nvmctrl_address;
+    uint16_t    sigrow_address;
+    uint16_t    fuses_address;
+    uint16_t    userrow_address;
+    uint8_t     userrow_size;
+    uint8_t     num_fuses;
+    uint8_t     nvm_version;
+} DeviceFamily;
+
+typedef struct {
+    uint8_t             dev;
+    const char          *name;
+    uint8_t             signature[3];
+    const DeviceFamily  *family;
+    uint32_t            flash_size;
+    uint16_t            flash_pagesize;
+} DeviceEntry;
+
+static const DeviceFamily family_mega0 =    {0x4000,    0x0F00, 0x1000, 0x1100, 0x1280, 0x1300, 64, 11, UPDI_NVM_V0};
+static const DeviceFamily family_tiny =     {0x8000,    0x0F00, 0x1000, 0x1100, 0x1280, 0x1300, 32, 11, UPDI_NVM_V0};
+static const DeviceFamily family_dx =       {0x800000,  0x0F00, 0x1000, 0x1100, 0x1050, 0x1080, 32, 9,  UPDI_NVM_V2};
+
+static const DeviceEntry devices[] = {
+    {ATMEGA4808,    "ATmega4808",   {0x1E, 0x96, 0x50}, &family_mega0,  48*1024,    128},
+    {ATMEGA4809,    "ATmega4809",   {0x1E, 0x96, 0x51}, &family_mega0,  48*1024,    128},
+    {ATMEGA3208,    "ATmega3208",   {0x1E, 0x95, 0x30}, &family_mega0,  32*1024,    128},
+    {ATMEGA3209,    "ATmega3209",   {0x1E, 0x95, 0x31}, &family_mega0,  32*1024,    128},
+
+    {ATTINY3216,    "ATtiny3216",   {0x1E, 0x95, 0x21}, &family_tiny,   32*1024,    128},
+    {ATTINY3217,    "ATtiny3217",   {0x1E, 0x95, 0x22}, &family_tiny,   32*1024,    128},
+
+    {ATTINY1604,    "ATtiny1604",   {0x1E, 0x94, 0x25}, &family_tiny,   16*1024,    64},
+    {ATTINY1606,    "ATtiny1606",   {0x1E, 0x94, 0x24}, &family_tiny,   16*1024,    64},
+    {ATTINY1607,    "ATtiny1607",   {0x1E, 0x94, 0x23}, &family_tiny,   16*1024,    64},
+    {ATTINY1614,    "ATtiny1614",   {0x1E, 0x94, 0x22}, &family_tiny,   16*1024,    64},
+    {ATTINY1616,    "ATtiny1616",   {0x1E, 0x94, 0x21}, &family_tiny,   16*1024,    64},
+    {ATTINY1617,    "ATtiny1617",   {0x1E, 0x94, 0x20}, &family_tiny,   16*1024,    64},
+
+    {ATTINY804,     "ATtiny804",    {0x1E, 0x93, 0x25}, &family_tiny,   8*1024,     64},
+    {ATTINY806,     "ATtiny806",    {0x1E, 0x93, 0x24}, &family_tiny,   8*1024,     64},
+    {ATTINY807,     "ATtiny807",    {0x1E, 0x93, 0x23}, &family_tiny,   8*1024,     64},
+    {ATTINY814,     "ATtiny814",    {0x1E, 0x93, 0x22}, &family_tiny,   8*1024,     64},
+    {ATTINY816,     "ATtiny816",    {0x1E, 0x93, 0x21}, &family_tiny,   8*1024,     64},
+    {ATTINY817,     "ATtiny817",    {0x1E, 0x93, 0x20}, &family_tiny,   8*1024,     64},
+
+    {ATTINY402,     "ATtiny402",    {0x1E, 0x92, 0x27}, &family_tiny,   4*1024,     64},
+    {ATTINY404,     "ATtiny404",    {0x1E, 0x92, 0x26}, &family_tiny,   4*1024,     64},
+    {ATTINY406,     "ATtiny406",    {0x1E, 0x92, 0x25}, &family_tiny,   4*1024,     64},
+    {ATTINY412,     "ATtiny412",    {0x1E, 0x92, 0x23}, &family_tiny,   4*1024,     64},
+    {ATTINY414,     "ATtiny414",    {0x1E, 0x92, 0x22}, &family_tiny,   4*1024,     64},
+    {ATTINY416,     "ATtiny416",    {0x1E, 0x92, 0x21}, &family_tiny,   4*1024,     64},
+    {ATTINY417,     "ATtiny417",    {0x1E, 0x92, 0x20}, &family_tiny,   4*1024,     64},
+
+    {ATTINY202,     "ATtiny202",    {0x1E, 0x91, 0x23}, &family_tiny,   2*1024,     64},
+    {ATTINY204,     "ATtiny204",    {0x1E, 0x91, 0x22}, &family_tiny,   2*1024,     64},
+    {ATTINY212,     "ATtiny212",    {0x1E, 0x91, 0x21}, &family_tiny,   2*1024,     64},
+    {ATTINY214,     "ATtiny214",    {0x1E, 0x91, 0x20}, &family_tiny,   2*1024,     64},
+
+    {AVR128DA28,    "AVR128DA28",   {0x1E, 0x97, 0x0A}, &family_dx,     128*1024,   512},
+    {AVR128DA32,    "AVR128DA32",   {0x1E, 0x97, 0x09}, &family_dx,     128*1024,   512},
+    {AVR128DA48,    "AVR128DA48",   {0x1E, 0x97, 0x08}, &family_dx,     128*1024,   512},
+    {AVR128DA64,    "AVR128DA64",   {0x1E, 0x97, 0x07}, &family_dx,     128*1024,   512},
+    {AVR64DA28,     "AVR64DA28",    {0x1E, 0x96, 0x15}, &family_dx,     64*1024,    512},
+    {AVR64DA32,     "AVR64DA32",    {0x1E, 0x96, 0x14}, &family_dx,     64*1024,    512},
+    {AVR64DA48,     "AVR64DA48",    {0x1E, 0x96, 0x13}, &family_dx,     64*1024,    512},
+    {AVR64DA64,     "AVR64DA64",    {0x1E, 0x96, 0x12}, &family_dx,     64*1024,    512},
+    {AVR32DA28,     "AVR32DA28",    {0x1E, 0x95, 0x34}, &family_dx,     32*1024,    512},
+    {AVR32DA32,     "AVR32DA32",    {0x1E, 0x95, 0x33}, &family_dx,     32*1024,    512},
+    {AVR32DA48,     "AVR32DA48",    {0x1E, 0x95, 0x32}, &family_dx,     32*1024,    512},
+
+    {AVR128DB28,    "AVR128DB28",   {0x1E, 0x97, 0x0E}, &family_dx,     128*1024,   512},
+    {AVR128DB32,    "AVR128DB32",   {0x1E, 0x97, 0x0D}, &family_dx,     128*1024,   512},
+    {AVR128DB48,    "AVR128DB48",   {0x1E, 0x97, 0x0C}, &family_dx,     128*1024,   512},
+    {AVR128DB64,    "AVR128DB64",   {0x1E, 0x97, 0x0B}, &family_dx,     128*1024,   512},
+    {AVR64DB28,     "AVR64DB28",    {0x1E, 0x96, 0x19}, &family_dx,     64*1024,    512},
+    {AVR64DB32,     "AVR64DB32",    {0x1E, 0x96, 0x18}, &family_dx,     64*1024,    512},
+    {AVR64DB48,     "AVR64DB48",    {0x1E, 0x96, 0x17}, &family_dx,     64*1024,    512},
+    {AVR64DB64,     "AVR64DB64",    {0x1E, 0x96, 0x16}, &family_dx,     64*1024,    512},
+    {AVR32DB28,     "AVR32DB28",    {0x1E, 0x95, 0x37}, &family_dx,     32*1024,    512},
+    {AVR32DB32,     "AVR32DB32",    {0x1E, 0x95, 0x36}, &family_dx,     32*1024,    512},
+    {AVR32DB48,     "AVR32DB48",    {0x1E, 0x95, 0x35}, &family_dx,     32*1024,    512},
+
+    {AVR64DD14,     "AVR64DD14",    {0x1E, 0x96, 0x1D}, &family_dx,     64*1024,    512},
+    {AVR64DD20,     "AVR64DD20",    {0x1E, 0x96, 0x1C}, &family_dx,     64*1024,    512},
+    {AVR64DD28,     "AVR64DD28",    {0x1E, 0x96, 0x1B}, &family_dx,     64*1024,    512},
+    {AVR64DD32,     "AVR64DD32",    {0x1E, 0x96, 0x1A}, &family_dx,     64*1024,    512},
+    {AVR32DD14,     "AVR32DD14",    {0x1E, 0x95, 0x3B}, &family_dx,     32*1024,    512},
+    {AVR32DD20,     "AVR32DD20",    {0x1E, 0x95, 0x3A}, &family_dx,     32*1024,    512},
+    {AVR32DD28,     "AVR32DD28",    {0x1E, 0x95, 0x39}, &family_dx,     32*1024,    512},
+    {AVR32DD32,     "AVR32DD32",    {0x1E, 0x95, 0x38}, &family_dx,     32*1024,    512},
+    {AVR16DD14,     "AVR16DD14",    {0x1E, 0x94, 0x34}, &family_dx,     16*1024,    512},
+    {AVR16DD20,     "AVR16DD20",    {0x1E, 0x94, 0x33}, &family_dx,     16*1024,    512},
+    {AVR16DD28,     "AVR16DD28",    {0x1E, 0x94, 0x32}, &family_dx,     16*1024,    512},
+    {AVR16DD32,     "AVR16DD32",    {0x1E, 0x94, 0x31}, &family_dx,     16*1024,    512},
+};
+
+#define NUM_DEVICES     (sizeof(devices) / sizeof(devices[0]))
+
+static const DeviceEntry   *find_device(uint8_t dev);
+static const DeviceEntry   *find_device_signature(uint8_t *signature);
+static bool                load_device(const DeviceEntry *entry, Device *device);
 
 
 void updi_init(UPDI *updi, uint8_t com_port, uint32_t baudrate, uint8_t dev, uint8_t args, char *fname, uint8_t fname_len){
@@ -73,191 +249,157 @@ void updi_init(UPDI *updi, uint8_t com_port, uint32_t baudrate, uint8_t dev, uin
     updi->baudrate = baudrate;
     updi->dev = dev;    
 
-    memset(updi->fuse_values_read, 0, updi->device.num_fuses);
-    memset(updi->fuse_values_write, 0, updi->device.num_fuses);
+    memset(&(updi->device), 0, sizeof(Device));
+    memset(updi->fuse_values_read, 0, UPDI_MAX_FUSES);
+    memset(updi->fuse_values_write, 0, UPDI_MAX_FUSES);
+    memset(updi->userrow_write, 0xFF, UPDI_MAX_USERROW_SIZE);
+#if defined UPDI_SMALL
+    updi->arena = NULL;
+    updi->read_page = NULL;
+    updi->read_ctx = NULL;
+#else
     memset(updi->flash_data_read, 0, UPDI_MAX_FLASH_SIZE);
     memset(updi->flash_data_write, 0, UPDI_MAX_FLASH_SIZE);
+#endif
 
     memset(updi->info.family, 0, 8);
     memset(updi->info.nvm_version, 0, 8);
     memset(updi->info.ocd_version, 0, 8);
 
     updi->args = args;    
+    updi->full_duplex = false;
+    updi->stream_write = false;
+    updi->stream_page_us = UPDI_STREAM_PAGE_US;
+    updi->keep_boot = false;
+    updi->session_open = false;
+    updi->locked = false;
+    updi->attached = false;
+    updi->image.started = false;
+    updi->transport = UPDI_DEFAULT_TRANSPORT;
+    updi->serial.transport = NULL;
+    updi->serial.port = NULL;
+    memset(&(updi->stats), 0, sizeof(UPDIStats));
     
-    //check numfuses is correct for everything other than atmega4808/9
-    switch(dev){
-        case ATMEGA4808:
-        case ATMEGA4809:{
-            updi->device.flash_start =        0x4000;
-            updi->device.flash_size =         48*1024;
-            updi->device.flash_pagesize =     128;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }
+    if(dev == UPDI_DEVICE_AUTO){
+        //geometry comes from the signature once connected, sigrow and syscfg are in the same place on every supported family
+        updi->device.sigrow_address = family_mega0.sigrow_address;
+        updi->device.syscfg_address = family_mega0.syscfg_address;
+        updi->device.nvmctrl_address = family_mega0.nvmctrl_address;
+    }else if(!load_device(find_device(dev), &(updi->device))){
+        log_error("Unknown device %d\r\n", dev);
+    }
 
-        case ATMEGA3208:
-        case ATMEGA3209:{
-            updi->device.flash_start =        0x4000;
-            updi->device.flash_size =         32*1024;
-            updi->device.flash_pagesize =     128;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }
+    return;
+}
 
-        case ATTINY3216:
-        case ATTINY3217:{
-            updi->device.flash_start =        0x8000;
-            updi->device.flash_size =         32*1024;
-            updi->device.flash_pagesize =     128;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }
+//run the updi process, one session opened around the operations set in args, returns whether all of them went through
+bool updi_process(UPDI *updi){    
 
-        
-        case ATTINY1604:
-        case ATTINY1606:
-        case ATTINY1607:
-        case ATTINY1614:
-        case ATTINY1616:
-        case ATTINY1617:{
-            updi->device.flash_start =        0x8000;
-            updi->device.flash_size =         16*1024;
-            updi->device.flash_pagesize =     64;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }         
-
-        case ATTINY804:
-        case ATTINY806:
-        case ATTINY807:
-        case ATTINY814:
-        case ATTINY816:
-        case ATTINY817:{
-            updi->device.flash_start =        0x8000;
-            updi->device.flash_size =         8*1024;
-            updi->device.flash_pagesize =     64;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }
-        
-        case ATTINY402:
-        case ATTINY404:
-        case ATTINY406:
-        case ATTINY412:
-        case ATTINY414:
-        case ATTINY416:
-        case ATTINY417:{
-            updi->device.flash_start =        0x8000;
-            updi->device.flash_size =         4*1024;
-            updi->device.flash_pagesize =     64;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }        
+    if(!(updi->args & (UPDI_PROCESS_GET_INFO | UPDI_PROCESS_READ_FUSES | UPDI_PROCESS_WRITE_FUSES | UPDI_PROCESS_READ_FLASH | UPDI_PROCESS_ERASE | UPDI_PROCESS_WRITE_FLASH | UPDI_PROCESS_WRITE_USERROW))){
+        log_important("No process args set\r\n");
+        return false;
+    }
 
-        case ATTINY202:
-        case ATTINY204:
-        case ATTINY212:
-        case ATTINY214:{
-            updi->device.flash_start =        0x8000;
-            updi->device.flash_size =         2*1024;
-            updi->device.flash_pagesize =     64;
-            updi->device.syscfg_address =     0x0F00;
-            updi->device.nvmctrl_address =    0x1000;
-            updi->device.sigrow_address =     0x1100;
-            updi->device.fuses_address =      0x1280;
-            updi->device.userrow_address =    0x1300;
-            updi->device.num_fuses =          11;
-            break;
-        }        
-        default: break;
+    //the image parses on its worker thread alongside the handshake and chip erase
+    if((updi->args & UPDI_PROCESS_WRITE_FLASH) && updi->hex_filename[0] != '\0'){
+        updi_load_image(updi);
     }
 
-    return;
+    //GET_INFO is done by updi_open() while identifying the device
+    trace_begin("open");
+    bool ok = updi_open(updi);
+    trace_end();
+
+    if(!ok){
+        return false;
+    }
+
+    //do requested actions, stopping at the first one that fails, each one a span of its own when tracing
+    uint8_t args = updi->args;
+
+    if(ok && (args & UPDI_PROCESS_READ_FUSES)){     trace_begin("read fuses");      ok = updi_read_fuses(updi);     trace_end(); }
+    if(ok && (args & UPDI_PROCESS_WRITE_FUSES)){    trace_begin("write fuses");     ok = updi_write_fuses(updi);    trace_end(); }
+    if(ok && (args & UPDI_PROCESS_READ_FLASH)){     trace_begin("read flash");      ok = updi_read_flash(updi);     trace_end(); }
+    if(ok && (args & UPDI_PROCESS_ERASE)){          trace_begin("erase");           ok = updi_erase(updi);          trace_end(); }
+    if(ok && (args & UPDI_PROCESS_WRITE_FLASH)){    trace_begin("write flash");     ok = updi_write_flash(updi, (args & UPDI_PROCESS_VERIFY_FLASH) != 0);   trace_end(); }
+    if(ok && (args & UPDI_PROCESS_WRITE_USERROW)){  trace_begin("write userrow");   ok = updi_write_userrow(updi);  trace_end(); }
+
+    //leave progmode & tidy up
+    trace_begin("close");
+    updi_close(updi);
+    trace_end();
+
+    if(ok){
+        log_important("Process Finished\r\n");
+    }
+
+    return ok;
 }
 
-//run the updi process 
-void updi_process(UPDI *updi){    
+/*
+Start parsing hex_filename, intel hex or ELF, on a worker thread for updi_write_flash() to program from as it goes. Called before updi_open() the parse
+overlaps the handshake, progmode and chip erase, otherwise updi_write_flash() starts it itself. updi_cleanup() stops it if it is never used
+*/
+bool updi_load_image(UPDI *updi){
+    if(updi->image.started) return true;
 
-    if(!(updi->args & (UPDI_PROCESS_GET_INFO | UPDI_PROCESS_READ_FUSES | UPDI_PROCESS_WRITE_FUSES | UPDI_PROCESS_READ_FLASH | UPDI_PROCESS_ERASE | UPDI_PROCESS_WRITE_FLASH | UPDI_PROCESS_WRITE_USERROW))){
-        log_important("No process args set\r\n");
-        return;
+    if(updi->hex_filename[0] == '\0'){
+        log_error("No filename specified to flash\r\n");
+        return false;
     }
-    
-    Device device = updi->device;
-    DeviceInfo *info = &(updi->info); 
+
+    if(!image_start(&(updi->image), updi->hex_filename, UPDI_MAX_FLASH_SIZE)){
+        log_error("Load image file failed\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Open a session: serial port, handshake, progmode and device identification, after which any sequence of the updi_read / write / erase functions
+below can run without repeating any of it. A locked device is only erased and unlocked if UPDI_PROCESS_ERASE or UPDI_PROCESS_WRITE_FLASH is set in the
+args passed to updi_init(), and UPDI_PROCESS_GET_INFO fills updi->info while identifying. Close with updi_close()
+With UPDI_PROCESS_WRITE_USERROW (and neither of those) a locked device is opened as is, updi->locked set, and only updi_write_userrow() will run
+*/
+bool updi_open(UPDI *updi){
+
+    updi->session_open = false;
+    updi->locked = false;
+    updi->attached = false;
 
     //set up serial
     Serial *serial = &(updi->serial);   
+    serial->transport = updi->transport;
     serial->com_port = updi->com_port;
     serial->baudrate = updi->baudrate;    
     if(!serial_init(serial)){
         log_error("Could not initialise serial\r\n");
         updi_cleanup(updi);
-        return;
+        return false;
     }
 
+    memset(&(updi->stats), 0, sizeof(UPDIStats));
+
     //handshake
-    send_handshake(serial);
-    init(serial);
-    if(!check(serial)){
-        log_str("UPDI not initialised\r\n");
+    if(!link_up(serial)){
+        updi_cleanup(updi);
+        return false;
+    }
 
-        if(!send_double_break(serial)){
-            log_error("Double break UPDI reset failed\r\n");
-            updi_cleanup(updi);
-            return;
-        }
-        init(serial);
-        if(!check(serial)){
-            log_error("Cannot initialise UPDI, aborting.\r\n");
-            updi_cleanup(updi);
-            return;
-        }else{
-            log_str("UPDI INITIALISED\r\n");
-        }
-    }else{
-        log_str("UPDI INITIALISED\r\n");
-    }    
+    //from here on nothing reopens the port, a failed write ahead shows up as an error on the next transfer that waits for a reply
+    if(updi->full_duplex && !serial_start_duplex(serial)){
+        log_str("Couldnt start full-duplex mode, staying synchronous\r\n");
+    }
 
 
     /*
     //Inrease UPDI clock speed to allow faster baudrates, for reference only, speed difference is negligable comapard to latency in usb-art process    
     stcs(serial, UPDI_ASI_CTRLA, 0x01);
-    serial_close(serial);
     if(!serial_change_baud(serial, 900000)){
         log_error("Could not increase baud rate\r\n");
         updi_cleanup(updi);
-        return;
+        return false;
     }
     */
 
@@ -266,7 +408,13 @@ void updi_process(UPDI *updi){
     if(!enter_progmode(serial)){
         log_str("Couldnt enter progmode\r\n");
 
-        if(updi->args & UPDI_PROCESS_WRITE_FLASH | updi->args & UPDI_PROCESS_ERASE){
+        //unlocking is a chip erase, it would take the bootloader keep_boot is there to keep
+        if(updi->keep_boot && (updi->args & (UPDI_PROCESS_WRITE_FLASH | UPDI_PROCESS_ERASE))){
+            log_error("Device locked, keep_boot wont unlock it as that erases the bootloader too\r\n");
+            updi_cleanup(updi);
+            return false;
+
+        }else if(updi->args & UPDI_PROCESS_WRITE_FLASH | updi->args & UPDI_PROCESS_ERASE){
             log_str("erasing and unlocking device\r\n");
 
             unlock_device(serial);
@@ -276,697 +424,2411 @@ void updi_process(UPDI *updi){
             }else{
                 log_error("Could not enter programming mode, aborting.\r\n");
                 updi_cleanup(updi);
-                return;
+                return false;
+            }
+
+        }else if(updi->args & UPDI_PROCESS_WRITE_USERROW){
+            //the signature cant be read back from a locked device, so the part has to be given
+            if(updi->dev == UPDI_DEVICE_AUTO || updi->device.userrow_size == 0){
+                log_error("Device locked, pass its device id to updi_init() to write the USERROW\r\n");
+                updi_cleanup(updi);
+                return false;
             }
 
+            log_str("Device locked, only the USERROW can be written\r\n");
+            updi->locked = true;
+            updi->session_open = true;
+
+            return true;
+
         }else{
             log_error("Need to erase device to unlock. Need process args UPDI_PROCESS_ERASE or UPDI_PROCESS_WRITE_FLASH set\r\n");
             updi_cleanup(updi);                
-            return;
+            return false;
         }        
     }else{
         log_str("IN PROG MODE\r\n");
     }
    
-    //do requested actions
     if(updi->args & UPDI_PROCESS_GET_INFO){
         log_important("\r\nGETTING DEVICE INFO\r\n");
-        get_device_info(serial, device, info);        
     }   
 
-    //save fuses into updi array
-    if(updi->args & UPDI_PROCESS_READ_FUSES){
-        log_important("\r\nREADING FUSES\r\n");        
-        
-        for(uint8_t i = 0; i < updi->device.num_fuses; i++){
-            uint8_t value = read_fuse(serial, device, i);            
-            updi->fuse_values_read[i] = value;            
-        }       
-    }   
+    //detect the part, or check its the one asked for, nothing below runs with the wrong geometry
+    if(!identify_device(serial, updi)){
+        leave_progmode(serial);
+        updi_cleanup(updi);
+        return false;
+    }
 
-    //write fuses from updi array    
-    if(updi->args & UPDI_PROCESS_WRITE_FUSES){
-        log_important("\r\nWRITING FUSES\r\n");
+    updi->session_open = true;
 
-        for(uint8_t i = 0; i < updi->device.num_fuses; i++){
-            write_fuse(serial, device, i, updi->fuse_values_write[i]);            
-        }
-    }   
+    return true;
+}
 
-    //save flash into updi array
-    if(updi->args & UPDI_PROCESS_READ_FLASH){
-        log_important("\r\nREADING FLASH\r\n");
+/*
+Whether a target answers on the port right now: the handshake break and one LDCS of STATUSA, no double break and nothing logged when it doesnt,
+so it can be polled. The port is opened and closed around it (daemon.c keeps it open underneath, which makes polling cheap)
+*/
+bool updi_detect(UPDI *updi){
+    Serial *serial = &(updi->serial);
+    serial->transport = updi->transport;
+    serial->com_port = updi->com_port;
+    serial->baudrate = updi->baudrate;
 
-        if(!read_flash(serial, device, device.flash_start, device.flash_size, updi->flash_data_read)){
-            log_error("Read flash failed\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
-        }
-    }   
+    if(!serial_init(serial)) return false;
 
-    //Erase flash
-    if(updi->args & UPDI_PROCESS_ERASE){
-        log_important("\r\nERASING FLASH\r\n");
+    uint8_t cmd[2] = {UPDI_PHY_SYNC, UPDI_LDCS | UPDI_CS_STATUSA};
+    uint8_t status = 0;
+    SerialIov tx[1] = {{cmd, 2}};
+    SerialIov rx[2] = {{NULL, 2}, {&status, 1}};
 
-        if(!chip_erase(serial, device)){
-            log_error("Chip erase failed\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
-        }
-    }   
+    send_handshake(serial);
+    bool found = serial_transfer(serial, tx, 1, rx, 2) && status != 0;
 
-    //Write flash from hex file
-    if(updi->args & UPDI_PROCESS_WRITE_FLASH){
-        log_important("\r\nWRITING FLASH\r\n");
+    serial_close(serial);
 
-        if(updi->hex_filename == NULL){
-            log_error("No filename specified to flash\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
-        }
+    return found;
+}
 
-        if(!chip_erase(serial, device)){
-            log_error("Chip erase failed\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
-        }
+/*
+Find the ports a target answers on, probing them all at once so it takes about as long as one probe. Each port is opened through transport
+(UPDI_DEFAULT_TRANSPORT when NULL) at baudrate on a thread of its own and gets the handshake break then STATUSA and the SIB in one transfer,
+no double break, so a port with nothing on it costs one read timeout. com_ports NULL probes every port UPDI_LIST_PORTS() finds.
+More than UPDI_DISCOVER_WAVE ports go in waves of that many, so they are never more than the platform can have open, and ports past
+UPDI_DISCOVER_MAX_PORTS or that wont open are logged rather than taken for empty. The jobs are static, one updi_discover() at a time.
+Fills found with the ports that answered, in the order they were given, and returns how many
+*/
+uint8_t updi_discover(const SerialTransport *transport, uint32_t baudrate, const uint8_t *com_ports, uint8_t count, UPDIProbe *found){
+    static DiscoverJob jobs[UPDI_DISCOVER_WAVE];
+    uint8_t listed[UPDI_DISCOVER_MAX_PORTS];
+    uint8_t n = 0;
 
-        //load hex, get data and start address
-        uint8_t data[UPDI_MAX_FLASH_SIZE];
-        uint8_t read_back[UPDI_MAX_FLASH_SIZE];
-        uint16_t length = 0;
+    if(com_ports == NULL){
+        count = UPDI_LIST_PORTS(listed, UPDI_DISCOVER_MAX_PORTS);
+        com_ports = listed;
+    }
 
-        if(!load_ihex(updi->hex_filename, data, &length)){
-            log_error("Load .hex file failed\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
+    for(uint8_t i = UPDI_DISCOVER_MAX_PORTS; i < count; i++){
+        log_error("Discover skipped port %d, more than UPDI_DISCOVER_MAX_PORTS given\r\n", com_ports[i]);
+    }
+    if(count > UPDI_DISCOVER_MAX_PORTS) count = UPDI_DISCOVER_MAX_PORTS;
+
+    trace_begin_arg("discover", "ports", count);
+
+    for(uint8_t wave = 0; wave < count; wave += UPDI_DISCOVER_WAVE){
+        uint8_t size = (count - wave < UPDI_DISCOVER_WAVE) ? count - wave : UPDI_DISCOVER_WAVE;
+
+        for(uint8_t i = 0; i < size; i++){
+            DiscoverJob *job = &(jobs[i]);
+
+            memset(job, 0, sizeof(DiscoverJob));
+            job->serial.transport = (transport != NULL) ? transport : UPDI_DEFAULT_TRANSPORT;
+            job->serial.com_port = com_ports[wave + i];
+            job->serial.baudrate = baudrate;
+            job->probe.com_port = com_ports[wave + i];
+
+            job->started = thread_start(&(job->thread), probe_port, job);
+            if(!job->started) log_error("Discover couldnt start a probe for port %d\r\n", com_ports[wave + i]);
         }
 
-        log_str("loaded %d bytes: \r\n", length);
-        
-        log_important("\r\nThis will take several minutes, dont touch anything until complete\r\n");
+        for(uint8_t i = 0; i < size; i++){
+            if(!jobs[i].started) continue;
 
-        if(!write_flash(serial, device, device.flash_start, data, length)){
-            log_error("Writing flash failed\r\n");
-            leave_progmode(serial);
-            updi_cleanup(updi);
-            return;
-        }else{
-            log_important("\r\n\r\nFlash written\r\n");
+            thread_join(&(jobs[i].thread));
+            if(!jobs[i].opened) log_error("Discover couldnt open port %d, not probed\r\n", jobs[i].probe.com_port);
+            if(jobs[i].found) found[n++] = jobs[i].probe;
         }
+    }
 
-        if(updi->args & UPDI_PROCESS_VERIFY_FLASH){            
-            log_important("\r\nREADING FLASH\r\n");
+    trace_end();
 
-            if(!read_flash(serial, device, device.flash_start, length + (device.flash_pagesize - length % device.flash_pagesize), updi->flash_data_read)){
-                log_str("Read flash failed\r\n");
-                leave_progmode(serial);
-                updi_cleanup(updi);
-                return;
-            }
+    log_str("Discover found %d of %d ports\r\n", n, count);
 
-            log_important("\r\nVERIFYING FLASH\r\n");
+    return n;
+}
 
-            bool fail = false;
-            //only check length of written bytes since padded bytes dont exist in original data
-            for(int i = 0; i < length; i++){
-                if(data[i] != updi->flash_data_read[i]){
-                    fail = true;                    
-                    log_str("MEM MISMATCH at addr: %d, should be: %d, received: %d\r\n", i + device.flash_start, data[i], updi->flash_data_read[i]);
-                }
-            }
+//updi_discover() thread, a port that doesnt open or answer is left out
+static void probe_port(void *arg){
+    DiscoverJob *job = (DiscoverJob*)arg;
+    Serial *serial = &(job->serial);
+    UPDIProbe *probe = &(job->probe);
 
-            if(fail){
-                log_error("\r\nVerify flash failed, program may or may not be ok\r\n");
-            }else{
-                log_important("\r\nVerify flash passed\r\n");                
-            }
-        } 
-    }   
+    uint8_t cmd[4] = {UPDI_PHY_SYNC, UPDI_LDCS | UPDI_CS_STATUSA, UPDI_PHY_SYNC, UPDI_KEY | UPDI_KEY_SIB | UPDI_SIB_16BYTES};
+    uint8_t sib[16];
+    SerialIov tx[1] = {{cmd, 4}};
+    SerialIov rx[4] = {{NULL, 2}, {&(probe->status), 1}, {NULL, 2}, {sib, 16}};
 
-    //leave progmode
-    leave_progmode(serial);    
-    
-    //Tidy up
-    updi_cleanup(updi);
-    log_important("Process Finished\r\n");
+    job->opened = serial_init(serial);
+    if(!job->opened) return;
 
-    return;
-}
+    send_handshake(serial);
+    job->found = serial_transfer(serial, tx, 1, rx, 4) && probe->status != 0;
 
-//tidy up
-void updi_cleanup(UPDI *updi){
-    serial_close(&(updi->serial));
-    return;
-}
+    serial_close(serial);
+
+    if(job->found){
+        memcpy(probe->family, sib, 7);
+        memcpy(probe->sib, sib, 16);
+    }
 
-static void send_handshake(Serial *serial){
-    uint8_t buf[1] = {UPDI_BREAK};
-    serial_send(serial, buf, 1);
-    
     return;
 }
 
-static void init(Serial *serial){
-    stcs(serial, UPDI_CS_CTRLB, 1 << UPDI_CTRLB_CCDETDIS_BIT);
-    stcs(serial, UPDI_CS_CTRLA, 1 << UPDI_CTRLA_IBDLY_BIT);
+/*
+Open a session on a running device without disturbing it: serial port and handshake only, no reset, no keys and no progmode, so the application
+carries on while updi_watch() reads its SRAM and I/O registers. The device has to be unlocked. updi_close() then only disables UPDI again
+*/
+bool updi_attach(UPDI *updi){
 
-    return;
-}
+    updi->session_open = false;
+    updi->locked = false;
+    updi->attached = false;
 
-static bool check(Serial *serial){
-    if(ldcs(serial, UPDI_CS_STATUSA) != 0){
-        return true;
-    }else{
+    Serial *serial = &(updi->serial);
+    serial->transport = updi->transport;
+    serial->com_port = updi->com_port;
+    serial->baudrate = updi->baudrate;
+    if(!serial_init(serial)){
+        log_error("Could not initialise serial\r\n");
+        updi_cleanup(updi);
         return false;
     }
-}
 
-static bool send_double_break(Serial *serial){
-    log_str("Sending dbl break\r\n");
-    serial_close(serial);
-    if(!serial_init_dbl_break(serial)){
-        log_str("couldnt re-init serial port to dbl break settings\r\n");
+    memset(&(updi->stats), 0, sizeof(UPDIStats));
+
+    if(!link_up(serial)){
+        updi_cleanup(updi);
         return false;
     }
 
-    uint8_t buf[2] = {UPDI_BREAK, UPDI_BREAK};
-    uint8_t recv[2];
-    serial_send_receive(serial, buf, 2, recv, 2);
+    if(updi->full_duplex && !serial_start_duplex(serial)){
+        log_str("Couldnt start full-duplex mode, staying synchronous\r\n");
+    }
 
-    serial_close(serial);
-    if(!serial_init(serial)){
-        log_str("couldnt re-init serial to normal settings\r\n");
+    if(ldcs(serial, UPDI_ASI_SYS_STATUS) & (1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS)){
+        log_error("Device is locked, its memory cant be read without erasing it\r\n");
+        stcs(serial, UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
+        updi_cleanup(updi);
         return false;
-    }    
+    }
+
+    log_str("ATTACHED\r\n");
+
+    updi->attached = true;
+    updi->session_open = true;
 
     return true;
 }
 
-static bool in_prog_mode(Serial *serial){
-    if(ldcs(serial, UPDI_ASI_SYS_STATUS) & (1 << UPDI_ASI_SYS_STATUS_NVMPROG)){
-        return true;
+//Leave progmode and close the port, a session from updi_attach() just has UPDI disabled so the device isnt reset
+void updi_close(UPDI *updi){
+    if(!updi->session_open) return;
+
+    if(updi->attached){
+        stcs(&(updi->serial), UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
     }else{
-        return false;
+        leave_progmode(&(updi->serial));
     }
+
+    updi_cleanup(updi);
+    updi->session_open = false;
+    updi->locked = false;
+    updi->attached = false;
+
+    return;
 }
 
-static bool enter_progmode(Serial *serial){
-    //Enter NVMProg key
-    if(!in_prog_mode(serial)){
-        if(!progmode_key(serial)){
-            return false;
-        }
-    }
+//Read the SIB, UPDI revision, signature and device revision into updi->info
+bool updi_get_info(UPDI *updi){
+    if(!session_check(updi)) return false;
 
-    //Toggle reset
-    apply_reset(serial, true);
-    apply_reset(serial, false);
+    log_important("\r\nGETTING DEVICE INFO\r\n");
+    get_device_info(&(updi->serial), updi->device, &(updi->info));
 
-    //Wait for unlock
-    if(!wait_unlocked(serial, 100)){
-        log_str("FAILED TO ENTER NVM PROGRAMMING MODE, DEVICE IS LOCKED\r\n");        
-        return false;
-    }
+    return true;
+}
 
-    //Check for NVMPROG flag
-    if(!in_prog_mode(serial)){
-        log_str("STILL NOT IN PROG MODE\r\n");        
+//save fuses into updi array
+bool updi_read_fuses(UPDI *updi){
+    if(!session_check(updi)) return false;
+
+    log_important("\r\nREADING FUSES\r\n");        
+
+    UPDIReadRange range = {updi->device.fuses_address, updi->device.num_fuses, updi->fuse_values_read};
+
+    if(!read_ranges(&(updi->serial), &range, 1, NULL)){
+        log_error("Read fuses failed\r\n");
         return false;
     }
 
     return true;
 }
 
-//Disables UPDI which releases any keys enabled
-static void leave_progmode(Serial *serial){
-    log_str("leaving progmode...\r\n");    
-    apply_reset(serial, true);
-    apply_reset(serial, false);
+//write fuses from updi array
+bool updi_write_fuses(UPDI *updi){
+    bool ok = true;
 
-    stcs(serial, UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
+    if(!session_check(updi)) return false;
 
-    return;
-}
+    log_important("\r\nWRITING FUSES\r\n");
 
-static void apply_reset(Serial *serial, bool reset){
-    if(reset){
-        log_str("Applying reset\r\n");        
-        stcs(serial, UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_VALUE);
-    }else{
-        log_str("Releasing reset\r\n");        
-        stcs(serial, UPDI_ASI_RESET_REQ, 0x00);
-    }    
+    for(uint8_t i = 0; i < updi->device.num_fuses; i++){
+        if(!write_fuse(&(updi->serial), updi->device, i, updi->fuse_values_write[i])){
+            log_error("Write fuse %d failed\r\n", i);
+            ok = false;
+        }
+    }
+
+    return ok;
 }
 
-//Unlock and erase
-static bool unlock_device(Serial *serial){
-    log_str("UNLOCKING AND ERASING\r\n");
-    
-    //enter key
-    key(serial, UPDI_KEY_64, (uint8_t*)UPDI_KEY_CHIPERASE);
+//save flash into updi array, or with UPDI_SMALL pass it a chunk at a time to updi->read_page
+bool updi_read_flash(UPDI *updi){
+    if(!session_check(updi)) return false;
 
-    //check key status
-    uint8_t key_status = ldcs(serial, UPDI_ASI_KEY_STATUS);
+    log_important("\r\nREADING FLASH\r\n");
 
-    if(!(key_status & (1 << UPDI_ASI_KEY_STATUS_CHIPERASE))){
-        log_str("Unlock error: key not accepted\r\n");        
+#if defined UPDI_SMALL
+    if(updi->arena == NULL || updi->read_page == NULL){
+        log_error("Set updi->arena and updi->read_page to read flash\r\n");
         return false;
     }
 
-    //Insert NVMProg key as well
-    //In case of CRC being enabled, the device must be left in programming mode after the erase
-    //to allow the CRC to be disabled (or flash reprogrammed)
-    progmode_key(serial);
-
-    //Toggle reset
-    apply_reset(serial, true);
-    apply_reset(serial, false);
+    bool ok = read_flash(&(updi->serial), updi->device, updi->device.flash_start, updi->device.flash_size, updi->arena->read, updi->read_page, updi->read_ctx);
+#else
+    bool ok = read_flash(&(updi->serial), updi->device, updi->device.flash_start, updi->device.flash_size, updi->flash_data_read, NULL, NULL);
+#endif
 
-    //wait for unlock
-    if(!wait_unlocked(serial, 100)){
-        log_str("Failed to chip erase using key\r\n");        
+    if(!ok){
+        log_error("Read flash failed\r\n");
         return false;
     }
 
-    log_str("UNLOCKED DEVICE\r\n");
-
     return true;
 }
 
-//Get device info
-static void get_device_info(Serial *serial, Device device, DeviceInfo *info){
-    uint8_t buf[2] = {UPDI_PHY_SYNC, UPDI_KEY | UPDI_KEY_SIB | UPDI_SIB_16BYTES};
-    uint8_t recv[16];
+//Erase flash
+bool updi_erase(UPDI *updi){
+    if(!session_check(updi)) return false;
 
-    if(!serial_send_receive(serial, buf, 2, recv, 16)){
-        log_str("SIB recv error");        
-    }else{
+    log_important("\r\nERASING FLASH\r\n");
+
+    trace_begin("chip erase");
+    bool erased = chip_erase(&(updi->serial), updi->device);
+    trace_end();
+
+    if(!erased){
+        log_error("Chip erase failed\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//Write flash from the image file, programming pages as they are parsed, optionally read it back and compare
+bool updi_write_flash(UPDI *updi, bool verify){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+
+    if(!session_check(updi)) return false;
+
+    log_important("\r\nWRITING FLASH\r\n");
+
+#if defined UPDI_SMALL
+    if(updi->arena == NULL){
+        log_error("Set updi->arena to write flash\r\n");
+        return false;
+    }
+#endif
+
+    if(updi->keep_boot && updi->stream_write){
+        log_error("keep_boot and stream_write cant be used together\r\n");
+        return false;
+    }
+
+    if(!updi_load_image(updi)){
+        return false;
+    }
+
+    //keep_boot leaves the chip erase out, each application page is erased as it is written or, if the image leaves it out, on its own
+    uint32_t app_start = 0;
+    uint32_t app_end = device.flash_size;
+
+    if(updi->keep_boot){
+        updi->stats.app_pages = 0;
+
+        if(!app_section(updi, &app_start, &app_end)){
+            image_finish(&(updi->image), NULL);
+            return false;
+        }
+    }else{
+        trace_begin("chip erase");
+        bool erased = chip_erase(serial, device);
+        trace_end();
+
+        if(!erased){
+            log_error("Chip erase failed\r\n");
+            image_finish(&(updi->image), NULL);
+            return false;
+        }
+    }
+
+    log_important("\r\nThis will take several minutes, dont touch anything until complete\r\n");
+
+    uint32_t length = 0;
+
+    if(!write_image(updi, verify, app_start, app_end, &length)){
+        log_error("Writing flash failed\r\n");
+        return false;
+    }
+
+    log_str("written %d bytes\r\n", length);
+    log_important("\r\n\r\nFlash written\r\n");
+
+#if defined UPDI_SMALL
+    //each page was checked as it was written
+    if(verify){
+        log_important("\r\nVerify flash passed\r\n");
+    }
+#else
+    uint8_t *data = updi->flash_data_write;
+
+    if(verify){            
+        //only what was written, keep_boot left the boot and application data sections out and erased the rest of the application section
+        uint32_t end = (updi->keep_boot || length > app_end) ? app_end : length;
+
+        log_important("\r\nREADING FLASH\r\n");
+
+        if(end > app_start && !read_flash(serial, device, device.flash_start + app_start, end - app_start, updi->flash_data_read + app_start, NULL, NULL)){
+            log_str("Read flash failed\r\n");
+            return false;
+        }
+
+        log_important("\r\nVERIFYING FLASH\r\n");
+
+        bool fail = false;
+        for(uint32_t i = app_start; i < end; i++){
+            if(data[i] != updi->flash_data_read[i]){
+                fail = true;                    
+                log_str("MEM MISMATCH at addr: %d, should be: %d, received: %d\r\n", i + device.flash_start, data[i], updi->flash_data_read[i]);
+            }
+        }
+
+        if(fail){
+            log_error("\r\nVerify flash failed, program may or may not be ok\r\n");
+            return false;
+        }else{
+            log_important("\r\nVerify flash passed\r\n");                
+        }
+    } 
+#endif
+
+    return true;
+}
+
+/*
+Apply count edits to flash without a chip erase, for per-unit data such as serial numbers, MAC addresses or calibration at fixed offsets.
+Each page the edits touch is read once, patched and written back once (flash_erase_write_page()), pages the edits leave as they were are
+not written at all. Edits can come in any order, cross page boundaries and overlap, the later one wins. With verify each written page is
+read back, patches of a page that doesnt check out are not retried. The pages are built in flash_data_write (UPDI_SMALL: the arena)
+*/
+bool updi_patch_flash(UPDI *updi, const UPDIPatch *patches, uint8_t count, bool verify){
+    Device device = updi->device;
+    uint32_t next = 0;
+
+    if(!session_check(updi)) return false;
+
+    log_important("\r\nPATCHING FLASH\r\n");
+
+#if defined UPDI_SMALL
+    if(updi->arena == NULL){
+        log_error("Set updi->arena to patch flash\r\n");
+        return false;
+    }
+#endif
+
+    for(uint8_t i = 0; i < count; i++){
+        if(patches[i].size == 0 || patches[i].offset >= device.flash_size || patches[i].size > device.flash_size - patches[i].offset){
+            log_error("Patch %d is empty or outside flash\r\n", i);
+            return false;
+        }
+    }
+
+    updi->stats.patch_pages = 0;
+
+    //pages in address order, each the lowest one from next that an edit lands in
+    while(true){
+        uint32_t page = UINT32_MAX;
+
+        for(uint8_t i = 0; i < count; i++){
+            uint32_t first = patches[i].offset;
+            uint32_t last = first + patches[i].size - 1;
+            if(last < next) continue;
+
+            uint32_t start = (first > next) ? first : next;
+            start -= start % device.flash_pagesize;
+            if(start < page) page = start;
+        }
+
+        if(page == UINT32_MAX) break;
+
+        if(!patch_page(updi, patches, count, page, verify)){
+            log_error("Patching flash failed at %d\r\n", (int)(device.flash_start + page));
+            return false;
+        }
+
+        next = page + device.flash_pagesize;
+    }
+
+    log_important("\r\nFlash patched, %d pages written\r\n", updi->stats.patch_pages);
+
+    return true;
+}
+
+/*
+Write updi->userrow_write to the USERROW, through the NVM controller in progmode or through the USERROW write key when the session was opened on a
+locked device. The locked path leaves flash and its lock bits alone, so per-unit data can go onto a locked board without erasing it
+*/
+bool updi_write_userrow(UPDI *updi){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+
+    if(!updi->session_open){
+        log_error("No session open, call updi_open() first\r\n");
+        return false;
+    }
+
+    if(updi->attached){
+        log_error("Attached without progmode, only updi_watch() can run\r\n");
+        return false;
+    }
+
+    log_important("\r\nWRITING USERROW\r\n");
+
+    bool ok = updi->locked ? write_userrow_locked(serial, device, updi->userrow_write) : write_userrow(serial, device, updi->userrow_write);
+
+    if(!ok){
+        log_error("Write USERROW failed\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Sample the data space addresses in watch over and over until it says stop, in an updi_attach() session while the application runs or in an
+updi_open() one. Addresses next to each other are read in one st_ptr + repeat + ld_ptr_inc burst, each burst is a single round trip with
+response signatures off for the ST ptr. Gaps are never read across, reading an I/O register can clear its flags. A lost byte costs that sample
+and a resync without reset. The rate achieved is logged and left in watch
+*/
+bool updi_watch(UPDI *updi, UPDIWatch *watch){
+    Serial *serial = &(updi->serial);
+    WatchBurst bursts[UPDI_WATCH_MAX_BURSTS];
+    uint8_t slot[UPDI_WATCH_MAX_ADDRESSES];
+    uint8_t data[UPDI_WATCH_MAX_ADDRESSES];
+    UPDIWatchSample sample;
+    uint8_t failures = 0;
+    bool ok = true;
+
+    watch->samples = 0;
+    watch->elapsed_us = 0;
+    watch->rate_hz = 0;
+
+    if(!updi->session_open || updi->locked){
+        log_error("No session open, call updi_attach() or updi_open() first\r\n");
+        return false;
+    }
+
+    if(watch->max_samples == 0 && watch->duration_ms == 0 && watch->func == NULL){
+        log_error("Watch needs max_samples, duration_ms or func to stop\r\n");
+        return false;
+    }
+
+    if(watch->ring != NULL && watch->ring_size == 0){
+        log_error("Watch ring_size is 0\r\n");
+        return false;
+    }
+
+    if(!watch_plan(watch, bursts, slot)){
+        return false;
+    }
+
+    log_important("\r\nWATCHING %d ADDRESSES IN %d BURSTS\r\n", watch->count, watch->bursts);
+
+    uint8_t ctrla_ackon = 1 << UPDI_CTRLA_IBDLY_BIT;
+    uint8_t ctrla_ackoff = ctrla_ackon | (1 << UPDI_CTRLA_RSD_BIT);
+
+    stcs(serial, UPDI_CS_CTRLA, ctrla_ackoff);
+
+    uint64_t start = micros();
+    uint64_t end = deadline((uint32_t)watch->duration_ms * 1000);
+
+    while(watch->max_samples == 0 || watch->samples < watch->max_samples){
+        if(watch->duration_ms != 0 && deadline_passed(end)) break;
+
+        uint64_t sample_start = micros();
+
+        if(!watch_read(serial, bursts, watch->bursts, data)){
+            uint64_t recover_start = micros();
+
+            log_important("\r\nLink lost, resyncing\r\n");
+
+            if(++failures > UPDI_MAX_RECOVERIES || !link_up(serial)){
+                log_error("Resync failed\r\n");
+                updi->stats.failed_recoveries++;
+                ok = false;
+                break;
+            }
+
+            stcs(serial, UPDI_CS_CTRLA, ctrla_ackoff);
+            updi->stats.recoveries++;
+            updi->stats.recovery_us += (uint32_t)(micros() - recover_start);
+            continue;
+        }
+
+        failures = 0;
+
+        uint64_t sample_end = micros();
+
+        sample.time_us = sample_start + (sample_end - sample_start) / 2;
+        sample.index = watch->samples;
+        for(uint8_t i = 0; i < watch->count; i++) sample.values[i] = data[slot[i]];
+
+        if(watch->ring != NULL) watch->ring[watch->samples % watch->ring_size] = sample;
+        watch->samples++;
+
+        if(watch->func != NULL && !watch->func(watch->ctx, &sample)) break;
+    }
+
+    watch->elapsed_us = (uint32_t)(micros() - start);
+    if(watch->elapsed_us > 0) watch->rate_hz = (uint32_t)((uint64_t)watch->samples * 1000000 / watch->elapsed_us);
+
+    stcs(serial, UPDI_CS_CTRLA, ctrla_ackon);
+
+    log_important("%d samples in %d ms, %d per second\r\n", (int)watch->samples, (int)(watch->elapsed_us / 1000), (int)watch->rate_hz);
+
+    return ok;
+}
+
+/*
+Read up to UPDI_MAX_READ_RANGES ranges of data space in one plan, see read_ranges(): sorted, merged where reading through a gap is cheaper than
+another round trip, a round trip per burst of up to UPDI_MAX_REPEAT_SIZE + 1 bytes. Runs in updi_attach() sessions too
+*/
+bool updi_read_ranges(UPDI *updi, UPDIReadRange *ranges, uint8_t count){
+    if(!updi->session_open || updi->locked){
+        log_error("No session open, call updi_attach() or updi_open() first\r\n");
+        return false;
+    }
+
+    if(!read_ranges(&(updi->serial), ranges, count, NULL)){
+        log_error("Read ranges failed\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+Signature, serial number, fuses and USERROW in one read plan for traceability records, two round trips on tinyAVR / megaAVR 0 where SIGROW is
+far from the rest and one on AVR Dx at the default UPDI_ROUND_TRIP_US and 115200 baud. In an updi_attach() session the part has to have been
+given to updi_init()
+*/
+bool updi_snapshot(UPDI *updi, UPDISnapshot *snapshot){
+    Device device = updi->device;
+    bool v2 = (device.nvm_version == UPDI_NVM_V2);
+
+    if(!updi->session_open || updi->locked){
+        log_error("No session open, call updi_attach() or updi_open() first\r\n");
+        return false;
+    }
+
+    if(device.num_fuses == 0){
+        log_error("Device not known, pass its device id to updi_init()\r\n");
+        return false;
+    }
+
+    log_important("\r\nREADING SNAPSHOT\r\n");
+
+    memset(snapshot, 0, sizeof(UPDISnapshot));
+    snapshot->serial_size = v2 ? UPDI_SIGROW_SERNUM_V2_SIZE : UPDI_SIGROW_SERNUM_V0_SIZE;
+    snapshot->num_fuses = device.num_fuses;
+    snapshot->userrow_size = device.userrow_size;
+
+    UPDIReadRange ranges[4] = {
+        {device.sigrow_address, 3, snapshot->signature},
+        {device.sigrow_address + (v2 ? UPDI_SIGROW_SERNUM_V2 : UPDI_SIGROW_SERNUM_V0), snapshot->serial_size, snapshot->serial},
+        {device.fuses_address, device.num_fuses, snapshot->fuses},
+        {device.userrow_address, device.userrow_size, snapshot->userrow},
+    };
+
+    if(!read_ranges(&(updi->serial), ranges, 4, &(snapshot->round_trips))){
+        log_error("Snapshot read failed\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//tidy up
+void updi_cleanup(UPDI *updi){
+    image_finish(&(updi->image), NULL);
+    serial_close(&(updi->serial));
+    log_flush();
+    return;
+}
+
+static bool session_check(UPDI *updi){
+    if(!updi->session_open){
+        log_error("No session open, call updi_open() first\r\n");
+        return false;
+    }
+
+    if(updi->locked){
+        log_error("Device is locked, only the USERROW can be written\r\n");
+        return false;
+    }
+
+    if(updi->attached){
+        log_error("Attached without progmode, only updi_watch() can run\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void send_handshake(Serial *serial){
+    trace_begin("handshake");
+    serial_send_break(serial, UPDI_BREAK_US, 1);
+    trace_end();
+
+    return;
+}
+
+//Handshake and check UPDI answers, resetting it with a double break if it doesnt
+static bool link_up(Serial *serial){
+    send_handshake(serial);
+    init(serial);
+    if(check(serial)){
+        log_str("UPDI INITIALISED\r\n");
+        return true;
+    }
+
+    log_str("UPDI not initialised\r\n");
+
+    uint64_t recover_start = micros();
+
+    if(!send_double_break(serial)){
+        log_error("Double break UPDI reset failed\r\n");
+        return false;
+    }
+    init(serial);
+    if(!check(serial)){
+        log_error("Cannot initialise UPDI, aborting.\r\n");
+        return false;
+    }
+
+    log_str("UPDI INITIALISED, recovered in %d us\r\n", (int)(micros() - recover_start));
+    (void)recover_start;        //only logged, unused when LOG_LEVEL strips log_str
+
+    return true;
+}
+
+//Get the link back after a lost ACK or sync in the middle of an operation: break, re-init and back into progmode only if that was lost too,
+//nothing is erased. Counted in updi->stats either way
+static bool resync(UPDI *updi, uint32_t address){
+    Serial *serial = &(updi->serial);
+    uint64_t start = micros();
+
+    log_important("\r\nLink lost, resyncing\r\n");
+
+    if(!link_up(serial) || (!in_prog_mode(serial) && !enter_progmode(serial)) || !clear_nvm_error(serial, updi->device)){
+        log_error("Resync failed\r\n");
+        updi->stats.failed_recoveries++;
+        return false;
+    }
+
+    uint32_t elapsed = (uint32_t)(micros() - start);
+
+    updi->stats.recoveries++;
+    updi->stats.recovery_us += elapsed;
+    updi->stats.last_recovery_address = address;
+
+    log_important("Resynced in %d us, resuming at address %d\r\n", (int)elapsed, (int)address);
+
+    return true;
+}
+
+static void init(Serial *serial){
+    stcs(serial, UPDI_CS_CTRLB, 1 << UPDI_CTRLB_CCDETDIS_BIT);
+    stcs(serial, UPDI_CS_CTRLA, 1 << UPDI_CTRLA_IBDLY_BIT);
+
+    return;
+}
+
+static bool check(Serial *serial){
+    if(ldcs(serial, UPDI_CS_STATUSA) != 0){
+        return true;
+    }else{
+        return false;
+    }
+}
+
+//Two long breaks on the open port, resets UPDI whatever state it is in without reopening or reconfiguring anything
+static bool send_double_break(Serial *serial){
+    log_str("Sending dbl break\r\n");
+
+    trace_begin("double break");
+    bool sent = serial_send_break(serial, UPDI_DOUBLE_BREAK_US, 2);
+    trace_end();
+
+    if(!sent){
+        log_str("couldnt send dbl break\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool in_prog_mode(Serial *serial){
+    if(ldcs(serial, UPDI_ASI_SYS_STATUS) & (1 << UPDI_ASI_SYS_STATUS_NVMPROG)){
+        return true;
+    }else{
+        return false;
+    }
+}
+
+static bool enter_progmode(Serial *serial){
+    //Enter NVMProg key
+    if(!in_prog_mode(serial)){
+        if(!progmode_key(serial)){
+            return false;
+        }
+    }
+
+    //Toggle reset
+    toggle_reset(serial);
+
+    //Wait for unlock
+    if(!wait_unlocked(serial, 100)){
+        log_str("FAILED TO ENTER NVM PROGRAMMING MODE, DEVICE IS LOCKED\r\n");        
+        return false;
+    }
+
+    //Check for NVMPROG flag
+    if(!in_prog_mode(serial)){
+        log_str("STILL NOT IN PROG MODE\r\n");        
+        return false;
+    }
+
+    return true;
+}
+
+//Disables UPDI which releases any keys enabled
+static void leave_progmode(Serial *serial){
+    log_str("leaving progmode...\r\n");    
+    toggle_reset(serial);
+
+    stcs(serial, UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
+
+    return;
+}
+
+static void apply_reset(Serial *serial, bool reset){
+    if(reset){
+        log_str("Applying reset\r\n");        
+        stcs(serial, UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_VALUE);
+    }else{
+        log_str("Releasing reset\r\n");        
+        stcs(serial, UPDI_ASI_RESET_REQ, 0x00);
+    }    
+}
+
+//Reset pulse, which is when any key just entered takes effect
+static void toggle_reset(Serial *serial){
+    trace_begin("reset");
+    apply_reset(serial, true);
+    apply_reset(serial, false);
+    trace_end();
+
+    return;
+}
+
+//Unlock and erase
+static bool unlock_device(Serial *serial){
+    log_str("UNLOCKING AND ERASING\r\n");
+    
+    //enter key
+    key(serial, UPDI_KEY_64, (uint8_t*)UPDI_KEY_CHIPERASE);
+
+    //check key status
+    uint8_t key_status = ldcs(serial, UPDI_ASI_KEY_STATUS);
+
+    if(!(key_status & (1 << UPDI_ASI_KEY_STATUS_CHIPERASE))){
+        log_str("Unlock error: key not accepted\r\n");        
+        return false;
+    }
+
+    //Insert NVMProg key as well
+    //In case of CRC being enabled, the device must be left in programming mode after the erase
+    //to allow the CRC to be disabled (or flash reprogrammed)
+    progmode_key(serial);
+
+    //Toggle reset
+    toggle_reset(serial);
+
+    //wait for unlock
+    if(!wait_unlocked(serial, 100)){
+        log_str("Failed to chip erase using key\r\n");        
+        return false;
+    }
+
+    log_str("UNLOCKED DEVICE\r\n");
+
+    return true;
+}
+
+//Get device info
+static void get_device_info(Serial *serial, Device device, DeviceInfo *info){
+    uint8_t buf[2] = {UPDI_PHY_SYNC, UPDI_KEY | UPDI_KEY_SIB | UPDI_SIB_16BYTES};
+    uint8_t recv[16];
+
+    if(!serial_send_receive(serial, buf, 2, recv, 16)){
+        log_str("SIB recv error");        
+    }else{
         for(uint8_t i = 0; i < 7; i++) info->family[i] = recv[i];
         for(uint8_t i = 8; i < 11; i++) info->nvm_version[i - 8] = recv[i];
         for(uint8_t i = 11; i < 14; i++) info->ocd_version[i - 11] = recv[i];
         info->dbg_osc_freq = recv[15];
     }
-    
-    info->pdi_rev = ldcs(serial, UPDI_CS_STATUSA) >> 4;
+    
+    info->pdi_rev = ldcs(serial, UPDI_CS_STATUSA) >> 4;
+
+    if(in_prog_mode(serial)){
+        uint8_t dev_id[3] = {0, 0, 0};
+        uint8_t dev_rev = 0;
+        UPDIReadRange ranges[2] = {{device.sigrow_address, 3, dev_id}, {device.syscfg_address, 1, &dev_rev}};
+        read_ranges(serial, ranges, 2, NULL);
+
+        //Add 65 to dev_rev so that 0 = A, 1 = B etc
+        for(int i = 0; i < 3; i++) info->dev_id[i] = dev_id[i];
+        info->dev_rev = dev_rev + 65;
+    }
+    
+    return;
+}
+
+/*
+With dev UPDI_DEVICE_AUTO look the signature up in the registry and load that part's geometry into updi->device, otherwise check the signature
+matches the part passed to updi_init(). The SIB and signature are read by get_device_info() so GET_INFO costs nothing extra.
+updi->dev is set to the part found, so further updi_process() calls on the same UPDI skip the detection
+*/
+static bool identify_device(Serial *serial, UPDI *updi){
+    DeviceInfo *info = &(updi->info);
+    const DeviceEntry *entry;
+    bool auto_detect = (updi->dev == UPDI_DEVICE_AUTO);
+    UPDIReadRange signature = {updi->device.sigrow_address, 3, info->dev_id};
+
+    if(auto_detect || (updi->args & UPDI_PROCESS_GET_INFO)){
+        get_device_info(serial, updi->device, info);
+    }else if(!read_ranges(serial, &signature, 1, NULL)){
+        log_error("Couldnt read device signature\r\n");
+        return false;
+    }
+
+    entry = find_device_signature(info->dev_id);
+    if(entry == NULL){
+        log_error("Unknown device signature %d %d %d\r\n", info->dev_id[0], info->dev_id[1], info->dev_id[2]);
+        return false;
+    }
+
+    if(!auto_detect){
+        if(entry->dev != updi->dev){
+            log_error("Device signature doesnt match, connected part is not the one passed to updi_init()\r\n");
+            return false;
+        }
+        return true;
+    }
+
+    //the SIB names the NVM controller version, a mismatch means the signature read was bad
+    if(info->nvm_version[2] != '0' + entry->family->nvm_version){
+        log_error("Device signature doesnt match the NVM version in the SIB\r\n");
+        return false;
+    }
+
+    load_device(entry, &(updi->device));
+    updi->dev = entry->dev;
+    log_str("Detected device %d\r\n", entry->dev);
+
+    return true;
+}
+
+static const DeviceEntry *find_device(uint8_t dev){
+    for(uint8_t i = 0; i < NUM_DEVICES; i++){
+        if(devices[i].dev == dev) return &(devices[i]);
+    }
+
+    return NULL;
+}
+
+static const DeviceEntry *find_device_signature(uint8_t *signature){
+    for(uint8_t i = 0; i < NUM_DEVICES; i++){
+        if(memcmp(devices[i].signature, signature, 3) == 0) return &(devices[i]);
+    }
+
+    return NULL;
+}
+
+//Fill a Device from its registry entry, returns false if there isnt one
+static bool load_device(const DeviceEntry *entry, Device *device){
+    if(entry == NULL) return false;
+
+    device->flash_start =       entry->family->flash_start;
+    device->flash_size =        entry->flash_size;
+    device->flash_pagesize =    entry->flash_pagesize;
+    device->syscfg_address =    entry->family->syscfg_address;
+    device->nvmctrl_address =   entry->family->nvmctrl_address;
+    device->sigrow_address =    entry->family->sigrow_address;
+    device->fuses_address =     entry->family->fuses_address;
+    device->userrow_address =   entry->family->userrow_address;
+    device->userrow_size =      entry->family->userrow_size;
+    device->num_fuses =         entry->family->num_fuses;
+    device->nvm_version =       entry->family->nvm_version;
+    device->name =              entry->name;
+    memcpy(device->signature, entry->signature, 3);
+
+    return true;
+}
+
+//Does a chip erase using the NVM controller Note that on locked devices this it not possible and the ERASE KEY has to be used instead
+static bool chip_erase(Serial *serial, Device device){
+    log_str("ERASING CHIP...\r\n");
+
+    //Wait until NVM CTRL is ready to erase
+    if(!wait_flash_ready(serial, device)){
+        log_str("in chip_erase() error: timeout waiting for flash ready before erase\r\n");
+        return false;
+    }
+
+    //Erase
+    if(!execute_nvm_command(serial, device, (device.nvm_version == UPDI_NVM_V2) ? UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE : UPDI_NVMCTRL_CTRLA_CHIP_ERASE)){
+        log_str("in chip_erase() error: execute_nvm_command() failed()\r\n");
+        return false;
+    }
+
+    //Wait to finish
+    if(!wait_flash_ready(serial, device)){
+        log_str("in chip_erase() error: timeout waiting for flash ready after erase\r\n");
+        return false;
+    }
+
+    //NVMv2 commands stay set until cleared
+    if(device.nvm_version == UPDI_NVM_V2 && !execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD)){
+        log_str("in chip_erase() error: execute_nvm_command() failed clearing command\r\n");
+        return false;
+    }
+
+    log_str("ERASED\r\n");
+
+    return true;
+}
+
+//Erases count flash pages from address, stopping at the end of flash. A write anywhere in a page selects it for the page erase
+static bool erase_pages(Serial *serial, Device device, uint32_t address, uint32_t count){
+    uint8_t blank = 0xFF;
+
+    if(!wait_flash_ready(serial, device)){
+        log_str("in erase_pages() error: cant wait flash ready\r\n");
+        return false;
+    }
+
+    //NVMv2 keeps FLASH_PAGE_ERASE set and erases the page of each write, it has to start from NOCMD
+    if(device.nvm_version == UPDI_NVM_V2){
+        if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD) || !execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE)){
+            log_str("in erase_pages() error: execute nvm command\r\n");
+            return false;
+        }
+    }
+
+    for(uint32_t i = 0; i < count && address < device.flash_start + device.flash_size; i++, address += device.flash_pagesize){
+        if(!write_data(serial, address, &blank, 1)){
+            log_str("in erase_pages() error: write data fail\r\n");
+            return false;
+        }
+
+        if(device.nvm_version != UPDI_NVM_V2 && !execute_nvm_command(serial, device, UPDI_NVMCTRL_CTRLA_ERASE_PAGE)){
+            log_str("in erase_pages() error: execute nvm command\r\n");
+            return false;
+        }
+
+        if(!wait_flash_ready(serial, device)){
+            log_str("in erase_pages() error: cant wait flash ready after erase\r\n");
+            return false;
+        }
+    }
+
+    if(device.nvm_version == UPDI_NVM_V2 && !execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD)){
+        log_str("in erase_pages() error: execute nvm command\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//Reads a number of bytes of data from UPDI
+static bool read_data(Serial *serial, uint32_t address, uint16_t size, uint8_t *ret){
+    //Range check
+    if(size > UPDI_MAX_REPEAT_SIZE + 1){
+        log_str("read_data error: cant read that many bytes at once\r\n");
+        return false;
+    }
+
+    //Store address pointer
+    st_ptr(serial, address);
+
+    //Set repeat
+    if(size > 1){
+        repeat(serial, size);
+    }
+
+    if(!ld_ptr_inc(serial, ret, size)){
+        log_str("in read_data(): ld_ptr_inc error\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//Reads a number of words of data from UPDI
+static bool read_data_words(Serial *serial, uint32_t address, uint16_t numwords, uint8_t *buffer){
+    //Range check
+    if(numwords > (UPDI_MAX_REPEAT_SIZE >> 1) + 1){
+        log_str("in read_data_words() error: cant write that many words in a go\r\n");
+        return false;
+    }
+
+    //store address
+    if(!st_ptr(serial, address)){
+        log_str("in read_data_words() error: st_ptr()\r\n");
+        return false;
+    }
+
+    //set up repeat
+    if(numwords > 1){
+        repeat(serial, numwords);
+    }
+
+    if(!ld_ptr_inc16(serial, buffer, numwords)){
+        log_str("in read_data_words() error: ld_ptr_inc16()\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//Read flash, each chunk is received straight into buffer. Chunks are a page, or as many words as one repeat allows for bigger pages.
+//With a sink every chunk goes to the start of buffer instead and is handed to sink, so buffer only needs to hold one chunk (UPDI_MAX_PAGESIZE)
+static bool read_flash(Serial *serial, Device device, uint32_t address, uint32_t size, uint8_t *buffer, UPDIPageFunc sink, void *ctx){
+    if(!in_prog_mode(serial)){
+        log_str("in read_flash() error: not in prog mode\r\n");
+        return false;
+    }
+
+    uint32_t i;
+    uint16_t numwords = device.flash_pagesize; //max read size
+    if(numwords > (UPDI_MAX_REPEAT_SIZE >> 1) + 1) numwords = (UPDI_MAX_REPEAT_SIZE >> 1) + 1;
+
+    uint16_t chunk = numwords * 2;
+    uint8_t p_cnt = 10;
+    uint32_t chunks = (size % chunk != 0) ? (size / chunk) + 1 : size / chunk;
+
+    for(i = 0; i < size / chunk; i++){
+        uint8_t *dest = (sink != NULL) ? buffer : buffer + i * chunk;
+
+        if(!read_data_words(serial, address + i * chunk, numwords, dest)){
+            log_str("in read_flash() error: read_data_words()\r\n");
+            return false;
+        }
+
+        if(sink != NULL && !sink(ctx, address + i * chunk - device.flash_start, dest, chunk)){
+            return false;
+        }
+
+        if(100 * i / chunks > p_cnt){
+            log_important("%d percent done\r\n", p_cnt);
+            p_cnt += 10;
+        }
+
+    }
+
+    if(size % chunk != 0){ 
+        uint8_t *dest = (sink != NULL) ? buffer : buffer + i * chunk;
+
+        if(!read_data(serial, address + i * chunk, size % chunk, dest)){
+            log_str("in read_flash() error: read_data()\r\n");
+            return false;
+        }
+
+        if(sink != NULL && !sink(ctx, address + i * chunk - device.flash_start, dest, size % chunk)){
+            return false;
+        }
+    }
+
+    log_important("100 percent done\r\n");
+
+    return true;
+}
+
+/*
+Read every range in one plan. Sorted by address, ranges that overlap or lie closer together than the bytes a round trip is worth at the baud
+rate (UPDI_ROUND_TRIP_US, 12 bit 8E2 characters) make up one span read straight through, gaps and all, and each span goes in bursts of at
+most UPDI_MAX_REPEAT_SIZE + 1 bytes. Only the first burst of a span sets the pointer, the rest carry on from where ld_ptr_inc left it.
+Response signatures are off throughout so every burst is one write and one read, round_trips (if not NULL) gets how many there were, up to 255.
+Turning them off goes out with the first burst, turning them back on is the only write of its own
+*/
+static bool read_ranges(Serial *serial, UPDIReadRange *ranges, uint8_t count, uint8_t *round_trips){
+    uint8_t order[UPDI_MAX_READ_RANGES];
+    uint8_t chunk[UPDI_MAX_REPEAT_SIZE + 1];
+    uint32_t max_gap = (uint32_t)((uint64_t)UPDI_ROUND_TRIP_US * serial->baudrate / 12 / 1000000);
+    uint32_t trips = 0;
+    bool acks_off = false;
+    bool ok = true;
+
+    if(count > UPDI_MAX_READ_RANGES){
+        log_str("in read_ranges() error: too many ranges\r\n");
+        return false;
+    }
+
+    //insertion sort of the range indices by address
+    for(uint8_t i = 0; i < count; i++){
+        uint8_t j = i;
+        while(j > 0 && ranges[order[j - 1]].address > ranges[i].address){
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    uint8_t i = 0;
+    while(i < count && ok){
+        uint8_t first = i;
+        uint32_t start = ranges[order[i]].address;
+        uint32_t end = start + ranges[order[i]].size;
+
+        for(i++; i < count && ranges[order[i]].address <= end + max_gap; i++){
+            uint32_t range_end = ranges[order[i]].address + ranges[order[i]].size;
+            if(range_end > end) end = range_end;
+        }
+
+        for(uint32_t address = start; address < end; address += sizeof(chunk)){
+            uint16_t size = (end - address < sizeof(chunk)) ? (uint16_t)(end - address) : sizeof(chunk);
+
+            //a burst that fails may still have turned them off
+            bool ackoff = !acks_off;
+            acks_off = true;
+
+            if(!read_burst(serial, address, address == start, size, chunk, ackoff)){
+                ok = false;
+                break;
+            }
+            trips++;
+
+            //each range in the span takes its part of the burst
+            for(uint8_t r = first; r < i; r++){
+                UPDIReadRange *range = &(ranges[order[r]]);
+                uint32_t lo = (range->address > address) ? range->address : address;
+                uint32_t hi = (range->address + range->size < address + size) ? range->address + range->size : address + size;
+
+                if(lo < hi) memcpy(range->data + (lo - range->address), chunk + (lo - address), hi - lo);
+            }
+        }
+    }
+
+    if(acks_off) stcs(serial, UPDI_CS_CTRLA, 1 << UPDI_CTRLA_IBDLY_BIT);
+
+    if(round_trips != NULL) *round_trips = (trips > UINT8_MAX) ? UINT8_MAX : (uint8_t)trips;
+
+    return ok;
+}
+
+//One burst of read_ranges(): pointer (unless carrying on), repeat and ld_ptr_inc in one write, the data in one read. ackoff turns response
+//signatures off first, they have to be off by the time the ST ptr runs
+static bool read_burst(Serial *serial, uint32_t address, bool set_ptr, uint16_t size, uint8_t *buffer, bool ackoff){
+    uint8_t off[3] = {UPDI_PHY_SYNC, UPDI_STCS | UPDI_CS_CTRLA, (1 << UPDI_CTRLA_IBDLY_BIT) | (1 << UPDI_CTRLA_RSD_BIT)};
+    uint8_t cmd[12];
+    uint8_t len = burst_command(cmd, address, set_ptr, size);
+
+    SerialIov tx[2] = {{off, 3}, {cmd, len}};
+    SerialIov rx[2] = {{NULL, (ackoff ? 3 : 0) + len}, {buffer, size}};
+
+    if(!serial_transfer(serial, ackoff ? tx : tx + 1, ackoff ? 2 : 1, rx, 2)){
+        log_str("in read_burst() error: no data\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//[ST ptr address] [REPEAT size - 1] LD *ptr++ for size bytes (up to UPDI_MAX_REPEAT_SIZE + 1), into cmd (12 bytes). Returns its length
+static uint8_t burst_command(uint8_t *cmd, uint32_t address, bool set_ptr, uint16_t size){
+    uint8_t len = 0;
+
+    if(set_ptr){
+        uint8_t ptr_len = address_bytes(cmd + 2, address);
+        cmd[len++] = UPDI_PHY_SYNC;
+        cmd[len++] = UPDI_ST | UPDI_PTR_ADDRESS | ((ptr_len == 3) ? UPDI_DATA_24 : UPDI_DATA_16);
+        len += ptr_len;
+    }
+
+    if(size > 1){
+        cmd[len++] = UPDI_PHY_SYNC;
+        cmd[len++] = UPDI_REPEAT | UPDI_REPEAT_BYTE;
+        cmd[len++] = (uint8_t)(size - 1);
+    }
+
+    cmd[len++] = UPDI_PHY_SYNC;
+    cmd[len++] = UPDI_LD | UPDI_PTR_INC | UPDI_DATA_8;
+
+    return len;
+}
+
+/*
+Sort and merge the watched addresses into bursts of consecutive ones, each no longer than one repeat allows, and build their instructions.
+slot[i] is where the byte for watch->addresses[i] lands in the data watch_read() fills
+*/
+static bool watch_plan(UPDIWatch *watch, WatchBurst *bursts, uint8_t *slot){
+    uint32_t sorted[UPDI_WATCH_MAX_ADDRESSES];
+    uint8_t unique = 0;
+
+    if(watch->count == 0 || watch->count > UPDI_WATCH_MAX_ADDRESSES){
+        log_error("Watch needs 1 to %d addresses\r\n", UPDI_WATCH_MAX_ADDRESSES);
+        return false;
+    }
+
+    //insertion sort, dropping repeats
+    for(uint8_t i = 0; i < watch->count; i++){
+        uint32_t address = watch->addresses[i];
+        uint8_t j = unique;
+
+        while(j > 0 && sorted[j - 1] > address) j--;
+        if(j > 0 && sorted[j - 1] == address) continue;
+
+        memmove(sorted + j + 1, sorted + j, (unique - j) * sizeof(uint32_t));
+        sorted[j] = address;
+        unique++;
+    }
+
+    uint8_t n = 0;
+
+    for(uint8_t i = 0; i < unique; i++){
+        if(n > 0 && sorted[i] == bursts[n - 1].address + bursts[n - 1].size && bursts[n - 1].size < UPDI_MAX_REPEAT_SIZE + 1){
+            bursts[n - 1].size++;
+            continue;
+        }
+
+        if(n == UPDI_WATCH_MAX_BURSTS){
+            log_error("Watched addresses need more than %d bursts\r\n", UPDI_WATCH_MAX_BURSTS);
+            return false;
+        }
+
+        bursts[n].address = sorted[i];
+        bursts[n].size = 1;
+        bursts[n].offset = i;
+        n++;
+    }
+
+    for(uint8_t b = 0; b < n; b++){
+        bursts[b].cmd_len = burst_command(bursts[b].cmd, bursts[b].address, true, bursts[b].size);
+    }
+
+    //sorted[] and the burst offsets both count unique addresses, so an address' index in sorted[] is its slot
+    for(uint8_t i = 0; i < watch->count; i++){
+        uint8_t j = 0;
+        while(sorted[j] != watch->addresses[i]) j++;
+        slot[i] = j;
+    }
+
+    watch->bursts = n;
+
+    return true;
+}
+
+//One sample, a round trip per burst. Response signatures have to be off or the ST ptr ACK would collide with the rest of the burst
+static bool watch_read(Serial *serial, WatchBurst *bursts, uint8_t count, uint8_t *data){
+    for(uint8_t b = 0; b < count; b++){
+        SerialIov tx[1] = {{bursts[b].cmd, bursts[b].cmd_len}};
+        SerialIov rx[2] = {{NULL, bursts[b].cmd_len}, {data + bursts[b].offset, bursts[b].size}};
+
+        if(!serial_transfer(serial, tx, 1, rx, 2)){
+            log_str("in watch_read() error: no data\r\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//Writes a number of bytes to memory
+static bool write_data(Serial *serial, uint32_t address, uint8_t *data, uint16_t len){
+    if(len == 1){
+        if(!st(serial, address, data[0])){
+            log_str("in write_data() error: st ret false\r\n");
+            return false;
+        }
+    }else if(len == 2){
+        if(!st(serial, address, data[0])){
+            log_str("in write_data() error: st ret false\r\n");
+            return false;
+        }
+        if(!st(serial, address + 1, data[1])){
+            log_str("in write_data() error: st ret false\r\n");
+            return false;
+        }
+    }else{
+        //Range check
+        if(len > UPDI_MAX_REPEAT_SIZE + 1){
+            log_str("in write_data() error: invalid length\r\n");
+            return false;
+        }
+
+        //store address
+        if(!st_ptr(serial, address)){
+            log_str("in write_data() error: couldnt st_ptr(address)\r\n");
+            return false;
+        }
+
+        //set up repeat
+        repeat(serial, len);
+        if(!st_ptr_inc(serial, data, len)){
+            log_str("in write_data() error: couldnt st_ptr_inc() error\r\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//Writes a number of bytes to memory using word access, an odd last byte is written with 0xFF as its high byte
+static bool write_data_words(Serial *serial, uint32_t address, uint8_t *data, uint16_t len){
+    uint16_t numwords = (len + 1) >> 1;
+
+    if(numwords == 1){
+        uint16_t value = data[0] + (((len > 1) ? data[1] : 0xFF) << 8);
+        if(!st16(serial, address, value)){
+            log_str("in write_data_words error: st16() error\r\n");
+            return false;
+        }
+    }else{
+        //Range check
+        if(numwords > (UPDI_MAX_REPEAT_SIZE + 1)){
+            log_str("in write_data_words error: invalid length\r\n");
+            return false;
+        }
+
+        //Store address
+        if(!st_ptr(serial, address)){
+            log_str("in write_data_words error: st_ptr() error\r\n");
+            return false;
+        }
+
+        //Set up repeat
+        repeat(serial, numwords);
+        st_ptr_inc16(serial, data, len);
+    }
+
+    return true;
+}
+
+//Writes one fuse value
+static bool write_fuse(Serial *serial, Device device, uint8_t fuse, uint8_t value){
+    uint8_t data;
+
+    if(!in_prog_mode(serial)){
+        log_str("in write_fuse() error: not in prog mode\r\n");
+        return false;
+    }
+
+    if(!wait_flash_ready(serial, device)){
+        log_str("in write_fuse() error: cant wait flash ready\r\n");
+        return false;
+    }
+
+    //NVMv2 writes fuses like eeprom, straight to their address
+    if(device.nvm_version == UPDI_NVM_V2){
+        if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE)){
+            log_str("in write_fuse() error: execute nvm command\r\n");
+            return false;
+        }
+
+        if(!write_data(serial, device.fuses_address + fuse, &value, 1)){
+            log_str("in write_fuse() error: write data fail\r\n");
+            return false;
+        }
+
+        if(!wait_flash_ready(serial, device)){
+            log_str("in write_fuse() error: cant wait flash ready after write\r\n");
+            return false;
+        }
+
+        if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD)){
+            log_str("in write_fuse() error: execute nvm command\r\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    data = (device.fuses_address + fuse) & 0xff;
+    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_ADDRL, &data, 1)){
+        log_str("in write_fuse() error: write data fail\r\n");
+        return false;
+    }
+
+    data = (device.fuses_address + fuse) >> 8;
+    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_ADDRH, &data, 1)){
+        log_str("in write_fuse() error: write data fail\r\n");
+        return false;
+    }
+
+    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_DATAL, &value, 1)){
+        log_str("in write_fuse() error: write data fail\r\n");
+        return false;
+    }
+
+    data = UPDI_NVMCTRL_CTRLA_WRITE_FUSE;
+    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA, &data, 1)){
+        log_str("in write_fuse() error: write data fail\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+//Writes the whole USERROW in progmode, the row is loaded with ACKs off and committed with one erase/write
+static bool write_userrow(Serial *serial, Device device, uint8_t *data){
+    if(!in_prog_mode(serial)){
+        log_str("in write_userrow() error: not in prog mode\r\n");
+        return false;
+    }
+
+    //NVMv2 erase/writes the USERROW like eeprom, the row is committed once its last byte is in
+    if(device.nvm_version == UPDI_NVM_V2){
+        if(!wait_flash_ready(serial, device)){
+            log_str("in write_userrow() error: cant wait flash ready\r\n");
+            return false;
+        }
+
+        if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE)){
+            log_str("in write_userrow() error: execute nvm command\r\n");
+            return false;
+        }
+
+        if(!write_data_words(serial, device.userrow_address, data, device.userrow_size)){
+            log_str("in write_userrow() error: write_data_words() error\r\n");
+            return false;
+        }
+
+        if(!wait_flash_ready(serial, device)){
+            log_str("in write_userrow() error: cant wait flash ready after write\r\n");
+            return false;
+        }
+
+        if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD)){
+            log_str("in write_userrow() error: execute nvm command\r\n");
+            return false;
+        }
+
+        return true;
+    }
 
-    if(in_prog_mode(serial)){
-        uint8_t dev_id[3];
-        uint8_t dev_rev;
-        read_data(serial, device.sigrow_address, 3, dev_id);
-        read_data(serial, device.syscfg_address, 1, &dev_rev);
+    if(!write_nvm(serial, device, device.userrow_address, data, device.userrow_size, UPDI_NVMCTRL_CTRLA_ERASE_WRITE_PAGE, true)){
+        log_str("in write_userrow() error: write_nvm() error\r\n");
+        return false;
+    }
 
-        //Add 65 to dev_rev so that 0 = A, 1 = B etc
-        for(int i = 0; i < 3; i++) info->dev_id[i] = dev_id[i];
-        info->dev_rev = dev_rev + 65;
+    return true;
+}
+
+//Writes the whole USERROW of a locked device. The USERROW write key and a reset put it into user row programming, the row is written to its
+//usual address and UROWWRITE_FINAL commits it. Flash, EEPROM and the lock stay as they are
+static bool write_userrow_locked(Serial *serial, Device device, uint8_t *data){
+    key(serial, UPDI_KEY_64, (uint8_t*)UPDI_KEY_USERROW_WRITE);
+
+    uint8_t key_status = ldcs(serial, UPDI_ASI_KEY_STATUS);
+
+    if(!(key_status & (1 << UPDI_ASI_KEY_STATUS_UROWWRITE))){
+        log_str("in write_userrow_locked() error: key not accepted\r\n");
+        return false;
     }
-    
-    return;
+
+    toggle_reset(serial);
+
+    if(!wait_urow_prog(serial, 500, true)){
+        log_str("in write_userrow_locked() error: didnt enter user row programming\r\n");
+        return false;
+    }
+
+    if(!write_data_words(serial, device.userrow_address, data, device.userrow_size)){
+        log_str("in write_userrow_locked() error: write_data_words() error\r\n");
+        return false;
+    }
+
+    stcs(serial, UPDI_ASI_SYS_CTRLA, 1 << UPDI_ASI_SYS_CTRLA_UROWWRITE_FINAL);
+
+    bool ok = wait_urow_prog(serial, 500, false);
+    if(!ok){
+        log_str("in write_userrow_locked() error: user row write didnt finish\r\n");
+    }
+
+    //clear the key and reset out of user row programming either way
+    stcs(serial, UPDI_ASI_KEY_STATUS, 1 << UPDI_ASI_KEY_STATUS_UROWWRITE);
+    toggle_reset(serial);
+
+    return ok;
 }
 
-//Does a chip erase using the NVM controller Note that on locked devices this it not possible and the ERASE KEY has to be used instead
-static bool chip_erase(Serial *serial, Device device){
-    log_str("ERASING CHIP...\r\n");
+/*
+Program flash from updi->image as the parser hands over blocks. Each block is merged into its page's buffer (see image_page_buffer()) and a page is
+written once a block for a different page turns up. A page the file comes back to later is written again, programming only clears bits so what is
+already there stays. A file that turns out bad part way has the pages before that written.
+With UPDI_SMALL and verify each page is read back and compared as soon as it is written, otherwise updi_write_flash() verifies the whole image after.
+Only pages from app_start up to app_end are written, with keep_boot each one is erased along with its write and the pages of the application
+section the image leaves out are erased (boot_page())
+*/
+static bool write_image(UPDI *updi, bool verify, uint32_t app_start, uint32_t app_end, uint32_t *length){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+    ImageStream *image = &(updi->image);
+    ImageBlock *block;
+
+    uint32_t page = 0;
+    uint8_t *page_data = NULL;
+    uint16_t page_len = 0;      //nothing pending while 0
+    uint32_t prev = 0;
+    uint8_t *prev_data = NULL;  //NULL until the first page is written
+    uint32_t end = 0;           //end of the highest page started, a page below it is one the file has come back to
+    uint32_t reported = 0;
+    uint32_t skipped = 0;       //image bytes outside app_start to app_end
+    uint32_t erased = app_start;    //keep_boot: every application page below this has been erased or written
+    bool written;
+
+    StreamWrite stream;
+    stream.count = 0;
+    stream.page_us = updi->stream_page_us;
+    stream.acks_off = false;
+    stream.failed = false;
+#if defined UPDI_SMALL
+    stream.read_back = verify;      //the arena only holds the page just written, it is checked before the next one replaces it
+#else
+    stream.read_back = false;       //updi_write_flash() verifies the whole image once, after it is written
+#endif
+
+#if !defined UPDI_SMALL
+    memset(updi->flash_data_write, 0xFF, device.flash_size);
+#endif
+
+    if(!flash_write_begin(serial, device)){
+        image_finish(image, NULL);
+        return false;
+    }
 
-    //Wait until NVM CTRL is ready to erase
-    if(!wait_flash_ready(serial, device)){
-        log_str("in chip_erase() error: timeout waiting for flash ready before erase\r\n");
+    while((block = image_next(image)) != NULL){
+        uint32_t block_page = block->address / device.flash_pagesize * device.flash_pagesize;
+
+        if(block->address + block->len > device.flash_size){
+            log_error("Image data beyond end of flash\r\n");
+            image_finish(image, NULL);
+            return false;
+        }
+
+        if(block_page < app_start || block_page >= app_end){
+            skipped += block->len;
+            image_release(image);
+            continue;
+        }
+
+        if(page_len > 0 && block_page != page){
+            if(updi->keep_boot){
+                written = boot_page(updi, &erased, page, page_data, page_len, verify);
+            }else if(updi->stream_write){
+                written = stream_page(updi, &stream, page, page_data, page_len);
+            }else{
+                written = write_image_page(updi, page, page_data, page_len, (prev_data != NULL) ? prev : page, prev_data)
+                    && (!verify || verify_page(updi, page, page_data, page_len));
+            }
+
+            if(!written){
+                image_finish(image, NULL);
+                return false;
+            }
+
+            prev = page;
+            prev_data = page_data;
+            page_len = 0;
+
+            if(prev >= reported + UPDI_PROGRESS_BYTES){
+                reported = prev;
+                log_important("%d bytes written\r\n", reported);
+            }
+        }
+
+        if(page_len == 0){
+            page = block_page;
+
+            if(!image_page_buffer(updi, page, prev_data, page < end, &page_data)){
+                image_finish(image, NULL);
+                return false;
+            }
+
+            if(page + device.flash_pagesize > end) end = page + device.flash_pagesize;
+        }
+
+        uint16_t offset = block->address - page;
+        for(uint16_t i = 0; i < block->len; i++) page_data[offset + i] &= block->data[i];
+
+        if(offset + block->len > page_len) page_len = offset + block->len;
+
+        image_release(image);
+    }
+
+    if(!image_finish(image, length)){
+        log_error("Load image file failed\r\n");
         return false;
     }
 
-    //Erase
-    if(!execute_nvm_command(serial, device, UPDI_NVMCTRL_CTRLA_CHIP_ERASE)){
-        log_str("in chip_erase() error: execute_nvm_command() failed()\r\n");
+    if(page_len > 0){
+        if(updi->keep_boot){
+            written = boot_page(updi, &erased, page, page_data, page_len, verify);
+        }else if(updi->stream_write){
+            written = stream_page(updi, &stream, page, page_data, page_len);
+        }else{
+            written = write_image_page(updi, page, page_data, page_len, (prev_data != NULL) ? prev : page, prev_data)
+                && (!verify || verify_page(updi, page, page_data, page_len));
+        }
+
+        if(!written){
+            return false;
+        }
+    }
+
+    if(updi->keep_boot && !erase_app_pages(updi, &erased, app_end, verify)){
+        return false;
+    }
+
+    if(updi->stream_write){
+        updi->stats.stream_page_us = stream.page_us;
+
+        if(!stream_checkpoint(updi, &stream)){
+            return false;
+        }
+    }
+
+    if(!flash_write_end(serial, device)){
+        return false;
+    }
+
+    if(skipped > 0){
+        log_str("%d image bytes outside the application section left out\r\n", skipped);
+    }
+
+    log_important("%d bytes written\r\n", *length);
+
+    return true;
+}
+
+/*
+The application section from the BOOTEND and APPEND fuses (AVR Dx: BOOTSIZE and CODESIZE), as offsets from the start of flash. Below BOOTEND is the
+boot section and from APPEND up the application data section, APPEND at or below BOOTEND runs the application section to the end of flash.
+BOOTEND 0 makes all of flash boot section, there is no bootloader to keep then so it is an error
+*/
+static bool app_section(UPDI *updi, uint32_t *start, uint32_t *end){
+    Device device = updi->device;
+    uint32_t block = (device.nvm_version == UPDI_NVM_V2) ? UPDI_BOOT_BLOCK_V2_SIZE : UPDI_BOOT_BLOCK_SIZE;
+    uint8_t fuses[2];       //APPEND then BOOTEND, next to each other on every supported family
+
+    if(!read_data(&(updi->serial), device.fuses_address + UPDI_FUSE_APPEND, 2, fuses)){
+        log_error("Read BOOTEND and APPEND fuses failed\r\n");
+        return false;
+    }
+
+    uint8_t append = fuses[0];
+    uint8_t bootend = fuses[1];
+
+    *start = bootend * block;
+    *end = (append > bootend) ? append * block : device.flash_size;
+
+    if(bootend == 0 || *start >= device.flash_size){
+        log_error("No boot section to keep, BOOTEND is %d\r\n", bootend);
+        return false;
+    }
+
+    if(*end > device.flash_size) *end = device.flash_size;
+
+    log_str("application section from %d to %d\r\n", *start, *end);
+
+    return true;
+}
+
+//Erase and write one whole application page for keep_boot, offset from the start of flash. A page that fails is resynced and redone, it is
+//erased again along with its write so nothing from the failed attempt stays. Up to UPDI_MAX_RECOVERIES times
+static bool write_app_page(UPDI *updi, uint32_t offset, uint8_t *data){
+    Device device = updi->device;
+
+    for(uint8_t attempts = 0; ; attempts++){
+        if(flash_erase_write_page(&(updi->serial), device, device.flash_start + offset, data)){
+            updi->stats.app_pages++;
+            return true;
+        }
+
+        if(attempts == UPDI_MAX_RECOVERIES || !resync(updi, device.flash_start + offset)){
+            return false;
+        }
+    }
+}
+
+/*
+One page of the image for keep_boot: the application pages from *erased up to it are erased first (erase_app_pages()), then it is erased and
+written, with verify under UPDI_SMALL read back, and *erased moves past it. A page the file comes back to below *erased only gets the write
+*/
+static bool boot_page(UPDI *updi, uint32_t *erased, uint32_t offset, uint8_t *data, uint16_t len, bool verify){
+    if(!erase_app_pages(updi, erased, offset, verify)){
+        return false;
+    }
+
+    if(!write_app_page(updi, offset, data) || (verify && !verify_page(updi, offset, data, len))){
+        return false;
+    }
+
+    if(offset + updi->device.flash_pagesize > *erased) *erased = offset + updi->device.flash_pagesize;
+
+    return true;
+}
+
+/*
+Page erase the application pages from *erased up to end for keep_boot, so none of the old application stays in pages the image doesnt cover.
+A page that fails is resynced and erased again, up to UPDI_MAX_RECOVERIES times. With verify under UPDI_SMALL each one is read back blank,
+otherwise updi_write_flash() verifies the whole application section after. *erased ends up at end
+*/
+static bool erase_app_pages(UPDI *updi, uint32_t *erased, uint32_t end, bool verify){
+    Device device = updi->device;
+
+    for(; *erased < end; *erased += device.flash_pagesize){
+        uint32_t address = device.flash_start + *erased;
+
+        for(uint8_t attempts = 0; !erase_pages(&(updi->serial), device, address, 1); attempts++){
+            if(attempts == UPDI_MAX_RECOVERIES || !resync(updi, address)){
+                return false;
+            }
+        }
+
+#if defined UPDI_SMALL
+        uint8_t *read = updi->arena->read;
+
+        if(verify && !read_page(&(updi->serial), address, device.flash_pagesize, read)){
+            log_str("Read flash failed\r\n");
+            return false;
+        }
+
+        for(uint16_t i = 0; verify && i < device.flash_pagesize; i++){
+            if(read[i] != 0xFF){
+                log_error("Application page at %d not blank after erasing\r\n", address);
+                return false;
+            }
+        }
+#endif
+    }
+
+    return true;
+}
+
+/*
+Write one page of the image, offset from the start of flash. If the link is lost, resync and redo it along with the page written before it (prev,
+the same as offset for the first page), that one went out with ACKs off so sync could have been lost in it rather than in this one.
+Both are redone whole from erased, as either may hold bytes from an earlier pass. Up to UPDI_MAX_RECOVERIES times
+*/
+static bool write_image_page(UPDI *updi, uint32_t offset, uint8_t *data, uint16_t len, uint32_t prev, uint8_t *prev_data){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+
+    if(flash_write_page(serial, device, device.flash_start + offset, data, len)){
+        return true;
+    }
+
+    for(uint8_t attempts = 0; attempts < UPDI_MAX_RECOVERIES; attempts++){
+        if(!resync(updi, device.flash_start + offset)){
+            return false;
+        }
+
+        if(prev != offset && !erase_pages(serial, device, device.flash_start + prev, 1)){
+            return false;
+        }
+
+        if(!erase_pages(serial, device, device.flash_start + offset, 1) || !flash_write_begin(serial, device)){
+            return false;
+        }
+
+        if((prev == offset || flash_write_page(serial, device, device.flash_start + prev, prev_data, device.flash_pagesize))
+            && flash_write_page(serial, device, device.flash_start + offset, data, device.flash_pagesize)){
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+Find the buffer to build the page at offset in. Normally that is the page's place in flash_data_write, which keeps the whole image.
+With UPDI_SMALL it is whichever arena page isnt holding the page before, blank, or read back from flash if the file is coming back to a page it
+has already written, so a redo or verify of it still sees everything
+*/
+static bool image_page_buffer(UPDI *updi, uint32_t offset, uint8_t *prev_data, bool revisit, uint8_t **data){
+#if defined UPDI_SMALL
+    Device device = updi->device;
+
+    *data = (prev_data == updi->arena->write[0]) ? updi->arena->write[1] : updi->arena->write[0];
+
+    if(revisit){
+        return read_page(&(updi->serial), device.flash_start + offset, device.flash_pagesize, *data);
+    }
+
+    memset(*data, 0xFF, device.flash_pagesize);
+#else
+    *data = updi->flash_data_write + offset;
+#endif
+
+    return true;
+}
+
+//Read a page just written back into the arena and compare, only used with UPDI_SMALL where the whole image is never held
+static bool verify_page(UPDI *updi, uint32_t offset, uint8_t *data, uint16_t len){
+#if defined UPDI_SMALL
+    Device device = updi->device;
+    uint8_t *read = updi->arena->read;
+    bool fail = false;
+
+    if(!read_page(&(updi->serial), device.flash_start + offset, len, read)){
+        log_str("Read flash failed\r\n");
+        return false;
+    }
+
+    for(uint16_t i = 0; i < len; i++){
+        if(data[i] != read[i]){
+            fail = true;
+            log_str("MEM MISMATCH at addr: %d, should be: %d, received: %d\r\n", offset + i + device.flash_start, data[i], read[i]);
+        }
+    }
+
+    if(fail){
+        log_error("\r\nVerify flash failed, program may or may not be ok\r\n");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+#if defined UPDI_SMALL
+//Read len bytes of one page, rounded up to words, in as few repeats as it takes, only the UPDI_SMALL paths work a page at a time
+static bool read_page(Serial *serial, uint32_t address, uint16_t len, uint8_t *buffer){
+    uint16_t max_words = (UPDI_MAX_REPEAT_SIZE >> 1) + 1;
+    uint16_t numwords = (len + 1) >> 1;
+
+    for(uint16_t i = 0; i < numwords; i += max_words){
+        uint16_t n = (numwords - i < max_words) ? numwords - i : max_words;
+
+        if(!read_data_words(serial, address + i * 2, n, buffer + i * 2)){
+            log_str("in read_page() error: read_data_words()\r\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+#endif
+
+//Get the NVM controller ready for flash_write_page(), NVMv2 sets FLASH_WRITE here and it stays set until flash_write_end()
+static bool flash_write_begin(Serial *serial, Device device){
+    if(!in_prog_mode(serial)){
+        log_str("in flash_write_begin() error: not in prog mode\r\n");
         return false;
     }
 
-    //Wait to finish
     if(!wait_flash_ready(serial, device)){
-        log_str("in chip_erase() error: timeout waiting for flash ready after erase\r\n");
+        log_str("in flash_write_begin() error: cant wait flash ready\r\n");
         return false;
     }
 
-    log_str("ERASED\r\n");
+    if(device.nvm_version != UPDI_NVM_V2){
+        return true;
+    }
+
+    if(!execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE)){
+        log_str("in flash_write_begin() error: execute nvm command\r\n");
+        return false;
+    }
 
     return true;
 }
 
-//Reads a number of bytes of data from UPDI
-static bool read_data(Serial *serial, uint16_t address, uint16_t size, uint8_t *ret){
-    uint8_t recv[size];
+//Program len bytes from the start of a page, as one batch (see page_batch()) and then the busy wait. NVMv0 loads the page buffer and commits it
+//with WRITE_PAGE, the page buffer clear leaves the rest as 0xFF. NVMv2 streams the data straight to its flash addresses with no page buffer commands
+static bool flash_write_page(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len){
+    bool ok = false;
 
-    //Range check
-    if(size > UPDI_MAX_REPEAT_SIZE + 1){
-        log_str("read_data error: cant read that many bytes at once\r\n");
+    trace_begin_arg("page", "address", address);
+
+    if(!page_batch(serial, device, address, data, len, UPDI_NVMCTRL_CTRLA_WRITE_PAGE)){
+        log_str("in flash_write_page() error: page_batch() error\r\n");
+    }else if(!wait_flash_ready(serial, device)){
+        log_str("in flash_write_page() error: cant wait flash ready after page\r\n");
+    }else{
+        ok = true;
+    }
+
+    trace_end();
+
+    return ok;
+}
+
+/*
+Every instruction of a page write up to the commit is known in advance, so they go out in a single transfer with response signatures off
+for the page buffer clear (NVMv0), pointer, repeat and data words, rather than waiting for an ACK after each store. The transfer ends with
+LD ptr straight after the last data word. Its reply only comes if the data was exactly as long as the target expected (a byte short and
+the LD's SYNC is stored as data), and the pointer it returns is only the end of the page if the pointer and repeat instructions both
+arrived. An ACK at the end would prove neither, a lost repeat count leaves the words unstored while everything after them is ACKed.
+Response signatures then go back on and NVMv0 commits the page with command (WRITE_PAGE or ERASE_WRITE_PAGE) in an STS to CTRLA, address and
+command both ACKed, NVMv2 ignores command.
+Over a network link (tcp.c) that is one segment each way per page, three on NVMv0, plus the busy wait.
+The NVM controller has to be ready beforehand
+*/
+static bool page_batch(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len, uint8_t command){
+    uint16_t numwords = (len + 1) >> 1;
+    uint32_t ctrla = device.nvmctrl_address + UPDI_NVMCTRL_CTRLA;
+    uint8_t head[24];
+    uint8_t check[2];
+    uint8_t end[3];
+    uint8_t foot[12];
+    uint8_t tail[2] = {data[len - 1], 0xFF};
+    uint8_t reply[3] = {0, 0, 0};
+    uint8_t recv[1] = {0};
+    uint8_t m = 0;
+
+    uint8_t ctrla_ackon = 1 << UPDI_CTRLA_IBDLY_BIT;
+
+    if(numwords > (UPDI_MAX_REPEAT_SIZE + 1)){
+        log_str("in page_batch error: invalid length\r\n");
+        return false;
+    }
+
+    uint8_t n = page_head(head, device, address, numwords, true);
+    uint8_t ptr_len = address_bytes(end, address);
+
+    //the pointer is read back as wide as it was set, a 16-bit one wraps at the end of the last page below 64K
+    check[0] = UPDI_PHY_SYNC;
+    check[1] = UPDI_LD | UPDI_PTR_ADDRESS | ((ptr_len == 3) ? UPDI_DATA_24 : UPDI_DATA_16);
+    address_bytes(end, address + numwords * 2);
+
+    //an odd length gets 0xFF as the high byte of the last word
+    SerialIov tx[4] = {{head, n}, {data, len & ~1}, {tail, 2}, {check, 2}};
+    SerialIov rx[2] = {{NULL, n + numwords * 2 + 2}, {reply, ptr_len}};
+
+    if(!(len & 1)) tx[2] = tx[3];
+
+    trace_begin_arg((device.nvm_version == UPDI_NVM_V2) ? "load" : "buffer clear + load", "bytes", len);
+    bool loaded = serial_transfer(serial, tx, (len & 1) ? 4 : 3, rx, 2);
+    trace_end();
+
+    if(!loaded || memcmp(reply, end, ptr_len) != 0){
+        log_str("in page_batch error: pointer not at the end of the page data\r\n");
         return false;
     }
 
-    //Store address pointer
-    st_ptr(serial, address);
+    foot[m++] = UPDI_PHY_SYNC;
+    foot[m++] = UPDI_STCS | UPDI_CS_CTRLA;
+    foot[m++] = ctrla_ackon;
 
-    //Set repeat
-    if(size > 1){
-        repeat(serial, size);
+    //NVMv2 has nothing to commit, the words were written as they arrived
+    if(device.nvm_version == UPDI_NVM_V2){
+        return serial_send(serial, foot, m);
     }
 
-    if(!ld_ptr_inc(serial, recv, size)){
-        log_str("in read_data(): ld_ptr_inc error\r\n");
+    uint8_t sts_len = address_bytes(foot + m + 2, ctrla);
+    foot[m++] = UPDI_PHY_SYNC;
+    foot[m++] = UPDI_STS | UPDI_DATA_8 | ((sts_len == 3) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16);
+    m += sts_len;
+
+    trace_begin("commit");
+    bool committed = serial_send_receive(serial, foot, m, recv, 1) && recv[0] == UPDI_PHY_ACK
+        && serial_send_receive(serial, &command, 1, recv, 1) && recv[0] == UPDI_PHY_ACK;
+    trace_end();
+
+    if(!committed){
+        log_str("in page_batch error: no ACK to page commit\r\n");
         return false;
     }
 
-    for(uint16_t i = 0; i < size; i++) ret[i] = recv[i];
-
     return true;
 }
 
-//Reads a number of words of data from UPDI
-static bool read_data_words(Serial *serial, uint16_t address, uint16_t numwords, uint8_t *buffer){
-    //Range check
-    if(numwords > (UPDI_MAX_REPEAT_SIZE >> 1) + 1){
-        log_str("in read_data_words() error: cant write that many words in a go\r\n");
-        return false;
+//Erase and program a whole page, NVMv0 in one ERASE_WRITE_PAGE commit. NVMv2 has no combined command, the page is erased and then written
+static bool flash_erase_write_page(Serial *serial, Device device, uint32_t address, uint8_t *data){
+    if(device.nvm_version == UPDI_NVM_V2){
+        if(!erase_pages(serial, device, address, 1)){
+            log_str("in flash_erase_write_page() error: erase_pages() error\r\n");
+            return false;
+        }
+
+        return flash_write_begin(serial, device) && flash_write_page(serial, device, address, data, device.flash_pagesize) && flash_write_end(serial, device);
     }
 
-    //store address
-    if(!st_ptr(serial, address)){
-        log_str("in read_data_words() error: st_ptr()\r\n");
+    if(!wait_flash_ready(serial, device)){
+        log_str("in flash_erase_write_page() error: cant wait flash ready\r\n");
         return false;
     }
 
-    //set up repeat
-    if(numwords > 1){
-        repeat(serial, numwords);
-    }
+    bool ok = false;
 
-    if(!ld_ptr_inc16(serial, buffer, numwords)){
-        log_str("in read_data_words() error: ld_ptr_inc16()\r\n");
-        return false;
+    trace_begin_arg("page", "address", address);
+
+    if(!page_batch(serial, device, address, data, device.flash_pagesize, UPDI_NVMCTRL_CTRLA_ERASE_WRITE_PAGE)){
+        log_str("in flash_erase_write_page() error: page_batch() error\r\n");
+    }else if(!wait_flash_ready(serial, device)){
+        log_str("in flash_erase_write_page() error: cant wait flash ready after page\r\n");
+    }else{
+        ok = true;
     }
 
-    return true;
+    trace_end();
+
+    return ok;
 }
 
-//Reads one fuse value
-static uint8_t read_fuse(Serial *serial, Device device, uint8_t fuse){
-    if(!in_prog_mode(serial)){
-        log_str("in read_fuse() error: not in prog mode\r\n");
-        return 0;
-    }
+/*
+Everything of a page write before its data: response signatures off if asked, NVMv0 page buffer clear, pointer, repeat and ST ptr++.
+Needs room for 20 bytes, returns how many it used
+*/
+static uint8_t page_head(uint8_t *head, Device device, uint32_t address, uint16_t numwords, bool ackoff){
+    uint8_t n = 0;
 
-    return ld(serial, device.fuses_address + fuse);
-}
+    if(ackoff){
+        head[n++] = UPDI_PHY_SYNC;
+        head[n++] = UPDI_STCS | UPDI_CS_CTRLA;
+        head[n++] = (1 << UPDI_CTRLA_IBDLY_BIT) | (1 << UPDI_CTRLA_RSD_BIT);
+    }
 
-//Read flash
-static bool read_flash(Serial *serial, Device device, uint16_t address, uint16_t size, uint8_t *buffer){
-    if(!in_prog_mode(serial)){
-        log_str("in read_flash() error: not in prog mode\r\n");
-        return false;
+    if(device.nvm_version != UPDI_NVM_V2){
+        uint8_t sts_len = address_bytes(head + n + 2, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA);
+        head[n++] = UPDI_PHY_SYNC;
+        head[n++] = UPDI_STS | UPDI_DATA_8 | ((sts_len == 3) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16);
+        n += sts_len;
+        head[n++] = UPDI_NVMCTRL_CTRLA_PAGE_BUFFER_CLR;
     }
 
-    uint16_t i;
-    uint16_t buf_count = 0;    
-    uint16_t numwords = device.flash_pagesize; //max read size
-    uint8_t recv[numwords*2];
+    uint8_t ptr_len = address_bytes(head + n + 2, address);
+    head[n++] = UPDI_PHY_SYNC;
+    head[n++] = UPDI_ST | UPDI_PTR_ADDRESS | ((ptr_len == 3) ? UPDI_DATA_24 : UPDI_DATA_16);
+    n += ptr_len;
 
-    uint8_t p_cnt = 10;
-    uint16_t chunks = (size % (numwords * 2) != 0) ? (size / (numwords * 2)) + 1 : size / (numwords * 2);
+    head[n++] = UPDI_PHY_SYNC;
+    head[n++] = UPDI_REPEAT | UPDI_REPEAT_WORD;
+    head[n++] = (uint8_t)((numwords - 1) & 0xFF);
+    head[n++] = (uint8_t)(((numwords - 1) >> 8) & 0xFF);
 
-    for(i = 0; i < size / (numwords * 2); i++){
-        read_data_words(serial, address + i * (numwords * 2), numwords, recv);
+    head[n++] = UPDI_PHY_SYNC;
+    head[n++] = UPDI_ST | UPDI_PTR_INC | UPDI_DATA_16;
 
-        for(uint16_t j = 0; j < numwords*2; j++){
-            buffer[buf_count++] = recv[j];
-        }
+    return n;
+}
 
-        if(100 * i / chunks > p_cnt){
-            log_important("%d percent done\r\n", p_cnt);
-            p_cnt += 10;
-        }
+/*
+Streamed page write, updi_write_flash() with updi->stream_write set. Response signatures stay off from one page to the next, so the whole page,
+NVMv0 page buffer clear and WRITE_PAGE commit included, is one transfer with only its echo and two short replies to wait for, and the NVM
+controller is given stream->page_us to program it instead of being polled. As in page_batch() an LD ptr after the data only comes back as the
+end of the page if the pointer, repeat and every data byte arrived. On NVMv0 an LDS of the NVM status after the commit has to find the flash
+busy, a commit that lost a byte either never ran or swallowed the LDS. Neither costs a round trip of its own, the echo is waited for anyway.
+In full-duplex mode the transfer can return before the page is on the wire (tcp.c holds it back for the next read) so the echoes are synced
+first, and any of the wire time not yet gone is waited as well. A page that fails either check goes to stream_checkpoint() straight away,
+otherwise one comes every UPDI_STREAM_CHECKPOINT_PAGES pages. The NVM controller has to be ready beforehand (flash_write_begin())
+*/
+static bool stream_page(UPDI *updi, StreamWrite *stream, uint32_t offset, uint8_t *data, uint16_t len){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+    uint32_t address = device.flash_start + offset;
+    uint16_t numwords = (len + 1) >> 1;
+    uint8_t head[20];
+    uint8_t check[2];
+    uint8_t end[3];
+    uint8_t foot[11];
+    uint8_t tail[2] = {data[len - 1], 0xFF};
+    uint8_t reply[3] = {0, 0, 0};
+    uint8_t status = 0;
+    uint8_t m = 0;
+
+    uint8_t n = page_head(head, device, address, numwords, !stream->acks_off);
 
+    //the pointer is read back as wide as it was set, a 16-bit one wraps at the end of the last page below 64K
+    uint8_t ptr_len = address_bytes(end, address);
+    check[0] = UPDI_PHY_SYNC;
+    check[1] = UPDI_LD | UPDI_PTR_ADDRESS | ((ptr_len == 3) ? UPDI_DATA_24 : UPDI_DATA_16);
+    address_bytes(end, address + numwords * 2);
+
+    if(device.nvm_version != UPDI_NVM_V2){
+        uint8_t sts_len = address_bytes(foot + 2, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA);
+        foot[m++] = UPDI_PHY_SYNC;
+        foot[m++] = UPDI_STS | UPDI_DATA_8 | ((sts_len == 3) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16);
+        m += sts_len;
+        foot[m++] = UPDI_NVMCTRL_CTRLA_WRITE_PAGE;
+
+        uint8_t lds_len = address_bytes(foot + m + 2, device.nvmctrl_address + UPDI_NVMCTRL_STATUS);
+        foot[m++] = UPDI_PHY_SYNC;
+        foot[m++] = UPDI_LDS | UPDI_DATA_8 | ((lds_len == 3) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16);
+        m += lds_len;
     }
 
-    if(size % (numwords * 2) != 0){ 
-        read_data(serial, address + i * (numwords * 2), size % (numwords * 2), recv);
-        for(int j = 0; j < size % (numwords * 2); j++){
-            buffer[buf_count++] = recv[j];
-        }
+    //an odd length gets 0xFF as the high byte of the last word
+    SerialIov tx[5] = {{head, n}, {data, len & ~1}};
+    uint8_t count = 2;
+    if(len & 1) tx[count++] = (SerialIov){tail, 2};
+    tx[count++] = (SerialIov){check, 2};
+    if(m > 0) tx[count++] = (SerialIov){foot, m};
+
+    uint32_t bytes = n + numwords * 2 + 2 + ptr_len + m + ((m > 0) ? 1 : 0);
+    uint32_t wire_us = (uint32_t)((uint64_t)bytes * 12 * 1000000 / serial->baudrate);
+    SerialIov rx[4] = {{NULL, n + numwords * 2 + 2}, {reply, ptr_len}, {NULL, m}, {&status, 1}};
+
+    trace_begin_arg("page", "address", address);
+
+    uint64_t start = micros();
+    bool sent = serial_transfer(serial, tx, count, rx, (m > 0) ? 4 : 2);
+    sent = serial_sync(serial) && sent;
+    uint32_t elapsed = (uint32_t)(micros() - start);
+
+    if(sent && memcmp(reply, end, ptr_len) != 0){
+        log_str("in stream_page() error: pointer not at the end of the page\r\n");
+        sent = false;
     }
 
-    log_important("100 percent done\r\n");
+    if(sent && m > 0 && !(status & (1 << UPDI_NVM_STATUS_FLASH_BUSY))){
+        log_str("in stream_page() error: page not committed\r\n");
+        sent = false;
+    }
 
-    return true;
-}
+    trace_begin("page budget");
+    sleep_us(stream->page_us + ((elapsed < wire_us) ? wire_us - elapsed : 0));
+    trace_end();
 
-//Writes a number of bytes to memory
-static bool write_data(Serial *serial, uint16_t address, uint8_t *data, uint16_t len){
-    if(len == 1){
-        if(!st(serial, address, data[0])){
-            log_str("in write_data() error: st ret false\r\n");
-            return false;
-        }
-    }else if(len == 2){
-        if(!st(serial, address, data[0])){
-            log_str("in write_data() error: st ret false\r\n");
-            return false;
-        }
-        if(!st(serial, address + 1, data[1])){
-            log_str("in write_data() error: st ret false\r\n");
-            return false;
-        }
-    }else{
-        //Range check
-        if(len > UPDI_MAX_REPEAT_SIZE + 1){
-            log_str("in write_data() error: invalid length\r\n");
-            return false;
-        }
+    trace_end();
 
-        //store address
-        if(!st_ptr(serial, address)){
-            log_str("in write_data() error: couldnt st_ptr(address)\r\n");
-            return false;
-        }
+    stream->offsets[stream->count] = offset;
+    stream->data[stream->count] = data;
+    stream->count++;
+    stream->acks_off = true;
+    if(!sent) stream->failed = true;
 
-        //set up repeat
-        repeat(serial, len);
-        if(!st_ptr_inc(serial, data, len)){
-            log_str("in write_data() error: couldnt st_ptr_inc() error\r\n");
-            return false;
-        }
+    if(!sent || stream->count == UPDI_STREAM_CHECKPOINT_PAGES){
+        return stream_checkpoint(updi, stream);
     }
 
     return true;
 }
 
-//Writes a number of words to memory
-static bool write_data_words(Serial *serial, uint16_t address, uint8_t *data, uint16_t numwords){
-    if(numwords == 1){
-        uint16_t value = data[0] + (data[1] << 8);
-        if(!st16(serial, address, value)){
-            log_str("in write_data_words error: st16() error\r\n");
+/*
+Check the pages streamed since the last checkpoint with stream_check(). If any of them didnt make it, resync and write them again the ACKed way
+from erased, whole pages as they may hold bytes from an earlier pass, up to UPDI_MAX_RECOVERIES times. Leaves response signatures on
+*/
+static bool stream_checkpoint(UPDI *updi, StreamWrite *stream){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+
+    if(stream->count == 0) return true;
+
+    trace_begin_arg("checkpoint", "pages", stream->count);
+    bool ok = stream_check(updi, stream) && !stream->failed;
+    trace_end();
+
+    for(uint8_t attempts = 0; !ok && attempts < UPDI_MAX_RECOVERIES; attempts++){
+        if(!resync(updi, device.flash_start + stream->offsets[0])){
             return false;
         }
-    }else{
-        //Range check
-        if(numwords > (UPDI_MAX_REPEAT_SIZE + 1)){
-            log_str("in write_data_words error: invalid length\r\n");
-            return false;
+
+        ok = true;
+
+        for(uint8_t i = 0; i < stream->count && ok; i++){
+            ok = erase_pages(serial, device, device.flash_start + stream->offsets[i], 1);
         }
 
-        //Store address
-        if(!st_ptr(serial, address)){
-            log_str("in write_data_words error: st_ptr() error\r\n");
-            return false;
+        ok = ok && flash_write_begin(serial, device);
+
+        for(uint8_t i = 0; i < stream->count && ok; i++){
+            ok = flash_write_page(serial, device, device.flash_start + stream->offsets[i], stream->data[i], device.flash_pagesize);
         }
 
-        //Set up repeat
-        repeat(serial, numwords);
-        st_ptr_inc16(serial, data, numwords);
+        ok = ok && stream_check(updi, stream);
+    }
+
+    stream->count = 0;
+    stream->acks_off = false;
+    stream->failed = false;
+
+    if(!ok){
+        log_str("in stream_checkpoint() error: pages still wrong after resyncing\r\n");
+        return false;
     }
 
+    updi->stats.stream_checkpoints++;
+
     return true;
 }
 
-//Writes one fuse value
-static bool write_fuse(Serial *serial, Device device, uint8_t fuse, uint8_t value){
-    uint8_t data;
+/*
+Response signatures back on and the NVM status, in one transfer with an LDCS of CTRLA after them. A lost byte of the STCS would leave the
+signatures off unnoticed otherwise, the next page turns them off anyway but anything ACKed after the last one would fail. A status still busy
+means stream->page_us is too short, it grows by a quarter and the write is waited out. Only with stream->read_back are the pages since the last
+checkpoint read back (read_ranges(), adjacent pages merge into bursts) and compared, otherwise each page's own checks and updi_write_flash()'s
+verify cover them. True if nothing was found wrong
+*/
+static bool stream_check(UPDI *updi, StreamWrite *stream){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+    UPDIReadRange ranges[UPDI_STREAM_CHECKPOINT_PAGES];
+    uint8_t cmd[12] = {UPDI_PHY_SYNC, UPDI_STCS | UPDI_CS_CTRLA, 1 << UPDI_CTRLA_IBDLY_BIT, UPDI_PHY_SYNC, UPDI_LDS | UPDI_DATA_8};
+    uint8_t status = 0;
+    uint8_t ctrla = 0;
 
-    if(!in_prog_mode(serial)){
-        log_str("in write_fuse() error: not in prog mode\r\n");
-        return false;
-    }
+    uint8_t error_mask = (device.nvm_version == UPDI_NVM_V2) ? UPDI_V2_NVM_STATUS_WRITE_ERROR_MASK : (1 << UPDI_NVM_STATUS_WRITE_ERROR);
+    uint8_t busy_mask = (1 << UPDI_NVM_STATUS_EEPROM_BUSY) | (1 << UPDI_NVM_STATUS_FLASH_BUSY);
 
-    if(!wait_flash_ready(serial, device)){
-        log_str("in write_fuse() error: cant wait flash ready\r\n");
-        return false;
-    }
+    uint8_t lds_len = address_bytes(cmd + 5, device.nvmctrl_address + UPDI_NVMCTRL_STATUS);
+    uint8_t n = 5 + lds_len;
+    cmd[4] |= (lds_len == 3) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16;
+    cmd[n++] = UPDI_PHY_SYNC;
+    cmd[n++] = UPDI_LDCS | UPDI_CS_CTRLA;
 
-    data = (device.fuses_address + fuse) & 0xff;
-    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_ADDRL, &data, 1)){
-        log_str("in write_fuse() error: write data fail\r\n");
+    SerialIov tx[1] = {{cmd, n}};
+    SerialIov rx[4] = {{NULL, n - 2}, {&status, 1}, {NULL, 2}, {&ctrla, 1}};
+
+    if(!serial_transfer(serial, tx, 1, rx, 4)){
+        log_str("in stream_check() error: no status\r\n");
         return false;
     }
 
-    data = (device.fuses_address + fuse) >> 8;
-    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_ADDRH, &data, 1)){
-        log_str("in write_fuse() error: write data fail\r\n");
+    if(ctrla & (1 << UPDI_CTRLA_RSD_BIT)){
+        log_str("in stream_check() error: response signatures still off\r\n");
         return false;
     }
 
-    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_DATAL, &value, 1)){
-        log_str("in write_fuse() error: write data fail\r\n");
+    if(status & busy_mask){
+        if(stream->page_us < UPDI_STREAM_PAGE_MAX_US){
+            stream->page_us += stream->page_us / 4;
+        }
+        log_str("NVM still busy at checkpoint, page budget now %d us\r\n", (int)stream->page_us);
+
+        if(!wait_flash_ready(serial, device)){
+            return false;
+        }
+    }else if(status & error_mask){
+        log_str("in stream_check() error: nvm error\r\n");
         return false;
     }
 
-    data = UPDI_NVMCTRL_CTRLA_WRITE_FUSE;
-    if(!write_data(serial, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA, &data, 1)){
-        log_str("in write_fuse() error: write data fail\r\n");
-        return false;
+    if(!stream->read_back){
+        return true;
     }
 
-    return true;
-}
+    for(uint8_t i = 0; i < stream->count; i++){
+        ranges[i].address = device.flash_start + stream->offsets[i];
+        ranges[i].size = device.flash_pagesize;
+#if defined UPDI_SMALL
+        ranges[i].data = updi->arena->read;
+#else
+        ranges[i].data = updi->flash_data_read + stream->offsets[i];
+#endif
+    }
 
-//Write flash memory in pages
-static bool write_flash(Serial *serial, Device device, uint16_t address, uint8_t *data, uint16_t len){
-    if(!in_prog_mode(serial)){
-        log_str("in write_flash error: not in prog mode\r\n");        
+    if(!read_ranges(serial, ranges, stream->count, NULL)){
+        log_str("in stream_check() error: read back failed\r\n");
         return false;
     }
 
-    if(len % device.flash_pagesize > 0){
-        //pad data
-        log_str("PADDING DATA\r\n");
-        uint8_t padded_data[len + (len % device.flash_pagesize)];
-        for(uint16_t i = 0; i < len; i++){
-            padded_data[i] = data[i];
-        }
-        for(uint16_t i = len; i < len + (device.flash_pagesize - (len % device.flash_pagesize)); i++){
-            padded_data[i] = 0xFF;
+    for(uint8_t i = 0; i < stream->count; i++){
+        if(memcmp(ranges[i].data, stream->data[i], device.flash_pagesize) != 0){
+            log_str("Streamed page at %d doesnt match\r\n", (int)ranges[i].address);
+            return false;
         }
+    }
 
-        //program by page        
-        uint16_t numpages = (len + (device.flash_pagesize - (len % device.flash_pagesize))) / device.flash_pagesize;        
-        uint8_t p_cnt = 10;
-
-        for(uint16_t i = 0; i < numpages; i++){
-            uint8_t page[device.flash_pagesize];
+    return true;
+}
 
-            for(uint16_t j = 0; j < device.flash_pagesize; j++){
-                page[j] = padded_data[device.flash_pagesize * i + j];
-            }
+/*
+Read the page at offset, apply whichever edits fall in it and write it back if that changed anything
+*/
+static bool patch_page(UPDI *updi, const UPDIPatch *patches, uint8_t count, uint32_t offset, bool verify){
+    Serial *serial = &(updi->serial);
+    Device device = updi->device;
+    uint16_t pagesize = device.flash_pagesize;
+    uint32_t address = device.flash_start + offset;
+    bool changed = false;
 
-            if(!write_nvm(serial, device, address, page, device.flash_pagesize, UPDI_NVMCTRL_CTRLA_WRITE_PAGE, true)){
-                log_str("Write NVM error");                        
-                return false;
-            }
-            
-            address += device.flash_pagesize;
-           
-            if(((i+1)*100 / numpages) > p_cnt){                
-                log_important("%d percent done\r\n", p_cnt);
-                p_cnt += 10;
-            }
-        }
-    }else{
-        //program by page
-        uint16_t numpages = len / device.flash_pagesize;
+#if defined UPDI_SMALL
+    uint8_t *data = updi->arena->write[0];
+    uint8_t *check = updi->arena->read;
+#else
+    uint8_t *data = updi->flash_data_write + offset;
+    uint8_t *check = updi->flash_data_read + offset;
+#endif
 
-        uint8_t p_cnt = 10;
-        for(uint16_t i = 0; i < numpages; i++){
-            uint8_t page[device.flash_pagesize];
+    UPDIReadRange range = {address, pagesize, data};
 
-            for(uint16_t j = 0; j < device.flash_pagesize; j++){
-                page[j] = data[device.flash_pagesize * i + j];
-            }
+    trace_begin_arg("patch page", "address", address);
 
-            if(!write_nvm(serial, device, address, page, device.flash_pagesize, UPDI_NVMCTRL_CTRLA_WRITE_PAGE, true)){
-                log_str("Write NVM error");                        
-                return false;
-            }
+    if(!read_ranges(serial, &range, 1, NULL)){
+        log_str("in patch_page() error: cant read page\r\n");
+        trace_end();
+        return false;
+    }
 
-            address += device.flash_pagesize;
+    for(uint8_t i = 0; i < count; i++){
+        uint32_t from = (patches[i].offset > offset) ? patches[i].offset : offset;
+        uint32_t to = patches[i].offset + patches[i].size;
+        if(to > offset + pagesize) to = offset + pagesize;
 
-            if(((i+1)*100 / numpages) > p_cnt){                
-                log_important("%d percent done\r\n", p_cnt);
-                p_cnt += 10;
+        for(uint32_t j = from; j < to; j++){
+            uint8_t value = patches[i].data[j - patches[i].offset];
+            if(data[j - offset] != value){
+                data[j - offset] = value;
+                changed = true;
             }
         }
     }
 
-    log_important("100 percent done");   
-
-    return true;
-}
-
-static bool load_ihex(char *filename, uint8_t *data, uint16_t *length){
-    uint16_t total_data_len = 0;
-
-    File file;
-    if(!open_file(&file, filename)){
-        log_error("Couldnt open file\r\n");
-        return false;
-    }
-
-    char line[256];
-    memset(line, 0, sizeof(line));
-    while(file_read_line(&file, line, sizeof(line))){        
-        //21 bytes max size we'll encounter
-        uint8_t record_bin[21];
-        uint8_t record_bin_index = 0;
-        memset(record_bin, 0, 21);
-        uint8_t data_length = 0;
-        uint16_t address = 0;
-        uint8_t type = 0;
-        uint8_t crc = 0;
-
-       //i = 1 to skip ':' at start of record
-        for(int i = 1; i < strlen(line); i += 2){
-            uint8_t bin_value = 0;
-            
-            if(line[i] == '\r' || line[i] == '\n' || line[i+1] == '\r' || line[i+1] == '\n') break;             
-        
-            if(line[i] >= '0' && line[i] <= '9'){
-                bin_value += ((uint8_t)(line[i]) - 48) * 16;
-            }else if(line[i] >= 'A' && line[i] <= 'F'){
-                bin_value += ((uint8_t)(line[i]) - 55) * 16;
-            }
+    bool ok = true;
 
-            if(line[i+1] >= '0' && line[i+1] <= '9'){
-                bin_value += ((uint8_t)(line[i+1]) - 48);
-            }else if(line[i+1] >= 'A' && line[i+1] <= 'F'){
-                bin_value += ((uint8_t)(line[i+1]) - 55);
-            }
+    if(!changed){
+        log_str("page at %d already holds its patches\r\n", address);
+    }else if(!flash_erase_write_page(serial, device, address, data)){
+        log_str("in patch_page() error: cant write page\r\n");
+        ok = false;
+    }else{
+        updi->stats.patch_pages++;
 
-            record_bin[record_bin_index++] = bin_value;
+        range.data = check;
+        if(verify && (!read_ranges(serial, &range, 1, NULL) || memcmp(check, data, pagesize) != 0)){
+            log_str("in patch_page() error: page at %d doesnt match after writing\r\n", address);
+            ok = false;
         }
+    }
 
-        data_length = record_bin[0];
-        total_data_len += data_length;
-        address = record_bin[1] * 256 + record_bin[2];
-        type = record_bin[3];
+    trace_end();
 
-        if(type == 0){
-            //data
-            for(int i = 0; i < data_length; i++){
-                data[address++] = record_bin[4+i];
-            }
-        }else if(type == 1){
-            //End of records
-            log_str("End of records reached\r\n");
-        }else{
-            log_error("load_ihex() error, unsupported hex file\r\n");
-            return false;
-        }
-    }
-    
-    close_file(&file);
+    return ok;
+}
 
-    *length = total_data_len;
+static bool flash_write_end(Serial *serial, Device device){
+    if(device.nvm_version == UPDI_NVM_V2 && !execute_nvm_command(serial, device, UPDI_V2_NVMCTRL_CTRLA_NOCMD)){
+        log_str("in flash_write_end() error: execute nvm command\r\n");
+        return false;
+    }
 
     return true;
 }
@@ -985,27 +2847,45 @@ static uint8_t ldcs(Serial *serial, uint8_t address){
     }
 }
 
-//Load a single byte direct from a 16-bit address
-static uint8_t ld(Serial *serial, uint16_t address){
+//Little endian address operand for LDS / STS / ST ptr, 16-bit unless the address is above 64K (24-bit, UPDI rev 2 parts). Returns its length
+static uint8_t address_bytes(uint8_t *buf, uint32_t address){
+    buf[0] = (uint8_t)(address & 0xFF);
+    buf[1] = (uint8_t)((address >> 8) & 0xFF);
 
-    uint8_t buf[4] = {UPDI_PHY_SYNC, UPDI_LDS | UPDI_ADDRESS_16 | UPDI_DATA_8, (uint8_t)(address & 0xFF), (uint8_t)((address >> 8) & 0xFF)};
-    uint8_t recv[1] = {0};
+    if(address > 0xFFFF){
+        buf[2] = (uint8_t)((address >> 16) & 0xFF);
+        return 3;
+    }
+
+    return 2;
+}
 
-    if(!serial_send_receive(serial, buf, 4, recv, 1)){
+//Load a single byte direct from a 16 or 24-bit address, for polls that mustn't take a lost reply as a 0
+static bool ld8(Serial *serial, uint32_t address, uint8_t *value){
+
+    uint8_t buf[5] = {UPDI_PHY_SYNC, UPDI_LDS | UPDI_DATA_8};
+    uint8_t len = 2 + address_bytes(buf + 2, address);
+
+    buf[1] |= (len == 5) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16;
+
+    if(!serial_send_receive(serial, buf, len, value, 1)){
         log_str("ld error\r\n");
-        return 0;
-    }else{
-        return recv[0];
+        return false;
     }
+
+    return true;
 }
 
-//Load a 16-bit word directly from a 16-bit address
-static bool ld16(Serial *serial, uint16_t address, uint16_t *word){
+//Load a 16-bit word directly from a 16 or 24-bit address
+static bool ld16(Serial *serial, uint32_t address, uint16_t *word){
 
-    uint8_t buf[4] = {UPDI_PHY_SYNC, UPDI_LDS | UPDI_ADDRESS_16 | UPDI_DATA_16, (uint8_t)(address & 0xFF), (uint8_t)((address >> 8) & 0xFF)};
+    uint8_t buf[5] = {UPDI_PHY_SYNC, UPDI_LDS | UPDI_DATA_16};
+    uint8_t len = 2 + address_bytes(buf + 2, address);
     uint8_t recv[2] = {0, 0};
 
-    if(!serial_send_receive(serial, buf, 4, recv, 2)){
+    buf[1] |= (len == 5) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16;
+
+    if(!serial_send_receive(serial, buf, len, recv, 2)){
         log_str("ld16 error\r\n");
         return false;
     }
@@ -1015,37 +2895,31 @@ static bool ld16(Serial *serial, uint16_t address, uint16_t *word){
     return true;
 }
 
-//Loads a number of bytes from the pointer location with pointer post-increment
+//Loads a number of bytes from the pointer location with pointer post-increment, received straight into buffer
 static bool ld_ptr_inc(Serial *serial, uint8_t *buffer, uint16_t size){
     uint8_t buf[2] = {UPDI_PHY_SYNC, UPDI_LD | UPDI_PTR_INC | UPDI_DATA_8};
-    uint8_t recv[size];
+    SerialIov tx[1] = {{buf, 2}};
+    SerialIov rx[2] = {{NULL, 2}, {buffer, size}};
 
-    if(!serial_send_receive(serial, buf, 2, recv, size)){
+    if(!serial_transfer(serial, tx, 1, rx, 2)){
         log_str("in ld_ptr_inc(): error\r\n");
         return false;
     }
 
-    for(uint16_t i = 0; i < size; i++){
-        buffer[i] = recv[i];
-    }
-
     return true;
 }
 
-//Load a 16-bit word value from the pointer location with pointer post-increment
+//Load a 16-bit word value from the pointer location with pointer post-increment, received straight into buffer
 static bool ld_ptr_inc16(Serial *serial, uint8_t *buffer, uint16_t numwords){
     uint8_t buf[2] = {UPDI_PHY_SYNC, UPDI_LD | UPDI_PTR_INC | UPDI_DATA_16};
-    uint8_t recv[numwords << 1];
+    SerialIov tx[1] = {{buf, 2}};
+    SerialIov rx[2] = {{NULL, 2}, {buffer, numwords << 1}};
 
-    if(!serial_send_receive(serial, buf, 2, recv, numwords << 1)){
+    if(!serial_transfer(serial, tx, 1, rx, 2)){
         log_str("ld_ptr_inc16 error\r\n");
         return false;
     }
 
-    for(uint16_t i = 0; i < numwords << 1; i++){
-        buffer[i] = recv[i];
-    }
-
     return true;
 }
 
@@ -1058,12 +2932,15 @@ static void stcs(Serial *serial, uint8_t address, uint8_t value){
     return;
 }
 
-//Store a single byte value directly to a 16-bit address
-static bool st(Serial *serial, uint16_t address, uint8_t value){
-    uint8_t buf[4] = {UPDI_PHY_SYNC, UPDI_STS | UPDI_ADDRESS_16 | UPDI_DATA_8, (uint8_t)(address & 0xFF), (uint8_t)((address >> 8) & 0xFF)};
+//Store a single byte value directly to a 16 or 24-bit address
+static bool st(Serial *serial, uint32_t address, uint8_t value){
+    uint8_t buf[5] = {UPDI_PHY_SYNC, UPDI_STS | UPDI_DATA_8};
+    uint8_t len = 2 + address_bytes(buf + 2, address);
     uint8_t recv[1] = {0};
 
-    if(!serial_send_receive(serial, buf, 4, recv, 1)){
+    buf[1] |= (len == 5) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16;
+
+    if(!serial_send_receive(serial, buf, len, recv, 1)){
         log_str("ST error sending address");        
         return false;
     }else{
@@ -1088,12 +2965,15 @@ static bool st(Serial *serial, uint16_t address, uint8_t value){
     return true;
 }
 
-//Store a 16-bit word value directly to a 16-bit address
-static bool st16(Serial *serial, uint16_t address, uint16_t value){
-    uint8_t buf[4] = {UPDI_PHY_SYNC, UPDI_STS | UPDI_ADDRESS_16 | UPDI_DATA_16, (uint8_t)(address & 0xFF), (uint8_t)((address >> 8) & 0xFF)};
+//Store a 16-bit word value directly to a 16 or 24-bit address
+static bool st16(Serial *serial, uint32_t address, uint16_t value){
+    uint8_t buf[5] = {UPDI_PHY_SYNC, UPDI_STS | UPDI_DATA_16};
+    uint8_t len = 2 + address_bytes(buf + 2, address);
     uint8_t recv[1] = {0};
 
-    if(!serial_send_receive(serial, buf, 4, recv, 1)){
+    buf[1] |= (len == 5) ? UPDI_ADDRESS_24 : UPDI_ADDRESS_16;
+
+    if(!serial_send_receive(serial, buf, len, recv, 1)){
         log_str("st16 error\r\n");
         return false;
     }else{
@@ -1118,12 +2998,15 @@ static bool st16(Serial *serial, uint16_t address, uint16_t value){
     return true;
 }
 
-//Set the pointer location
-static bool st_ptr(Serial *serial, uint16_t address){
-    uint8_t buf[4] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_ADDRESS | UPDI_DATA_16, (uint8_t)(address & 0xFF), (uint8_t)((address >> 8) & 0xFF)};
+//Set the pointer location, a 24-bit pointer for addresses above 64K
+static bool st_ptr(Serial *serial, uint32_t address){
+    uint8_t buf[5] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_ADDRESS};
+    uint8_t len = 2 + address_bytes(buf + 2, address);
     uint8_t recv[1] = {0};
 
-    if(!serial_send_receive(serial, buf, 4, recv, 1)){
+    buf[1] |= (len == 5) ? UPDI_DATA_24 : UPDI_DATA_16;
+
+    if(!serial_send_receive(serial, buf, len, recv, 1)){
         log_str("st ptr error\r\n");
         return false;
     }else{
@@ -1169,9 +3052,13 @@ static bool st_ptr_inc(Serial *serial, uint8_t *data, uint16_t size){
     return true;
 }
 
-//Store a 16-bit word value to the pointer location with pointer post-increment. Disable acks when we do this, to reduce latency.
-static void st_ptr_inc16(Serial *serial, uint8_t *data, uint16_t numwords){
+//Store 16-bit word values to the pointer location with pointer post-increment. Disable acks when we do this, to reduce latency.
+//The instruction and data go out in one transfer straight from data, an odd length gets 0xFF as the high byte of the last word
+static void st_ptr_inc16(Serial *serial, uint8_t *data, uint16_t len){
     uint8_t buf[2] = {UPDI_PHY_SYNC, UPDI_ST | UPDI_PTR_INC | UPDI_DATA_16};
+    uint8_t tail[2] = {data[len - 1], 0xFF};
+    SerialIov tx[3] = {{buf, 2}, {data, len & ~1}, {tail, 2}};
+    SerialIov rx[1] = {{NULL, 2 + ((len + 1) & ~1)}};
 
     uint8_t ctrla_ackon = 1 << UPDI_CTRLA_IBDLY_BIT;
     uint8_t ctrla_ackoff = ctrla_ackon | (1 << UPDI_CTRLA_RSD_BIT);
@@ -1179,8 +3066,7 @@ static void st_ptr_inc16(Serial *serial, uint8_t *data, uint16_t numwords){
     //disable acks
     stcs(serial, UPDI_CS_CTRLA, ctrla_ackoff);
 
-    serial_send(serial, buf, 2); //no response expected
-    serial_send(serial, data, numwords << 1);
+    serial_transfer(serial, tx, (len & 1) ? 3 : 2, rx, 1); //no response expected
 
     //reenable acks
     stcs(serial, UPDI_CS_CTRLA, ctrla_ackon);
@@ -1203,14 +3089,18 @@ static void repeat(Serial *serial, uint16_t repeats){
 static void key(Serial *serial, uint8_t size, uint8_t *key){
     uint16_t len = 8 << size;
     uint8_t buf[2] = {UPDI_PHY_SYNC, (uint8_t)(UPDI_KEY | UPDI_KEY_KEY | size)};
-    uint8_t key_reversed[len];
+    uint8_t key_reversed[16];       //128-bit keys at most
 
     for(uint16_t i = 0; i < len; i++){
         key_reversed[i] = key[len - 1 - i];
     }
 
-    serial_send(serial, buf, 2);
-    serial_send(serial, key_reversed, 8 << size);
+    SerialIov tx[2] = {{buf, 2}, {key_reversed, len}};
+    SerialIov rx[1] = {{NULL, 2 + len}};
+
+    trace_begin("key");
+    serial_transfer(serial, tx, 2, rx, 1);
+    trace_end();
 
     return;
 }
@@ -1230,26 +3120,66 @@ static bool progmode_key(Serial *serial){
 
 //Waits for the device to be unlocked. All devices boot up as locked until proven otherwise
 static bool wait_unlocked(Serial *serial, uint16_t timeout){    
-    unsigned long int start = millis();
-    
-    while(millis() - start < timeout){
+    uint64_t end = deadline((uint32_t)timeout * 1000);
+    bool unlocked = false;
+
+    trace_begin("unlock wait");
+
+    do{
         if(!(ldcs(serial, UPDI_ASI_SYS_STATUS) & (1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS))){
-            return true;
+            unlocked = true;
+            break;
         }
+        sleep_us(UPDI_POLL_INTERVAL_US);
+    }while(!deadline_passed(end));
+
+    trace_end();
+
+    if(!unlocked){
+        log_str("TIMEOUT WAITING FOR DEVICE TO UNLOCK\r\n");    
     }
 
-    log_str("TIMEOUT WAITING FOR DEVICE TO UNLOCK\r\n");    
+    return unlocked;
+}
+
+//Waits for SYS_STATUS.UROWPROG to be set (active) or cleared
+static bool wait_urow_prog(Serial *serial, uint16_t timeout, bool active){
+    uint64_t end = deadline((uint32_t)timeout * 1000);
+
+    do{
+        bool urowprog = (ldcs(serial, UPDI_ASI_SYS_STATUS) & (1 << UPDI_ASI_SYS_STATUS_UROWPROG)) != 0;
+        if(urowprog == active){
+            return true;
+        }
+        sleep_us(UPDI_POLL_INTERVAL_US);
+    }while(!deadline_passed(end));
+
+    log_str("TIMEOUT WAITING FOR USER ROW PROGRAMMING\r\n");
 
     return false;
 }
 
-//Waits for the NVM controller to be ready
+//Waits for the NVM controller to be ready, one status poll span when tracing
 static bool wait_flash_ready(Serial *serial, Device device){
-    unsigned long int start = millis();
+    trace_begin("status poll");
+    bool ready = poll_flash_ready(serial, device);
+    trace_end();
+
+    return ready;
+}
+
+static bool poll_flash_ready(Serial *serial, Device device){
+    uint64_t end = deadline(UPDI_NVM_TIMEOUT_US);
+
+    do{
+        uint8_t status = 0;
+        if(!ld8(serial, device.nvmctrl_address + UPDI_NVMCTRL_STATUS, &status)){
+            log_str("in wait_flash_ready() error: no status\r\n");
+            return false;
+        }
 
-    while(millis() - start < 10000){
-        uint8_t status = ld(serial, device.nvmctrl_address + UPDI_NVMCTRL_STATUS);
-        if (status & (1 << UPDI_NVM_STATUS_WRITE_ERROR)){
+        uint8_t error_mask = (device.nvm_version == UPDI_NVM_V2) ? UPDI_V2_NVM_STATUS_WRITE_ERROR_MASK : (1 << UPDI_NVM_STATUS_WRITE_ERROR);
+        if (status & error_mask){
             log_str("in wait_flash_ready() error: nvm error\r\n");
             return false;
         }
@@ -1257,15 +3187,47 @@ static bool wait_flash_ready(Serial *serial, Device device){
         if(!(status & ((1 << UPDI_NVM_STATUS_EEPROM_BUSY) | (1 << UPDI_NVM_STATUS_FLASH_BUSY)))){
             return true;
         }
-    }
+        sleep_us(UPDI_POLL_INTERVAL_US);
+    }while(!deadline_passed(end));
 
     log_str("in wait_flash_ready() error: wait flash ready timed out\r\n");
     return false;
 }
 
+/*
+Whatever the lost link garbled may have left the NVM controller reporting a write error, which stays until the next command.
+Let any operation still running finish and issue the no-op command, so the retry starts from a clean status
+*/
+static bool clear_nvm_error(Serial *serial, Device device){
+    uint64_t end = deadline(UPDI_NVM_TIMEOUT_US);
+    uint8_t status = 0;
+
+    while(true){
+        if(!ld8(serial, device.nvmctrl_address + UPDI_NVMCTRL_STATUS, &status)){
+            log_str("in clear_nvm_error() error: no status\r\n");
+            return false;
+        }
+
+        if(!(status & ((1 << UPDI_NVM_STATUS_EEPROM_BUSY) | (1 << UPDI_NVM_STATUS_FLASH_BUSY)))) break;
+
+        if(deadline_passed(end)){
+            log_str("in clear_nvm_error() error: wait flash ready timed out\r\n");
+            return false;
+        }
+        sleep_us(UPDI_POLL_INTERVAL_US);
+    }
+
+    //NOP and NOCMD are both 0, and on NVMv2 leave any command still set
+    return execute_nvm_command(serial, device, UPDI_NVMCTRL_CTRLA_NOP);
+}
+
 //Execute NVM command
 static bool execute_nvm_command(Serial *serial, Device device, uint8_t command){
-    if(!st(serial, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA, command)){
+    trace_begin_arg("nvm command", "command", command);
+    bool ok = st(serial, device.nvmctrl_address + UPDI_NVMCTRL_CTRLA, command);
+    trace_end();
+
+    if(!ok){
         log_str("in execute_nvm_command() error: st() false return\r\n");
         return false;
     }
@@ -1273,7 +3235,7 @@ static bool execute_nvm_command(Serial *serial, Device device, uint8_t command){
 }
 
 //Writes a page of data to NVM. By default the PAGE_WRITE command is used, which requires that the page is already erased. By default word access is used (flash)
-static bool write_nvm(Serial *serial, Device device, uint16_t address, uint8_t *data, uint16_t len, uint8_t command, bool use_word_acess){
+static bool write_nvm(Serial *serial, Device device, uint32_t address, uint8_t *data, uint16_t len, uint8_t command, bool use_word_acess){
     //wait for NVM controller to be ready
     if(!wait_flash_ready(serial, device)){
         log_str("in write_nvm() error: cant wait flash ready\r\n");        
@@ -1294,7 +3256,7 @@ static bool write_nvm(Serial *serial, Device device, uint16_t address, uint8_t *
 
     //Load the page buffer by writing directly to location
     if(use_word_acess){
-        if(!write_data_words(serial, address, data, len >> 1)){
+        if(!write_data_words(serial, address, data, len)){
             log_str("in write_nvm() error: write_data_words() error\r\n");            
             return false;
         }
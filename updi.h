@@ -11,22 +11,47 @@ Author: Jonty   www.tyjean.com
 #include <inttypes.h>
 
 /*
-Pick which OS-specific files to include, ideally will port to several systems
+Pick which OS-specific files to include, ideally will port to several systems.
+The serial port is only the default transport (see transport.h), updi.transport can point at any other one at runtime
 */
+#include "transport.h"
+
 #if defined UPDI_WIN32
-    #include "win32\file.h"
-    #include "win32\serial.h"
-    #include "win32\time.h"
+    #include "win32/file.h"
+    #include "win32/serial.h"
+    #include "win32/time.h"
+    #include "win32/thread.h"
+    #define UPDI_DEFAULT_TRANSPORT          (&win32_serial_transport)
+    #define UPDI_LIST_PORTS(ports, max)     win32_list_ports(ports, max)
+    #define UPDI_DISCOVER_WAVE              SERIAL_MAX_PORTS
 #elif defined UPDI_LINUX
-    #include "linux\file.h"
-    #include "linux\serial.h"
-    #include "linux\time.h"
+    #include "linux/file.h"
+    #include "linux/serial.h"
+    #include "linux/time.h"
+    #include "linux/thread.h"
+    #define UPDI_DEFAULT_TRANSPORT          (&linux_serial_transport)
+    #define UPDI_LIST_PORTS(ports, max)     linux_list_ports(ports, max)
+    #define UPDI_DISCOVER_WAVE              16
+#elif defined UPDI_SIM
+    #include "sim/file.h"
+    #include "sim/serial.h"
+    #include "sim/time.h"
+    #include "sim/thread.h"
+    #define UPDI_DEFAULT_TRANSPORT          (&sim_serial_transport)
+    #define UPDI_LIST_PORTS(ports, max)     sim_list_ports(ports, max)
+    #define UPDI_DISCOVER_WAVE              SIM_MAX_PORTS
 #endif
 
 #include "log.h"
+#include "trace.h"
+#include "image.h"
 
 #define UPDI_BREAK                          0x00
 
+//break lengths sent with serial_send_break(), the double break is two of the longest break UPDI can need to see (slowest UPDI clock)
+#define UPDI_BREAK_US                       1000
+#define UPDI_DOUBLE_BREAK_US                24600
+
 #define UPDI_LDS                            0x00
 #define UPDI_STS                            0x40
 #define UPDI_LD                             0x20
@@ -42,9 +67,11 @@ Pick which OS-specific files to include, ideally will port to several systems
 
 #define UPDI_ADDRESS_8                      0x00
 #define UPDI_ADDRESS_16                     0x04
+#define UPDI_ADDRESS_24                     0x08
 
 #define UPDI_DATA_8                         0x00
 #define UPDI_DATA_16                        0x01
+#define UPDI_DATA_24                        0x02
 
 #define UPDI_KEY_SIB                        0x04
 #define UPDI_KEY_KEY                        0x00
@@ -112,6 +139,11 @@ Pick which OS-specific files to include, ideally will port to several systems
 #define UPDI_NVMCTRL_DATAH                  0x07
 #define UPDI_NVMCTRL_ADDRL                  0x08
 #define UPDI_NVMCTRL_ADDRH                  0x09
+#define UPDI_NVMCTRL_ADDRZ                  0x0A
+
+//NVM controller versions, from the P:n field of the SIB
+#define UPDI_NVM_V0                         0       //tinyAVR 0/1/2, megaAVR 0
+#define UPDI_NVM_V2                         2       //AVR DA/DB/DD
 
 //CTRLA
 #define UPDI_NVMCTRL_CTRLA_NOP              0x00
@@ -127,6 +159,16 @@ Pick which OS-specific files to include, ideally will port to several systems
 #define UPDI_NVM_STATUS_EEPROM_BUSY         1
 #define UPDI_NVM_STATUS_FLASH_BUSY          0
 
+//NVMv2 CTRLA, the command stays active until changed and has to go back to NOCMD before another one is set
+#define UPDI_V2_NVMCTRL_CTRLA_NOCMD                 0x00
+#define UPDI_V2_NVMCTRL_CTRLA_NOOP                  0x01
+#define UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE           0x02
+#define UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE      0x08
+#define UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE    0x13
+#define UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE            0x20
+
+#define UPDI_V2_NVM_STATUS_WRITE_ERROR_MASK         0x70
+
 
 //SUPPORTED DEVICES
 #define ATMEGA4808                          0
@@ -164,8 +206,88 @@ Pick which OS-specific files to include, ideally will port to several systems
 #define ATTINY212                           27
 #define ATTINY214                           28
 
-#define UPDI_MAX_FLASH_SIZE                 48*1024
+#define AVR128DA28                          29
+#define AVR128DA32                          30
+#define AVR128DA48                          31
+#define AVR128DA64                          32
+#define AVR64DA28                           33
+#define AVR64DA32                           34
+#define AVR64DA48                           35
+#define AVR64DA64                           36
+#define AVR32DA28                           37
+#define AVR32DA32                           38
+#define AVR32DA48                           39
+
+#define AVR128DB28                          40
+#define AVR128DB32                          41
+#define AVR128DB48                          42
+#define AVR128DB64                          43
+#define AVR64DB28                           44
+#define AVR64DB32                           45
+#define AVR64DB48                           46
+#define AVR64DB64                           47
+#define AVR32DB28                           48
+#define AVR32DB32                           49
+#define AVR32DB48                           50
+
+#define AVR64DD14                           51
+#define AVR64DD20                           52
+#define AVR64DD28                           53
+#define AVR64DD32                           54
+#define AVR32DD14                           55
+#define AVR32DD20                           56
+#define AVR32DD28                           57
+#define AVR32DD32                           58
+#define AVR16DD14                           59
+#define AVR16DD20                           60
+#define AVR16DD28                           61
+#define AVR16DD32                           62
+
+//pass as dev to updi_init() to pick the part from its signature once connected
+#define UPDI_DEVICE_AUTO                    0xFF
+
+//SIGROW serial number, right after the signature on NVMv0 parts and at 0x10 on NVMv2
+#define UPDI_SIGROW_SERNUM_V0               0x03
+#define UPDI_SIGROW_SERNUM_V0_SIZE          10
+#define UPDI_SIGROW_SERNUM_V2               0x10
+#define UPDI_SIGROW_SERNUM_V2_SIZE          16
+#define UPDI_MAX_SERNUM_SIZE                16
+
+#define UPDI_MAX_FLASH_SIZE                 128*1024
+#define UPDI_MAX_PAGESIZE                   512
 #define UPDI_MAX_FUSES                      11
+#define UPDI_MAX_USERROW_SIZE               64
+
+//wait loops sleep this long between status polls that found the device still busy, timeouts are in microseconds
+#define UPDI_POLL_INTERVAL_US               200
+
+//what a round trip is taken to cost when planning reads, the FTDI default latency timer. A gap between two ranges is read through when
+//that takes less time at the baud rate than another round trip would, lower it for adapters that answer sooner
+#define UPDI_ROUND_TRIP_US                  16000
+#define UPDI_MAX_READ_RANGES                16
+
+//resyncs allowed in one flash write before giving up
+#define UPDI_MAX_RECOVERIES                 5
+#define UPDI_NVM_TIMEOUT_US                 10000000
+
+//streamed flash write (updi.stream_write), the time given each page write before the next is sent, a little over the 2ms the bench target
+//takes. Set updi.stream_page_us from the part's datasheet, a checkpoint that finds the NVM still busy grows it by a quarter anyway
+#define UPDI_STREAM_PAGE_US                 2500
+#define UPDI_STREAM_PAGE_MAX_US             20000   //the budget stops growing here, past it something other than the page time is wrong
+#if defined UPDI_SMALL
+    #define UPDI_STREAM_CHECKPOINT_PAGES    1       //the arena only holds the page just written
+#else
+    #define UPDI_STREAM_CHECKPOINT_PAGES    16
+#endif
+
+//updi_write_flash() logs progress every this many bytes, the image length isnt known until it has all been parsed
+#define UPDI_PROGRESS_BYTES                 8192
+
+//boot section layout for updi.keep_boot, FUSE.APPEND and FUSE.BOOTEND (AVR Dx: CODESIZE and BOOTSIZE) count blocks of these
+#define UPDI_FUSE_APPEND                    7
+#define UPDI_FUSE_BOOTEND                   8
+#define UPDI_BOOT_BLOCK_SIZE                256
+#define UPDI_BOOT_BLOCK_V2_SIZE             512
 
 
 //PROCESS ARGS
@@ -178,16 +300,21 @@ Pick which OS-specific files to include, ideally will port to several systems
 #define UPDI_PROCESS_GET_INFO               64
 #define UPDI_PROCESS_WRITE_USERROW          128
 
+//flash_start is the UPDI address of flash, above 64K (so 24-bit instructions) on the AVR Dx parts
 typedef struct {
-    uint16_t    flash_start;
-    uint16_t    flash_size;
-    uint8_t     flash_pagesize;
+    uint32_t    flash_start;
+    uint32_t    flash_size;
+    uint16_t    flash_pagesize;
     uint16_t    syscfg_address;
     uint16_t    nvmctrl_address;
     uint16_t    sigrow_address;
     uint16_t    fuses_address;
     uint16_t    userrow_address;
+    uint8_t     userrow_size;
     uint8_t     num_fuses;
+    uint8_t     nvm_version;
+    uint8_t     signature[3];
+    const char  *name;
 } Device;
 
 typedef struct {
@@ -202,27 +329,173 @@ typedef struct {
 } DeviceInfo;
 
 
+/*
+Build with -DUPDI_SMALL for programming hosts with a few KiB of RAM (small SBCs, a microcontroller based field programmer). UPDI then holds no flash
+sized buffers, about 1.1 KiB in all with the sim platform, and every flash path works a page at a time in one UPDIArena the caller supplies:
+updi_write_flash() builds each page there and verifies it straight after writing it, updi_read_flash() hands each chunk to updi->read_page.
+Nothing is allocated in either build.
+
+Stack: every buffer in updi.c and image.c is fixed size. Measured on x86-64 gcc -O2 -DUPDI_SMALL with -fstack-usage and -fcallgraph-info=su, not
+counting the platform serial functions. The largest frames are updi_watch() 864 B, image_run() 576 B and read_ranges() 512 B; updi_discover()
+is 160 B, its jobs are in the caller's storage. The deepest chain on the calling thread is a streamed write, updi_write_flash() > stream_page()
+> stream_checkpoint() > stream_check() > read_ranges() > serial_send() > a log call that has to format on the spot, about 1.8 KiB. The image
+parser thread needs 1.2 KiB and the log writer 0.5 KiB. The UPDI_SMALL bench build (bench.c) has -Wstack-usage=1024 -Werror, so no frame
+grows past 1 KiB unnoticed; redo the chains when one gets near it. For small builds also shrink the log rings, e.g. -DLOG_RING_SIZE=16
+-DLOG_MAX_THREADS=2, or compile logging out with LOG_LEVEL
+*/
+//called with each chunk updi_read_flash() reads with UPDI_SMALL, offset from the start of flash. Returning false stops the read
+typedef bool (*UPDIPageFunc)(void *ctx, uint32_t offset, uint8_t *data, uint16_t len);
+
+#if defined UPDI_SMALL
+typedef struct {
+    uint8_t write[2][UPDI_MAX_PAGESIZE];    //page being built and the one written before it, kept to redo both after a resync
+    uint8_t read[UPDI_MAX_PAGESIZE];        //read back for verify and updi_read_flash()
+} UPDIArena;
+#endif
+
+//one range for updi_read_ranges(), size bytes from address into data
+typedef struct {
+    uint32_t    address;
+    uint16_t    size;
+    uint8_t     *data;
+} UPDIReadRange;
+
+//one edit for updi_patch_flash(), size bytes of data written at offset from the start of flash
+typedef struct {
+    uint32_t        offset;
+    uint16_t        size;
+    const uint8_t   *data;
+} UPDIPatch;
+
+//everything that identifies one unit, read by updi_snapshot()
+typedef struct {
+    uint8_t     signature[3];
+    uint8_t     serial[UPDI_MAX_SERNUM_SIZE];
+    uint8_t     serial_size;
+    uint8_t     fuses[UPDI_MAX_FUSES];
+    uint8_t     num_fuses;
+    uint8_t     userrow[UPDI_MAX_USERROW_SIZE];
+    uint8_t     userrow_size;
+    uint8_t     round_trips;        //bursts the read took
+} UPDISnapshot;
+
+//PORT DISCOVERY, see updi_discover(). Ports are probed UPDI_DISCOVER_WAVE (set above, as many as the platform can have open) at a time
+#define UPDI_DISCOVER_MAX_PORTS             32
+
+//a port a target answered on
+typedef struct {
+    uint8_t     com_port;
+    uint8_t     status;             //STATUSA, the UPDI revision in the high nibble
+    char        family[8];          //SIB family, "megaAVR", "tinyAVR" or "    AVR" (Dx)
+    char        sib[17];            //the whole 16 byte SIB
+} UPDIProbe;
+
+//LIVE WATCH, see updi_watch()
+#define UPDI_WATCH_MAX_ADDRESSES            64
+#define UPDI_WATCH_MAX_BURSTS               16
+
+typedef struct {
+    uint64_t    time_us;                            //micros() halfway through reading the sample
+    uint32_t    index;
+    uint8_t     values[UPDI_WATCH_MAX_ADDRESSES];   //one per address, in the order they were given
+} UPDIWatchSample;
+
+//called with each sample as it is read, returning false stops the watch
+typedef bool (*UPDIWatchFunc)(void *ctx, const UPDIWatchSample *sample);
+
+/*
+What updi_watch() samples and where the samples go. Either or both of func and ring can be set, ring keeps the latest ring_size samples
+with sample n in ring[n % ring_size]. The watch stops after max_samples, after duration_ms or when func returns false, at least one has to be set
+*/
+typedef struct {
+    uint32_t            addresses[UPDI_WATCH_MAX_ADDRESSES];    //data space addresses, in any order, repeats allowed
+    uint8_t             count;
+    uint32_t            max_samples;
+    uint32_t            duration_ms;
+    UPDIWatchFunc       func;
+    void                *ctx;
+    UPDIWatchSample     *ring;
+    uint32_t            ring_size;
+
+    //filled in by updi_watch()
+    uint8_t             bursts;         //st_ptr + repeat + ld_ptr_inc runs each sample takes
+    uint32_t            samples;
+    uint32_t            elapsed_us;
+    uint32_t            rate_hz;        //samples per second achieved
+} UPDIWatch;
+
+//per session, cleared by updi_open()
+typedef struct {
+    uint16_t recoveries;                //link resyncs an operation carried on after
+    uint16_t failed_recoveries;
+    uint32_t recovery_us;               //total time spent resyncing
+    uint32_t last_recovery_address;     //where the last resync resumed
+    uint16_t stream_checkpoints;        //checkpoints a streamed flash write passed
+    uint32_t stream_page_us;            //page budget a streamed flash write finished with
+    uint16_t patch_pages;               //pages the last updi_patch_flash() wrote
+    uint16_t app_pages;                 //pages the last updi_write_flash() with keep_boot erased and wrote, not the ones it only erased
+} UPDIStats;
+
 typedef struct {
     Serial serial;
     Device device;
     DeviceInfo info;
+    UPDIStats stats;
 
+    const SerialTransport *transport;   //UPDI_DEFAULT_TRANSPORT after updi_init(), set it after that to go through another one
     uint8_t com_port;
     uint32_t baudrate;
     uint8_t dev;
     uint8_t args;
     char hex_filename[256];
+    bool full_duplex;       //set after updi_init() to run the session with serial_start_duplex(), writes go out ahead of their echoes
+    bool stream_write;      //set after updi_init() for updi_write_flash() to stream pages with response signatures off, see stream_page() in updi.c
+    uint32_t stream_page_us;    //time each streamed page write is given, UPDI_STREAM_PAGE_US after updi_init()
+    bool keep_boot;         //set after updi_init() for updi_write_flash() to page erase and write only the application section, see app_section() in updi.c
+    bool session_open;
+    bool locked;            //session opened on a locked device for UPDI_PROCESS_WRITE_USERROW, only updi_write_userrow() can run
+    bool attached;          //session opened by updi_attach(), the application is running and only updi_watch() can run
 
     uint8_t fuse_values_read[UPDI_MAX_FUSES];
     uint8_t fuse_values_write[UPDI_MAX_FUSES];
 
+    uint8_t userrow_write[UPDI_MAX_USERROW_SIZE];       //whole USERROW written by updi_write_userrow(), device.userrow_size bytes, 0xFF after updi_init()
+
+    ImageStream image;      //hex_filename being parsed for updi_write_flash(), see updi_load_image()
+
+#if defined UPDI_SMALL
+    UPDIArena *arena;           //set after updi_init(), scratch for updi_write_flash() and updi_read_flash()
+    UPDIPageFunc read_page;     //set after updi_init() for updi_read_flash()
+    void *read_ctx;
+#else
     uint8_t flash_data_read[UPDI_MAX_FLASH_SIZE];
-    uint8_t flash_data_write[UPDI_MAX_FLASH_SIZE];
+    uint8_t flash_data_write[UPDI_MAX_FLASH_SIZE];      //image written by updi_write_flash(), 0xFF where the file sets nothing
+#endif
 } UPDI;
 
 void updi_init(UPDI *updi, uint8_t com_port, uint32_t baudrate, uint8_t dev, uint8_t args, char *fname, uint8_t fname_len);
-void updi_process(UPDI *updi);
+bool updi_process(UPDI *updi);
 void updi_cleanup(UPDI *updi);
 
+//session API, updi_process() is one of these opened around whatever is set in args
+bool updi_load_image(UPDI *updi);
+bool updi_open(UPDI *updi);
+bool updi_detect(UPDI *updi);
+bool updi_attach(UPDI *updi);
+void updi_close(UPDI *updi);
+bool updi_get_info(UPDI *updi);
+bool updi_read_fuses(UPDI *updi);
+bool updi_write_fuses(UPDI *updi);
+bool updi_read_flash(UPDI *updi);
+bool updi_erase(UPDI *updi);
+bool updi_write_flash(UPDI *updi, bool verify);
+bool updi_patch_flash(UPDI *updi, const UPDIPatch *patches, uint8_t count, bool verify);
+bool updi_write_userrow(UPDI *updi);
+bool updi_watch(UPDI *updi, UPDIWatch *watch);
+bool updi_read_ranges(UPDI *updi, UPDIReadRange *ranges, uint8_t count);
+bool updi_snapshot(UPDI *updi, UPDISnapshot *snapshot);
+
+uint8_t updi_discover(const SerialTransport *transport, uint32_t baudrate, const uint8_t *com_ports, uint8_t count, UPDIProbe *found);
+
 
 #endif
\ No newline at end of file
@@ -18,7 +18,7 @@ Porting C_UPDI to a new platform will require re-writing these functions
 
 bool open_file(File *file, char *fname){
 
-    file->fp = fopen(fname, "r");
+    file->fp = fopen(fname, "rb");
 
     if(file->fp == NULL){
         log_str("couldnt open file\r\n");
@@ -42,6 +42,17 @@ bool file_read_line(File *file, char *buffer, int length){
     return false;
 }
 
+/*
+Read up to length bytes, returns how many were read
+*/
+int file_read(File *file, uint8_t *buffer, int length){
+    return (int)fread(buffer, 1, length, file->fp);
+}
+
+bool file_seek(File *file, uint32_t offset){
+    return fseek(file->fp, (long)offset, SEEK_SET) == 0;
+}
+
 void close_file(File *file){
     fclose(file->fp);
     return;
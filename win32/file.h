@@ -14,6 +14,7 @@ Porting C_UPDI to a new platform will require re-writing these functions
 #define FILE_H
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdbool.h>
 
 //Non OS-specific struct for updi.c to access file handle, containing OS-specific handle
@@ -24,6 +25,8 @@ typedef struct {
 
 bool open_file(File *file, char *fname);
 bool file_read_line(File *file, char *buffer, int length);
+int file_read(File *file, uint8_t *buffer, int length);
+bool file_seek(File *file, uint32_t offset);
 void close_file(File *file);
 
 
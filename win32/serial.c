@@ -4,192 +4,477 @@ Author: Jonty   www.tyjean.com
                 https://github.com/jarl93rsa
 (2020)
 
-Provide os-specific serial functions open/close read/write configure etc for updi.c, using a common struct Serial.
+Provide the os-specific serial port as a SerialTransport for updi.c, see transport.h.
 
 Porting C_UPDI to a new platform will require re-writing these functions
+
+The port is opened for overlapped I/O so that in full-duplex mode (win32_start_duplex) the receive thread can sit in ReadFile while the caller
+keeps writing, a handle opened without it serialises the two.
 */
 
 #include <windows.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../log.h" 
 #include "serial.h"
+#include "time.h"
+
+static bool        win32_open(Serial *serial);
+static void        win32_close(Serial *serial);
+static bool        win32_set_baud(Serial *serial, uint32_t baudrate);
+static bool        win32_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count);
+static bool        win32_send_break(Serial *serial, uint32_t duration_us, uint8_t count);
+static bool        win32_start_duplex(Serial *serial);
+static void        win32_stop_duplex(Serial *serial);
+static bool        win32_sync(Serial *serial);
+static bool        open_port(Win32Port *port, uint32_t baudrate, uint8_t stopbits, uint8_t parity);
+static bool        set_timeouts(Win32Port *port, bool duplex);
+static bool        port_write(Win32Port *port, uint8_t *data, uint16_t length);
+static DWORD       port_read(Win32Port *port, uint8_t *data, uint16_t length, HANDLE event);
+static void        rx_thread(void *arg);
+static bool        ring_read(Win32Port *port, uint8_t *dest, uint32_t length, uint32_t timeout_us);
+
+static Win32Port win32_ports[SERIAL_MAX_PORTS];
+
+const SerialTransport win32_serial_transport = {
+    "win32 serial", win32_open, win32_close, win32_set_baud, win32_transfer, win32_send_break, win32_start_duplex, win32_stop_duplex, win32_sync
+};
 
 /*
-Open serial connection at desired settings
+The COM port numbers windows knows about, from HARDWARE\\DEVICEMAP\\SERIALCOMM where every serial driver lists the ports it has, for UPDI_LIST_PORTS()
 */
-bool serial_init(Serial *serial){
+uint8_t win32_list_ports(uint8_t *com_ports, uint8_t max){
+    HKEY key;
+    uint8_t count = 0;
 
-    log_str("in serial.init()\r\n");
+    if(RegOpenKeyExA(HKEY_LOCAL_MACHINE, "HARDWARE\\DEVICEMAP\\SERIALCOMM", 0, KEY_READ, &key) != ERROR_SUCCESS){
+        log_error("error listing serial ports\r\n");
+        return 0;
+    }
 
-    char com_str[20];
-    memset(com_str, 0, 20);
-    sprintf(com_str, "\\\\.\\COM%d", serial->com_port);
-    serial->h_serial = CreateFile(com_str, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    for(DWORD i = 0; count < max; i++){
+        char name[256];
+        char value[16];
+        DWORD name_len = sizeof(name);
+        DWORD value_len = sizeof(value) - 1;
+        DWORD type;
 
-    if(serial->h_serial == INVALID_HANDLE_VALUE){        
-        log_error("error opening serial port\r\n");
-        return false;
+        LONG result = RegEnumValueA(key, i, name, &name_len, NULL, &type, (LPBYTE)value, &value_len);
+        if(result == ERROR_NO_MORE_ITEMS) break;
+        if(result != ERROR_SUCCESS || type != REG_SZ) continue;
+
+        value[value_len] = '\0';
+        if(strncmp(value, "COM", 3) != 0) continue;
+
+        int number = atoi(value + 3);
+        if(number > 0 && number <= 255) com_ports[count++] = (uint8_t)number;
     }
-    
-    log_str("opened serial port\r\n");    
 
-    serial->dcb_serial_params.DCBlength = sizeof(serial->dcb_serial_params);
+    RegCloseKey(key);
 
-    int status = GetCommState(serial->h_serial, &(serial->dcb_serial_params));
-    
-    serial->dcb_serial_params.BaudRate = serial->baudrate;
-    serial->dcb_serial_params.ByteSize = 8;         // Setting ByteSize = 8
-    serial->dcb_serial_params.StopBits = TWOSTOPBITS;// Setting StopBits = 1
-    serial->dcb_serial_params.Parity   = EVENPARITY;  // Setting Parity = None
+    return count;
+}
 
-    SetCommState(serial->h_serial, &(serial->dcb_serial_params));
+/*
+Open serial connection at desired settings, on the first free entry of win32_ports
+*/
+static bool win32_open(Serial *serial){
+    Win32Port *port = NULL;
 
-    COMMTIMEOUTS timeouts = { 0 };
-    timeouts.ReadIntervalTimeout         = 50; // in milliseconds       max interval between arrival between 2 bytes
-    timeouts.ReadTotalTimeoutConstant    = 50; // in milliseconds       total timeout period for read ops, added to multiplier * numbytes
-    timeouts.ReadTotalTimeoutMultiplier  = 10; // in milliseconds       multiplied by requested number of bytes 
-    timeouts.WriteTotalTimeoutConstant   = 50; // in milliseconds       
-    timeouts.WriteTotalTimeoutMultiplier = 10; // in milliseconds
+    for(uint8_t i = 0; i < SERIAL_MAX_PORTS && port == NULL; i++){
+        bool expected = false;
+        if(atomic_compare_exchange_strong(&(win32_ports[i].used), &expected, true)) port = &(win32_ports[i]);
+    }
 
-    SetCommTimeouts(serial->h_serial, &timeouts);
+    if(port == NULL){
+        log_error("error opening serial port, too many open\r\n");
+        return false;
+    }
+
+    port->com_port = serial->com_port;
+
+    if(!open_port(port, serial->baudrate, TWOSTOPBITS, EVENPARITY)){
+        atomic_store(&(port->used), false);
+        return false;
+    }
+
+    serial->port = port;
 
     return true;
 }
 
 /*
-Change the baud rate of serial connection.
+Change the baud rate of the open serial connection, only the DCB baud rate is changed.
 This function is not necessary for normal use and wont necessarily require re-writing when porting to a new system.
 This is used in commented-out section in updi_process where the updi clock speed is increased to allow faster baudrates to try and decrease programming time.
 Tested the process with much higher baud rates, up to 900000 (datasheet max), without loss of information but with diminishing speed returns. Far too much latency in the
 whole USB-UART process to make a significant difference. 
 Left this here, and the commented-out speed change in updi_process() for reference.
 */
-bool serial_change_baud(Serial *serial, uint32_t baudrate){
-    char com_str[20];
-    memset(com_str, 0, 20);
-    sprintf(com_str, "\\\\.\\COM%d", serial->com_port);
-    serial->h_serial = CreateFile(com_str, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+static bool win32_set_baud(Serial *serial, uint32_t baudrate){
+    Win32Port *port = serial->port;
 
-    if(serial->h_serial == INVALID_HANDLE_VALUE){        
-        log_error("error opening serial port\r\n");
+    port->dcb_serial_params.BaudRate = baudrate;
+
+    if(!SetCommState(port->h_serial, &(port->dcb_serial_params))){
+        log_error("error changing baud rate\r\n");
         return false;
     }
-    
-    log_str("opened serial port\r\n");
-    
-    serial->dcb_serial_params.DCBlength = sizeof(serial->dcb_serial_params);
 
-    int status = GetCommState(serial->h_serial, &(serial->dcb_serial_params));
-    
-    serial->dcb_serial_params.BaudRate = baudrate;//CBR_115200; 
-    serial->dcb_serial_params.ByteSize = 8;         // Setting ByteSize = 8
-    serial->dcb_serial_params.StopBits = TWOSTOPBITS;// Setting StopBits = 1
-    serial->dcb_serial_params.Parity   = EVENPARITY;  // Setting Parity = None
+    return true;
+}
 
-    SetCommState(serial->h_serial, &(serial->dcb_serial_params));
+/*
+Hold the line low for duration_us, count times with SERIAL_BREAK_GAP_US of idle in between, using the comm break control on the open handle so
+the port settings are never touched. Whatever the adapter received while the line was low (a 0x00 with a framing error on most) is thrown away
+*/
+static bool win32_send_break(Serial *serial, uint32_t duration_us, uint8_t count){
+    Win32Port *port = serial->port;
+
+    win32_sync(serial);
+
+    for(uint8_t i = 0; i < count; i++){
+        if(i > 0) sleep_us(SERIAL_BREAK_GAP_US);
+
+        if(!SetCommBreak(port->h_serial)){
+            log_error("serial_send_break error, SetCommBreak failed\r\n");
+            return false;
+        }
+        sleep_us(duration_us);
+        if(!ClearCommBreak(port->h_serial)){
+            log_error("serial_send_break error, ClearCommBreak failed\r\n");
+            return false;
+        }
+    }
 
-    COMMTIMEOUTS timeouts = { 0 };
-    timeouts.ReadIntervalTimeout         = 50; // in milliseconds       max interval between arrival between 2 bytes
-    timeouts.ReadTotalTimeoutConstant    = 50; // in milliseconds       total timeout period for read ops, added to multiplier * numbytes
-    timeouts.ReadTotalTimeoutMultiplier  = 10; // in milliseconds       multiplied by requested number of bytes 
-    timeouts.WriteTotalTimeoutConstant   = 50; // in milliseconds       
-    timeouts.WriteTotalTimeoutMultiplier = 10; // in milliseconds
+    sleep_us(SERIAL_BREAK_GAP_US);
+    PurgeComm(port->h_serial, PURGE_RXCLEAR);
 
-    SetCommTimeouts(serial->h_serial, &timeouts);
+    //in full-duplex mode the receive thread may already have picked it up
+    if(port->duplex){
+        atomic_store(&(port->rx_tail), atomic_load(&(port->rx_head)));
+    }
 
     return true;
 }
 
 /*
-Reconfigure the serial port at a much lower baud rate to be able to send a "double break" of required length to UPDI
+Close the port, in full-duplex mode anything still written ahead is waited for and the receive thread stopped first
 */
-bool serial_init_dbl_break(Serial *serial){
-    char com_str[20];
-    memset(com_str, 0, 20);
-    sprintf(com_str, "\\\\.\\COM%d", serial->com_port);
-    serial->h_serial = CreateFile(com_str, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+static void win32_close(Serial *serial){
+    Win32Port *port = serial->port;
 
-    if(serial->h_serial == INVALID_HANDLE_VALUE){        
-        log_error("error opening serial port\r\n");
-        return false;
+    if(port->duplex){
+        win32_sync(serial);
+        win32_stop_duplex(serial);
     }
-    
-    log_str("opened serial port\r\n");
-    
-    serial->dcb_serial_params.DCBlength = sizeof(serial->dcb_serial_params);
 
-    int status = GetCommState(serial->h_serial, &(serial->dcb_serial_params));
+    CloseHandle(port->h_serial);
+    CloseHandle(port->tx_event);
+    CloseHandle(port->rx_event);
 
-    serial->dcb_serial_params.BaudRate = 300;  // Setting BaudRate = 9600
-    serial->dcb_serial_params.ByteSize = 8;         // Setting ByteSize = 8
-    serial->dcb_serial_params.StopBits = ONESTOPBIT;// Setting StopBits = 1
-    serial->dcb_serial_params.Parity   = NOPARITY;  // Setting Parity = None
+    atomic_store(&(port->used), false);
+}
 
-    SetCommState(serial->h_serial, &(serial->dcb_serial_params));
+/*
+Switch to full-duplex mode, a thread drains the port into rx_ring as bytes arrive.
+Transfers that only discard echoes then return as soon as they are written, their echoes are consumed by the next transfer that waits for a reply
+(or serial_sync), so the host can keep writing while earlier bytes are still coming back
+*/
+static bool win32_start_duplex(Serial *serial){
+    Win32Port *port = serial->port;
 
-    COMMTIMEOUTS timeouts = { 0 };
-    timeouts.ReadIntervalTimeout         = 50; // in milliseconds       max interval between arrival between 2 bytes
-    timeouts.ReadTotalTimeoutConstant    = 50; // in milliseconds       total timeout period for read ops, added to multiplier * numbytes
-    timeouts.ReadTotalTimeoutMultiplier  = 10; // in milliseconds       multiplied by requested number of bytes 
-    timeouts.WriteTotalTimeoutConstant   = 50; // in milliseconds       
-    timeouts.WriteTotalTimeoutMultiplier = 10; // in milliseconds
+    if(port->duplex) return true;
 
-    SetCommTimeouts(serial->h_serial, &timeouts);
+    port->rx_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(port->rx_ready == NULL){
+        log_error("serial_start_duplex error, couldnt create event\r\n");
+        return false;
+    }
+
+    atomic_store(&(port->rx_head), 0);
+    atomic_store(&(port->rx_tail), 0);
+    atomic_store(&(port->rx_stop), false);
+    port->pending_echo = 0;
+
+    if(!set_timeouts(port, true) || !thread_start(&(port->rx_thread), rx_thread, port)){
+        log_error("serial_start_duplex error, couldnt start receive thread\r\n");
+        set_timeouts(port, false);
+        CloseHandle(port->rx_ready);
+        return false;
+    }
+
+    port->duplex = true;
+    log_str("serial full-duplex mode\r\n");
 
-    
     return true;
 }
 
 /*
-
+Back to synchronous transfers, call serial_sync() first if echoes are still pending
 */
-void serial_close(Serial *serial){
-    CloseHandle(serial->h_serial);
-}
+static void win32_stop_duplex(Serial *serial){
+    Win32Port *port = serial->port;
+
+    if(!port->duplex) return;
+
+    atomic_store(&(port->rx_stop), true);
+    thread_join(&(port->rx_thread));
+    CloseHandle(port->rx_ready);
+    set_timeouts(port, false);
 
+    port->duplex = false;
+    port->pending_echo = 0;
+
+    return;
+}
 
 /*
-Send bytes to serial, these will echo back
+Consume the echoes of everything written ahead, returns false if any of them didnt come back.
+Nothing to do outside full-duplex mode
 */
-bool serial_send(Serial *serial, uint8_t *data, uint16_t length){
-    long unsigned int bytes_written = 0;
-    int status = WriteFile(serial->h_serial, data, length, &bytes_written, NULL);
+static bool win32_sync(Serial *serial){
+    Win32Port *port = serial->port;
 
-    //read back echo
-    long unsigned int bytes_read = 0;
-    char recv[length];
-    ReadFile(serial->h_serial, recv, length, &bytes_read, NULL);
-    
-    if(bytes_read != length){
-        log_error("serial_send error, bytes received != bytes sent\r\n");
+    if(!port->duplex || port->pending_echo == 0) return true;
+
+    uint32_t pending = port->pending_echo;
+    port->pending_echo = 0;
+
+    if(!ring_read(port, NULL, pending, serial_timeout_us(serial, pending))){
+        log_error("serial_sync error, echo of written bytes missing\r\n");
         return false;
     }
-    
+
     return true;
 }
 
 /*
-Send bytes to serial, read echo as well as expected reply
+Scatter/gather transfer, write every tx segment in order then read every rx segment in order straight into its buffer.
+rx segments with a NULL data pointer are read into the port's discard sink, which is how echo bytes are skipped without copying.
+In full-duplex mode a transfer whose rx segments are all discarded doesnt wait, see serial_start_duplex()
 */
-bool serial_send_receive(Serial *serial, uint8_t *data, uint16_t send_len, uint8_t *recv, uint16_t recv_len){
-    long unsigned int bytes_written = 0;
-    int status = WriteFile(serial->h_serial, data, send_len, &bytes_written, NULL);    
+static bool win32_transfer(Serial *serial, SerialIov *tx, uint8_t tx_count, SerialIov *rx, uint8_t rx_count){
+    Win32Port *port = serial->port;
 
     long unsigned int bytes_read = 0;
-    char recv_buf[send_len + recv_len];
+    uint16_t total = 0;
+
+    for(uint8_t i = 0; i < tx_count; i++) total += tx[i].len;
+
+    //keep what is written ahead well inside the ring, the receive thread stops reading the port when it is full
+    if(port->duplex && port->pending_echo + total > SERIAL_RING_SIZE / 2){
+        if(!win32_sync(serial)) return false;
+    }
+
+    if(total <= SERIAL_GATHER_SIZE){
+        //small headers and operands, one write keeps them in one USB transfer
+        uint8_t gather[SERIAL_GATHER_SIZE];
+        uint16_t n = 0;
+
+        for(uint8_t i = 0; i < tx_count; i++){
+            memcpy(gather + n, tx[i].data, tx[i].len);
+            n += tx[i].len;
+        }
+
+        if(!port_write(port, gather, n)) return false;
+    }else{
+        for(uint8_t i = 0; i < tx_count; i++){
+            if(!port_write(port, tx[i].data, tx[i].len)) return false;
+        }
+    }
 
-    ReadFile(serial->h_serial, recv_buf, send_len + recv_len, &bytes_read, NULL);
-   
-    if(bytes_read != send_len + recv_len){
-        log_error("serial_send error, bytes received != bytes sent + bytes wanted\r\n");
+    if(port->duplex){
+        bool reply = false;
+        uint32_t echo = 0;
+
+        for(uint8_t i = 0; i < rx_count; i++){
+            if(rx[i].data != NULL){
+                reply = true;
+                break;
+            }
+            echo += rx[i].len;
+        }
+
+        if(!reply){
+            port->pending_echo += echo;
+            return true;
+        }
+
+        if(!win32_sync(serial)) return false;
+
+        for(uint8_t i = 0; i < rx_count; i++){
+            if(!ring_read(port, rx[i].data, rx[i].len, serial_timeout_us(serial, rx[i].len))) return false;
+        }
+
+        return true;
+    }
+
+    //one total timeout per read, only reconfigured when it changes
+    uint32_t expected = 0;
+    for(uint8_t i = 0; i < rx_count; i++) expected += rx[i].len;
+
+    DWORD read_ms = (serial_timeout_us(serial, expected) + 999) / 1000;
+    if(read_ms != port->read_timeout_ms){
+        port->read_timeout_ms = read_ms;
+        if(!set_timeouts(port, false)) return false;
+    }
+
+    for(uint8_t i = 0; i < rx_count; i++){
+        uint16_t remaining = rx[i].len;
+        uint8_t *dest = rx[i].data;
+
+        while(remaining > 0){
+            uint16_t chunk = remaining;
+            if(dest == NULL && chunk > sizeof(port->discard)) chunk = sizeof(port->discard);
+
+            bytes_read = port_read(port, (dest == NULL) ? port->discard : dest, chunk, port->rx_event);
+            if(bytes_read != chunk) return false;
+
+            remaining -= chunk;
+            if(dest != NULL) dest += chunk;
+        }
+    }
+
+    return true;
+}
+
+static bool open_port(Win32Port *port, uint32_t baudrate, uint8_t stopbits, uint8_t parity){
+    char com_str[20];
+    memset(com_str, 0, 20);
+    sprintf(com_str, "\\\\.\\COM%d", port->com_port);
+    port->h_serial = CreateFile(com_str, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+    if(port->h_serial == INVALID_HANDLE_VALUE){        
+        log_error("error opening serial port\r\n");
         return false;
     }
+    
+    log_str("opened serial port\r\n");
+
+    port->tx_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    port->rx_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    port->duplex = false;
+    port->pending_echo = 0;
+    
+    port->dcb_serial_params.DCBlength = sizeof(port->dcb_serial_params);
 
-    for(uint16_t i = send_len; i < send_len + recv_len; i++){        
-        recv[i - send_len] = recv_buf[i];
-    }     
+    int status = GetCommState(port->h_serial, &(port->dcb_serial_params));
     
+    port->dcb_serial_params.BaudRate = baudrate;
+    port->dcb_serial_params.ByteSize = 8;
+    port->dcb_serial_params.StopBits = stopbits;
+    port->dcb_serial_params.Parity   = parity;
+
+    SetCommState(port->h_serial, &(port->dcb_serial_params));
+
+    //until the first transfer works out its own
+    port->read_timeout_ms = SERIAL_LATENCY_US / 1000 * 2;
+    set_timeouts(port, false);
+
+    return true;
+}
+
+static bool set_timeouts(Win32Port *port, bool duplex){
+    COMMTIMEOUTS timeouts = { 0 };
+
+    if(duplex){
+        //receive thread, return as soon as anything has arrived or after 10ms with nothing so it can check for stop
+        timeouts.ReadIntervalTimeout         = MAXDWORD;
+        timeouts.ReadTotalTimeoutMultiplier  = MAXDWORD;
+        timeouts.ReadTotalTimeoutConstant    = 10;
+    }else{
+        //no interval timeout, the total covers the whole read (see serial_timeout_us())
+        timeouts.ReadTotalTimeoutConstant    = port->read_timeout_ms;
+    }
+    timeouts.WriteTotalTimeoutConstant   = 50; // in milliseconds       
+    timeouts.WriteTotalTimeoutMultiplier = 10; // in milliseconds
+
+    return SetCommTimeouts(port->h_serial, &timeouts);
+}
+
+static bool port_write(Win32Port *port, uint8_t *data, uint16_t length){
+    OVERLAPPED ov = { 0 };
+    DWORD bytes_written = 0;
+
+    ov.hEvent = port->tx_event;
+    if(!WriteFile(port->h_serial, data, length, NULL, &ov) && GetLastError() != ERROR_IO_PENDING) return false;
+    if(!GetOverlappedResult(port->h_serial, &ov, &bytes_written, TRUE)) return false;
+
+    return bytes_written == length;
+}
+
+//Blocking read bounded by the port timeouts, returns the number of bytes read
+static DWORD port_read(Win32Port *port, uint8_t *data, uint16_t length, HANDLE event){
+    OVERLAPPED ov = { 0 };
+    DWORD bytes_read = 0;
+
+    ov.hEvent = event;
+    if(!ReadFile(port->h_serial, data, length, NULL, &ov) && GetLastError() != ERROR_IO_PENDING) return 0;
+    if(!GetOverlappedResult(port->h_serial, &ov, &bytes_read, TRUE)) return 0;
+
+    return bytes_read;
+}
+
+//Full-duplex receive thread, the only producer of rx_ring. Reads go straight into the free part of the ring
+static void rx_thread(void *arg){
+    Win32Port *port = (Win32Port*)arg;
+
+    while(!atomic_load_explicit(&(port->rx_stop), memory_order_relaxed)){
+        unsigned int head = atomic_load_explicit(&(port->rx_head), memory_order_relaxed);
+        unsigned int space = SERIAL_RING_SIZE - (head - atomic_load_explicit(&(port->rx_tail), memory_order_acquire));
+        unsigned int offset = head % SERIAL_RING_SIZE;
+
+        if(space == 0){
+            thread_sleep_ms(1);
+            continue;
+        }
+        if(space > SERIAL_RING_SIZE - offset) space = SERIAL_RING_SIZE - offset;
+        if(space > 0xFFFF) space = 0xFFFF;
+
+        DWORD n = port_read(port, port->rx_ring + offset, (uint16_t)space, port->rx_event);
+        if(n > 0){
+            atomic_store_explicit(&(port->rx_head), head + n, memory_order_release);
+            SetEvent(port->rx_ready);
+        }
+    }
+
+    return;
+}
+
+//Take length bytes out of rx_ring within timeout_us, dest NULL discards them
+static bool ring_read(Win32Port *port, uint8_t *dest, uint32_t length, uint32_t timeout_us){
+    uint64_t end = deadline(timeout_us);
+
+    while(length > 0){
+        unsigned int tail = atomic_load_explicit(&(port->rx_tail), memory_order_relaxed);
+        unsigned int available = atomic_load_explicit(&(port->rx_head), memory_order_acquire) - tail;
+
+        if(available == 0){
+            uint32_t remaining = deadline_remaining_us(end);
+            if(remaining == 0) return false;
+            WaitForSingleObject(port->rx_ready, (remaining + 999) / 1000);
+            continue;
+        }
+
+        if(available > length) available = length;
+
+        if(dest != NULL){
+            unsigned int offset = tail % SERIAL_RING_SIZE;
+            unsigned int first = SERIAL_RING_SIZE - offset;
+            if(first > available) first = available;
+
+            memcpy(dest, port->rx_ring + offset, first);
+            memcpy(dest + first, port->rx_ring, available - first);
+            dest += available;
+        }
+
+        atomic_store_explicit(&(port->rx_tail), tail + available, memory_order_release);
+        length -= available;
+    }
+
     return true;
 }
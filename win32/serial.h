@@ -4,7 +4,7 @@ Author: Jonty   www.tyjean.com
                 https://github.com/jarl93rsa
 (2020)
 
-Provide os-specific serial functions open/close read/write configure etc for updi.c, using a common struct Serial.
+Provide the os-specific serial port as a SerialTransport for updi.c, win32_serial_transport, see transport.h.
 
 Porting C_UPDI to a new platform will require re-writing these functions
 */
@@ -15,21 +15,50 @@ Porting C_UPDI to a new platform will require re-writing these functions
 #include <windows.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include "../transport.h"
+#include "thread.h"
 
 #define MAX_RECV_LEN 256
 
+//ports open at once, each one's state comes from a static table, enough for updi_discover() to probe a fixture's worth together
+#define SERIAL_MAX_PORTS 16
+
+//tx segments up to this size in total are gathered into one write so they still go out in a single USB transfer
+#define SERIAL_GATHER_SIZE 64
+
+//full-duplex receive ring, power of two
+#define SERIAL_RING_SIZE 4096
+
+//line idle between the breaks of a serial_send_break() and after the last one
+#define SERIAL_BREAK_GAP_US 1000
+
+//per open port, behind Serial.port
 typedef struct {
+    atomic_bool used;
     HANDLE h_serial;
     DCB dcb_serial_params;
     uint8_t com_port;
-    uint32_t baudrate;
-} Serial;
-
-bool serial_init(Serial *serial);
-bool serial_init_dbl_break(Serial *serial);
-bool serial_change_baud(Serial *serial, uint32_t baudrate);
-bool serial_send(Serial *serial, uint8_t *data, uint16_t length);
-bool serial_send_receive(Serial *serial, uint8_t *data, uint16_t send_len, uint8_t *recv, uint16_t recv_len);
-void serial_close(Serial *serial);
+
+    HANDLE tx_event;
+    HANDLE rx_event;
+    DWORD read_timeout_ms;      //ReadTotalTimeoutConstant outside full-duplex mode, set for each transfer from serial_timeout_us()
+    uint8_t discard[MAX_RECV_LEN];  //echoes are read into it, the port's own as ports are served from several threads at once
+
+    //full-duplex mode, rx_thread is the only writer of rx_head and the caller the only writer of rx_tail
+    bool duplex;
+    uint32_t pending_echo;
+    Thread rx_thread;
+    HANDLE rx_ready;
+    atomic_bool rx_stop;
+    atomic_uint rx_head;
+    atomic_uint rx_tail;
+    uint8_t rx_ring[SERIAL_RING_SIZE];
+} Win32Port;
+
+extern const SerialTransport win32_serial_transport;
+
+uint8_t win32_list_ports(uint8_t *com_ports, uint8_t max);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+/*
+C_UPDI thread.c
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide os-specific thread functions start/join/sleep for the background parts of c_updi (the log writer), using a common struct Thread.
+
+Porting C_UPDI to a new platform will require re-writing these functions
+*/
+
+#include <windows.h>
+
+#include "../log.h"
+#include "thread.h"
+
+static DWORD WINAPI thread_entry(LPVOID param){
+    Thread *thread = (Thread*)param;
+    thread->func(thread->arg);
+
+    //hand this thread's log ring back before it goes away
+    log_thread_exit();
+
+    return 0;
+}
+
+/*
+Start func(arg) on a new thread, the Thread struct must stay valid until thread_join()
+*/
+bool thread_start(Thread *thread, ThreadFunc func, void *arg){
+    thread->func = func;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+
+    if(thread->handle == NULL){
+        log_error("couldnt start thread\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+void thread_join(Thread *thread){
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+
+    return;
+}
+
+void thread_sleep_ms(uint32_t ms){
+    Sleep(ms);
+}
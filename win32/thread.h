@@ -0,0 +1,31 @@
+/*
+C_UPDI thread.h
+Author: Jonty   www.tyjean.com
+                https://github.com/jarl93rsa
+(2020)
+
+Provide os-specific thread functions start/join/sleep for the background parts of c_updi (the log writer), using a common struct Thread.
+
+Porting C_UPDI to a new platform will require re-writing these functions
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <windows.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+typedef void (*ThreadFunc)(void *arg);
+
+typedef struct {
+    HANDLE handle;
+    ThreadFunc func;
+    void *arg;
+} Thread;
+
+bool thread_start(Thread *thread, ThreadFunc func, void *arg);
+void thread_join(Thread *thread);
+void thread_sleep_ms(uint32_t ms);
+
+#endif
@@ -4,15 +4,75 @@ Author: Jonty   www.tyjean.com
                 https://github.com/jarl93rsa
 (2020)
 
-Provide an os-specific arduino-style millis() functions for use in updi.c when checking if a process has timed out.
+Provide os-specific arduino-style millis() / micros() clocks and a deadline / sleep API for use in updi.c when checking if a process has timed out.
 
-Porting C_UPDI to a new platform will require re-writing this function
+Both clocks come from the performance counter, GetTickCount() only moves once per scheduler tick (~15ms). sleep_us() waits on a high resolution
+waitable timer where the OS has one (Windows 10 1803 on), Sleep() rounded up to whole milliseconds otherwise.
+
+Porting C_UPDI to a new platform will require re-writing these functions
 */
 
 #include <windows.h>
 
 #include "time.h"
 
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+    #define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+
 unsigned long int millis(void){
-    return GetTickCount();
-}
\ No newline at end of file
+    return (unsigned long int)(micros() / 1000);
+}
+
+/*
+Monotonic microseconds since an arbitrary start
+*/
+uint64_t micros(void){
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if(freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000ULL + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+}
+
+uint64_t deadline(uint32_t timeout_us){
+    return micros() + timeout_us;
+}
+
+bool deadline_passed(uint64_t deadline_us){
+    return micros() >= deadline_us;
+}
+
+uint32_t deadline_remaining_us(uint64_t deadline_us){
+    uint64_t now = micros();
+    return (now >= deadline_us) ? 0 : (uint32_t)(deadline_us - now);
+}
+
+/*
+Block the calling thread for at least us microseconds without using the cpu
+*/
+void sleep_us(uint32_t us){
+    if(us == 0) return;
+
+    HANDLE timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+    if(timer == NULL){
+        Sleep((us + 999) / 1000);
+        return;
+    }
+
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)us * 10;     //relative, in 100ns units
+    
+    if(SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)){
+        WaitForSingleObject(timer, INFINITE);
+    }else{
+        Sleep((us + 999) / 1000);
+    }
+
+    CloseHandle(timer);
+
+    return;
+}
@@ -4,14 +4,24 @@ Author: Jonty   www.tyjean.com
                 https://github.com/jarl93rsa
 (2020)
 
-Provide an os-specific arduino-style millis() functions for use in updi.c when checking if a process has timed out.
+Provide os-specific arduino-style millis() / micros() clocks and a deadline / sleep API for use in updi.c when checking if a process has timed out,
+so wait loops can sleep between polls instead of spinning.
 
-Porting C_UPDI to a new platform will require re-writing this function
+Porting C_UPDI to a new platform will require re-writing these functions
 */
 
 #ifndef TIME_H
 #define TIME_H
 
+#include <inttypes.h>
+#include <stdbool.h>
+
 unsigned long int millis(void);
+uint64_t    micros(void);
+
+uint64_t    deadline(uint32_t timeout_us);
+bool        deadline_passed(uint64_t deadline_us);
+uint32_t    deadline_remaining_us(uint64_t deadline_us);
+void        sleep_us(uint32_t us);
 
-#endif
\ No newline at end of file
+#endif